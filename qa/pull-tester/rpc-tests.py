@@ -96,6 +96,7 @@ BASE_SCRIPTS= [
     'wallet_zip317_default.py',
     'listtransactions.py',
     'mempool_resurrect_test.py',
+    'mempool_persist.py',
     'txn_doublespend.py',
     'txn_doublespend.py --mineblock',
     'getchaintips.py',
@@ -119,6 +120,7 @@ BASE_SCRIPTS= [
     'timestampindex.py',
     'decodescript.py',
     'blockchain.py',
+    'feature_txoutset_snapshot.py',
     'disablewallet.py',
     'keypool.py',
     'getblocktemplate.py',
@@ -132,6 +134,7 @@ BASE_SCRIPTS= [
     'p2p_txexpiry_dos.py',
     'p2p_txexpiringsoon.py',
     'p2p_node_bloom.py',
+    'p2p_sendheaders.py',
     'regtest_signrawtransaction.py',
     'shorter_block_times.py',
     'mining_shielded_coinbase.py',
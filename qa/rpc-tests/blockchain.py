@@ -47,6 +47,19 @@ class BlockchainTest(BitcoinTestFramework):
         assert_equal(res['bytes_serialized'], 14819), # 32*199 + 48*90 + 49*54 + 27*55
         assert_equal(len(res['bestblock']), 64)
         assert_equal(len(res['hash_serialized']), 64)
+        for pool in ['sprout', 'sapling', 'orchard']:
+            assert_equal(res['nullifiers'][pool]['count'], 0)
+            assert_equal(res['nullifiers'][pool]['hash'], res['nullifiers']['sprout']['hash'])
+
+        # The statistics are updated as blocks are connected and disconnected.
+        blockhash = node.generate(1)[0]
+        res2 = node.gettxoutsetinfo()
+        assert_equal(res2['height'], 201)
+        assert(res2['hash_serialized'] != res['hash_serialized'])
+        node.invalidateblock(blockhash)
+        assert_equal(node.gettxoutsetinfo(), res)
+        node.reconsiderblock(blockhash)
+        assert_equal(node.gettxoutsetinfo(), res2)
 
 
 if __name__ == '__main__':
@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+# Copyright (c) 2026 The Zcash developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#
+# Test dumptxoutset, and loading the snapshot it writes with loadtxoutset.
+#
+
+import os
+import time
+
+from test_framework.authproxy import JSONRPCException
+from test_framework.mininode import (
+    CBlockLocator,
+    NetworkThread,
+    NodeConn,
+    NodeConnCB,
+    mininode_lock,
+    msg_getheaders,
+    msg_headers,
+)
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import (
+    assert_equal,
+    assert_raises_message,
+    connect_nodes,
+    p2p_port,
+    start_node,
+    start_nodes,
+    stop_node,
+    sync_blocks,
+)
+
+
+# Fetches headers from one node and relays them to another, without ever
+# sending the blocks.
+class HeadersNode(NodeConnCB):
+    def __init__(self):
+        NodeConnCB.__init__(self)
+        self.create_callback_map()
+        self.connection = None
+        self.headers = []
+
+    def add_connection(self, conn):
+        self.connection = conn
+
+    def wait_for_verack(self):
+        while True:
+            with mininode_lock:
+                if self.verack_received:
+                    return
+            time.sleep(0.05)
+
+    def on_headers(self, conn, message):
+        self.headers.extend(message.headers)
+
+    def get_headers(self, locator_hash, count, timeout=30):
+        getheaders = msg_getheaders()
+        getheaders.locator = CBlockLocator()
+        getheaders.locator.vHave = [locator_hash]
+        self.connection.send_message(getheaders)
+        for _ in range(timeout * 20):
+            with mininode_lock:
+                if len(self.headers) >= count:
+                    return self.headers[:count]
+            time.sleep(0.05)
+        raise AssertionError("headers not received")
+
+    def send_headers(self, headers):
+        message = msg_headers()
+        message.headers = headers
+        self.connection.send_message(message)
+
+
+class TxOutSetSnapshotTest(BitcoinTestFramework):
+
+    def __init__(self):
+        super().__init__()
+        self.cache_behavior = 'clean'
+        self.num_nodes = 2
+
+    def setup_network(self, split=False):
+        self.nodes = start_nodes(self.num_nodes, self.options.tmpdir, [[], ['-disablewallet']])
+        self.is_network_split = True
+
+    def run_test(self):
+        self.nodes[0].generate(10)
+
+        res = self.nodes[0].dumptxoutset('snapshot.dat')
+        assert_equal(res['height'], 10)
+        assert_equal(res['base_hash'], self.nodes[0].getbestblockhash())
+        assert(res['records'] > 0)
+        assert(os.path.isfile(res['path']))
+        assert_equal(len(res['snapshot_hash']), 64)
+
+        # Snapshots of the same chain state are identical.
+        res2 = self.nodes[0].dumptxoutset('snapshot2.dat')
+        assert_equal(res2['snapshot_hash'], res['snapshot_hash'])
+
+        assert_raises_message(JSONRPCException, 'already exists',
+            self.nodes[0].dumptxoutset, 'snapshot.dat')
+
+        # The node with the wallet refuses to load snapshots.
+        assert_raises_message(JSONRPCException, 'wallet',
+            self.nodes[0].loadtxoutset, res['path'])
+
+        # Only snapshots whose hash is in the chain parameters can be loaded,
+        # and there are none for regtest by default.
+        assert_raises_message(JSONRPCException, 'No snapshot hash is known for the base block',
+            self.nodes[1].loadtxoutset, res['path'])
+        assert_equal(self.nodes[1].getblockcount(), 0)
+
+        stop_node(self.nodes[1], 1)
+        self.nodes[1] = start_node(1, self.options.tmpdir, [
+            '-disablewallet',
+            '-snapshothash=%s:%s' % (res['base_hash'], res['snapshot_hash']),
+        ])
+
+        # The isolated node has not seen the header of the base block yet.
+        assert_raises_message(JSONRPCException, 'is not known yet',
+            self.nodes[1].loadtxoutset, res['path'])
+
+        # Give it the headers, but not the blocks.
+        source = HeadersNode()
+        relay = HeadersNode()
+        connections = [
+            NodeConn('127.0.0.1', p2p_port(0), self.nodes[0], source),
+            NodeConn('127.0.0.1', p2p_port(1), self.nodes[1], relay),
+        ]
+        source.add_connection(connections[0])
+        relay.add_connection(connections[1])
+        NetworkThread().start()
+        source.wait_for_verack()
+        relay.wait_for_verack()
+        headers = source.get_headers(int(self.nodes[0].getblockhash(0), 16), 10)
+        relay.send_headers(headers)
+        for _ in range(600):
+            if any(tip['hash'] == res['base_hash'] for tip in self.nodes[1].getchaintips()):
+                break
+            time.sleep(0.05)
+        else:
+            raise AssertionError("the base block header was not accepted")
+        assert_equal(self.nodes[1].getblockcount(), 0)
+
+        loaded = self.nodes[1].loadtxoutset(res['path'])
+        assert_equal(loaded['height'], 10)
+        assert_equal(loaded['base_hash'], res['base_hash'])
+        assert_equal(loaded['records'], res['records'])
+        assert_equal(self.nodes[1].getbestblockhash(), res['base_hash'])
+        info0 = self.nodes[0].gettxoutsetinfo()
+        info1 = self.nodes[1].gettxoutsetinfo()
+        for key in ['bestblock', 'transactions', 'txouts', 'hash_serialized', 'total_amount']:
+            assert_equal(info1[key], info0[key])
+
+        # The node validates the blocks after the snapshot.
+        [ c.disconnect_node() for c in connections ]
+        connect_nodes(self.nodes[1], 0)
+        self.nodes[0].generate(5)
+        sync_blocks(self.nodes)
+        assert_equal(self.nodes[1].getblockcount(), 15)
+        assert_equal(self.nodes[1].gettxoutsetinfo()['hash_serialized'],
+            self.nodes[0].gettxoutsetinfo()['hash_serialized'])
+
+
+if __name__ == '__main__':
+    TxOutSetSnapshotTest().main()
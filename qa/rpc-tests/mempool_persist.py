@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+# Copyright (c) 2026 The Zcash developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#
+# Test that the mempool is dumped to mempool.dat at shutdown and loaded back
+# at startup with its entry times and fee deltas, unless -persistmempool=0.
+#
+
+import os
+import time
+
+from decimal import Decimal
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import (
+    assert_equal,
+    start_node,
+    stop_node,
+)
+from test_framework.zip317 import conventional_fee
+
+
+class MempoolPersistTest(BitcoinTestFramework):
+
+    def __init__(self):
+        super().__init__()
+        self.num_nodes = 1
+
+    def setup_network(self):
+        self.nodes = [start_node(0, self.options.tmpdir, ['-allowdeprecated=getnewaddress'])]
+        self.is_network_split = False
+
+    def restart_node(self, extra_args):
+        # Without the wallet, which would add its transactions back to the
+        # mempool.
+        stop_node(self.nodes[0], 0)
+        self.nodes[0] = start_node(0, self.options.tmpdir, ['-disablewallet'] + extra_args)
+
+    def wait_for_mempool_size(self, size):
+        # The mempool is loaded in the background once the node has started.
+        for _ in range(100):
+            if len(self.nodes[0].getrawmempool()) == size:
+                return
+            time.sleep(0.1)
+        assert_equal(len(self.nodes[0].getrawmempool()), size)
+
+    def run_test(self):
+        node = self.nodes[0]
+        address = node.getnewaddress()
+        fee = conventional_fee(1)
+        signed = []
+        for height in range(1, 4):
+            coinbase_txid = node.getblock(node.getblockhash(height))['tx'][0]
+            rawtx = node.createrawtransaction([{'txid': coinbase_txid, 'vout': 0}], {address: Decimal('10') - fee})
+            signed.append(node.signrawtransaction(rawtx)['hex'])
+
+        self.restart_node([])
+        node = self.nodes[0]
+        txids = [node.sendrawtransaction(tx) for tx in signed]
+        node.prioritisetransaction(txids[0], 0, 1000)
+        entries = node.getrawmempool(True)
+        assert_equal(len(entries), 3)
+
+        print("Restart the node, and check the mempool is loaded from disk")
+        self.restart_node([])
+        self.wait_for_mempool_size(3)
+        reloaded = self.nodes[0].getrawmempool(True)
+        for txid in txids:
+            assert_equal(reloaded[txid]['time'], entries[txid]['time'])
+            assert_equal(reloaded[txid]['modifiedfee'], entries[txid]['modifiedfee'])
+        assert_equal(reloaded[txids[0]]['modifiedfee'], fee + Decimal('0.00001'))
+
+        print("Restart the node with -persistmempool=0, and check the mempool is empty")
+        self.restart_node(['-persistmempool=0'])
+        time.sleep(1)
+        assert_equal(len(self.nodes[0].getrawmempool()), 0)
+
+        # The node did not overwrite mempool.dat at shutdown, as it had not
+        # loaded it.
+        print("Restart the node, and check the mempool is loaded again")
+        self.restart_node([])
+        self.wait_for_mempool_size(3)
+
+        mempool_path = os.path.join(self.options.tmpdir, 'node0', 'regtest', 'mempool.dat')
+        os.remove(mempool_path)
+        self.nodes[0].savemempool()
+        assert(os.path.isfile(mempool_path))
+
+
+if __name__ == '__main__':
+    MempoolPersistTest().main()
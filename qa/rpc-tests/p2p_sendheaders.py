@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+# Copyright (c) 2026 The Zcash developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+from test_framework.mininode import NodeConn, NodeConnCB, NetworkThread, \
+    CBlockLocator, msg_getheaders, msg_sendheaders, mininode_lock
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import initialize_chain_clean, start_nodes, \
+    p2p_port, assert_equal
+
+import time
+
+
+class TestNode(NodeConnCB):
+    def __init__(self):
+        NodeConnCB.__init__(self)
+        self.create_callback_map()
+        self.connection = None
+        self.last_inv = None
+        self.last_headers = None
+
+    def add_connection(self, conn):
+        self.connection = conn
+
+    def wait_for_verack(self):
+        while True:
+            with mininode_lock:
+                if self.verack_received:
+                    return
+            time.sleep(0.05)
+
+    def send_message(self, message):
+        self.connection.send_message(message)
+
+    def on_inv(self, conn, message):
+        self.last_inv = message
+
+    def on_headers(self, conn, message):
+        self.last_headers = message
+
+    def clear_last_announcement(self):
+        with mininode_lock:
+            self.last_inv = None
+            self.last_headers = None
+
+    # Tell the node that we have its tip, so that it knows we can connect a
+    # header announcement for the next block.
+    def sync_headers(self, tip):
+        getheaders = msg_getheaders()
+        getheaders.locator = CBlockLocator()
+        getheaders.locator.vHave = [tip]
+        self.send_message(getheaders)
+
+    def wait_for_announcement(self, timeout=30):
+        for _ in range(timeout * 20):
+            with mininode_lock:
+                if self.last_inv is not None or self.last_headers is not None:
+                    return
+            time.sleep(0.05)
+        raise AssertionError("no block announcement received")
+
+
+class SendHeadersTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 1)
+
+    def setup_network(self):
+        self.nodes = start_nodes(1, self.options.tmpdir)
+        self.is_network_split = False
+
+    def run_test(self):
+        self.nodes[0].generate(10)
+
+        inv_node = TestNode()
+        headers_node = TestNode()
+
+        connections = []
+        connections.append(NodeConn('127.0.0.1', p2p_port(0), self.nodes[0], inv_node))
+        connections.append(NodeConn('127.0.0.1', p2p_port(0), self.nodes[0], headers_node))
+        inv_node.add_connection(connections[0])
+        headers_node.add_connection(connections[1])
+
+        NetworkThread().start()
+
+        inv_node.wait_for_verack()
+        headers_node.wait_for_verack()
+
+        headers_node.send_message(msg_sendheaders())
+
+        tip = int(self.nodes[0].getbestblockhash(), 16)
+        inv_node.sync_headers(tip)
+        headers_node.sync_headers(tip)
+        time.sleep(1)
+        inv_node.clear_last_announcement()
+        headers_node.clear_last_announcement()
+
+        # A peer that did not send "sendheaders" is still sent an inv.
+        [new_hash] = self.nodes[0].generate(1)
+        inv_node.wait_for_announcement()
+        headers_node.wait_for_announcement()
+        with mininode_lock:
+            assert inv_node.last_headers is None
+            assert_equal(len(inv_node.last_inv.inv), 1)
+            assert_equal(inv_node.last_inv.inv[0].hash, int(new_hash, 16))
+
+            # A peer that did is sent the header directly.
+            assert headers_node.last_inv is None
+            assert_equal(len(headers_node.last_headers.headers), 1)
+            header = headers_node.last_headers.headers[0]
+            header.calc_sha256()
+            assert_equal(header.sha256, int(new_hash, 16))
+            assert_equal(header.hashPrevBlock, tip)
+
+        [ c.disconnect_node() for c in connections ]
+
+if __name__ == '__main__':
+    SendHeadersTest().main()
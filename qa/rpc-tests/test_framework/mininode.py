@@ -1730,6 +1730,22 @@ class msg_mempool(object):
         return "msg_mempool()"
 
 
+class msg_sendheaders(object):
+    command = b"sendheaders"
+
+    def __init__(self):
+        pass
+
+    def deserialize(self, f):
+        pass
+
+    def serialize(self):
+        return b""
+
+    def __repr__(self):
+        return "msg_sendheaders()"
+
+
 # getheaders message has
 # number of entries
 # vector of hashes
@@ -1877,7 +1893,8 @@ class NodeConnCB(object):
             b"headers": self.on_headers,
             b"getheaders": self.on_getheaders,
             b"reject": self.on_reject,
-            b"mempool": self.on_mempool
+            b"mempool": self.on_mempool,
+            b"sendheaders": self.on_sendheaders
         }
 
     def deliver(self, conn, message):
@@ -1924,6 +1941,7 @@ class NodeConnCB(object):
     def on_close(self, conn): pass
     def on_mempool(self, conn): pass
     def on_pong(self, conn, message): pass
+    def on_sendheaders(self, conn, message): pass
 
 
 # The actual NodeConn class
@@ -1946,7 +1964,8 @@ class NodeConn(asyncore.dispatcher):
         b"headers": msg_headers,
         b"getheaders": msg_getheaders,
         b"reject": msg_reject,
-        b"mempool": msg_mempool
+        b"mempool": msg_mempool,
+        b"sendheaders": msg_sendheaders
     }
     MAGIC_BYTES = {
         "mainnet": b"\x24\xe9\x27\x64",   # mainnet
@@ -2068,8 +2087,7 @@ class NodeConn(asyncore.dispatcher):
                     t.deserialize(f)
                     self.got_message(t)
                 else:
-                    self.show_debug_msg("Unknown command: '" + command + "' " +
-                                        repr(msg))
+                    self.show_debug_msg("Unknown command: %r %r" % (command, msg))
         except Exception as e:
             print('got_data:', repr(e))
             # import  traceback
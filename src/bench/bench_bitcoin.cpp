@@ -9,8 +9,10 @@
 #include "fs.h"
 #include "key.h"
 #include "main.h"
+#include "script/sigcache.h"
 #include "util/system.h"
 
+#include <rust/bridge.h>
 #include <rust/init.h>
 
 const std::function<std::string(const char*)> G_TRANSLATION_FUN = nullptr;
@@ -22,6 +24,8 @@ main(int argc, char** argv)
     ECC_Start();
     SetupEnvironment();
     fPrintToDebugLog = false; // don't want to write to debug log file
+    InitSignatureCache(DEFAULT_MAX_SIG_CACHE_SIZE * ((size_t) 1 << 20));
+    bundlecache::init(DEFAULT_MAX_SIG_CACHE_SIZE * ((size_t) 1 << 20));
 
     fs::path sprout_groth16 = ZC_GetParamsDir() / "sprout-groth16.params";
 
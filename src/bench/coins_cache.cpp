@@ -0,0 +1,62 @@
+// Copyright (c) 2026 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "bench.h"
+#include "coins.h"
+#include "crypto/common.h"
+#include "primitives/transaction.h"
+#include "script/script.h"
+#include "uint256.h"
+
+#include <vector>
+
+static const size_t CACHED_TRANSACTIONS = 100000;
+static const size_t TRANSACTIONS_PER_BLOCK = 200;
+
+static uint256 TxidAt(uint64_t n)
+{
+    uint256 txid;
+    WriteLE64(txid.begin(), n);
+    WriteLE64(txid.begin() + 8, n * 0x9e3779b97f4a7c15ULL);
+    return txid;
+}
+
+static void AddCoins(CCoinsViewCache& view, uint64_t n)
+{
+    CCoinsModifier coins = view.ModifyNewCoins(TxidAt(n));
+    coins->nVersion = 1;
+    coins->nHeight = n / TRANSACTIONS_PER_BLOCK;
+    coins->vout.assign(2, CTxOut(1000, CScript() << OP_TRUE));
+}
+
+// Models the use of the coins caches while connecting blocks: for each block,
+// a view on top of the tip cache fetches and spends the coins created
+// CACHED_TRANSACTIONS transactions earlier, creates new ones, and is flushed
+// into the tip cache, which holds about CACHED_TRANSACTIONS entries.
+static void CoinsCacheFetchModifyFlush(benchmark::State& state)
+{
+    CCoinsViewDummy base;
+    CCoinsViewCache tip(&base);
+    uint64_t n = 0;
+    for (; n < CACHED_TRANSACTIONS; n++) {
+        AddCoins(tip, n);
+    }
+
+    while (state.KeepRunning()) {
+        CCoinsViewCache view(&tip);
+        for (size_t i = 0; i < TRANSACTIONS_PER_BLOCK; i++, n++) {
+            {
+                CCoinsModifier coins = view.ModifyCoins(TxidAt(n - CACHED_TRANSACTIONS));
+                assert(coins->IsAvailable(0) && coins->IsAvailable(1));
+                coins->Spend(0);
+                coins->Spend(1);
+            }
+            AddCoins(view, n);
+        }
+        view.Flush();
+    }
+    assert(tip.DynamicMemoryUsage() > 0);
+}
+
+BENCHMARK(CoinsCacheFetchModifyFlush);
@@ -0,0 +1,186 @@
+// Copyright (c) 2026 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "bench.h"
+#include "chainparams.h"
+#include "coins.h"
+#include "consensus/validation.h"
+#include "crypto/common.h"
+#include "fs.h"
+#include "keystore.h"
+#include "main.h"
+#include "primitives/transaction.h"
+#include "random.h"
+#include "script/standard.h"
+#include "transaction_builder.h"
+#include "txdb.h"
+#include "txmempool.h"
+#include "util/system.h"
+#include "util/test.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <vector>
+
+// Transactions in a burst received from peers.
+static const size_t BURST_TRANSACTIONS = 16;
+static const CAmount INPUT_VALUE = 100000;
+static const CAmount NOTE_VALUE = 50000;
+// The ZIP 317 conventional fee for one transparent input, one Sapling spend
+// and two Sapling outputs.
+static const CAmount BURST_FEE = 15000;
+
+// Sets up a chain state holding just the genesis block in a temporary data
+// directory, as the unit tests do, so that transactions can be accepted to a
+// mempool on top of it.
+class ChainStateSetup
+{
+public:
+    ChainStateSetup()
+    {
+        ClearDatadirCache();
+        pathTemp = fs::temp_directory_path() / strprintf("bench_bitcoin_%lu_%i", (unsigned long)GetTime(), (int)GetRand(100000));
+        fs::create_directories(pathTemp);
+        mapArgs["-datadir"] = pathTemp.string();
+        pblocktree = new CBlockTreeDB(1 << 20, true);
+        pcoinsdbview = new CCoinsViewDB(1 << 23, true);
+        pcoinsTip = new CCoinsViewCache(pcoinsdbview);
+        bool fInit = InitBlockIndex(Params());
+        assert(fInit);
+        CValidationState state;
+        bool fActivated = ActivateBestChain(state, Params());
+        assert(fActivated);
+    }
+
+    ~ChainStateSetup()
+    {
+        UnloadBlockIndex();
+        delete pcoinsTip;
+        delete pcoinsdbview;
+        delete pblocktree;
+        pcoinsTip = nullptr;
+        pcoinsdbview = nullptr;
+        pblocktree = nullptr;
+        mapArgs.erase("-datadir");
+        ClearDatadirCache();
+        fs::remove_all(pathTemp);
+    }
+
+private:
+    fs::path pathTemp;
+};
+
+// Transactions that each spend a transparent coin and a Sapling note to two
+// Sapling outputs, so that admitting them checks a transparent signature, a
+// Sapling spend proof and signature, and two Sapling output proofs. The coins
+// they spend and the anchor of the notes are cached in view.
+static std::vector<CTransaction> CreateShieldedTransactions(CCoinsViewCache& view, int nHeight)
+{
+    CBasicKeyStore keystore;
+    CKey key = AddTestCKeyToKeyStore(keystore);
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    auto sk = GetTestMasterSaplingSpendingKey();
+    auto fvk = sk.expsk.full_viewing_key();
+    auto pa = sk.ToXFVK().DefaultAddress();
+
+    std::vector<libzcash::SaplingNote> vNotes;
+    std::vector<SaplingWitness> vWitnesses;
+    SaplingMerkleTree tree;
+    for (size_t i = 0; i < BURST_TRANSACTIONS; i++) {
+        libzcash::SaplingNote note(pa, NOTE_VALUE, libzcash::Zip212Enabled::BeforeZip212);
+        uint256 cm = note.cmu().value();
+        for (SaplingWitness& witness : vWitnesses) {
+            witness.append(cm);
+        }
+        tree.append(cm);
+        vNotes.push_back(note);
+        vWitnesses.push_back(tree.witness());
+    }
+    view.PushAnchor(tree);
+
+    std::vector<CTransaction> vtx;
+    for (size_t i = 0; i < BURST_TRANSACTIONS; i++) {
+        uint256 prevTxid;
+        WriteLE64(prevTxid.begin(), i + 1);
+        {
+            CCoinsModifier coins = view.ModifyNewCoins(prevTxid);
+            coins->nVersion = 1;
+            coins->nHeight = nHeight - 1;
+            coins->vout.assign(1, CTxOut(INPUT_VALUE, scriptPubKey));
+        }
+
+        CAmount nValueOut = INPUT_VALUE + NOTE_VALUE - BURST_FEE;
+        auto builder = TransactionBuilder(Params(), nHeight, std::nullopt, tree.root(), &keystore);
+        builder.SetFee(BURST_FEE);
+        builder.AddTransparentInput(COutPoint(prevTxid, 0), scriptPubKey, INPUT_VALUE);
+        builder.AddSaplingSpend(sk, vNotes[i], vWitnesses[i]);
+        builder.AddSaplingOutput(fvk.ovk, pa, nValueOut / 2, {});
+        builder.AddSaplingOutput(fvk.ovk, pa, nValueOut - nValueOut / 2, {});
+        vtx.push_back(builder.Build().GetTxOrThrow());
+    }
+    return vtx;
+}
+
+// Admits a burst of shielded transactions received from peers to the mempool
+// as the node does: the precheck threads verify their inputs, either with one
+// Sapling batch for all of them or one batch each, and then each transaction
+// is accepted to the mempool under cs_main without verifying them again.
+//
+// Nothing is added to the validity caches, so that every iteration verifies
+// the transactions in full. AcceptToMemoryPool() itself always fills the
+// caches when it verifies inputs, which is why the proofs and signatures are
+// checked by the precheck step here.
+static void AcceptBurst(benchmark::State& state, bool fBatch)
+{
+    RegtestActivateSapling();
+    {
+        ChainStateSetup setup;
+        int nHeight;
+        std::vector<CTransaction> vtx;
+        {
+            LOCK(cs_main);
+            nHeight = chainActive.Height() + 1;
+            vtx = CreateShieldedTransactions(*pcoinsTip, nHeight);
+        }
+        std::vector<const CTransaction*> vptx;
+        for (const CTransaction& tx : vtx) {
+            vptx.push_back(&tx);
+        }
+        CTxMemPool pool(CFeeRate(0));
+
+        while (state.KeepRunning()) {
+            if (fBatch) {
+                std::vector<bool> vVerified = VerifyTransactionInputs(Params(), vptx, *pcoinsTip, nHeight, false);
+                assert(std::count(vVerified.begin(), vVerified.end(), true) == (long)vtx.size());
+            } else {
+                for (const CTransaction* ptx : vptx) {
+                    std::vector<bool> vVerified = VerifyTransactionInputs(Params(), {ptx}, *pcoinsTip, nHeight, false);
+                    assert(vVerified[0]);
+                }
+            }
+
+            LOCK(cs_main);
+            for (const CTransaction& tx : vtx) {
+                CValidationState stateAccept;
+                bool fAccepted = AcceptToMemoryPool(Params(), pool, stateAccept, tx, false, nullptr, false, false, true);
+                assert(fAccepted);
+            }
+            pool.clear();
+        }
+    }
+    RegtestDeactivateSapling();
+}
+
+static void MempoolAcceptBurstBatched(benchmark::State& state)
+{
+    AcceptBurst(state, true);
+}
+
+static void MempoolAcceptBurstSingly(benchmark::State& state)
+{
+    AcceptBurst(state, false);
+}
+
+BENCHMARK(MempoolAcceptBurstBatched);
+BENCHMARK(MempoolAcceptBurstSingly);
@@ -0,0 +1,173 @@
+// Copyright (c) 2026 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "bench.h"
+#include "amount.h"
+#include "chainparams.h"
+#include "consensus/upgrades.h"
+#include "crypto/common.h"
+#include "primitives/transaction.h"
+#include "streams.h"
+#include "transaction_builder.h"
+#include "txmempool.h"
+#include "util/test.h"
+#include "version.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <list>
+#include <vector>
+
+// A mempool under spam, and the block that clears part of it.
+static const size_t MEMPOOL_TRANSACTIONS = 5000;
+static const size_t BLOCK_TRANSACTIONS = 500;
+
+// Add two transparent inputs, unique to transaction i, to mtx.
+static void AddSpamInputs(CMutableTransaction& mtx, size_t i)
+{
+    for (uint32_t n = 0; n < 2; n++) {
+        uint256 prevTxid;
+        WriteLE64(prevTxid.begin(), i + 1);
+        WriteLE32(prevTxid.begin() + 8, n);
+        mtx.vin.push_back(CTxIn(COutPoint(prevTxid, n)));
+    }
+}
+
+// Transactions with two transparent inputs each, of which every other one
+// also reveals two Sprout nullifiers in a JoinSplit. The Sprout and Orchard
+// indexes are keyed the same way.
+static std::vector<CTransaction> CreateSpamTransactions(size_t nCount)
+{
+    std::vector<CTransaction> vtx;
+    for (size_t i = 0; i < nCount; i++) {
+        CMutableTransaction mtx;
+        mtx.nVersion = 2;
+        AddSpamInputs(mtx, i);
+        mtx.vout.push_back(CTxOut(1000, CScript() << OP_TRUE));
+        if (i % 2 == 0) {
+            JSDescription jsdesc;
+            for (size_t j = 0; j < jsdesc.nullifiers.size(); j++) {
+                WriteLE64(jsdesc.nullifiers[j].begin(), i + 1);
+                WriteLE32(jsdesc.nullifiers[j].begin() + 8, j);
+            }
+            mtx.vJoinSplit.push_back(jsdesc);
+        }
+        vtx.push_back(mtx);
+    }
+    return vtx;
+}
+
+// As CreateSpamTransactions, but every other transaction reveals a Sapling
+// nullifier instead, which exercises the index keyed by SaltedNullifierHasher.
+// Creating thousands of spend proofs isn't practical, so a single Sapling
+// spend is built, and each transaction carries a copy of it with its
+// nullifier replaced. The mempool doesn't check proofs, only the nullifiers.
+static std::vector<CTransaction> CreateSaplingSpamTransactions(size_t nCount)
+{
+    RegtestActivateSapling();
+    auto sk = GetTestMasterSaplingSpendingKey();
+    auto fvk = sk.expsk.full_viewing_key();
+    auto pa = sk.ToXFVK().DefaultAddress();
+    auto testNote = GetTestSaplingNote(pa, 50000);
+    auto builder = TransactionBuilder(Params(), 1, std::nullopt, testNote.tree.root());
+    builder.SetFee(0);
+    builder.AddSaplingSpend(sk, testNote.note, testNote.tree.witness());
+    builder.AddSaplingOutput(fvk.ovk, pa, 50000, {});
+    CTransaction txSpend = builder.Build().GetTxOrThrow();
+    auto nf = txSpend.GetSaplingSpends()[0].nullifier();
+
+    std::vector<CTransaction> vtx;
+    for (size_t i = 0; i < nCount; i++) {
+        if (i % 2 != 0) {
+            CMutableTransaction mtx;
+            mtx.nVersion = 2;
+            AddSpamInputs(mtx, i);
+            mtx.vout.push_back(CTxOut(1000, CScript() << OP_TRUE));
+            vtx.push_back(mtx);
+            continue;
+        }
+        CMutableTransaction mtx(txSpend);
+        AddSpamInputs(mtx, i);
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << CTransaction(mtx);
+        auto it = std::search(ss.begin(), ss.end(), nf.begin(), nf.end());
+        assert(it != ss.end());
+        WriteLE64((unsigned char*)&*it, i + 1);
+        CTransaction tx;
+        ss >> tx;
+        assert(tx.GetSaplingSpends()[0].nullifier() != nf);
+        vtx.push_back(tx);
+    }
+    RegtestDeactivateSapling();
+    return vtx;
+}
+
+static void AddToMempool(CTxMemPool& pool, const CTransaction& tx)
+{
+    uint32_t nBranchId = NetworkUpgradeInfo[Consensus::BASE_SPROUT].nBranchId;
+    pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 10000, 0, 1, true, false, 1, nBranchId));
+}
+
+// Adds all of the transactions to an empty mempool, then removes them.
+static void AddRemove(benchmark::State& state, const std::vector<CTransaction>& vtx)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    while (state.KeepRunning()) {
+        for (const CTransaction& tx : vtx) {
+            AddToMempool(pool, tx);
+        }
+        for (const CTransaction& tx : vtx) {
+            std::list<CTransaction> removed;
+            pool.remove(tx, removed);
+        }
+        assert(pool.size() == 0);
+    }
+}
+
+// Connects a block of transactions from a full mempool, which removes them
+// and checks every input and nullifier they spend for conflicts.
+static void RemoveForBlock(benchmark::State& state, const std::vector<CTransaction>& vtx)
+{
+    CTxMemPool pool(CFeeRate(0));
+    std::vector<CTransaction> vBlockTx(vtx.begin(), vtx.begin() + BLOCK_TRANSACTIONS);
+    for (const CTransaction& tx : vtx) {
+        AddToMempool(pool, tx);
+    }
+
+    while (state.KeepRunning()) {
+        std::list<CTransaction> conflicts;
+        pool.removeForBlock(vBlockTx, 2, conflicts);
+        assert(pool.size() == MEMPOOL_TRANSACTIONS - BLOCK_TRANSACTIONS);
+        // Put the block back, as if it had been disconnected.
+        for (const CTransaction& tx : vBlockTx) {
+            AddToMempool(pool, tx);
+        }
+    }
+}
+
+static void MempoolAddRemove(benchmark::State& state)
+{
+    AddRemove(state, CreateSpamTransactions(MEMPOOL_TRANSACTIONS));
+}
+
+static void MempoolAddRemoveSapling(benchmark::State& state)
+{
+    AddRemove(state, CreateSaplingSpamTransactions(MEMPOOL_TRANSACTIONS));
+}
+
+static void MempoolRemoveForBlock(benchmark::State& state)
+{
+    RemoveForBlock(state, CreateSpamTransactions(MEMPOOL_TRANSACTIONS));
+}
+
+static void MempoolRemoveForBlockSapling(benchmark::State& state)
+{
+    RemoveForBlock(state, CreateSaplingSpamTransactions(MEMPOOL_TRANSACTIONS));
+}
+
+BENCHMARK(MempoolAddRemove);
+BENCHMARK(MempoolAddRemoveSapling);
+BENCHMARK(MempoolRemoveForBlock);
+BENCHMARK(MempoolRemoveForBlockSapling);
@@ -0,0 +1,203 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2026 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#ifndef ZCASH_BLOCKENCODINGS_H
+#define ZCASH_BLOCKENCODINGS_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+
+#include <limits>
+#include <optional>
+#include <memory>
+
+class CTxMemPool;
+
+/**
+ * Compact block relay, after BIP 152.
+ *
+ * A compact block ("cmpctblock") holds a block header, a few prefilled
+ * transactions (at least the coinbase), and a 6-byte short ID for each other
+ * transaction. The receiver reconstructs the block from its mempool, and
+ * requests the transactions it is missing with "getblocktxn", which are sent
+ * in a "blocktxn" message.
+ *
+ * Unlike BIP 152, short IDs are computed from the ZIP 239 wtxid (the txid and
+ * the authorizing data commitment), so that a mempool transaction with the
+ * same effects but different authorizing data does not match.
+ */
+
+/** A request for some of the transactions of a block, by index. */
+class BlockTransactionsRequest {
+public:
+    uint256 blockhash;
+    //! Ascending. On the wire, each index is encoded as its difference
+    //! from the previous index plus one.
+    std::vector<uint16_t> indexes;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(blockhash);
+        uint64_t nIndexes = indexes.size();
+        READWRITE(COMPACTSIZE(nIndexes));
+        if (ser_action.ForRead()) {
+            // Grow the vector as the indexes are read, rather than trusting
+            // the count.
+            indexes.clear();
+            uint64_t nOffset = 0;
+            while (indexes.size() < nIndexes) {
+                uint64_t nIndex = 0;
+                READWRITE(COMPACTSIZE(nIndex));
+                nIndex += nOffset;
+                if (nIndex > std::numeric_limits<uint16_t>::max())
+                    throw std::ios_base::failure("getblocktxn index overflowed 16 bits");
+                indexes.push_back(nIndex);
+                nOffset = nIndex + 1;
+            }
+        } else {
+            for (size_t i = 0; i < indexes.size(); i++) {
+                uint64_t nIndex = indexes[i] - (i == 0 ? 0 : indexes[i - 1] + 1);
+                READWRITE(COMPACTSIZE(nIndex));
+            }
+        }
+    }
+};
+
+/** The transactions of a block that were requested by a BlockTransactionsRequest. */
+class BlockTransactions {
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    BlockTransactions() {}
+    explicit BlockTransactions(const BlockTransactionsRequest& req) :
+        blockhash(req.blockhash), txn(req.indexes.size()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(blockhash);
+        READWRITE(txn);
+    }
+};
+
+/** A transaction sent in full in a compact block. */
+struct PrefilledTransaction {
+    //! On the wire, the difference from the index of the previous prefilled
+    //! transaction plus one.
+    uint16_t index;
+    CTransaction tx;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        uint64_t nIndex = index;
+        READWRITE(COMPACTSIZE(nIndex));
+        if (nIndex > std::numeric_limits<uint16_t>::max())
+            throw std::ios_base::failure("prefilled transaction index overflowed 16 bits");
+        index = nIndex;
+        READWRITE(tx);
+    }
+};
+
+typedef enum ReadStatus_t
+{
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, //!< Invalid object, peer is sending bogus data.
+    READ_STATUS_FAILED,  //!< Failed to process object, e.g. because of a short ID collision.
+} ReadStatus;
+
+class CBlockHeaderAndShortTxIDs {
+private:
+    mutable uint64_t shorttxidk0, shorttxidk1;
+    uint64_t nonce;
+
+    void FillShortTxIDSelector() const;
+
+    friend class PartiallyDownloadedBlock;
+
+    static const int SHORTTXIDS_LENGTH = 6;
+
+protected:
+    std::vector<uint64_t> shorttxids;
+    std::vector<PrefilledTransaction> prefilledtxn;
+
+public:
+    CBlockHeader header;
+
+    // Dummy for deserialization
+    CBlockHeaderAndShortTxIDs() {}
+
+    //! Prefills the coinbase, and uses short IDs for the other transactions.
+    explicit CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txid, const uint256& authDigest) const;
+
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(header);
+        READWRITE(nonce);
+
+        uint64_t nShortTxIDs = shorttxids.size();
+        READWRITE(COMPACTSIZE(nShortTxIDs));
+        if (ser_action.ForRead()) {
+            shorttxids.clear();
+        }
+        for (uint64_t i = 0; i < nShortTxIDs; i++) {
+            uint32_t lsb = 0;
+            uint16_t msb = 0;
+            if (!ser_action.ForRead()) {
+                lsb = shorttxids[i] & 0xffffffff;
+                msb = (shorttxids[i] >> 32) & 0xffff;
+            }
+            READWRITE(lsb);
+            READWRITE(msb);
+            if (ser_action.ForRead()) {
+                shorttxids.push_back((uint64_t(msb) << 32) | uint64_t(lsb));
+            }
+        }
+        static_assert(SHORTTXIDS_LENGTH == 6, "shorttxids serialization assumes 6-byte shorttxids");
+
+        READWRITE(prefilledtxn);
+
+        if (ser_action.ForRead())
+            FillShortTxIDSelector();
+    }
+};
+
+/** A block being reconstructed from a compact block and the mempool. */
+class PartiallyDownloadedBlock {
+protected:
+    std::vector<std::shared_ptr<const CTransaction>> txn_available;
+    size_t prefilled_count = 0, mempool_count = 0;
+    CTxMemPool* pool;
+    //! From NU5, the chain history root that the block commits to along with
+    //! the auth data root of its transactions.
+    std::optional<uint256> hashChainHistoryRoot;
+
+public:
+    CBlockHeader header;
+
+    explicit PartiallyDownloadedBlock(CTxMemPool* poolIn) : pool(poolIn) {}
+
+    //! hashChainHistoryRootIn, when set, lets FillBlock() check the
+    //! authorizing data of the transactions against the header.
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock,
+                        const std::optional<uint256>& hashChainHistoryRootIn = std::nullopt);
+    bool IsTxAvailable(size_t index) const;
+    //! Fill in the block, taking the transactions that were not available
+    //! from vtx_missing, in order.
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing) const;
+};
+
+#endif // ZCASH_BLOCKENCODINGS_H
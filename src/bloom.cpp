@@ -7,6 +7,7 @@
 
 #include "primitives/transaction.h"
 #include "hash.h"
+#include "memusage.h"
 #include "script/script.h"
 #include "script/standard.h"
 #include "random.h"
@@ -16,6 +17,7 @@
 #include <stdlib.h>
 
 #include <algorithm>
+#include <limits>
 
 #define LN2SQUARED 0.4804530139182014246671025263266649717305529515945455
 #define LN2 0.6931471805599453094172321214581765680755001343602552
@@ -284,3 +286,56 @@ void CRollingBloomFilter::initialize()
     nGeneration = 1;
     std::fill(data.begin(), data.end(), 0);
 }
+
+static const uint32_t BLOCKED_BLOOM_SALTS[8] = {
+    0x47b6137b, 0x44974d91, 0x8824ad5b, 0xa2b7289d,
+    0x705495c7, 0x2df1424b, 0x9efc4947, 0x5c6bfb31,
+};
+
+CBlockedBloomFilter::CBlockedBloomFilter(size_t nElements, unsigned int nBitsPerElement) :
+    data(8 * std::max<size_t>(1, (nElements * nBitsPerElement + 255) / 256)),
+    nHashKey0(GetRand(std::numeric_limits<uint64_t>::max())),
+    nHashKey1(GetRand(std::numeric_limits<uint64_t>::max())),
+    nCapacity(nElements),
+    nInserted(0)
+{
+}
+
+// The upper 32 bits of the hash select the block, and the lower 32 bits the
+// bit in each word of the block.
+uint32_t* CBlockedBloomFilter::Block(uint64_t nHash)
+{
+    return &data[8 * (((nHash >> 32) * (data.size() / 8)) >> 32)];
+}
+
+const uint32_t* CBlockedBloomFilter::Block(uint64_t nHash) const
+{
+    return &data[8 * (((nHash >> 32) * (data.size() / 8)) >> 32)];
+}
+
+void CBlockedBloomFilter::insert(const uint256& hash)
+{
+    uint64_t nHash = SipHashUint256(nHashKey0, nHashKey1, hash);
+    uint32_t* block = Block(nHash);
+    for (int i = 0; i < 8; i++) {
+        block[i] |= uint32_t{1} << (((uint32_t)nHash * BLOCKED_BLOOM_SALTS[i]) >> 27);
+    }
+    nInserted++;
+}
+
+bool CBlockedBloomFilter::contains(const uint256& hash) const
+{
+    uint64_t nHash = SipHashUint256(nHashKey0, nHashKey1, hash);
+    const uint32_t* block = Block(nHash);
+    for (int i = 0; i < 8; i++) {
+        if (!(block[i] & (uint32_t{1} << (((uint32_t)nHash * BLOCKED_BLOOM_SALTS[i]) >> 27)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t CBlockedBloomFilter::DynamicMemoryUsage() const
+{
+    return memusage::DynamicUsage(data);
+}
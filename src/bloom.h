@@ -146,4 +146,43 @@ private:
     int nHashFuncs;
 };
 
+/**
+ * BlockedBloomFilter is a probabilistic set of 256-bit hashes, used to skip
+ * looking up in a database hashes that are certainly not in it. Each element
+ * sets one bit in each of the eight 32-bit words of a single 256-bit block,
+ * so that an insertion or lookup touches one cache line ("split block" Bloom
+ * filter). Elements cannot be removed.
+ *
+ * With 16 bits per element, the false positive rate is about 0.1% once the
+ * filter holds the number of elements it was created for, and it grows as
+ * more elements are inserted.
+ *
+ * The hashes are salted with a random key, so that elements cannot be chosen
+ * to collide.
+ */
+class CBlockedBloomFilter
+{
+public:
+    CBlockedBloomFilter(size_t nElements, unsigned int nBitsPerElement);
+
+    void insert(const uint256& hash);
+    bool contains(const uint256& hash) const;
+
+    //! The number of elements the filter was created for.
+    size_t capacity() const { return nCapacity; }
+    //! The number of insertions so far.
+    size_t size() const { return nInserted; }
+    size_t DynamicMemoryUsage() const;
+
+private:
+    uint32_t* Block(uint64_t nHash);
+    const uint32_t* Block(uint64_t nHash) const;
+
+    std::vector<uint32_t> data;
+    uint64_t nHashKey0;
+    uint64_t nHashKey1;
+    size_t nCapacity;
+    size_t nInserted;
+};
+
 #endif // BITCOIN_BLOOM_H
@@ -270,6 +270,11 @@ public:
         // The best chain should have at least this much work.
         consensus.nMinimumChainWork = uint256S("0x00000000000000000000000000000000000000000000000011be8336c45e2dd4");
 
+        // No default: the scripts and proofs of ancestors of the last
+        // checkpoint are already skipped, and a later block would have to be
+        // reviewed for each release.
+        consensus.defaultAssumeValid = uint256S("0x00");
+
         /**
          * The message start string should be awesome! ⓩ❤
          */
@@ -613,6 +618,9 @@ public:
         // The best chain should have at least this much work.
         consensus.nMinimumChainWork = uint256S("000000000000000000000000000000000000000000000000000000263c0984a2");
 
+        // By default verify the scripts and proofs of all blocks.
+        consensus.defaultAssumeValid = uint256S("0x00");
+
         pchMessageStart[0] = 0xfa;
         pchMessageStart[1] = 0x1a;
         pchMessageStart[2] = 0xf9;
@@ -767,6 +775,9 @@ public:
         // The best chain should have at least this much work.
         consensus.nMinimumChainWork = uint256S("0x00");
 
+        // By default verify the scripts and proofs of all blocks.
+        consensus.defaultAssumeValid = uint256S("0x00");
+
         pchMessageStart[0] = 0xaa;
         pchMessageStart[1] = 0xe8;
         pchMessageStart[2] = 0x3f;
@@ -820,6 +831,11 @@ public:
         consensus.vFundingStreams[idx] = fs;
     }
 
+    void UpdateSnapshotHash(const uint256& hashBase, const uint256& hashSnapshot)
+    {
+        mapSnapshotHashes[hashBase] = hashSnapshot;
+    }
+
     void UpdateRegtestPow(
         int64_t nPowMaxAdjustDown,
         int64_t nPowMaxAdjustUp,
@@ -922,6 +938,11 @@ void UpdateFundingStreamParameters(Consensus::FundingStreamIndex idx, Consensus:
     regTestParams.UpdateFundingStreamParameters(idx, fs);
 }
 
+void UpdateRegtestSnapshotHash(const uint256& hashBase, const uint256& hashSnapshot)
+{
+    regTestParams.UpdateSnapshotHash(hashBase, hashSnapshot);
+}
+
 void UpdateRegtestPow(
     int64_t nPowMaxAdjustDown,
     int64_t nPowMaxAdjustUp,
@@ -35,6 +35,9 @@ struct CCheckpointData {
     double fTransactionsPerDay;
 };
 
+//! The hashes of the chain state snapshots that can be loaded, by base block hash.
+typedef std::map<uint256, uint256> MapSnapshotHashes;
+
 /**
  * CChainParams defines various tweakable parameters of a given instance of the
  * Bitcoin system. There are three: the main network on which people trade goods
@@ -100,6 +103,7 @@ public:
     }
     const std::vector<SeedSpec6>& FixedSeeds() const { return vFixedSeeds; }
     const CCheckpointData& Checkpoints() const { return checkpointData; }
+    const MapSnapshotHashes& SnapshotHashes() const { return mapSnapshotHashes; }
     /** Return the founder's reward address and script for a given block height */
     std::string GetFoundersRewardAddressAtHeight(int height) const;
     CScript GetFoundersRewardScriptAtHeight(int height) const;
@@ -126,6 +130,7 @@ protected:
     bool fMineBlocksOnDemand = false;
     bool fTestnetToBeDeprecatedFieldRPC = false;
     CCheckpointData checkpointData;
+    MapSnapshotHashes mapSnapshotHashes;
     std::vector<std::string> vFoundersRewardAddress;
 
     CAmount nSproutValuePoolCheckpointHeight = 0;
@@ -168,4 +173,9 @@ void UpdateRegtestPow(
  */
 void UpdateFundingStreamParameters(Consensus::FundingStreamIndex idx, Consensus::FundingStream fs);
 
+/**
+ * Allows adding a chain state snapshot that can be loaded on regtest.
+ */
+void UpdateRegtestSnapshotHash(const uint256& hashBase, const uint256& hashSnapshot);
+
 #endif // BITCOIN_CHAINPARAMS_H
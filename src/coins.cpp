@@ -7,9 +7,12 @@
 
 #include "memusage.h"
 #include "random.h"
+#include "streams.h"
 #include "version.h"
 
+#include <algorithm>
 #include <assert.h>
+#include <functional>
 
 #include <rust/history.h>
 
@@ -76,18 +79,126 @@ bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins,
                                   CNullifiersMap &mapOrchardNullifiers,
                                   CHistoryCacheMap &historyCacheMap,
                                   SubtreeCache &cacheSaplingSubtrees,
-                                  SubtreeCache &cacheOrchardSubtrees) {
+                                  SubtreeCache &cacheOrchardSubtrees,
+                                  const CCoinsSetStats &statsDelta,
+                                  bool fErase) {
     return base->BatchWrite(mapCoins, hashBlock,
                             hashSproutAnchor, hashSaplingAnchor, hashOrchardAnchor,
                             mapSproutAnchors, mapSaplingAnchors, mapOrchardAnchors,
                             mapSproutNullifiers, mapSaplingNullifiers, mapOrchardNullifiers,
-                            historyCacheMap, cacheSaplingSubtrees, cacheOrchardSubtrees);
+                            historyCacheMap, cacheSaplingSubtrees, cacheOrchardSubtrees,
+                            statsDelta,
+                            fErase);
 }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) const { return base->GetStats(stats); }
 
+void CCoinsSetStats::UpdateCoins(const uint256 &txid, const CCoins &coins, int sign) {
+    if (coins.IsPruned()) {
+        return;
+    }
+
+    CDataStream ss(SER_DISK, PROTOCOL_VERSION);
+    ss << txid << coins;
+    if (sign > 0) {
+        muhashCoins.Insert(reinterpret_cast<const unsigned char*>(ss.data()), ss.size());
+    } else {
+        muhashCoins.Remove(reinterpret_cast<const unsigned char*>(ss.data()), ss.size());
+    }
+
+    int64_t nOutputs = 0;
+    CAmount nAmount = 0;
+    for (const CTxOut &out : coins.vout) {
+        if (!out.IsNull()) {
+            nOutputs++;
+            nAmount += out.nValue;
+        }
+    }
+    nTransactions += sign;
+    nTransactionOutputs += sign * nOutputs;
+    // The size of the database value, plus the txid in its key.
+    nSerializedSize += sign * (int64_t)(ss.size());
+    nTotalAmount += sign * nAmount;
+}
+
+void CCoinsSetStats::AddCoins(const uint256 &txid, const CCoins &coins) { UpdateCoins(txid, coins, 1); }
+void CCoinsSetStats::RemoveCoins(const uint256 &txid, const CCoins &coins) { UpdateCoins(txid, coins, -1); }
+
+void CCoinsSetStats::AddNullifier(const uint256 &nf, ShieldedType type) {
+    switch (type) {
+        case SPROUT:
+            nSproutNullifiers++;
+            muhashSproutNullifiers.Insert(nf.begin(), nf.size());
+            break;
+        case SAPLING:
+            nSaplingNullifiers++;
+            muhashSaplingNullifiers.Insert(nf.begin(), nf.size());
+            break;
+        case ORCHARD:
+            nOrchardNullifiers++;
+            muhashOrchardNullifiers.Insert(nf.begin(), nf.size());
+            break;
+        default:
+            throw std::runtime_error("Unknown shielded type");
+    }
+}
+
+void CCoinsSetStats::RemoveNullifier(const uint256 &nf, ShieldedType type) {
+    switch (type) {
+        case SPROUT:
+            nSproutNullifiers--;
+            muhashSproutNullifiers.Remove(nf.begin(), nf.size());
+            break;
+        case SAPLING:
+            nSaplingNullifiers--;
+            muhashSaplingNullifiers.Remove(nf.begin(), nf.size());
+            break;
+        case ORCHARD:
+            nOrchardNullifiers--;
+            muhashOrchardNullifiers.Remove(nf.begin(), nf.size());
+            break;
+        default:
+            throw std::runtime_error("Unknown shielded type");
+    }
+}
+
+CCoinsSetStats& CCoinsSetStats::operator+=(const CCoinsSetStats &delta) {
+    nTransactions += delta.nTransactions;
+    nTransactionOutputs += delta.nTransactionOutputs;
+    nSerializedSize += delta.nSerializedSize;
+    nTotalAmount += delta.nTotalAmount;
+    muhashCoins *= delta.muhashCoins;
+    nSproutNullifiers += delta.nSproutNullifiers;
+    muhashSproutNullifiers *= delta.muhashSproutNullifiers;
+    nSaplingNullifiers += delta.nSaplingNullifiers;
+    muhashSaplingNullifiers *= delta.muhashSaplingNullifiers;
+    nOrchardNullifiers += delta.nOrchardNullifiers;
+    muhashOrchardNullifiers *= delta.muhashOrchardNullifiers;
+    return *this;
+}
+
+void CCoinsSetStats::ToCoinsStats(CCoinsStats &stats) {
+    stats.hashBlock = hashBlock;
+    stats.nTransactions = nTransactions;
+    stats.nTransactionOutputs = nTransactionOutputs;
+    stats.nSerializedSize = nSerializedSize;
+    stats.nTotalAmount = nTotalAmount;
+    muhashCoins.Finalize(stats.hashSerialized);
+    stats.nSproutNullifiers = nSproutNullifiers;
+    muhashSproutNullifiers.Finalize(stats.hashSproutNullifiers);
+    stats.nSaplingNullifiers = nSaplingNullifiers;
+    muhashSaplingNullifiers.Finalize(stats.hashSaplingNullifiers);
+    stats.nOrchardNullifiers = nOrchardNullifiers;
+    muhashOrchardNullifiers.Finalize(stats.hashOrchardNullifiers);
+}
+
 SaltedTxidHasher::SaltedTxidHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), cachedCoinsUsage(0) { }
+CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false),
+    cacheCoins(0, SaltedTxidHasher(), CCoinsMap::key_equal(), &cacheCoinsMemoryResource),
+    cacheSproutNullifiers(0, SaltedTxidHasher(), CNullifiersMap::key_equal(), &cacheSproutNullifiersMemoryResource),
+    cacheSaplingNullifiers(0, SaltedTxidHasher(), CNullifiersMap::key_equal(), &cacheSaplingNullifiersMemoryResource),
+    cacheOrchardNullifiers(0, SaltedTxidHasher(), CNullifiersMap::key_equal(), &cacheOrchardNullifiersMemoryResource),
+    cachedCoinsUsage(0) { }
 
 CCoinsViewCache::~CCoinsViewCache()
 {
@@ -95,6 +206,12 @@ CCoinsViewCache::~CCoinsViewCache()
 }
 
 size_t CCoinsViewCache::DynamicMemoryUsage() const {
+    // Memory on the freelists of the pools is reused for new entries before
+    // the pools grow, so it isn't counted.
+    size_t nFreeBytes = cacheCoinsMemoryResource.NumFreeBytes() +
+                        cacheSproutNullifiersMemoryResource.NumFreeBytes() +
+                        cacheSaplingNullifiersMemoryResource.NumFreeBytes() +
+                        cacheOrchardNullifiersMemoryResource.NumFreeBytes();
     return memusage::DynamicUsage(cacheCoins) +
            memusage::DynamicUsage(cacheSproutAnchors) +
            memusage::DynamicUsage(cacheSaplingAnchors) +
@@ -105,7 +222,8 @@ size_t CCoinsViewCache::DynamicMemoryUsage() const {
            memusage::DynamicUsage(historyCacheMap) +
            memusage::DynamicUsage(cacheSaplingSubtrees) +
            memusage::DynamicUsage(cacheOrchardSubtrees) +
-           cachedCoinsUsage;
+           memusage::DynamicUsage(cacheCoinsEvictionQueue) +
+           cachedCoinsUsage - nFreeBytes;
 }
 
 CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256 &txid) const {
@@ -121,11 +239,33 @@ CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256 &txid) const
         // The parent only has an empty entry for this txid; we can consider our
         // version as fresh.
         ret->second.flags = CCoinsCacheEntry::FRESH;
+    } else {
+        QueueForEviction(txid, ret->second.coins);
     }
     cachedCoinsUsage += ret->second.coins.DynamicMemoryUsage();
     return ret;
 }
 
+void CCoinsViewCache::QueueForEviction(const uint256 &txid, const CCoins &coins) const
+{
+    // Once most of the queue is out of date, rebuild it from the cache
+    // (which includes this entry) so that it doesn't grow without bound.
+    if (cacheCoinsEvictionQueue.size() > 2 * cacheCoins.size() + 1024) {
+        cacheCoinsEvictionQueue.clear();
+        for (const auto& entry : cacheCoins) {
+            if (entry.second.flags == 0) {
+                cacheCoinsEvictionQueue.emplace_back(entry.second.coins.nHeight, entry.first);
+            }
+        }
+        std::make_heap(cacheCoinsEvictionQueue.begin(), cacheCoinsEvictionQueue.end(),
+                       std::greater<std::pair<int, uint256>>());
+        return;
+    }
+    cacheCoinsEvictionQueue.emplace_back(coins.nHeight, txid);
+    std::push_heap(cacheCoinsEvictionQueue.begin(), cacheCoinsEvictionQueue.end(),
+                   std::greater<std::pair<int, uint256>>());
+}
+
 
 bool CCoinsViewCache::GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const {
     CAnchorsSproutMap::const_iterator it = cacheSproutAnchors.find(rt);
@@ -728,23 +868,33 @@ void CCoinsViewCache::PopAnchor(const uint256 &newrt, ShieldedType type) {
     }
 }
 
+void CCoinsViewCache::SetNullifier(CNullifiersMap& cacheNullifiers, const uint256& nf, ShieldedType type, bool spent) {
+    std::pair<CNullifiersMap::iterator, bool> ret = cacheNullifiers.insert(std::make_pair(nf, CNullifiersCacheEntry()));
+    // An entry that was already cached in the requested state is unchanged;
+    // otherwise the nullifier is taken to change state (consensus rules
+    // ensure that it does).
+    if (ret.second || ret.first->second.entered != spent) {
+        if (spent) {
+            cacheStatsDelta.AddNullifier(nf, type);
+        } else {
+            cacheStatsDelta.RemoveNullifier(nf, type);
+        }
+    }
+    ret.first->second.entered = spent;
+    ret.first->second.flags |= CNullifiersCacheEntry::DIRTY;
+}
+
 void CCoinsViewCache::SetNullifiers(const CTransaction& tx, bool spent) {
     for (const JSDescription &joinsplit : tx.vJoinSplit) {
         for (const uint256 &nullifier : joinsplit.nullifiers) {
-            std::pair<CNullifiersMap::iterator, bool> ret = cacheSproutNullifiers.insert(std::make_pair(nullifier, CNullifiersCacheEntry()));
-            ret.first->second.entered = spent;
-            ret.first->second.flags |= CNullifiersCacheEntry::DIRTY;
+            SetNullifier(cacheSproutNullifiers, nullifier, SPROUT, spent);
         }
     }
     for (const auto& spendDescription : tx.GetSaplingSpends()) {
-        std::pair<CNullifiersMap::iterator, bool> ret = cacheSaplingNullifiers.insert(std::make_pair(uint256::FromRawBytes(spendDescription.nullifier()), CNullifiersCacheEntry()));
-        ret.first->second.entered = spent;
-        ret.first->second.flags |= CNullifiersCacheEntry::DIRTY;
+        SetNullifier(cacheSaplingNullifiers, uint256::FromRawBytes(spendDescription.nullifier()), SAPLING, spent);
     }
     for (const uint256& nf : tx.GetOrchardBundle().GetNullifiers()) {
-        std::pair<CNullifiersMap::iterator, bool> ret = cacheOrchardNullifiers.insert(std::make_pair(nf, CNullifiersCacheEntry()));
-        ret.first->second.entered = spent;
-        ret.first->second.flags |= CNullifiersCacheEntry::DIRTY;
+        SetNullifier(cacheOrchardNullifiers, nf, ORCHARD, spent);
     }
 }
 
@@ -774,6 +924,11 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
         cachedCoinUsage = ret.first->second.coins.DynamicMemoryUsage();
     }
     // Assume that whenever ModifyCoins is called, the entry will be modified.
+    // The parent's version of the entry is removed from the statistics now;
+    // its final version is only added once it is flushed.
+    if (!(ret.first->second.flags & CCoinsCacheEntry::DIRTY)) {
+        cacheStatsDelta.RemoveCoins(txid, ret.first->second.coins);
+    }
     ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
     return CCoinsModifier(*this, ret.first, cachedCoinUsage);
 }
@@ -781,6 +936,9 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
 CCoinsModifier CCoinsViewCache::ModifyNewCoins(const uint256 &txid) {
     assert(!hasModifier);
     std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
+    if (!(ret.first->second.flags & CCoinsCacheEntry::DIRTY)) {
+        cacheStatsDelta.RemoveCoins(txid, ret.first->second.coins);
+    }
     ret.first->second.coins.Clear();
     ret.first->second.flags = CCoinsCacheEntry::FRESH;
     ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
@@ -838,7 +996,28 @@ void CCoinsViewCache::SetBestBlock(const uint256 &hashBlockIn) {
     hashBlock = hashBlockIn;
 }
 
-void BatchWriteNullifiers(CNullifiersMap &mapNullifiers, CNullifiersMap &cacheNullifiers)
+void CCoinsViewCache::ResetBestState() {
+    assert(!hasModifier);
+    cacheCoins.clear();
+    cacheSproutAnchors.clear();
+    cacheSaplingAnchors.clear();
+    cacheOrchardAnchors.clear();
+    cacheSproutNullifiers.clear();
+    cacheSaplingNullifiers.clear();
+    cacheOrchardNullifiers.clear();
+    historyCacheMap.clear();
+    cacheSaplingSubtrees.clear();
+    cacheOrchardSubtrees.clear();
+    cachedCoinsUsage = 0;
+    ReallocateCache();
+    cacheStatsDelta = CCoinsSetStats();
+    hashBlock.SetNull();
+    hashSproutAnchor.SetNull();
+    hashSaplingAnchor.SetNull();
+    hashOrchardAnchor.SetNull();
+}
+
+void BatchWriteNullifiers(CNullifiersMap &mapNullifiers, CNullifiersMap &cacheNullifiers, bool fErase)
 {
     for (CNullifiersMap::iterator child_it = mapNullifiers.begin(); child_it != mapNullifiers.end();) {
         if (child_it->second.flags & CNullifiersCacheEntry::DIRTY) { // Ignore non-dirty entries (optimization).
@@ -855,7 +1034,7 @@ void BatchWriteNullifiers(CNullifiersMap &mapNullifiers, CNullifiersMap &cacheNu
                 }
             }
         }
-        child_it = mapNullifiers.erase(child_it);
+        child_it = fErase ? mapNullifiers.erase(child_it) : std::next(child_it);
     }
 }
 
@@ -863,7 +1042,8 @@ template<typename Map, typename MapIterator, typename MapEntry>
 void BatchWriteAnchors(
     Map &mapAnchors,
     Map &cacheAnchors,
-    size_t &cachedCoinsUsage
+    size_t &cachedCoinsUsage,
+    bool fErase
 )
 {
     for (MapIterator child_it = mapAnchors.begin(); child_it != mapAnchors.end();)
@@ -887,7 +1067,7 @@ void BatchWriteAnchors(
             }
         }
 
-        child_it = mapAnchors.erase(child_it);
+        child_it = fErase ? mapAnchors.erase(child_it) : std::next(child_it);
     }
 }
 
@@ -933,11 +1113,19 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins,
                                  CNullifiersMap &mapOrchardNullifiers,
                                  CHistoryCacheMap &historyCacheMapIn,
                                  SubtreeCache &cacheSaplingSubtreesIn,
-                                 SubtreeCache &cacheOrchardSubtreesIn) {
+                                 SubtreeCache &cacheOrchardSubtreesIn,
+                                 const CCoinsSetStats &statsDelta,
+                                 bool fErase) {
     assert(!hasModifier);
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) { // Ignore non-dirty entries (optimization).
             CCoinsMap::iterator itUs = cacheCoins.find(it->first);
+            if (itUs != cacheCoins.end() && (itUs->second.flags & CCoinsCacheEntry::DIRTY)) {
+                // The child removed our version of the entry from the
+                // statistics, but it was never added to them: that is only
+                // done when we flush it, and it is about to be replaced.
+                cacheStatsDelta.AddCoins(itUs->first, itUs->second.coins);
+            }
             if (itUs == cacheCoins.end()) {
                 if (!it->second.coins.IsPruned()) {
                     // The parent cache does not have an entry, while the child
@@ -946,7 +1134,11 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins,
                     // would have pulled it in at first GetCoins).
                     assert(it->second.flags & CCoinsCacheEntry::FRESH);
                     CCoinsCacheEntry& entry = cacheCoins[it->first];
-                    entry.coins.swap(it->second.coins);
+                    if (fErase) {
+                        entry.coins.swap(it->second.coins);
+                    } else {
+                        entry.coins = it->second.coins;
+                    }
                     cachedCoinsUsage += entry.coins.DynamicMemoryUsage();
                     entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
                 }
@@ -960,28 +1152,34 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins,
                 } else {
                     // A normal modification.
                     cachedCoinsUsage -= itUs->second.coins.DynamicMemoryUsage();
-                    itUs->second.coins.swap(it->second.coins);
+                    if (fErase) {
+                        itUs->second.coins.swap(it->second.coins);
+                    } else {
+                        itUs->second.coins = it->second.coins;
+                    }
                     cachedCoinsUsage += itUs->second.coins.DynamicMemoryUsage();
                     itUs->second.flags |= CCoinsCacheEntry::DIRTY;
                 }
             }
         }
-        it = mapCoins.erase(it);
+        it = fErase ? mapCoins.erase(it) : std::next(it);
     }
 
-    ::BatchWriteAnchors<CAnchorsSproutMap, CAnchorsSproutMap::iterator, CAnchorsSproutCacheEntry>(mapSproutAnchors, cacheSproutAnchors, cachedCoinsUsage);
-    ::BatchWriteAnchors<CAnchorsSaplingMap, CAnchorsSaplingMap::iterator, CAnchorsSaplingCacheEntry>(mapSaplingAnchors, cacheSaplingAnchors, cachedCoinsUsage);
-    ::BatchWriteAnchors<CAnchorsOrchardMap, CAnchorsOrchardMap::iterator, CAnchorsOrchardCacheEntry>(mapOrchardAnchors, cacheOrchardAnchors, cachedCoinsUsage);
+    ::BatchWriteAnchors<CAnchorsSproutMap, CAnchorsSproutMap::iterator, CAnchorsSproutCacheEntry>(mapSproutAnchors, cacheSproutAnchors, cachedCoinsUsage, fErase);
+    ::BatchWriteAnchors<CAnchorsSaplingMap, CAnchorsSaplingMap::iterator, CAnchorsSaplingCacheEntry>(mapSaplingAnchors, cacheSaplingAnchors, cachedCoinsUsage, fErase);
+    ::BatchWriteAnchors<CAnchorsOrchardMap, CAnchorsOrchardMap::iterator, CAnchorsOrchardCacheEntry>(mapOrchardAnchors, cacheOrchardAnchors, cachedCoinsUsage, fErase);
 
-    ::BatchWriteNullifiers(mapSproutNullifiers, cacheSproutNullifiers);
-    ::BatchWriteNullifiers(mapSaplingNullifiers, cacheSaplingNullifiers);
-    ::BatchWriteNullifiers(mapOrchardNullifiers, cacheOrchardNullifiers);
+    ::BatchWriteNullifiers(mapSproutNullifiers, cacheSproutNullifiers, fErase);
+    ::BatchWriteNullifiers(mapSaplingNullifiers, cacheSaplingNullifiers, fErase);
+    ::BatchWriteNullifiers(mapOrchardNullifiers, cacheOrchardNullifiers, fErase);
 
     ::BatchWriteHistory(historyCacheMap, historyCacheMapIn);
 
     cacheSaplingSubtrees.BatchWrite(base, cacheSaplingSubtreesIn);
     cacheOrchardSubtrees.BatchWrite(base, cacheOrchardSubtreesIn);
 
+    cacheStatsDelta += statsDelta;
+
     hashSproutAnchor = hashSproutAnchorIn;
     hashSaplingAnchor = hashSaplingAnchorIn;
     hashOrchardAnchor = hashOrchardAnchorIn;
@@ -1008,7 +1206,9 @@ bool CCoinsViewCache::Flush() {
                                 cacheOrchardNullifiers,
                                 historyCacheMap,
                                 cacheSaplingSubtrees,
-                                cacheOrchardSubtrees);
+                                cacheOrchardSubtrees,
+                                cacheStatsDelta,
+                                true);
     cacheCoins.clear();
     cacheSproutAnchors.clear();
     cacheSaplingAnchors.clear();
@@ -1019,10 +1219,147 @@ bool CCoinsViewCache::Flush() {
     historyCacheMap.clear();
     cacheSaplingSubtrees.clear();
     cacheOrchardSubtrees.clear();
+    cacheStatsDelta = CCoinsSetStats();
     cachedCoinsUsage = 0;
+    ReallocateCache();
     return fOk;
 }
 
+template <typename Map, typename Resource>
+static void ReallocateMap(Map& map, Resource& resource)
+{
+    assert(map.empty());
+    typename Map::hasher hasher = map.hash_function();
+    map.~Map();
+    resource.~Resource();
+    ::new (&resource) Resource();
+    ::new (&map) Map(0, hasher, typename Map::key_equal(), &resource);
+}
+
+//! Clear the flags of the entries of a cache map once they have been written
+//! to the parent view.
+template <typename Map>
+static void ClearFlags(Map& map)
+{
+    for (auto& entry : map) {
+        entry.second.flags = 0;
+    }
+}
+
+bool CCoinsViewCache::Sync() {
+    assert(!hasModifier);
+    cacheSaplingSubtrees.Initialize(base);
+    cacheOrchardSubtrees.Initialize(base);
+
+    bool fOk = base->BatchWrite(cacheCoins,
+                                hashBlock,
+                                hashSproutAnchor,
+                                hashSaplingAnchor,
+                                hashOrchardAnchor,
+                                cacheSproutAnchors,
+                                cacheSaplingAnchors,
+                                cacheOrchardAnchors,
+                                cacheSproutNullifiers,
+                                cacheSaplingNullifiers,
+                                cacheOrchardNullifiers,
+                                historyCacheMap,
+                                cacheSaplingSubtrees,
+                                cacheOrchardSubtrees,
+                                cacheStatsDelta,
+                                false);
+
+    // The parent view now has every entry that is left in this cache, so
+    // none of them is fresh any more; spent coins need not be kept at all.
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end();) {
+        if (it->second.coins.IsPruned()) {
+            cachedCoinsUsage -= it->second.coins.DynamicMemoryUsage();
+            it = cacheCoins.erase(it);
+        } else {
+            if (it->second.flags != 0) {
+                it->second.flags = 0;
+                QueueForEviction(it->first, it->second.coins);
+            }
+            ++it;
+        }
+    }
+    ClearFlags(cacheSproutAnchors);
+    ClearFlags(cacheSaplingAnchors);
+    ClearFlags(cacheOrchardAnchors);
+    ClearFlags(cacheSproutNullifiers);
+    ClearFlags(cacheSaplingNullifiers);
+    ClearFlags(cacheOrchardNullifiers);
+    historyCacheMap.clear();
+    cacheSaplingSubtrees.clear();
+    cacheOrchardSubtrees.clear();
+    cacheStatsDelta = CCoinsSetStats();
+    return fOk;
+}
+
+//! Remove the unmodified anchor entries, other than the best anchor, from an
+//! anchor cache map.
+template <typename Map>
+static void EvictAnchors(Map& map, const uint256& hashBestAnchor, size_t& cachedCoinsUsage)
+{
+    for (auto it = map.begin(); it != map.end();) {
+        if (it->second.flags == 0 && it->first != hashBestAnchor) {
+            cachedCoinsUsage -= it->second.tree.DynamicMemoryUsage();
+            it = map.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+//! Remove the unmodified entries from a nullifier cache map.
+static void EvictNullifiers(CNullifiersMap& map)
+{
+    for (auto it = map.begin(); it != map.end();) {
+        if (it->second.flags == 0) {
+            it = map.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void CCoinsViewCache::Evict(size_t nTargetUsage) {
+    assert(!hasModifier);
+    if (DynamicMemoryUsage() <= nTargetUsage) {
+        return;
+    }
+
+    // Cached nullifiers and anchors are mostly from connecting blocks, and
+    // are rarely looked up again.
+    EvictAnchors(cacheSproutAnchors, GetBestAnchor(SPROUT), cachedCoinsUsage);
+    EvictAnchors(cacheSaplingAnchors, GetBestAnchor(SAPLING), cachedCoinsUsage);
+    EvictAnchors(cacheOrchardAnchors, GetBestAnchor(ORCHARD), cachedCoinsUsage);
+    EvictNullifiers(cacheSproutNullifiers);
+    EvictNullifiers(cacheSaplingNullifiers);
+    EvictNullifiers(cacheOrchardNullifiers);
+
+    // Then the coins of the oldest transactions.
+    while (DynamicMemoryUsage() > nTargetUsage && !cacheCoinsEvictionQueue.empty()) {
+        std::pop_heap(cacheCoinsEvictionQueue.begin(), cacheCoinsEvictionQueue.end(),
+                      std::greater<std::pair<int, uint256>>());
+        std::pair<int, uint256> candidate = cacheCoinsEvictionQueue.back();
+        cacheCoinsEvictionQueue.pop_back();
+        CCoinsMap::iterator it = cacheCoins.find(candidate.second);
+        if (it != cacheCoins.end() && it->second.flags == 0 && it->second.coins.nHeight == candidate.first) {
+            cachedCoinsUsage -= it->second.coins.DynamicMemoryUsage();
+            cacheCoins.erase(it);
+        }
+    }
+}
+
+void CCoinsViewCache::ReallocateCache()
+{
+    ReallocateMap(cacheCoins, cacheCoinsMemoryResource);
+    ReallocateMap(cacheSproutNullifiers, cacheSproutNullifiersMemoryResource);
+    ReallocateMap(cacheSaplingNullifiers, cacheSaplingNullifiersMemoryResource);
+    ReallocateMap(cacheOrchardNullifiers, cacheOrchardNullifiersMemoryResource);
+    std::vector<std::pair<int, uint256>>().swap(cacheCoinsEvictionQueue);
+}
+
 unsigned int CCoinsViewCache::GetCacheSize() const {
     return cacheCoins.size();
 }
@@ -1191,6 +1528,11 @@ void SubtreeCache::Initialize(CCoinsView *parentView)
 
 std::optional<libzcash::LatestSubtree> SubtreeCache::GetLatestSubtree(CCoinsView *parentView) {
     Initialize(parentView);
+    return GetLatestSubtree();
+}
+
+std::optional<libzcash::LatestSubtree> SubtreeCache::GetLatestSubtree() const {
+    assert(initialized);
 
     if (newSubtrees.size() > 0) {
         // The latest subtree is in our cache.
@@ -1214,8 +1556,13 @@ std::optional<libzcash::LatestSubtree> SubtreeCache::GetLatestSubtree(CCoinsView
 
 std::optional<libzcash::SubtreeData> SubtreeCache::GetSubtreeData(CCoinsView *parentView, libzcash::SubtreeIndex index) {
     Initialize(parentView);
+    return static_cast<const SubtreeCache&>(*this).GetSubtreeData(parentView, index);
+}
+
+std::optional<libzcash::SubtreeData> SubtreeCache::GetSubtreeData(const CCoinsView *parentView, libzcash::SubtreeIndex index) const {
+    assert(initialized);
 
-    auto latestSubtree = GetLatestSubtree(parentView);
+    auto latestSubtree = GetLatestSubtree();
 
     if (!latestSubtree.has_value() || latestSubtree.value().index < index) {
         // This subtree isn't complete in our local view
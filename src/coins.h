@@ -9,6 +9,7 @@
 
 #include "compressor.h"
 #include "core_memusage.h"
+#include "crypto/muhash.h"
 #include "hash.h"
 #include "memusage.h"
 #include "serialize.h"
@@ -338,11 +339,25 @@ enum ShieldedType: uint8_t
     ORCHARD = 0x03,
 };
 
-typedef boost::unordered_map<uint256, CCoinsCacheEntry, SaltedTxidHasher> CCoinsMap;
+/**
+ * Allocator for the maps of CCoinsViewCache. Their nodes are allocated from a
+ * pool that each map owns (see PoolResource), rather than one at a time from
+ * the heap, which saves the per-allocation overhead and keeps the nodes close
+ * together. Blocks are large enough for a node holding the entry and the
+ * map's own bookkeeping.
+ */
+template <typename Key, typename Entry>
+using CCacheMapAllocator = PoolAllocator<std::pair<const Key, Entry>,
+    (sizeof(std::pair<const Key, Entry>) + 4 * sizeof(void*) + alignof(void*) - 1) / alignof(void*) * alignof(void*),
+    alignof(void*)>;
+
+typedef boost::unordered_map<uint256, CCoinsCacheEntry, SaltedTxidHasher, std::equal_to<uint256>, CCacheMapAllocator<uint256, CCoinsCacheEntry>> CCoinsMap;
+typedef CCoinsMap::allocator_type::ResourceType CCoinsMapMemoryResource;
 typedef boost::unordered_map<uint256, CAnchorsSproutCacheEntry, SaltedTxidHasher> CAnchorsSproutMap;
 typedef boost::unordered_map<uint256, CAnchorsSaplingCacheEntry, SaltedTxidHasher> CAnchorsSaplingMap;
 typedef boost::unordered_map<uint256, CAnchorsOrchardCacheEntry, SaltedTxidHasher> CAnchorsOrchardMap;
-typedef boost::unordered_map<uint256, CNullifiersCacheEntry, SaltedTxidHasher> CNullifiersMap;
+typedef boost::unordered_map<uint256, CNullifiersCacheEntry, SaltedTxidHasher, std::equal_to<uint256>, CCacheMapAllocator<uint256, CNullifiersCacheEntry>> CNullifiersMap;
+typedef CNullifiersMap::allocator_type::ResourceType CNullifiersMapMemoryResource;
 typedef boost::unordered_map<uint32_t, HistoryCache> CHistoryCacheMap;
 
 struct CCoinsStats
@@ -354,8 +369,85 @@ struct CCoinsStats
     uint64_t nSerializedSize;
     uint256 hashSerialized;
     CAmount nTotalAmount;
+    uint64_t nSproutNullifiers;
+    uint256 hashSproutNullifiers;
+    uint64_t nSaplingNullifiers;
+    uint256 hashSaplingNullifiers;
+    uint64_t nOrchardNullifiers;
+    uint256 hashOrchardNullifiers;
+
+    CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0),
+        nSproutNullifiers(0), nSaplingNullifiers(0), nOrchardNullifiers(0) {}
+};
+
+/**
+ * Incrementally maintained statistics about the chain state: counts and a
+ * MuHash of the unspent coins and of each nullifier set.
+ *
+ * A CCoinsViewCache accumulates in one of these the change made to the
+ * chain state through it since it was last flushed, and passes it on to its
+ * parent view in BatchWrite, along with the dirty coins entries whose new
+ * versions are still to be added. CCoinsViewDB keeps the totals for its best
+ * block, so that GetStats does not have to walk the database.
+ */
+class CCoinsSetStats
+{
+public:
+    //! The best block of the chain state these statistics describe. Only
+    //! meaningful for the totals stored by CCoinsViewDB.
+    uint256 hashBlock;
+
+    //! Per-txid CCoins entries, and their non-null outputs. Each entry is
+    //! hashed as its serialized txid followed by its serialized CCoins.
+    int64_t nTransactions;
+    int64_t nTransactionOutputs;
+    int64_t nSerializedSize;
+    CAmount nTotalAmount;
+    MuHash3072 muhashCoins;
+
+    int64_t nSproutNullifiers;
+    MuHash3072 muhashSproutNullifiers;
+    int64_t nSaplingNullifiers;
+    MuHash3072 muhashSaplingNullifiers;
+    int64_t nOrchardNullifiers;
+    MuHash3072 muhashOrchardNullifiers;
+
+    CCoinsSetStats() : nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0),
+        nSproutNullifiers(0), nSaplingNullifiers(0), nOrchardNullifiers(0) {}
+
+    //! Add or remove the entry for txid; pruned entries are not part of the set.
+    void AddCoins(const uint256 &txid, const CCoins &coins);
+    void RemoveCoins(const uint256 &txid, const CCoins &coins);
+
+    void AddNullifier(const uint256 &nf, ShieldedType type);
+    void RemoveNullifier(const uint256 &nf, ShieldedType type);
+
+    //! Apply the change accumulated in another (child view's) instance.
+    CCoinsSetStats& operator+=(const CCoinsSetStats &delta);
+
+    //! Fill in the fields of stats that are derived from these statistics.
+    void ToCoinsStats(CCoinsStats &stats);
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(hashBlock);
+        READWRITE(nTransactions);
+        READWRITE(nTransactionOutputs);
+        READWRITE(nSerializedSize);
+        READWRITE(nTotalAmount);
+        READWRITE(muhashCoins);
+        READWRITE(nSproutNullifiers);
+        READWRITE(muhashSproutNullifiers);
+        READWRITE(nSaplingNullifiers);
+        READWRITE(muhashSaplingNullifiers);
+        READWRITE(nOrchardNullifiers);
+        READWRITE(muhashOrchardNullifiers);
+    }
 
-    CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
+private:
+    void UpdateCoins(const uint256 &txid, const CCoins &coins, int sign);
 };
 
 class SubtreeCache;
@@ -423,7 +515,9 @@ public:
 
     //! Do a bulk modification onto this cache. All of the provided
     //! caches may be modified and should be cleared by the caller
-    //! after this batch write.
+    //! after this batch write. If fErase is false, the coins, anchor
+    //! and nullifier entries are left in place (unmodified) so that the
+    //! caller can keep them cached.
     virtual bool BatchWrite(CCoinsMap &mapCoins,
                             const uint256 &hashBlock,
                             const uint256 &hashSproutAnchor,
@@ -437,7 +531,9 @@ public:
                             CNullifiersMap &mapOrchardNullifiers,
                             CHistoryCacheMap &historyCacheMap,
                             SubtreeCache &cacheSaplingSubtrees,
-                            SubtreeCache &cacheOrchardSubtrees) = 0;
+                            SubtreeCache &cacheOrchardSubtrees,
+                            const CCoinsSetStats &statsDelta,
+                            bool fErase) = 0;
 
     //! Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats) const = 0;
@@ -480,6 +576,11 @@ class SubtreeCache {
     //! Gets the subtree data for a given index, if available.
     std::optional<libzcash::SubtreeData> GetSubtreeData(CCoinsView *parentView, libzcash::SubtreeIndex index);
 
+    //! As above, for a cache that has already been initialized, which these
+    //! leave unmodified so that they can be called from several threads.
+    std::optional<libzcash::LatestSubtree> GetLatestSubtree() const;
+    std::optional<libzcash::SubtreeData> GetSubtreeData(const CCoinsView *parentView, libzcash::SubtreeIndex index) const;
+
     //! Inserts a new subtree into the view.
     void PushSubtree(CCoinsView *parentView, libzcash::SubtreeData subtree);
 
@@ -533,7 +634,9 @@ public:
                     CNullifiersMap &mapOrchardNullifiers,
                     CHistoryCacheMap &historyCacheMap,
                     SubtreeCache &cacheSaplingSubtrees,
-                    SubtreeCache &cacheOrchardSubtrees) { return false; }
+                    SubtreeCache &cacheOrchardSubtrees,
+                    const CCoinsSetStats &statsDelta,
+                    bool fErase) { return false; }
 
     bool GetStats(CCoinsStats &stats) const { return false; }
 };
@@ -577,7 +680,9 @@ public:
                     CNullifiersMap &mapOrchardNullifiers,
                     CHistoryCacheMap &historyCacheMap,
                     SubtreeCache &cacheSaplingSubtrees,
-                    SubtreeCache &cacheOrchardSubtrees);
+                    SubtreeCache &cacheOrchardSubtrees,
+                    const CCoinsSetStats &statsDelta,
+                    bool fErase);
     bool GetStats(CCoinsStats &stats) const;
 };
 
@@ -621,6 +726,12 @@ protected:
     /* Whether this cache has an active modifier. */
     bool hasModifier;
 
+    /* The pools that the nodes of the coins and nullifier maps are allocated from. */
+    CCoinsMapMemoryResource cacheCoinsMemoryResource;
+    CNullifiersMapMemoryResource cacheSproutNullifiersMemoryResource;
+    CNullifiersMapMemoryResource cacheSaplingNullifiersMemoryResource;
+    CNullifiersMapMemoryResource cacheOrchardNullifiersMemoryResource;
+
 
     /**
      * Make mutable so that we can "fill the cache" even from Get-methods
@@ -644,6 +755,19 @@ protected:
     /* Cached dynamic memory usage for the inner CCoins objects. */
     mutable size_t cachedCoinsUsage;
 
+    /* Unmodified coins entries as (height, txid), in a heap with the lowest
+     * height first, from which Evict removes the oldest entries. Entries are
+     * queued when they are read from the base view and when they are synced
+     * to it; those that have since been modified or removed are skipped. */
+    mutable std::vector<std::pair<int, uint256>> cacheCoinsEvictionQueue;
+
+    /* Change made to the chain state statistics since the last flush, not
+     * counting the addition of the current value of each dirty entry. That is
+     * left to the view the entries are flushed into, so that an entry that is
+     * modified many times is only hashed when it is first modified (to remove
+     * the parent's version) and when it is written. */
+    CCoinsSetStats cacheStatsDelta;
+
 public:
     CCoinsViewCache(CCoinsView *baseIn);
     ~CCoinsViewCache();
@@ -678,7 +802,9 @@ public:
                     CNullifiersMap &mapOrchardNullifiers,
                     CHistoryCacheMap &historyCacheMap,
                     SubtreeCache &cacheSaplingSubtrees,
-                    SubtreeCache &cacheOrchardSubtrees);
+                    SubtreeCache &cacheOrchardSubtrees,
+                    const CCoinsSetStats &statsDelta,
+                    bool fErase);
 
     // Adds the tree to mapSproutAnchors, mapSaplingAnchors, or mapOrchardAnchors
     // based on the type of tree and sets the current commitment root to this root.
@@ -740,6 +866,32 @@ public:
      */
     bool Flush();
 
+    /**
+     * Like Flush, but only write the modified entries to the base, and keep
+     * the coins, anchor and nullifier entries cached (no longer marked as
+     * modified). Spent coins are removed from the cache.
+     */
+    bool Sync();
+
+    /**
+     * Remove unmodified entries from the cache until its memory usage is at
+     * most nTargetUsage (or there are no unmodified entries left): first the
+     * cached nullifiers and anchors other than the best anchors, then the
+     * coins of the oldest transactions, which are the least likely to be
+     * spent soon. Entries are erased in place; their memory stays with the
+     * pools for new entries. Must not be called while a cache on top of this
+     * one has entries that it read from it.
+     */
+    void Evict(size_t nTargetUsage);
+
+    /**
+     * Forget the cached entries, best block and best anchors, so that they
+     * are read again from the base view. Used after the base view has been
+     * replaced wholesale; the cache must not have unwritten modifications
+     * (e.g. just synced).
+     */
+    void ResetBestState();
+
     //! Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize() const;
 
@@ -777,6 +929,15 @@ private:
     CCoinsMap::iterator FetchCoins(const uint256 &txid);
     CCoinsMap::const_iterator FetchCoins(const uint256 &txid) const;
 
+    void SetNullifier(CNullifiersMap& cacheNullifiers, const uint256& nf, ShieldedType type, bool spent);
+
+    //! Add an unmodified coins entry to the eviction queue.
+    void QueueForEviction(const uint256 &txid, const CCoins &coins) const;
+
+    //! Recreate the (empty) coins and nullifier maps, so that the memory of
+    //! their pools is released, and empty the eviction queue.
+    void ReallocateCache();
+
     /**
      * By making the copy constructor private, we prevent accidentally using it
      * when one intends to create a cache on top of a base cache.
@@ -0,0 +1,471 @@
+// Copyright (c) 2026 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "coinswriter.h"
+
+#include "memusage.h"
+#include "util/system.h"
+
+#include <stdexcept>
+
+struct CCoinsViewAsyncWriter::PendingBatch
+{
+    CCoinsMapMemoryResource coinsResource;
+    CCoinsMap mapCoins;
+    uint256 hashBlock;
+    uint256 hashSproutAnchor;
+    uint256 hashSaplingAnchor;
+    uint256 hashOrchardAnchor;
+    CAnchorsSproutMap mapSproutAnchors;
+    CAnchorsSaplingMap mapSaplingAnchors;
+    CAnchorsOrchardMap mapOrchardAnchors;
+    CNullifiersMapMemoryResource sproutNullifiersResource;
+    CNullifiersMapMemoryResource saplingNullifiersResource;
+    CNullifiersMapMemoryResource orchardNullifiersResource;
+    CNullifiersMap mapSproutNullifiers;
+    CNullifiersMap mapSaplingNullifiers;
+    CNullifiersMap mapOrchardNullifiers;
+    CHistoryCacheMap historyCacheMap;
+    SubtreeCache cacheSaplingSubtrees = SubtreeCache(SAPLING);
+    SubtreeCache cacheOrchardSubtrees = SubtreeCache(ORCHARD);
+    CCoinsSetStats statsDelta;
+    //! Memory used by the coins and trees held by the maps' entries.
+    size_t cachedUsage = 0;
+
+    PendingBatch() :
+        mapCoins(0, SaltedTxidHasher(), CCoinsMap::key_equal(), &coinsResource),
+        mapSproutNullifiers(0, SaltedTxidHasher(), CNullifiersMap::key_equal(), &sproutNullifiersResource),
+        mapSaplingNullifiers(0, SaltedTxidHasher(), CNullifiersMap::key_equal(), &saplingNullifiersResource),
+        mapOrchardNullifiers(0, SaltedTxidHasher(), CNullifiersMap::key_equal(), &orchardNullifiersResource) {}
+
+    const CNullifiersMap& GetNullifierMap(ShieldedType type) const
+    {
+        switch (type) {
+            case SPROUT:
+                return mapSproutNullifiers;
+            case SAPLING:
+                return mapSaplingNullifiers;
+            case ORCHARD:
+                return mapOrchardNullifiers;
+            default:
+                throw std::runtime_error("Unknown shielded type");
+        }
+    }
+
+    size_t DynamicMemoryUsage() const
+    {
+        return memusage::DynamicUsage(mapCoins) +
+               memusage::DynamicUsage(mapSproutAnchors) +
+               memusage::DynamicUsage(mapSaplingAnchors) +
+               memusage::DynamicUsage(mapOrchardAnchors) +
+               memusage::DynamicUsage(mapSproutNullifiers) +
+               memusage::DynamicUsage(mapSaplingNullifiers) +
+               memusage::DynamicUsage(mapOrchardNullifiers) +
+               memusage::DynamicUsage(historyCacheMap) +
+               memusage::DynamicUsage(cacheSaplingSubtrees) +
+               memusage::DynamicUsage(cacheOrchardSubtrees) +
+               cachedUsage;
+    }
+
+    // The maps are not erased while they are written, as reads from other
+    // threads may be looking them up at the same time.
+    bool Write(CCoinsView *base)
+    {
+        return base->BatchWrite(mapCoins,
+                                hashBlock,
+                                hashSproutAnchor,
+                                hashSaplingAnchor,
+                                hashOrchardAnchor,
+                                mapSproutAnchors,
+                                mapSaplingAnchors,
+                                mapOrchardAnchors,
+                                mapSproutNullifiers,
+                                mapSaplingNullifiers,
+                                mapOrchardNullifiers,
+                                historyCacheMap,
+                                cacheSaplingSubtrees,
+                                cacheOrchardSubtrees,
+                                statsDelta,
+                                false);
+    }
+};
+
+//! Move (or copy, if fErase is false) the modified entries of a cache map into
+//! the pending batch. Unmodified entries are not written, so they are skipped.
+template <typename Map>
+static void TakeModified(Map& mapFrom, Map& mapTo, bool fErase)
+{
+    for (auto it = mapFrom.begin(); it != mapFrom.end();) {
+        if (it->second.flags & Map::mapped_type::DIRTY) {
+            if (fErase) {
+                mapTo.emplace(it->first, std::move(it->second));
+            } else {
+                mapTo.emplace(it->first, it->second);
+            }
+        }
+        it = fErase ? mapFrom.erase(it) : std::next(it);
+    }
+}
+
+template <typename Map>
+static size_t TreesUsage(const Map& map)
+{
+    size_t nUsage = 0;
+    for (const auto& entry : map) {
+        nUsage += entry.second.tree.DynamicMemoryUsage();
+    }
+    return nUsage;
+}
+
+//! Look up an anchor in an anchor map of the pending batch. Returns false if
+//! the base view has to be asked instead.
+template <typename Map, typename Tree>
+static bool GetPendingAnchorAt(const Map& map, const uint256 &rt, Tree &tree, bool &fFound)
+{
+    // The empty root is never written to the base view, which always has it.
+    if (rt == Tree::empty_root()) {
+        return false;
+    }
+    auto it = map.find(rt);
+    if (it == map.end()) {
+        return false;
+    }
+    fFound = it->second.entered;
+    if (fFound) {
+        tree = it->second.tree;
+    }
+    return true;
+}
+
+CCoinsViewAsyncWriter::CCoinsViewAsyncWriter(CCoinsView *baseIn, std::function<void(const std::string&)> onFailureIn) :
+    CCoinsViewBacked(baseIn), fFailed(false), fRunning(true), onFailure(std::move(onFailureIn))
+{
+    thread = std::thread(&CCoinsViewAsyncWriter::ThreadWrite, this);
+}
+
+CCoinsViewAsyncWriter::~CCoinsViewAsyncWriter()
+{
+    Commit();
+    {
+        LOCK(cs);
+        fRunning = false;
+    }
+    cond.notify_all();
+    thread.join();
+}
+
+void CCoinsViewAsyncWriter::ThreadWrite()
+{
+    RenameThread("zc-coinswriter");
+    while (true) {
+        std::shared_ptr<PendingBatch> batch;
+        {
+            WAIT_LOCK(cs, lock);
+            while (fRunning && (!pending || fFailed)) {
+                cond.wait(lock);
+            }
+            if (!fRunning) {
+                return;
+            }
+            batch = pending;
+        }
+
+        bool fOk;
+        std::string strError = "Failed to write to coin database";
+        try {
+            fOk = batch->Write(base);
+        } catch (const std::exception& e) {
+            strError = strprintf("Error writing to the coins database: %s", e.what());
+            fOk = false;
+        }
+        if (!fOk) {
+            LogPrintf("%s: %s\n", __func__, strError);
+            if (onFailure) {
+                onFailure(strError);
+            }
+        }
+
+        {
+            LOCK(cs);
+            if (fOk) {
+                pending.reset();
+            } else {
+                fFailed = true;
+            }
+        }
+        cond.notify_all();
+    }
+}
+
+std::shared_ptr<const CCoinsViewAsyncWriter::PendingBatch> CCoinsViewAsyncWriter::GetPending() const
+{
+    LOCK(cs);
+    return pending;
+}
+
+bool CCoinsViewAsyncWriter::IsWriting() const
+{
+    LOCK(cs);
+    return pending && !fFailed;
+}
+
+size_t CCoinsViewAsyncWriter::DynamicMemoryUsage() const
+{
+    auto batch = GetPending();
+    return batch ? batch->DynamicMemoryUsage() : 0;
+}
+
+bool CCoinsViewAsyncWriter::Commit() const
+{
+    WAIT_LOCK(cs, lock);
+    while (pending && !fFailed) {
+        cond.wait(lock);
+    }
+    return !fFailed;
+}
+
+bool CCoinsViewAsyncWriter::GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const
+{
+    auto batch = GetPending();
+    bool fFound;
+    if (batch && GetPendingAnchorAt(batch->mapSproutAnchors, rt, tree, fFound)) {
+        return fFound;
+    }
+    return base->GetSproutAnchorAt(rt, tree);
+}
+
+bool CCoinsViewAsyncWriter::GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree) const
+{
+    auto batch = GetPending();
+    bool fFound;
+    if (batch && GetPendingAnchorAt(batch->mapSaplingAnchors, rt, tree, fFound)) {
+        return fFound;
+    }
+    return base->GetSaplingAnchorAt(rt, tree);
+}
+
+bool CCoinsViewAsyncWriter::GetOrchardAnchorAt(const uint256 &rt, OrchardMerkleFrontier &tree) const
+{
+    auto batch = GetPending();
+    bool fFound;
+    if (batch && GetPendingAnchorAt(batch->mapOrchardAnchors, rt, tree, fFound)) {
+        return fFound;
+    }
+    return base->GetOrchardAnchorAt(rt, tree);
+}
+
+bool CCoinsViewAsyncWriter::GetNullifier(const uint256 &nullifier, ShieldedType type) const
+{
+    auto batch = GetPending();
+    if (batch) {
+        const CNullifiersMap& map = batch->GetNullifierMap(type);
+        CNullifiersMap::const_iterator it = map.find(nullifier);
+        if (it != map.end()) {
+            return it->second.entered;
+        }
+    }
+    return base->GetNullifier(nullifier, type);
+}
+
+bool CCoinsViewAsyncWriter::GetCoins(const uint256 &txid, CCoins &coins) const
+{
+    auto batch = GetPending();
+    if (batch) {
+        CCoinsMap::const_iterator it = batch->mapCoins.find(txid);
+        if (it != batch->mapCoins.end()) {
+            if (it->second.coins.IsPruned()) {
+                return false;
+            }
+            coins = it->second.coins;
+            return true;
+        }
+    }
+    return base->GetCoins(txid, coins);
+}
+
+bool CCoinsViewAsyncWriter::HaveCoins(const uint256 &txid) const
+{
+    auto batch = GetPending();
+    if (batch) {
+        CCoinsMap::const_iterator it = batch->mapCoins.find(txid);
+        if (it != batch->mapCoins.end()) {
+            return !it->second.coins.IsPruned();
+        }
+    }
+    return base->HaveCoins(txid);
+}
+
+uint256 CCoinsViewAsyncWriter::GetBestBlock() const
+{
+    auto batch = GetPending();
+    if (batch && !batch->hashBlock.IsNull()) {
+        return batch->hashBlock;
+    }
+    return base->GetBestBlock();
+}
+
+uint256 CCoinsViewAsyncWriter::GetBestAnchor(ShieldedType type) const
+{
+    auto batch = GetPending();
+    if (batch) {
+        uint256 hash;
+        switch (type) {
+            case SPROUT:
+                hash = batch->hashSproutAnchor;
+                break;
+            case SAPLING:
+                hash = batch->hashSaplingAnchor;
+                break;
+            case ORCHARD:
+                hash = batch->hashOrchardAnchor;
+                break;
+            default:
+                throw std::runtime_error("Unknown shielded type");
+        }
+        if (!hash.IsNull()) {
+            return hash;
+        }
+    }
+    return base->GetBestAnchor(type);
+}
+
+HistoryIndex CCoinsViewAsyncWriter::GetHistoryLength(uint32_t epochId) const
+{
+    auto batch = GetPending();
+    if (batch) {
+        auto it = batch->historyCacheMap.find(epochId);
+        if (it != batch->historyCacheMap.end()) {
+            return it->second.length;
+        }
+    }
+    return base->GetHistoryLength(epochId);
+}
+
+HistoryNode CCoinsViewAsyncWriter::GetHistoryAt(uint32_t epochId, HistoryIndex index) const
+{
+    auto batch = GetPending();
+    if (batch) {
+        auto it = batch->historyCacheMap.find(epochId);
+        if (it != batch->historyCacheMap.end() && index >= it->second.updateDepth) {
+            auto node = it->second.appends.find(index);
+            if (node == it->second.appends.end()) {
+                throw std::runtime_error("Invalid history request");
+            }
+            return node->second;
+        }
+    }
+    return base->GetHistoryAt(epochId, index);
+}
+
+uint256 CCoinsViewAsyncWriter::GetHistoryRoot(uint32_t epochId) const
+{
+    auto batch = GetPending();
+    if (batch) {
+        auto it = batch->historyCacheMap.find(epochId);
+        if (it != batch->historyCacheMap.end()) {
+            return it->second.root;
+        }
+    }
+    return base->GetHistoryRoot(epochId);
+}
+
+// The subtree caches of a pending batch have been initialized by the view
+// that wrote them, so they can be looked up without modifying them.
+
+std::optional<libzcash::LatestSubtree> CCoinsViewAsyncWriter::GetLatestSubtree(ShieldedType type) const
+{
+    auto batch = GetPending();
+    if (batch) {
+        switch (type) {
+            case SAPLING:
+                return batch->cacheSaplingSubtrees.GetLatestSubtree();
+            case ORCHARD:
+                return batch->cacheOrchardSubtrees.GetLatestSubtree();
+            default:
+                throw std::runtime_error("GetLatestSubtree: unsupported shielded type");
+        }
+    }
+    return base->GetLatestSubtree(type);
+}
+
+std::optional<libzcash::SubtreeData> CCoinsViewAsyncWriter::GetSubtreeData(
+    ShieldedType type,
+    libzcash::SubtreeIndex index) const
+{
+    auto batch = GetPending();
+    if (batch) {
+        switch (type) {
+            case SAPLING:
+                return batch->cacheSaplingSubtrees.GetSubtreeData(base, index);
+            case ORCHARD:
+                return batch->cacheOrchardSubtrees.GetSubtreeData(base, index);
+            default:
+                throw std::runtime_error("GetSubtreeData: unsupported shielded type");
+        }
+    }
+    return base->GetSubtreeData(type, index);
+}
+
+bool CCoinsViewAsyncWriter::BatchWrite(CCoinsMap &mapCoins,
+                                       const uint256 &hashBlock,
+                                       const uint256 &hashSproutAnchor,
+                                       const uint256 &hashSaplingAnchor,
+                                       const uint256 &hashOrchardAnchor,
+                                       CAnchorsSproutMap &mapSproutAnchors,
+                                       CAnchorsSaplingMap &mapSaplingAnchors,
+                                       CAnchorsOrchardMap &mapOrchardAnchors,
+                                       CNullifiersMap &mapSproutNullifiers,
+                                       CNullifiersMap &mapSaplingNullifiers,
+                                       CNullifiersMap &mapOrchardNullifiers,
+                                       CHistoryCacheMap &historyCacheMap,
+                                       SubtreeCache &cacheSaplingSubtrees,
+                                       SubtreeCache &cacheOrchardSubtrees,
+                                       const CCoinsSetStats &statsDelta,
+                                       bool fErase)
+{
+    // Build the batch while the previous one may still be being written.
+    auto batch = std::make_shared<PendingBatch>();
+    TakeModified(mapCoins, batch->mapCoins, fErase);
+    TakeModified(mapSproutAnchors, batch->mapSproutAnchors, fErase);
+    TakeModified(mapSaplingAnchors, batch->mapSaplingAnchors, fErase);
+    TakeModified(mapOrchardAnchors, batch->mapOrchardAnchors, fErase);
+    TakeModified(mapSproutNullifiers, batch->mapSproutNullifiers, fErase);
+    TakeModified(mapSaplingNullifiers, batch->mapSaplingNullifiers, fErase);
+    TakeModified(mapOrchardNullifiers, batch->mapOrchardNullifiers, fErase);
+    batch->historyCacheMap = historyCacheMap;
+    batch->cacheSaplingSubtrees = cacheSaplingSubtrees;
+    batch->cacheOrchardSubtrees = cacheOrchardSubtrees;
+    batch->statsDelta = statsDelta;
+    for (const auto& entry : batch->mapCoins) {
+        batch->cachedUsage += entry.second.coins.DynamicMemoryUsage();
+    }
+    batch->cachedUsage += TreesUsage(batch->mapSproutAnchors);
+    batch->cachedUsage += TreesUsage(batch->mapSaplingAnchors);
+    batch->cachedUsage += TreesUsage(batch->mapOrchardAnchors);
+    batch->hashBlock = hashBlock;
+    batch->hashSproutAnchor = hashSproutAnchor;
+    batch->hashSaplingAnchor = hashSaplingAnchor;
+    batch->hashOrchardAnchor = hashOrchardAnchor;
+
+    // Only one batch is pending at a time, so that reads only need to look it
+    // up before falling through to the base view.
+    WAIT_LOCK(cs, lock);
+    while (pending && !fFailed) {
+        cond.wait(lock);
+    }
+    if (fFailed) {
+        return false;
+    }
+    pending = batch;
+    cond.notify_all();
+    return true;
+}
+
+bool CCoinsViewAsyncWriter::GetStats(CCoinsStats &stats) const
+{
+    if (!Commit()) {
+        return false;
+    }
+    return base->GetStats(stats);
+}
@@ -0,0 +1,111 @@
+// Copyright (c) 2026 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#ifndef ZCASH_COINSWRITER_H
+#define ZCASH_COINSWRITER_H
+
+#include "coins.h"
+#include "sync.h"
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+
+/**
+ * A view that writes the batches written to it to its base view (the coins
+ * database) in a background thread, so that writing the chain state does
+ * not hold cs_main for as long as the database write takes.
+ *
+ * BatchWrite takes the modified entries into a pending batch and returns
+ * without writing them. Until the background thread has written the pending
+ * batch, reads are answered from it first, and fall through to the base view
+ * otherwise, so this view always reflects everything written to it. At most
+ * one batch is pending: BatchWrite waits for the previous batch to be written
+ * before it queues the next one, so batches reach the base view in order.
+ *
+ * Each batch is written to the database atomically with its best block, so
+ * after a crash the chain state is that of some earlier block, and the blocks
+ * after it are connected again, just as if the last batch had not been
+ * written yet. If a write fails, the failure callback is called from the
+ * writing thread, so that the node can shut down without waiting for the
+ * next batch.
+ */
+class CCoinsViewAsyncWriter : public CCoinsViewBacked
+{
+private:
+    struct PendingBatch;
+
+    mutable Mutex cs;
+    mutable std::condition_variable cond;
+    //! The batch that has not been written to the base view yet, if any.
+    std::shared_ptr<PendingBatch> pending GUARDED_BY(cs);
+    //! Set if writing a batch failed. The failed batch stays pending (so that
+    //! reads remain correct), and all later writes fail.
+    bool fFailed GUARDED_BY(cs);
+    bool fRunning GUARDED_BY(cs);
+    std::function<void(const std::string&)> onFailure;
+    std::thread thread;
+
+    //! The pending batch, for lookups. It is shared with the writing thread,
+    //! so it must not be modified.
+    std::shared_ptr<const PendingBatch> GetPending() const;
+    void ThreadWrite();
+
+public:
+    CCoinsViewAsyncWriter(CCoinsView *baseIn, std::function<void(const std::string&)> onFailureIn = nullptr);
+    //! Writes the pending batch, if any, before returning.
+    ~CCoinsViewAsyncWriter();
+
+    bool GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const;
+    bool GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree) const;
+    bool GetOrchardAnchorAt(const uint256 &rt, OrchardMerkleFrontier &tree) const;
+    bool GetNullifier(const uint256 &nullifier, ShieldedType type) const;
+    bool GetCoins(const uint256 &txid, CCoins &coins) const;
+    bool HaveCoins(const uint256 &txid) const;
+    uint256 GetBestBlock() const;
+    uint256 GetBestAnchor(ShieldedType type) const;
+    HistoryIndex GetHistoryLength(uint32_t epochId) const;
+    HistoryNode GetHistoryAt(uint32_t epochId, HistoryIndex index) const;
+    uint256 GetHistoryRoot(uint32_t epochId) const;
+    std::optional<libzcash::LatestSubtree> GetLatestSubtree(ShieldedType type) const;
+    std::optional<libzcash::SubtreeData> GetSubtreeData(
+            ShieldedType type,
+            libzcash::SubtreeIndex index) const;
+    bool BatchWrite(CCoinsMap &mapCoins,
+                    const uint256 &hashBlock,
+                    const uint256 &hashSproutAnchor,
+                    const uint256 &hashSaplingAnchor,
+                    const uint256 &hashOrchardAnchor,
+                    CAnchorsSproutMap &mapSproutAnchors,
+                    CAnchorsSaplingMap &mapSaplingAnchors,
+                    CAnchorsOrchardMap &mapOrchardAnchors,
+                    CNullifiersMap &mapSproutNullifiers,
+                    CNullifiersMap &mapSaplingNullifiers,
+                    CNullifiersMap &mapOrchardNullifiers,
+                    CHistoryCacheMap &historyCacheMap,
+                    SubtreeCache &cacheSaplingSubtrees,
+                    SubtreeCache &cacheOrchardSubtrees,
+                    const CCoinsSetStats &statsDelta,
+                    bool fErase);
+    //! The statistics are those of the base view, so this waits for the
+    //! pending batch to be written first.
+    bool GetStats(CCoinsStats &stats) const;
+
+    /**
+     * Wait until every batch written to this view has been written to the
+     * base view. Returns false if writing any of them failed.
+     */
+    bool Commit() const;
+
+    //! Whether a batch is waiting to be written, so that BatchWrite would
+    //! block until it is.
+    bool IsWriting() const;
+
+    //! Calculate the size of the pending batch, if any.
+    size_t DynamicMemoryUsage() const;
+};
+
+#endif // ZCASH_COINSWRITER_H
@@ -101,8 +101,15 @@ typedef int32_t ssize_t;
 size_t strnlen( const char *start, size_t max_len);
 #endif // HAVE_DECL_STRNLEN
 
+// Where epoll(7) is available, the network thread waits for socket events with
+// it, and single sockets are waited on with poll(2). Neither is limited to
+// sockets below FD_SETSIZE.
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_POLL_H)
+#define USE_EPOLL
+#endif
+
 bool static inline IsSelectableSocket(SOCKET s) {
-#ifdef WIN32
+#if defined(WIN32) || defined(USE_EPOLL)
     return true;
 #else
     return (s < FD_SETSIZE);
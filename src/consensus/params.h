@@ -431,6 +431,11 @@ struct Params {
     int64_t MaxActualTimespan(int nHeight) const;
 
     uint256 nMinimumChainWork;
+    /**
+     * By default assume that the scripts and proofs in ancestors of this
+     * block are valid (see -assumevalid). Null to verify all blocks.
+     */
+    uint256 defaultAssumeValid;
 };
 } // namespace Consensus
 
@@ -78,6 +78,21 @@ public:
 
         batch.Delete(slKey);
     }
+
+    /** Write a key and value that are already serialized. */
+    void WriteRaw(const std::vector<unsigned char>& key, const std::vector<unsigned char>& value)
+    {
+        leveldb::Slice slKey((const char*)key.data(), key.size());
+        leveldb::Slice slValue((const char*)value.data(), value.size());
+        batch.Put(slKey, slValue);
+    }
+
+    /** Erase a key that is already serialized. */
+    void EraseRaw(const std::vector<unsigned char>& key)
+    {
+        leveldb::Slice slKey((const char*)key.data(), key.size());
+        batch.Delete(slKey);
+    }
 };
 
 class CDBIterator
@@ -136,6 +151,18 @@ public:
         return piter->value().size();
     }
 
+    /** Copy the serialized key of the current entry. */
+    void GetRawKey(std::vector<unsigned char>& key) {
+        leveldb::Slice slKey = piter->key();
+        key.assign(slKey.data(), slKey.data() + slKey.size());
+    }
+
+    /** Copy the serialized value of the current entry. */
+    void GetRawValue(std::vector<unsigned char>& value) {
+        leveldb::Slice slValue = piter->value();
+        value.assign(slValue.data(), slValue.data() + slValue.size());
+    }
+
 };
 
 class CDBWrapper
@@ -234,6 +261,27 @@ public:
 
     bool WriteBatch(CDBBatch& batch, bool fSync = false);
 
+    /**
+     * Return the approximate number of bytes the keys in [key_begin, key_end)
+     * take on disk. Recent writes that are not yet in a table file are not
+     * counted.
+     */
+    template <typename K>
+    size_t EstimateSize(const K& key_begin, const K& key_end) const
+    {
+        CDataStream ssKey1(SER_DISK, CLIENT_VERSION), ssKey2(SER_DISK, CLIENT_VERSION);
+        ssKey1.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
+        ssKey2.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
+        ssKey1 << key_begin;
+        ssKey2 << key_end;
+        leveldb::Slice slKey1(ssKey1.data(), ssKey1.size());
+        leveldb::Slice slKey2(ssKey2.data(), ssKey2.size());
+        uint64_t size = 0;
+        leveldb::Range range(slKey1, slKey2);
+        pdb->GetApproximateSizes(&range, 1, &size);
+        return size;
+    }
+
     // not available for LevelDB; provide for compatibility with BDB
     bool Flush()
     {
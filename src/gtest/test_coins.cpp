@@ -326,7 +326,9 @@ public:
                     CNullifiersMap& mapOrchardNullifiers,
                     CHistoryCacheMap &historyCacheMap,
                     SubtreeCache &cacheSaplingSubtrees,
-                    SubtreeCache &cacheOrchardSubtrees)
+                    SubtreeCache &cacheOrchardSubtrees,
+                    const CCoinsSetStats &statsDelta,
+                    bool fErase)
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
             if (it->second.flags & CCoinsCacheEntry::DIRTY) {
@@ -365,7 +367,9 @@ public:
                                  mapOrchardNullifiers,
                                  historyCacheMap,
                                  cacheSaplingSubtrees,
-                                 cacheOrchardSubtrees);
+                                 cacheOrchardSubtrees,
+                                 statsDelta,
+                                 fErase);
         }
 
         if (!hashBlock.IsNull())
@@ -56,6 +56,28 @@ TEST(MempoolLimitTests, RecentlyEvictedListDoesNotContainAfterExpiry)
     EXPECT_FALSE(recentlyEvicted.contains(TX_ID3));
 }
 
+TEST(MempoolLimitTests, RecentlyEvictedListRestoresEntries)
+{
+    FixedClock clock(std::chrono::seconds(10));
+    // maxSize=3, timeToKeep=5
+    RecentlyEvictedList recentlyEvicted(&clock, 3, 5);
+    recentlyEvicted.add(TX_ID1, 3);
+    recentlyEvicted.add(TX_ID2, 6);
+    recentlyEvicted.add(TX_ID3);
+    // An entry older than timeToKeep is not restored.
+    EXPECT_FALSE(recentlyEvicted.contains(TX_ID1));
+    EXPECT_TRUE(recentlyEvicted.contains(TX_ID2));
+    EXPECT_TRUE(recentlyEvicted.contains(TX_ID3));
+    auto entries = recentlyEvicted.entries();
+    ASSERT_EQ(entries.size(), 2);
+    EXPECT_EQ(entries[0], std::make_pair(TX_ID2, (int64_t)6));
+    EXPECT_EQ(entries[1], std::make_pair(TX_ID3, (int64_t)10));
+    // Restored entries expire at their original time.
+    clock.Set(std::chrono::seconds(12));
+    EXPECT_FALSE(recentlyEvicted.contains(TX_ID2));
+    EXPECT_TRUE(recentlyEvicted.contains(TX_ID3));
+}
+
 TEST(MempoolLimitTests, RecentlyEvictedDropOneAtATime)
 {
     FixedClock clock(std::chrono::seconds(1));
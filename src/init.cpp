@@ -12,6 +12,7 @@
 #include "addrman.h"
 #include "amount.h"
 #include "checkpoints.h"
+#include "coinswriter.h"
 #include "compat.h"
 #include "compat/sanity.h"
 #include "consensus/upgrades.h"
@@ -27,6 +28,7 @@
 #endif
 #include "main.h"
 #include "mempool_limit.h"
+#include "messagecapture.h"
 #include "metrics.h"
 #include "miner.h"
 #include "net.h"
@@ -36,6 +38,7 @@
 #include "script/standard.h"
 #include "script/sigcache.h"
 #include "scheduler.h"
+#include "snapshot.h"
 #include "txdb.h"
 #include "torcontrol.h"
 #include "ui_interface.h"
@@ -172,8 +175,9 @@ public:
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB *pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher *pcoinscatcher = NULL;
+//! Whether the mempool was loaded at startup, and should be dumped at shutdown.
+static std::atomic<bool> fDumpMempoolLater(false);
 
 void Interrupt(boost::thread_group& threadGroup)
 {
@@ -214,9 +218,14 @@ void Shutdown()
     GenerateBitcoins(false, 0, Params());
 #endif
     StopNode();
+    CloseMessageCapture();
     StopTorControl();
     UnregisterNodeSignals(GetNodeSignals());
 
+    if (fDumpMempoolLater && GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
+        DumpMempool();
+    }
+
     {
         LOCK(cs_main);
         if (pcoinsTip != NULL) {
@@ -226,6 +235,8 @@ void Shutdown()
         pcoinsTip = NULL;
         delete pcoinscatcher;
         pcoinscatcher = NULL;
+        delete pcoinswriter;
+        pcoinswriter = NULL;
         delete pcoinsdbview;
         pcoinsdbview = NULL;
         delete pblocktree;
@@ -326,8 +337,11 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-version", _("Print version and exit"));
     strUsage += HelpMessageOpt("-alerts", strprintf(_("Receive and display P2P network alerts (default: %u)"), DEFAULT_ALERTS));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
+    strUsage += HelpMessageOpt("-assumevalid=<hex>", _("If this block is in the chain assume that it and its ancestors are valid and potentially skip their script and proof verification (default: 0, verify all)"));
     strUsage += HelpMessageOpt("-allowdeprecated=<feature>", strprintf(_("Explicitly allow the use of the specified deprecated feature. Multiple instances of this parameter are permitted; values for <feature> must be selected from among {%s}"), GetAllowableDeprecatedFeatures()));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
+    strUsage += HelpMessageOpt("-blockprefetch=<n>", strprintf(_("Number of blocks to read and check ahead of the chain tip while connecting blocks (0 to %d, 0 = disabled, default: %d)"),
+        MAX_BLOCK_PREFETCH_DEPTH, DEFAULT_BLOCK_PREFETCH_DEPTH));
     if (showDebug)
         strUsage += HelpMessageOpt("-blocksonly", strprintf(_("Whether to reject transactions from network peers. Automatic broadcast and rebroadcast of any transactions from inbound peers is disabled, unless '-whitelistforcerelay' is '1', in which case whitelisted peers' transactions will be relayed. RPC transactions are not affected. (default: %u)"), DEFAULT_BLOCKSONLY));
     strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), DEFAULT_CHECKBLOCKS));
@@ -346,9 +360,11 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-exportdir=<dir>", _("Specify directory to be used when exporting data"));
     strUsage += HelpMessageOpt("-ibdskiptxverification", strprintf(_("Skip transaction verification during initial block download up to the last checkpoint height. Incompatible with flags that disable checkpoints. (default = %u)"), DEFAULT_IBD_SKIP_TX_VERIFICATION));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file on startup"));
+    strUsage += HelpMessageOpt("-loadsnapshot=<file>", _("Replace the chain state with the snapshot in <file> (written by dumptxoutset) once the header of its base block is known. The snapshot hash must be part of the chain parameters. Incompatible with the wallet, -txindex, -insightexplorer and -lightwalletd"));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
+    strUsage += HelpMessageOpt("-persistmempool", strprintf(_("Whether to save the mempool on shutdown and load on restart (default: %u)"), DEFAULT_PERSIST_MEMPOOL));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-pid=<file>", strprintf(_("Specify pid file. Relative paths will be prefixed by a net-specific datadir location. (default: %s)"), BITCOIN_PID_FILENAME));
 #endif
@@ -362,6 +378,8 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-reindex-chainstate", _("Rebuild chain state from the currently indexed blocks"));
     strUsage += HelpMessageOpt("-reindex", _("Rebuild chain state and block index from the blk*.dat files on disk"));
 #endif
+    strUsage += HelpMessageOpt("-shieldedbatchwindow=<n>", strprintf(_("Number of consecutive blocks whose Sapling and Orchard proofs and signatures are validated in a single batch during initial block download (1 to %d, 1 = disabled, default: %d)"),
+        MAX_SHIELDED_BATCH_WINDOW, DEFAULT_SHIELDED_BATCH_WINDOW));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
 #endif
@@ -398,6 +416,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-proxyrandomize", strprintf(_("Randomize credentials for every proxy connection. This enables Tor stream isolation (default: %u)"), DEFAULT_PROXYRANDOMIZE));
     strUsage += HelpMessageOpt("-seednode=<ip>", _("Connect to a node to retrieve peer addresses, and disconnect"));
     strUsage += HelpMessageOpt("-timeout=<n>", strprintf(_("Specify connection timeout in milliseconds (minimum: 1, default: %d)"), DEFAULT_CONNECT_TIMEOUT));
+    strUsage += HelpMessageOpt("-txreconciliation", strprintf(_("Relay transactions to peers that support it by reconciling the sets of transactions we would announce to each other, rather than announcing each transaction (default: %u)"), DEFAULT_TXRECONCILIATION));
     strUsage += HelpMessageOpt("-torcontrol=<ip>:<port>", strprintf(_("Tor control port to use if onion listening enabled (default: %s)"), DEFAULT_TOR_CONTROL));
     strUsage += HelpMessageOpt("-torpassword=<pass>", _("Tor control port password (default: empty)"));
     strUsage += HelpMessageOpt("-whitebind=<addr>", _("Bind to given address and whitelist peers connecting to it. Use [host]:port notation for IPv6"));
@@ -440,6 +459,8 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-testsafemode", strprintf("Force safe mode (default: %u)", DEFAULT_TESTSAFEMODE));
         strUsage += HelpMessageOpt("-dropmessagestest=<n>", "Randomly drop 1 of every <n> network messages");
         strUsage += HelpMessageOpt("-fuzzmessagestest=<n>", "Randomly fuzz 1 of every <n> network messages");
+        strUsage += HelpMessageOpt("-capturemessages", strprintf("Record the network messages received from peers in the message_capture directory (default: %u)", DEFAULT_CAPTURE_MESSAGES));
+        strUsage += HelpMessageOpt("-replaymessages=<file>", "Instead of connecting to peers, handle the network messages recorded in <file> by -capturemessages, log how long that took, and stop");
         strUsage += HelpMessageOpt("-stopafterblockimport", strprintf("Stop running after importing blocks from disk (default: %u)", DEFAULT_STOPAFTERBLOCKIMPORT));
         strUsage += HelpMessageOpt("-limitancestorcount=<n>", strprintf("Do not accept transactions if number of in-mempool ancestors is <n> or more (default: %u)", DEFAULT_ANCESTOR_LIMIT));
         strUsage += HelpMessageOpt("-limitancestorsize=<n>", strprintf("Do not accept transactions whose size with all in-mempool ancestors exceeds <n> kilobytes (default: %u)", DEFAULT_ANCESTOR_SIZE_LIMIT));
@@ -450,6 +471,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt(
                 "-fundingstream=streamId:startHeight:endHeight:comma_delimited_addresses",
                 "Use given addresses for block subsidy share paid to the funding stream with id <streamId> (regtest-only)");
+        strUsage += HelpMessageOpt("-snapshothash=baseBlockHash:snapshotHash", "Allow loading the chain state snapshot with the given hash for the given base block (regtest-only)");
     }
     std::string debugCategories = "addrman, alert, bench, coindb, db, http, libevent, lock, mempool, mempoolrej, net, partitioncheck, pow, proxy, prune, "
                              "rand, receiveunsafe, reindex, rpc, selectcoins, tor, zmq, zrpc, zrpcunsafe (implies zrpc)"; // Don't translate these
@@ -743,6 +765,65 @@ void ThreadStartWalletNotifier()
     ThreadNotifyWallets(pindexLastTip);
 }
 
+void ThreadLoadSnapshot(fs::path pathSnapshot, const CChainParams& chainparams)
+{
+    RenameThread("zcash-loadsnap");
+
+    CSnapshotMetadata metadata;
+    std::string strError;
+    if (!ReadSnapshotMetadata(chainparams, pathSnapshot, metadata, strError)) {
+        InitError(strError);
+        StartShutdown();
+        return;
+    }
+
+    // Wait for the header of the snapshot base block to arrive from peers.
+    LogPrintf("-loadsnapshot: waiting for the header of block %s at height %d\n",
+        metadata.hashBase.GetHex(), metadata.nHeight);
+    while (true) {
+        {
+            LOCK(cs_main);
+            if (chainActive.Height() >= metadata.nHeight) {
+                LogPrintf("-loadsnapshot: the active chain is already at height %d, not loading the snapshot\n",
+                    chainActive.Height());
+                return;
+            }
+            BlockMap::iterator mi = mapBlockIndex.find(metadata.hashBase);
+            if (mi != mapBlockIndex.end() && pindexBestHeader->GetAncestor(metadata.nHeight) == mi->second) {
+                break;
+            }
+        }
+        MilliSleep(1000);
+    }
+
+    uint64_t nRecords = 0;
+    if (!LoadSnapshot(chainparams, pathSnapshot, metadata, nRecords, strError)) {
+        InitError(strError);
+        StartShutdown();
+        return;
+    }
+
+    CValidationState state;
+    if (!ActivateBestChain(state, chainparams)) {
+        LogPrintf("Failed to connect best block");
+        StartShutdown();
+    }
+}
+
+void ThreadReplayMessages(fs::path pathCapture, const CChainParams& chainparams)
+{
+    RenameThread("zcash-replay");
+
+    // Replay against the chain state once it is fully loaded.
+    while ((fImporting || fReindex) && !ShutdownRequested()) {
+        MilliSleep(100);
+    }
+    if (!ReplayMessages(chainparams, pathCapture)) {
+        InitError(strprintf(_("Unable to replay network messages from %s"), pathCapture.string()));
+    }
+    StartShutdown();
+}
+
 void ThreadImport(std::vector<fs::path> vImportFiles, const CChainParams& chainparams)
 {
     RenameThread("zcash-loadblk");
@@ -820,6 +901,11 @@ void ThreadImport(std::vector<fs::path> vImportFiles, const CChainParams& chainp
         LogPrintf("Stopping after block import\n");
         StartShutdown();
     }
+
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
+        LoadMempool(chainparams);
+        fDumpMempoolLater = !ShutdownRequested();
+    }
 }
 
 /** Sanity checks
@@ -913,6 +999,14 @@ void InitParameterInteraction()
             LogPrintf("%s: parameter interaction: -connect set -> setting -listen=0\n", __func__);
     }
 
+    if (mapArgs.count("-replaymessages")) {
+        // replaying captured messages does not use the network
+        if (SoftSetBoolArg("-listen", false))
+            LogPrintf("%s: parameter interaction: -replaymessages set -> setting -listen=0\n", __func__);
+        if (SoftSetBoolArg("-dnsseed", false))
+            LogPrintf("%s: parameter interaction: -replaymessages set -> setting -dnsseed=0\n", __func__);
+    }
+
     if (mapArgs.count("-proxy")) {
         // to protect privacy, do not listen by default if a default proxy server is specified
         if (SoftSetBoolArg("-listen", false))
@@ -1094,7 +1188,9 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     nMaxConnections = std::max(nUserMaxConnections, 0);
 
     // Trim requested connection counts, to fit into system limitations
+#ifndef USE_EPOLL
     nMaxConnections = std::max(std::min(nMaxConnections, FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS), 0);
+#endif
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -1111,6 +1207,20 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         }
     }
 
+    // ensure that the wallet is disabled if a chain state snapshot is to be
+    // loaded, as it cannot be synced with the blocks before the snapshot.
+    if (mapArgs.count("-loadsnapshot")) {
+#ifdef ENABLE_WALLET
+        if (!GetBoolArg("-disablewallet", false)) {
+            return InitError(_("-loadsnapshot is incompatible with the wallet; use -disablewallet"));
+        }
+#endif
+    }
+
+    if (mapArgs.count("-replaymessages") && GetBoolArg("-capturemessages", DEFAULT_CAPTURE_MESSAGES)) {
+        return InitError(_("-replaymessages and -capturemessages cannot be used together"));
+    }
+
     // ********************************************************* Step 3: parameter-to-internal-flags
 
     fDebug = !mapMultiArgs["-debug"].empty();
@@ -1155,6 +1265,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     fIBDSkipTxVerification = GetBoolArg("-ibdskiptxverification", DEFAULT_IBD_SKIP_TX_VERIFICATION);
     fCheckpointsEnabled = GetBoolArg("-checkpoints", DEFAULT_CHECKPOINTS_ENABLED);
 
+    hashAssumeValid = uint256S(GetArg("-assumevalid", chainparams.GetConsensus().defaultAssumeValid.GetHex()));
+    if (!hashAssumeValid.IsNull())
+        LogPrintf("Assuming ancestors of block %s have valid scripts and proofs.\n", hashAssumeValid.GetHex());
+    else
+        LogPrintf("Validating scripts and proofs for all blocks.\n");
+
     // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
     nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
     if (nScriptCheckThreads <= 0)
@@ -1164,6 +1280,9 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    nBlockPrefetchDepth = std::max(0, std::min<int>(GetArg("-blockprefetch", DEFAULT_BLOCK_PREFETCH_DEPTH), MAX_BLOCK_PREFETCH_DEPTH));
+    nShieldedBatchWindow = std::max(1, std::min<int>(GetArg("-shieldedbatchwindow", DEFAULT_SHIELDED_BATCH_WINDOW), MAX_SHIELDED_BATCH_WINDOW));
+
     fServer = GetBoolArg("-server", false);
 
     // block pruning; get the amount of disk space (in MiB) to allot for block & undo files
@@ -1218,6 +1337,8 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
 
     fIsBareMultisigStd = GetBoolArg("-permitbaremultisig", DEFAULT_PERMIT_BAREMULTISIG);
+    fTxReconciliation = GetBoolArg("-txreconciliation", DEFAULT_TXRECONCILIATION);
+    fCaptureMessages = GetBoolArg("-capturemessages", DEFAULT_CAPTURE_MESSAGES);
     fAcceptDatacarrier = GetBoolArg("-datacarrier", DEFAULT_ACCEPT_DATACARRIER);
     nMaxDatacarrierBytes = GetArg("-datacarriersize", nMaxDatacarrierBytes);
 
@@ -1365,6 +1486,22 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         }
     }
 
+    if (!mapMultiArgs["-snapshothash"].empty()) {
+        if (chainparams.NetworkIDString() != "regtest") {
+            return InitError("Snapshot hashes may only be added on regtest.");
+        }
+        for (const std::string& strSnapshot : mapMultiArgs["-snapshothash"]) {
+            std::vector<std::string> vSnapshotParams;
+            boost::split(vSnapshotParams, strSnapshot, boost::is_any_of(":"));
+            if (vSnapshotParams.size() != 2 ||
+                !IsHex(vSnapshotParams[0]) || vSnapshotParams[0].size() != 64 ||
+                !IsHex(vSnapshotParams[1]) || vSnapshotParams[1].size() != 64) {
+                return InitError("Snapshot hash malformed, expecting baseBlockHash:snapshotHash");
+            }
+            UpdateRegtestSnapshotHash(uint256S(vSnapshotParams[0]), uint256S(vSnapshotParams[1]));
+        }
+    }
+
 #ifdef ENABLE_MINING
     if (mapArgs.count("-mineraddress")) {
         KeyIO keyIO(chainparams);
@@ -1452,6 +1589,14 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     if (nScriptCheckThreads) {
         for (int i=0; i<nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadPrecheck);
+    }
+
+    if (nBlockPrefetchDepth) {
+        LogPrintf("Prefetching up to %d blocks ahead of the tip\n", nBlockPrefetchDepth);
+        for (int i=0; i<BLOCK_PREFETCH_THREADS; i++)
+            threadGroup.create_thread(&ThreadBlockPrefetch);
     }
 
     // Start the lightweight task scheduler thread
@@ -1704,13 +1849,23 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             try {
                 UnloadBlockIndex();
                 delete pcoinsTip;
+                delete pcoinswriter;
                 delete pcoinsdbview;
                 delete pcoinscatcher;
                 delete pblocktree;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex || fReindexChainState);
-                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
+                pcoinsdbview->LoadNullifierFilters(nCoinCacheUsage / 100 * NULLIFIER_FILTER_MAX_CACHE_PERCENT);
+                pcoinswriter = new CCoinsViewAsyncWriter(pcoinsdbview, [](const std::string& strError) {
+                    // The chain state in memory is ahead of the database,
+                    // which will only be written again by the next flush.
+                    // Shut down now rather than keep running until then.
+                    SetMiscWarning(strError, GetTime());
+                    uiInterface.ThreadSafeMessageBox(_("Error writing to database, shutting down."), "", CClientUIInterface::MSG_ERROR);
+                    StartShutdown();
+                });
+                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinswriter);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
 
                 if (fReindex) {
@@ -1762,7 +1917,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
                 // Check for changed -prune state.  What we are concerned about is a user who has pruned blocks
                 // in the past, but is now trying to run unpruned.
-                if (fHavePruned && !fPruneMode) {
+                if (fHavePruned && !fPruneMode && !fSnapshotChainState) {
                     strLoadError = _("You need to rebuild the database using -reindex to go back to unpruned mode.  This will redownload the entire blockchain");
                     break;
                 }
@@ -1960,6 +2115,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         }
     }
 
+    // likewise if the chain state was loaded from a snapshot
+    if (fSnapshotChainState) {
+        LogPrintf("Unsetting NODE_NETWORK as the chain state was loaded from a snapshot\n");
+        nLocalServices &= ~NODE_NETWORK;
+    }
+
     // ********************************************************* Step 10: import blocks
 
     if (!CheckDiskSpace())
@@ -1988,6 +2149,11 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles, chainparams));
 
+    if (mapArgs.count("-loadsnapshot")) {
+        fs::path pathSnapshot = AbsPathForConfigVal(GetArg("-loadsnapshot", ""));
+        threadGroup.create_thread(boost::bind(&ThreadLoadSnapshot, pathSnapshot, boost::cref(chainparams)));
+    }
+
     // Wait for genesis block to be processed
     {
         WAIT_LOCK(g_genesis_wait_mutex, lock);
@@ -2031,7 +2197,15 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     if (GetBoolArg("-listenonion", DEFAULT_LISTEN_ONION))
         StartTorControl(threadGroup, scheduler);
 
-    StartNode(threadGroup, scheduler);
+    if (mapArgs.count("-replaymessages")) {
+        fs::path pathCapture = AbsPathForConfigVal(GetArg("-replaymessages", ""));
+        threadGroup.create_thread(boost::bind(&ThreadReplayMessages, pathCapture, boost::cref(chainparams)));
+    } else {
+        if (fCaptureMessages && !OpenMessageCapture()) {
+            return InitError(_("Unable to open a file to capture network messages to"));
+        }
+        StartNode(threadGroup, scheduler);
+    }
 
 #ifdef ENABLE_MINING
     // Generate coins in the background
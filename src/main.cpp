@@ -9,9 +9,11 @@
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "coinswriter.h"
 #include "consensus/consensus.h"
 #include "consensus/funding.h"
 #include "consensus/merkle.h"
@@ -27,6 +29,7 @@
 #include "policy/policy.h"
 #include "pow.h"
 #include "reverse_iterator.h"
+#include "snapshot.h"
 #include "time.h"
 #include "txmempool.h"
 #include "ui_interface.h"
@@ -41,6 +44,8 @@
 
 #include <algorithm>
 #include <atomic>
+#include <functional>
+#include <list>
 #include <sstream>
 #include <variant>
 
@@ -86,6 +91,8 @@ std::condition_variable g_best_block_cv;
 uint256 g_best_block;
 int g_best_block_height;
 int nScriptCheckThreads = 0;
+int nBlockPrefetchDepth = 0;
+int nShieldedBatchWindow = 1;
 std::atomic_bool fImporting(false);
 std::atomic_bool fReindex(false);
 bool fTxIndex = false;
@@ -93,12 +100,15 @@ bool fAddressIndex = false;     // insightexplorer || lightwalletd
 bool fSpentIndex = false;       // insightexplorer
 bool fTimestampIndex = false;   // insightexplorer
 bool fHavePruned = false;
+bool fSnapshotChainState = false;
 bool fPruneMode = false;
 int32_t nPreferredTxVersion = DEFAULT_PREFERRED_TX_VERSION;
 bool fIsBareMultisigStd = DEFAULT_PERMIT_BAREMULTISIG;
+bool fTxReconciliation = DEFAULT_TXRECONCILIATION;
 bool fCheckBlockIndex = false;
 bool fCheckpointsEnabled = DEFAULT_CHECKPOINTS_ENABLED;
 bool fIBDSkipTxVerification = DEFAULT_IBD_SKIP_TX_VERIFICATION;
+uint256 hashAssumeValid;
 bool fCoinbaseEnforcedShieldingEnabled = true;
 size_t nCoinCacheUsage = 5000 * 300;
 uint64_t nPruneTarget = 0;
@@ -286,6 +296,7 @@ namespace {
         int64_t nTime;           //!< Time of "getdata" request in microseconds.
         bool fValidatedHeaders;  //!< Whether this block has validated headers at the time of request.
         int64_t nTimeDisconnect; //!< The timeout for this block request (for disconnecting a slow peer)
+        std::shared_ptr<PartiallyDownloadedBlock> partialBlock; //!< Optional, used for compact blocks.
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -295,14 +306,39 @@ namespace {
     /** Number of preferable block download peers. */
     int nPreferredDownload = 0;
 
+    /**
+     * The peers we asked to announce new blocks to us as compact blocks
+     * (high-bandwidth mode), oldest first. Protected by cs_main.
+     */
+    std::list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
+    /**
+     * The last new block connected as the tip, and its compact form, to announce to peers in high-bandwidth mode and to
+     * answer requests for its transactions without reading it from disk.
+     * Protected by cs_main.
+     */
+    std::shared_ptr<const CBlock> pMostRecentBlock;
+    std::shared_ptr<const CBlockHeaderAndShortTxIDs> pMostRecentCompactBlock;
+    /** The "cmpctblock" message of pMostRecentCompactBlock, serialized once for all peers. */
+    std::shared_ptr<const CSharedMessage> pMostRecentCompactBlockMsg;
+
     /** Dirty block index entries. */
     set<CBlockIndex*> setDirtyBlockIndex;
 
     /** Dirty block file entries. */
     set<int> setDirtyFileInfo;
 
+    /**
+     * A transaction in the relay map, and its "tx" message once a peer has
+     * asked for it, serialized once for all the peers that do.
+     */
+    struct CRelayEntry {
+        std::shared_ptr<const CTransaction> tx;
+        std::shared_ptr<const CSharedMessage> msg;
+    };
+
     /** Relay map, protected by cs_main. */
-    typedef std::map<uint256, std::shared_ptr<const CTransaction>> MapRelay;
+    typedef std::map<uint256, CRelayEntry> MapRelay;
     MapRelay mapRelay;
     /** Expiration-time ordered list of (expire time, relay map entry) pairs, protected by cs_main). */
     std::deque<std::pair<int64_t, MapRelay::iterator>> vRelayExpiration;
@@ -346,6 +382,10 @@ struct CNodeState {
     uint256 hashLastUnknownBlock;
     //! The last full block we both have.
     CBlockIndex *pindexLastCommonBlock;
+    //! The best header we have sent our peer.
+    CBlockIndex *pindexBestHeaderSent;
+    //! Length of current-streak of unconnecting headers announcements
+    int nUnconnectingHeaders;
     //! Whether we've started headers synchronization with this peer.
     bool fSyncStarted;
     //! Since when we're stalling block download progress (in microseconds), or 0.
@@ -353,8 +393,21 @@ struct CNodeState {
     list<QueuedBlock> vBlocksInFlight;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
+    //! Moving average of the time between blocks this peer delivers while it has requests
+    //! outstanding (in microseconds), or 0 before its first block.
+    int64_t nBlockDeliveryTime;
+    //! When this peer last delivered a block we requested from it (in microseconds).
+    int64_t nLastBlockReceived;
+    //! How many blocks may be in flight from this peer, see UpdateMaxBlocksInFlight.
+    int nMaxBlocksInFlight;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Whether this peer wants new blocks announced with headers rather than inv.
+    bool fPreferHeaders;
+    //! Whether this peer can give us compact blocks.
+    bool fProvidesHeaderAndIDs;
+    //! Whether this peer wants new blocks announced as compact blocks.
+    bool fPreferHeaderAndIDs;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -363,11 +416,19 @@ struct CNodeState {
         pindexBestKnownBlock = NULL;
         hashLastUnknownBlock.SetNull();
         pindexLastCommonBlock = NULL;
+        pindexBestHeaderSent = NULL;
+        nUnconnectingHeaders = 0;
         fSyncStarted = false;
         nStallingSince = 0;
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
+        nBlockDeliveryTime = 0;
+        nLastBlockReceived = 0;
+        nMaxBlocksInFlight = DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER;
         fPreferredDownload = false;
+        fPreferHeaders = false;
+        fProvidesHeaderAndIDs = false;
+        fPreferHeaderAndIDs = false;
     }
 };
 
@@ -447,6 +508,33 @@ bool MarkBlockAsReceived(const uint256& hash) {
     return false;
 }
 
+// Requires cs_main.
+// Record that a peer delivered a block we requested from it, for sizing its
+// download window. nTimeReceived is when the message carrying the block was
+// received, so that the time we take to process it isn't counted. Must be
+// called before MarkBlockAsReceived.
+void UpdateBlockDeliveryTime(NodeId nodeid, const uint256& hash, int64_t nTimeReceived) {
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != nodeid)
+        return;
+    CNodeState *state = State(nodeid);
+    int64_t nNow = nTimeReceived;
+    // Time since the peer could have started sending this block: its request,
+    // or the previous block if the request was queued behind it.
+    int64_t nDeliveryTime = std::max<int64_t>(nNow - std::max(itInFlight->second.second->nTime, state->nLastBlockReceived), 1);
+    if (state->nBlockDeliveryTime == 0) {
+        state->nBlockDeliveryTime = nDeliveryTime;
+    } else {
+        state->nBlockDeliveryTime = (state->nBlockDeliveryTime * 7 + nDeliveryTime) / 8;
+    }
+    state->nLastBlockReceived = nNow;
+}
+
+// Requires cs_main.
+void UpdateMaxBlocksInFlight(CNodeState *state, int64_t nPingUsecTime) {
+    state->nMaxBlocksInFlight = GetMaxBlocksInFlight(state->nBlockDeliveryTime, nPingUsecTime);
+}
+
 // Requires cs_main.
 void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL) {
     CNodeState *state = State(nodeid);
@@ -465,6 +553,43 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
 }
 
+/**
+ * Ask a peer that just gave us a new tip to announce new blocks to us as
+ * compact blocks, replacing the peer we asked longest ago if we already have
+ * MAX_HIGH_BANDWIDTH_COMPACT_PEERS of them. Requires cs_main.
+ */
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(NodeId nodeid) {
+    CNodeState* nodestate = State(nodeid);
+    if (nodestate == nullptr || !nodestate->fProvidesHeaderAndIDs) {
+        // Never ask from peers who can't provide compact blocks.
+        return;
+    }
+    for (auto it = lNodesAnnouncingHeaderAndIDs.begin(); it != lNodesAnnouncingHeaderAndIDs.end(); it++) {
+        if (*it == nodeid) {
+            lNodesAnnouncingHeaderAndIDs.erase(it);
+            lNodesAnnouncingHeaderAndIDs.push_back(nodeid);
+            return;
+        }
+    }
+
+    std::optional<NodeId> nodeidEvicted;
+    if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_HIGH_BANDWIDTH_COMPACT_PEERS) {
+        nodeidEvicted = lNodesAnnouncingHeaderAndIDs.front();
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+    }
+    lNodesAnnouncingHeaderAndIDs.push_back(nodeid);
+
+    uint64_t nCMPCTBLOCKVersion = 1;
+    LOCK(cs_vNodes);
+    for (CNode* pnode : vNodes) {
+        if (pnode->GetId() == nodeid) {
+            pnode->PushMessage("sendcmpct", true, nCMPCTBLOCKVersion);
+        } else if (nodeidEvicted && pnode->GetId() == *nodeidEvicted) {
+            pnode->PushMessage("sendcmpct", false, nCMPCTBLOCKVersion);
+        }
+    }
+}
+
 /** Check whether the last unknown block a peer advertized is not yet known. */
 void ProcessBlockAvailability(NodeId nodeid) {
     CNodeState *state = State(nodeid);
@@ -498,6 +623,16 @@ void UpdateBlockAvailability(NodeId nodeid, const uint256 &hash) {
     }
 }
 
+/** Whether the peer is known to have the given header. Requires cs_main. */
+bool PeerHasHeader(CNodeState *state, CBlockIndex *pindex)
+{
+    if (state->pindexBestKnownBlock && pindex == state->pindexBestKnownBlock->GetAncestor(pindex->nHeight))
+        return true;
+    if (state->pindexBestHeaderSent && pindex == state->pindexBestHeaderSent->GetAncestor(pindex->nHeight))
+        return true;
+    return false;
+}
+
 /** Find the last common ancestor two blocks have.
  *  Both pa and pb must be non-NULL. */
 CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
@@ -551,10 +686,13 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
     CBlockIndex *pindexWalk = state->pindexLastCommonBlock;
     // Never fetch further than the best block we know the peer has, or more than BLOCK_DOWNLOAD_WINDOW + 1 beyond the last
     // linked block we have in common with this peer. The +1 is so we can detect stalling, namely if we would be able to
-    // download that next block if the window were 1 larger.
-    int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
+    // download that next block if the window were 1 larger. The window grows with the number of blocks we keep in flight
+    // from this peer, so that a fast peer doesn't run into it.
+    int nWindow = BLOCK_DOWNLOAD_WINDOW * std::max(state->nMaxBlocksInFlight, DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER) / DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER;
+    int nWindowEnd = state->pindexLastCommonBlock->nHeight + nWindow;
     int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
     NodeId waitingfor = -1;
+    CBlockIndex *pindexWaitingFor = NULL;
     while (pindexWalk->nHeight < nMaxHeight) {
         // Read up to 128 (or more, if more blocks than that are needed) successors of pindexWalk (towards
         // pindexBestKnownBlock) into vToFetch. We fetch 128, because CBlockIndex::GetAncestor may be as expensive
@@ -585,7 +723,17 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                     // We reached the end of the window.
                     if (vBlocks.size() == 0 && waitingfor != nodeid) {
                         // We aren't able to fetch anything, but we would be if the download window was one larger.
-                        nodeStaller = waitingfor;
+                        // If the block holding the window back was requested from a much slower peer, ask this
+                        // peer for it instead, rather than waiting for the slow peer to deliver it or stall.
+                        CNodeState *stateWaitingFor = waitingfor != -1 ? State(waitingfor) : NULL;
+                        if (stateWaitingFor != NULL &&
+                            ShouldMoveBlockFromPeer(stateWaitingFor->nBlockDeliveryTime, state->nBlockDeliveryTime)) {
+                            LogPrint("net", "Moving block %s from slow peer=%d to peer=%d\n",
+                                pindexWaitingFor->GetBlockHash().ToString(), waitingfor, nodeid);
+                            vBlocks.push_back(pindexWaitingFor);
+                        } else {
+                            nodeStaller = waitingfor;
+                        }
                     }
                     return;
                 }
@@ -596,6 +744,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                pindexWaitingFor = pindex;
             }
         }
     }
@@ -603,6 +752,26 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
 
 } // anon namespace
 
+int GetMaxBlocksInFlight(int64_t nBlockDeliveryTime, int64_t nPingUsecTime) {
+    if (nBlockDeliveryTime == 0 || nPingUsecTime == std::numeric_limits<int64_t>::max()) {
+        return DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER;
+    }
+    // Twice what the peer can deliver in one round trip, so that its link
+    // doesn't go idle while our next requests are on their way. While the
+    // window is too small to keep the link busy, blocks arrive more slowly
+    // than the peer can send them and the window grows towards that size.
+    int64_t nBlocks = 2 * nPingUsecTime / nBlockDeliveryTime + 1;
+    // Only a peer too slow to deliver the default number of blocks within
+    // BLOCK_SLOW_DELIVERY_TIMEOUT gets fewer.
+    bool fSlow = nBlockDeliveryTime > BLOCK_SLOW_DELIVERY_TIMEOUT * 1000000 / DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER;
+    int64_t nMinBlocks = fSlow ? MIN_BLOCKS_IN_TRANSIT_PER_PEER : DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER;
+    return std::max<int64_t>(nMinBlocks, std::min<int64_t>(MAX_BLOCKS_IN_TRANSIT_PER_PEER, nBlocks));
+}
+
+bool ShouldMoveBlockFromPeer(int64_t nSlowBlockDeliveryTime, int64_t nBlockDeliveryTime) {
+    return nBlockDeliveryTime != 0 && nSlowBlockDeliveryTime > 2 * nBlockDeliveryTime;
+}
+
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     LOCK(cs_main);
     CNodeState *state = State(nodeid);
@@ -621,6 +790,7 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
 void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.GetHeight.connect(&GetHeight);
+    nodeSignals.PrecheckMessages.connect(&PrecheckMessages);
     nodeSignals.ProcessMessages.connect(&ProcessMessages);
     nodeSignals.SendMessages.connect(&SendMessages);
     nodeSignals.InitializeNode.connect(&InitializeNode);
@@ -630,6 +800,7 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals)
 void UnregisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.GetHeight.disconnect(&GetHeight);
+    nodeSignals.PrecheckMessages.disconnect(&PrecheckMessages);
     nodeSignals.ProcessMessages.disconnect(&ProcessMessages);
     nodeSignals.SendMessages.disconnect(&SendMessages);
     nodeSignals.InitializeNode.disconnect(&InitializeNode);
@@ -655,6 +826,8 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewDB *pcoinsdbview = NULL;
+CCoinsViewAsyncWriter *pcoinswriter = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
@@ -1743,10 +1916,11 @@ std::string FormatStateMessage(const CValidationState &state)
         state.GetRejectCode());
 }
 
-bool AcceptToMemoryPool(
+static bool AcceptToMemoryPoolWorker(
         const CChainParams& chainparams,
         CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-        bool* pfMissingInputs, bool fRejectAbsurdFee)
+        bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectAbsurdFee, bool fTxChecked,
+        bool fAuthChecked, bool fScriptsChecked)
 {
     AssertLockHeld(cs_main);
     LOCK(pool.cs); // mempool "read lock" (held through pool.addUnchecked())
@@ -1764,8 +1938,8 @@ bool AcceptToMemoryPool(
         return false;
     }
 
-    auto verifier = ProofVerifier::Strict();
-    if (!CheckTransaction(tx, state, verifier))
+    auto verifier = fAuthChecked ? ProofVerifier::Disabled() : ProofVerifier::Strict();
+    if (!fTxChecked && !CheckTransaction(tx, state, verifier))
         return false;
 
     // Check transaction contextually against the set of consensus rules which apply in the next block to be mined.
@@ -1894,7 +2068,7 @@ bool AcceptToMemoryPool(
         // For v1-v4 transactions, we don't yet know if the transaction commits
         // to consensusBranchId, but if the entry gets added to the mempool, then
         // it has passed ContextualCheckInputs and therefore this is correct.
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), chainActive.Height(), pool.HasNoInputsOf(tx), fSpendsCoinbase, nSigOps, consensusBranchId);
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime, chainActive.Height(), pool.HasNoInputsOf(tx), fSpendsCoinbase, nSigOps, consensusBranchId);
         unsigned int nSize = entry.GetTxSize();
 
         // No transactions are allowed with modified fee below the minimum relay fee,
@@ -1949,7 +2123,7 @@ bool AcceptToMemoryPool(
             allPrevOutputs.push_back(view.GetOutputFor(input));
         }
         PrecomputedTransactionData txdata(tx, allPrevOutputs);
-        if (!ContextualCheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, txdata, chainparams.GetConsensus(), consensusBranchId))
+        if (!ContextualCheckInputs(tx, state, view, !fScriptsChecked, STANDARD_SCRIPT_VERIFY_FLAGS, true, txdata, chainparams.GetConsensus(), consensusBranchId))
         {
             return false;
         }
@@ -1963,7 +2137,7 @@ bool AcceptToMemoryPool(
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!ContextualCheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata, chainparams.GetConsensus(), consensusBranchId))
+        if (!fScriptsChecked && !ContextualCheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata, chainparams.GetConsensus(), consensusBranchId))
         {
             return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s, %s",
                 __func__, hash.ToString(), FormatStateMessage(state));
@@ -1971,12 +2145,15 @@ bool AcceptToMemoryPool(
 
         // This will be a single-transaction batch, which will be more efficient
         // than unbatched if the transaction contains at least one Sapling Spend
-        // or at least two Sapling Outputs.
-        std::optional<rust::Box<sapling::BatchValidator>> saplingAuth = sapling::init_batch_validator(true);
+        // or at least two Sapling Outputs. Not needed if the authorization of the
+        // bundles was already checked.
+        std::optional<rust::Box<sapling::BatchValidator>> saplingAuth = fAuthChecked ?
+            std::nullopt : std::optional(sapling::init_batch_validator(true));
 
         // This will be a single-transaction batch, which is still more efficient as every
         // Orchard bundle contains at least two signatures.
-        std::optional<rust::Box<orchard::BatchValidator>> orchardAuth = orchard::init_batch_validator(true);
+        std::optional<rust::Box<orchard::BatchValidator>> orchardAuth = fAuthChecked ?
+            std::nullopt : std::optional(orchard::init_batch_validator(true));
 
         // Check shielded input signatures.
         if (!ContextualCheckShieldedInputs(
@@ -1995,11 +2172,10 @@ bool AcceptToMemoryPool(
         }
 
         // Check Sapling and Orchard bundle authorizations.
-        // `saplingAuth` and `orchardAuth` are known here to be non-null.
-        if (!saplingAuth.value()->validate()) {
+        if (saplingAuth.has_value() && !saplingAuth.value()->validate()) {
             return state.DoS(100, false, REJECT_INVALID, "bad-sapling-bundle-authorization");
         }
-        if (!orchardAuth.value()->validate()) {
+        if (orchardAuth.has_value() && !orchardAuth.value()->validate()) {
             return state.DoS(100, false, REJECT_INVALID, "bad-orchard-bundle-authorization");
         }
 
@@ -2032,6 +2208,24 @@ bool AcceptToMemoryPool(
     return true;
 }
 
+bool AcceptToMemoryPoolWithTime(
+        const CChainParams& chainparams,
+        CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+        bool* pfMissingInputs, int64_t nAcceptTime, bool fTxChecked, bool fInputsVerified)
+{
+    return AcceptToMemoryPoolWorker(chainparams, pool, state, tx, fLimitFree, pfMissingInputs,
+        nAcceptTime, false, fTxChecked, fInputsVerified, fInputsVerified);
+}
+
+bool AcceptToMemoryPool(
+        const CChainParams& chainparams,
+        CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+        bool* pfMissingInputs, bool fRejectAbsurdFee, bool fTxChecked, bool fInputsVerified)
+{
+    return AcceptToMemoryPoolWorker(chainparams, pool, state, tx, fLimitFree, pfMissingInputs,
+        GetTime(), fRejectAbsurdFee, fTxChecked, fInputsVerified, fInputsVerified);
+}
+
 bool GetTimestampIndex(unsigned int high, unsigned int low, bool fActiveOnly,
     std::vector<std::pair<uint256, unsigned int> > &hashes)
 {
@@ -2229,6 +2423,36 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
     return true;
 }
 
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& block, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart)
+{
+    // The block is preceded by the network magic and its size, as written by
+    // WriteBlockToDisk.
+    CDiskBlockPos hpos = pos;
+    if (hpos.nPos < 8)
+        return error("%s: Invalid block position %s", __func__, pos.ToString());
+    hpos.nPos -= 8;
+
+    CAutoFile filein(OpenBlockFile(hpos, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+
+    try {
+        CMessageHeader::MessageStartChars blockStart;
+        unsigned int nSize;
+        filein >> FLATDATA(blockStart) >> nSize;
+        if (memcmp(blockStart, messageStart, CMessageHeader::MESSAGE_START_SIZE))
+            return error("%s: Block magic mismatch at %s", __func__, pos.ToString());
+        if (nSize > MAX_BLOCK_SIZE)
+            return error("%s: Block too large (%u bytes) at %s", __func__, nSize, pos.ToString());
+        block.resize(nSize);
+        filein.read((char*)block.data(), nSize);
+    }
+    catch (const std::exception& e) {
+        return error("%s: I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+    return true;
+}
+
 static std::atomic<bool> IBDLatchToFalse{false};
 // testing-only, allow initial block down state to be set or reset
 bool TestSetIBD(bool ibd) {
@@ -2491,6 +2715,18 @@ bool CScriptCheck::operator()() {
     return true;
 }
 
+bool CSproutProofCheck::operator()() {
+    auto verifier = ProofVerifier::Strict();
+    if (!verifier.VerifySprout(ptx->vJoinSplit[nJoinSplit], ptx->joinSplitPubKey)) {
+        if (pFailedTx) {
+            const CTransaction* expected = nullptr;
+            pFailedTx->compare_exchange_strong(expected, ptx);
+        }
+        return false;
+    }
+    return true;
+}
+
 int GetSpendHeight(const CCoinsViewCache& inputs)
 {
     LOCK(cs_main);
@@ -2667,6 +2903,83 @@ bool ContextualCheckInputs(
     return true;
 }
 
+/**
+ * Verify the scripts of tx and the shielded signatures that aren't batched,
+ * and queue its Sapling and Orchard bundles in the given batches.
+ */
+static bool QueueTransactionInputs(
+    const CChainParams& chainparams,
+    const CTransaction& tx,
+    const CCoinsViewCache& view,
+    int nHeight,
+    bool cacheStore,
+    std::optional<rust::Box<sapling::BatchValidator>>& saplingAuth,
+    std::optional<rust::Box<orchard::BatchValidator>>& orchardAuth)
+{
+    const Consensus::Params& consensus = chainparams.GetConsensus();
+    uint32_t consensusBranchId = CurrentEpochBranchId(nHeight, consensus);
+
+    std::vector<CTxOut> allPrevOutputs;
+    for (const auto& input : tx.vin) {
+        allPrevOutputs.push_back(view.GetOutputFor(input));
+    }
+    PrecomputedTransactionData txdata(tx, allPrevOutputs);
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        const CCoins* coins = view.AccessCoins(tx.vin[i].prevout.hash);
+        assert(coins);
+        CScriptCheck check(*coins, tx, i, STANDARD_SCRIPT_VERIFY_FLAGS, cacheStore, consensusBranchId, &txdata);
+        if (!check())
+            return false;
+    }
+
+    // Failures are handled by AcceptToMemoryPool(), so their DoS level
+    // doesn't matter here.
+    CValidationState state;
+    return ContextualCheckShieldedInputs(
+        tx,
+        txdata,
+        state,
+        view,
+        saplingAuth,
+        orchardAuth,
+        consensus,
+        consensusBranchId,
+        consensus.NetworkUpgradeActive(nHeight, Consensus::UPGRADE_NU5),
+        false,
+        [](const Consensus::Params&) { return false; });
+}
+
+std::vector<bool> VerifyTransactionInputs(
+    const CChainParams& chainparams,
+    const std::vector<const CTransaction*>& vtx,
+    const CCoinsViewCache& view,
+    int nHeight,
+    bool cacheStore)
+{
+    std::vector<bool> vVerified(vtx.size(), false);
+    std::optional<rust::Box<sapling::BatchValidator>> saplingAuth = sapling::init_batch_validator(cacheStore);
+    std::optional<rust::Box<orchard::BatchValidator>> orchardAuth = orchard::init_batch_validator(cacheStore);
+    for (size_t i = 0; i < vtx.size(); i++) {
+        vVerified[i] = QueueTransactionInputs(chainparams, *vtx[i], view, nHeight, cacheStore, saplingAuth, orchardAuth);
+    }
+    if (saplingAuth.value()->validate() && orchardAuth.value()->validate())
+        return vVerified;
+
+    // At least one of the transactions is invalid; find out which, by
+    // verifying each on its own. A transaction that failed before its bundles
+    // were fully queued may be the one that failed the batch, so only those
+    // that passed so far are verified again.
+    for (size_t i = 0; i < vtx.size(); i++) {
+        if (!vVerified[i])
+            continue;
+        std::optional<rust::Box<sapling::BatchValidator>> saplingAuthTx = sapling::init_batch_validator(cacheStore);
+        std::optional<rust::Box<orchard::BatchValidator>> orchardAuthTx = orchard::init_batch_validator(cacheStore);
+        vVerified[i] = QueueTransactionInputs(chainparams, *vtx[i], view, nHeight, cacheStore, saplingAuthTx, orchardAuthTx) &&
+            saplingAuthTx.value()->validate() && orchardAuthTx.value()->validate();
+    }
+    return vVerified;
+}
+
 namespace {
 
 bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStart)
@@ -2993,13 +3306,43 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+static CCheckQueue<CBlockCheck> scriptcheckqueue(128);
 
 void ThreadScriptCheck() {
     RenameThread("zc-scriptcheck");
     scriptcheckqueue.Thread();
 }
 
+/**
+ * A check that doesn't depend on context, run on the precheck queue without
+ * cs_main. It records its own outcome, so that the queue runs every check.
+ */
+class CPrecheck
+{
+private:
+    std::function<void()> func;
+
+public:
+    CPrecheck() {}
+    explicit CPrecheck(std::function<void()> funcIn) : func(std::move(funcIn)) {}
+
+    bool operator()() {
+        func();
+        return true;
+    }
+
+    void swap(CPrecheck& check) { func.swap(check.func); }
+};
+
+// The precheck threads are started alongside the script check threads, so
+// this is only used if nScriptCheckThreads is nonzero.
+static CCheckQueue<CPrecheck> precheckqueue(1);
+
+void ThreadPrecheck() {
+    RenameThread("zc-precheck");
+    precheckqueue.Thread();
+}
+
 static int64_t nTimeVerify = 0;
 static int64_t nTimeConnect = 0;
 static int64_t nTimeIndex = 0;
@@ -3021,9 +3364,230 @@ static bool ShouldCheckTransactions(const CChainParams& chainparams, const CBloc
              && Checkpoints::IsAncestorOfLastCheckpoint(chainparams.Checkpoints(), pindex));
 }
 
+/**
+ * Determine whether the block under inspection is covered by -assumevalid.
+ * Returns `true` only if all of the following are true:
+ *   - the block is an ancestor of the -assumevalid block
+ *   - the block is an ancestor of the best header
+ *   - the best header has at least nMinimumChainWork
+ *   - the best header is at least two weeks' worth of work past the block.
+ */
+static bool IsAssumedValid(const CChainParams& chainparams, const CBlockIndex* pindex) {
+    AssertLockHeld(cs_main);
+
+    if (hashAssumeValid.IsNull() || pindexBestHeader == nullptr) {
+        return false;
+    }
+    // We've been configured with the hash of a block which has been
+    // externally verified to have a valid history. A suitable default value
+    // is included with the software and updated from time to time. Because
+    // validity relative to a piece of software is an objective fact these
+    // defaults can be easily reviewed. This setting doesn't force the
+    // selection of any particular chain but makes validating some faster by
+    // effectively caching the result of part of the verification.
+    BlockMap::const_iterator it = mapBlockIndex.find(hashAssumeValid);
+    if (it == mapBlockIndex.end()) {
+        return false;
+    }
+    if (it->second->GetAncestor(pindex->nHeight) != pindex ||
+        pindexBestHeader->GetAncestor(pindex->nHeight) != pindex ||
+        pindexBestHeader->nChainWork < UintToArith256(chainparams.GetConsensus().nMinimumChainWork))
+    {
+        return false;
+    }
+    // The equivalent time check discourages hash power from extorting the
+    // network via DoS attack into accepting an invalid block through telling
+    // users they must manually set -assumevalid. Requiring a software change
+    // or burying the invalid block, regardless of the setting, makes it hard
+    // to hide the implication of the demand. The test against
+    // nMinimumChainWork prevents the skipping when denied access to any chain
+    // at least as good as the expected chain.
+    return GetBlockProofEquivalentTime(*pindexBestHeader, *pindex, *pindexBestHeader, chainparams.GetConsensus()) > 60 * 60 * 24 * 7 * 2;
+}
+
+/**
+ * Determine whether to verify proofs and signatures when connecting blocks.
+ * Returns `false` if the block under inspection is an ancestor of the latest
+ * checkpoint, or is covered by -assumevalid.
+ */
+static bool ShouldCheckProofs(const CChainParams& chainparams, const CBlockIndex* pindex) {
+    return !((fCheckpointsEnabled
+              && Checkpoints::IsAncestorOfLastCheckpoint(chainparams.Checkpoints(), pindex))
+             || IsAssumedValid(chainparams, pindex));
+}
+
+/**
+ * Reads, deserializes and runs the context-free checks on blocks that are
+ * about to be connected to the active chain, so that loading block N+1 from
+ * disk overlaps with ConnectBlock for block N.
+ *
+ * The thread holding cs_main in ActivateBestChainStep schedules upcoming
+ * blocks with Prefetch() and collects them with Take(). Blocks are loaded by
+ * the BLOCK_PREFETCH_THREADS threads running ThreadBlockPrefetch().
+ */
+class CBlockPrefetcher
+{
+private:
+    struct Entry
+    {
+        const CChainParams* chainparams;
+        uint256 hash;
+        CDiskBlockPos pos;
+        //! Whether ConnectBlock will run transaction checks for this block.
+        bool fCheckTransactions;
+        //! Set once a worker has finished with this entry.
+        bool fDone = false;
+        //! The loaded block, or null if it could not be read.
+        std::shared_ptr<const CBlock> block;
+    };
+
+    //! Mutex to protect the inner state
+    boost::mutex mutex;
+
+    //! Worker threads block on this when out of work
+    boost::condition_variable condWorker;
+
+    //! The master blocks on this while waiting for a block that is being loaded
+    boost::condition_variable condMaster;
+
+    //! All scheduled entries, indexed by block hash.
+    std::map<uint256, std::shared_ptr<Entry>> mapEntries;
+
+    //! Scheduled entries that no worker has picked up yet, in chain order.
+    std::deque<std::shared_ptr<Entry>> queue;
+
+public:
+    /**
+     * Schedule the blocks on the path to pindexMostWork, starting at height
+     * nHeight, for prefetching. Entries for blocks outside of that window
+     * (for example after a reorg or an invalid block) are discarded.
+     */
+    void Prefetch(const CChainParams& chainparams, const CBlockIndex* pindexMostWork, int nHeight, int nDepth)
+        EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+    {
+        AssertLockHeld(cs_main);
+
+        std::vector<const CBlockIndex*> vpindex;
+        int nLastHeight = std::min(nHeight + nDepth - 1, pindexMostWork->nHeight);
+        for (const CBlockIndex* pindex = pindexMostWork->GetAncestor(nLastHeight);
+             pindex && pindex->nHeight >= nHeight;
+             pindex = pindex->pprev) {
+            vpindex.push_back(pindex);
+        }
+        std::reverse(vpindex.begin(), vpindex.end());
+
+        std::set<uint256> setWanted;
+        for (const CBlockIndex* pindex : vpindex) {
+            setWanted.insert(pindex->GetBlockHash());
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        for (auto it = mapEntries.begin(); it != mapEntries.end(); ) {
+            if (setWanted.count(it->first) == 0) {
+                queue.erase(std::remove(queue.begin(), queue.end(), it->second), queue.end());
+                it = mapEntries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        for (const CBlockIndex* pindex : vpindex) {
+            if (!(pindex->nStatus & BLOCK_HAVE_DATA)) {
+                break;
+            }
+            if (mapEntries.count(pindex->GetBlockHash())) {
+                continue;
+            }
+            auto entry = std::make_shared<Entry>();
+            entry->chainparams = &chainparams;
+            entry->hash = pindex->GetBlockHash();
+            entry->pos = pindex->GetBlockPos();
+            entry->fCheckTransactions = ShouldCheckTransactions(chainparams, pindex);
+            mapEntries.emplace(entry->hash, entry);
+            queue.push_back(entry);
+        }
+        if (!queue.empty()) {
+            condWorker.notify_all();
+        }
+    }
+
+    /**
+     * Return the prefetched block for pindex, waiting for it if a worker is
+     * currently loading it. Returns null if the block was not scheduled, has
+     * not been picked up by a worker yet, or could not be read, in which case
+     * the caller should read it from disk itself.
+     */
+    std::shared_ptr<const CBlock> Take(const CBlockIndex* pindex)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        auto it = mapEntries.find(pindex->GetBlockHash());
+        if (it == mapEntries.end()) {
+            return nullptr;
+        }
+        std::shared_ptr<Entry> entry = it->second;
+        mapEntries.erase(it);
+
+        auto qit = std::find(queue.begin(), queue.end(), entry);
+        if (qit != queue.end()) {
+            queue.erase(qit);
+            return nullptr;
+        }
+
+        // The caller holds cs_main, so don't let a shutdown interrupt us here.
+        boost::this_thread::disable_interruption di;
+        while (!entry->fDone) {
+            condMaster.wait(lock);
+        }
+        return entry->block;
+    }
+
+    void Thread()
+    {
+        while (true) {
+            std::shared_ptr<Entry> entry;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queue.empty()) {
+                    condWorker.wait(lock);
+                }
+                entry = queue.front();
+                queue.pop_front();
+            }
+
+            auto block = std::make_shared<CBlock>();
+            if (ReadBlockFromDisk(*block, entry->pos, entry->chainparams->GetConsensus()) &&
+                block->GetHash() == entry->hash)
+            {
+                // If these checks pass, the block is marked as checked and
+                // ConnectBlock can skip them. If they fail, the block is
+                // handed over anyway, and ConnectBlock repeats the checks
+                // and reports the failure.
+                CValidationState state;
+                auto verifier = ProofVerifier::Disabled();
+                CheckBlock(*block, state, *entry->chainparams, verifier, true, true, entry->fCheckTransactions);
+            } else {
+                block.reset();
+            }
+
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                entry->block = block;
+                entry->fDone = true;
+            }
+            condMaster.notify_all();
+        }
+    }
+};
+
+static CBlockPrefetcher blockPrefetcher;
+
+void ThreadBlockPrefetch() {
+    RenameThread("zc-blockprefetch");
+    blockPrefetcher.Thread();
+}
+
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex,
                   CCoinsViewCache& view, const CChainParams& chainparams,
-                  bool fJustCheck, CheckAs blockChecks)
+                  bool fJustCheck, CheckAs blockChecks, CShieldedAuthBatch* pshieldedBatch)
 {
     AssertLockHeld(cs_main);
 
@@ -3049,8 +3613,9 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         assert(false);
     }
 
-    // If this block is an ancestor of a checkpoint, disable expensive checks
-    if (fCheckpointsEnabled && Checkpoints::IsAncestorOfLastCheckpoint(chainparams.Checkpoints(), pindex)) {
+    // If this block is an ancestor of a checkpoint or of the -assumevalid
+    // block, disable expensive checks
+    if (!ShouldCheckProofs(chainparams, pindex)) {
         fExpensiveChecks = false;
     }
 
@@ -3058,20 +3623,27 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // (still consult the cache, though, which will be empty for benchmarks).
     bool fCacheResults = fJustCheck && (blockChecks != CheckAs::SlowBenchmark);
 
-    // proof verification is expensive, disable if possible
-    auto verifier = fExpensiveChecks ? ProofVerifier::Strict() : ProofVerifier::Disabled();
+    // Sprout proofs are verified below on the script check queue, alongside
+    // the transparent scripts, rather than serially within CheckBlock.
+    auto verifier = ProofVerifier::Disabled();
+
+    // Sapling and Orchard authorizations are either queued into the caller's
+    // batch, or validated by this block's own batch validators.
+    bool fDeferShieldedAuth = fExpensiveChecks && !fJustCheck && pshieldedBatch != nullptr;
 
     // Disable Sapling and Orchard batch validation if possible.
-    std::optional<rust::Box<sapling::BatchValidator>> saplingAuth = fExpensiveChecks ?
+    std::optional<rust::Box<sapling::BatchValidator>> blockSaplingAuth = fExpensiveChecks && !fDeferShieldedAuth ?
         std::optional(sapling::init_batch_validator(fCacheResults)) : std::nullopt;
-    std::optional<rust::Box<orchard::BatchValidator>> orchardAuth = fExpensiveChecks ?
+    std::optional<rust::Box<orchard::BatchValidator>> blockOrchardAuth = fExpensiveChecks && !fDeferShieldedAuth ?
         std::optional(orchard::init_batch_validator(fCacheResults)) : std::nullopt;
+    auto& saplingAuth = fDeferShieldedAuth ? pshieldedBatch->saplingAuth : blockSaplingAuth;
+    auto& orchardAuth = fDeferShieldedAuth ? pshieldedBatch->orchardAuth : blockOrchardAuth;
 
     // If in initial block download, and this block is an ancestor of a checkpoint,
     // and -ibdskiptxverification is set, disable all transaction checks.
     bool fCheckTransactions = ShouldCheckTransactions(chainparams, pindex);
 
-    // Check it again to verify JoinSplit proofs, and in case a previous version let a bad block in
+    // Check it again in case a previous version let a bad block in
     if (!CheckBlock(block, state, chainparams, verifier,
         !fJustCheck, !fJustCheck, fCheckTransactions))
     {
@@ -3154,7 +3726,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     CBlockUndo blockundo;
 
-    CCheckQueueControl<CScriptCheck> control(fExpensiveChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    // Set by a queued Sprout proof check that fails. Declared before control,
+    // whose destructor waits for the queued checks.
+    std::atomic<const CTransaction*> pFailedSproutTx(nullptr);
+    CCheckQueueControl<CBlockCheck> control(fExpensiveChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
     int64_t nTimeStart = GetTimeMicros();
     std::vector<uint256> vOrphanErase;
@@ -3227,6 +3802,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     std::vector<PrecomputedTransactionData> txdata;
     txdata.reserve(block.vtx.size()); // Required so that pointers to individual PrecomputedTransactionData don't get invalidated
+    CShieldedAuthBatch::Block deferredBlock;
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
         const CTransaction &tx = block.vtx[i];
@@ -3335,7 +3911,27 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             if (!ContextualCheckInputs(tx, state, view, fExpensiveChecks, flags, fCacheResults, txdata.back(), consensusParams, consensusBranchId, nScriptCheckThreads ? &vChecks : NULL))
                 return error("%s: CheckInputs on %s failed with %s", __func__,
                     tx.GetHash().ToString(), FormatStateMessage(state));
-            control.Add(vChecks);
+            std::vector<CBlockCheck> vBlockChecks;
+            vBlockChecks.reserve(vChecks.size());
+            for (auto& check : vChecks) {
+                vBlockChecks.emplace_back(check);
+            }
+            control.Add(vBlockChecks);
+        }
+
+        // Verify Sprout proofs, in parallel with the script checks if possible.
+        if (fExpensiveChecks && fCheckTransactions && !tx.vJoinSplit.empty()) {
+            std::vector<CBlockCheck> vProofChecks;
+            for (size_t js = 0; js < tx.vJoinSplit.size(); js++) {
+                CSproutProofCheck check(tx, js, &pFailedSproutTx);
+                if (nScriptCheckThreads) {
+                    vProofChecks.emplace_back(check);
+                } else if (!check()) {
+                    return state.DoS(100, error("%s: joinsplit on %s does not verify", __func__, tx.GetHash().ToString()),
+                                     REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
+                }
+            }
+            control.Add(vProofChecks);
         }
 
         // Check shielded inputs.
@@ -3357,6 +3953,15 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                 FormatStateMessage(state));
         }
 
+        // Keep the signature hash of deferred bundles, in case they have to
+        // be queued again to find out which block of the batch is invalid.
+        // Computing it above succeeded, so it cannot throw here.
+        if (fDeferShieldedAuth && (tx.GetSaplingBundle().IsPresent() || tx.GetOrchardBundle().IsPresent())) {
+            CScript scriptCode;
+            deferredBlock.vSigHashes.emplace_back(i,
+                SignatureHash(scriptCode, tx, NOT_AN_INPUT, SIGHASH_ALL, 0, consensusBranchId, txdata.back()));
+        }
+
         // insightexplorer
         // https://github.com/bitpay/bitcoin/commit/017f548ea6d89423ef568117447e61dd5707ec42#diff-7ec3c68a81efff79b6ca22ac1f1eabbaR2656
         if (fAddressIndex) {
@@ -3637,21 +4242,29 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     }
 
     // Ensure Sapling authorizations are valid (if we are checking them)
-    if (saplingAuth.has_value() && !saplingAuth.value()->validate()) {
+    if (blockSaplingAuth.has_value() && !blockSaplingAuth.value()->validate()) {
         return state.DoS(100,
             error("%s: a Sapling bundle within the block is invalid", __func__),
             REJECT_INVALID, "bad-sapling-bundle-authorization");
     }
 
     // Ensure Orchard signatures are valid (if we are checking them)
-    if (orchardAuth.has_value() && !orchardAuth.value()->validate()) {
+    if (blockOrchardAuth.has_value() && !blockOrchardAuth.value()->validate()) {
         return state.DoS(100,
             error("%s: an Orchard bundle within the block is invalid", __func__),
             REJECT_INVALID, "bad-orchard-bundle-authorization");
     }
 
-    if (!control.Wait())
+    if (!control.Wait()) {
+        // Report a Sprout proof failure as the serial path does. Otherwise a
+        // transparent script failed.
+        const CTransaction* pFailedTx = pFailedSproutTx.load();
+        if (pFailedTx) {
+            return state.DoS(100, error("%s: joinsplit on %s does not verify", __func__, pFailedTx->GetHash().ToString()),
+                             REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
+        }
         return state.DoS(100, false);
+    }
     int64_t nTime2 = GetTimeMicros(); nTimeVerify += nTime2 - nTimeStart;
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime2 - nTimeStart), nInputs <= 1 ? 0 : 0.001 * (nTime2 - nTimeStart) / (nInputs-1), nTimeVerify * 0.000001);
 
@@ -3684,7 +4297,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             pindex->nCachedBranchId = pindex->pprev->nCachedBranchId;
         }
 
-        pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
+        // With deferred shielded authorizations, this is only done once
+        // they have been validated.
+        if (!fDeferShieldedAuth)
+            pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
         setDirtyBlockIndex.insert(pindex);
     }
 
@@ -3743,6 +4359,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         LogPrint("mempool", "Erased %d orphan tx included or conflicted by block\n", nErased);
     }
 
+    if (fDeferShieldedAuth) {
+        deferredBlock.pindex = pindex;
+        pshieldedBatch->vBlocks.push_back(std::move(deferredBlock));
+    }
+
     return true;
 }
 
@@ -3788,7 +4409,10 @@ bool static FlushStateToDisk(
     if (nLastFlush == 0) {
         nLastFlush = nNow;
     }
-    size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+    // A batch that is still being written to the database takes memory too,
+    // as do the nullifier filters, which flushing doesn't shrink.
+    size_t nFilterUsage = pcoinsdbview ? pcoinsdbview->DynamicMemoryUsage() : 0;
+    size_t cacheSize = pcoinsTip->DynamicMemoryUsage() + (pcoinswriter ? pcoinswriter->DynamicMemoryUsage() : 0) + nFilterUsage;
     // The cache is large and close to the limit, but we have time now (not in the middle of a block processing).
     bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0/9) > nCoinCacheUsage;
     // The cache is over the limit, we have to write now.
@@ -3797,8 +4421,14 @@ bool static FlushStateToDisk(
     bool fPeriodicWrite = mode == FLUSH_STATE_PERIODIC && nNow > nLastWrite + (int64_t)DATABASE_WRITE_INTERVAL * 1000000;
     // It's been very long since we flushed the cache. Do this infrequently, to optimize cache usage.
     bool fPeriodicFlush = mode == FLUSH_STATE_PERIODIC && nNow > nLastFlush + (int64_t)DATABASE_FLUSH_INTERVAL * 1000000;
-    // Combine all conditions that result in a full cache flush.
+    // Combine all conditions that result in writing the chainstate.
     bool fDoFullFlush = (mode == FLUSH_STATE_ALWAYS) || fCacheLarge || fCacheCritical || fPeriodicFlush || fFlushForPrune;
+    // Writing the chainstate waits for the previous batch to reach the
+    // database. Unless we have to, don't wait for that under cs_main, and
+    // try again next time instead.
+    if (mode == FLUSH_STATE_PERIODIC && !fFlushForPrune && pcoinswriter && pcoinswriter->IsWriting()) {
+        fDoFullFlush = false;
+    }
     // Write blocks and block index to disk.
     if (fDoFullFlush || fPeriodicWrite) {
         // Depend on nMinDiskSpace to ensure we can write block index
@@ -3844,9 +4474,20 @@ bool static FlushStateToDisk(
         // overwrite one. Still, use a conservative safety factor of 2.
         if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
-        // Flush the chainstate (which may refer to block index entries).
-        if (!pcoinsTip->Flush())
+        // Write the chainstate (which may refer to block index entries),
+        // keeping the now clean entries cached. The database write happens
+        // in the background, unless the caller needs it done now, or block
+        // files are about to be pruned.
+        if (!pcoinsTip->Sync())
+            return AbortNode(state, "Failed to write to coin database");
+        if ((mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && pcoinswriter && !pcoinswriter->Commit())
             return AbortNode(state, "Failed to write to coin database");
+        // Only when the cache has outgrown -dbcache, make room in it by
+        // evicting clean entries.
+        if (fCacheLarge || fCacheCritical) {
+            size_t nTargetUsage = nCoinCacheUsage / 100 * COINS_CACHE_EVICT_TARGET_PERCENT;
+            pcoinsTip->Evict(nTargetUsage > nFilterUsage ? nTargetUsage - nFilterUsage : 0);
+        }
         nLastFlush = nNow;
     }
     // Don't flush the wallet witness cache (SetBestChain()) here, see #4301
@@ -3976,7 +4617,7 @@ void static UpdateTip(CBlockIndex *pindexNew, const CChainParams& chainParams) {
     auto tx = tfm::format("%lu", (unsigned long)chainActive.Tip()->nChainTx);
     auto date = DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime());
     auto progress = tfm::format("%f", Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip()));
-    auto cache = tfm::format("%.1fMiB(%utx)", pcoinsTip->DynamicMemoryUsage() * (1.0 / (1<<20)), pcoinsTip->GetCacheSize());
+    auto cache = tfm::format("%.1fMiB(%utx)", (pcoinsTip->DynamicMemoryUsage() + (pcoinswriter ? pcoinswriter->DynamicMemoryUsage() : 0) + (pcoinsdbview ? pcoinsdbview->DynamicMemoryUsage() : 0)) * (1.0 / (1<<20)), pcoinsTip->GetCacheSize());
 
     TracingInfo("main", "UpdateTip: new best",
         "hash", hash.c_str(),
@@ -4010,8 +4651,10 @@ void static UpdateTip(CBlockIndex *pindexNew, const CChainParams& chainParams) {
 /**
  * Disconnect chainActive's tip. You probably want to call mempool.removeForReorg and
  * mempool.removeWithoutBranchId after this, with cs_main held.
+ * If fFlush is false, the chain state is not written to disk; the caller must
+ * call FlushStateToDisk once it is consistent again.
  */
-bool static DisconnectTip(CValidationState &state, const CChainParams& chainparams, bool fBare = false)
+bool static DisconnectTip(CValidationState &state, const CChainParams& chainparams, bool fBare = false, bool fFlush = true)
 {
     CBlockIndex *pindexDelete = chainActive.Tip();
     assert(pindexDelete);
@@ -4036,7 +4679,7 @@ bool static DisconnectTip(CValidationState &state, const CChainParams& chainpara
     uint256 saplingAnchorAfterDisconnect = pcoinsTip->GetBestAnchor(SAPLING);
     uint256 orchardAnchorAfterDisconnect = pcoinsTip->GetBestAnchor(ORCHARD);
     // Write the chain state to disk, if necessary.
-    if (!FlushStateToDisk(chainparams, state, FLUSH_STATE_IF_NEEDED))
+    if (fFlush && !FlushStateToDisk(chainparams, state, FLUSH_STATE_IF_NEEDED))
         return false;
 
     if (!fBare) {
@@ -4094,12 +4737,30 @@ std::map<const CBlockIndex*, std::list<CTransaction>> recentlyConflictedTxs;
 uint64_t nConnectedSequence = 0;
 uint64_t nNotifiedSequence = 0;
 
+/** Forget the peer that sent us a block, now that it has been fully validated. */
+static void BlockSourceValidated(const CChainParams& chainparams, const CBlockIndex* pindex)
+{
+    auto itSource = mapBlockSource.find(pindex->GetBlockHash());
+    if (itSource != mapBlockSource.end()) {
+        if (!IsInitialBlockDownload(chainparams.GetConsensus())) {
+            MaybeSetPeerAsAnnouncingHeaderAndIDs(itSource->second);
+        }
+        mapBlockSource.erase(itSource);
+    }
+}
+
 /**
- * Connect a new block to chainActive. pblock is either NULL or a pointer to a CBlock
+ * Connect a new block to chainActive. pblock is a pointer to a CBlock
  * corresponding to pindexNew, to bypass loading it again from disk.
+ * If pshieldedBatch is set, the block's Sapling and Orchard authorizations are
+ * queued into it, and the chain state is not written to disk; the caller must
+ * call ValidateShieldedAuthBatch before doing so. Listeners are only told that
+ * the block was checked once that has been done.
  * You probably want to call mempool.removeWithoutBranchId after this, with cs_main held.
  */
-bool static ConnectTip(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexNew, const CBlock* pblock)
+bool static ConnectTip(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexNew,
+                       const std::shared_ptr<const CBlock>& pblock,
+                       CShieldedAuthBatch* pshieldedBatch = nullptr)
 {
     assert(pblock && pindexNew->pprev == chainActive.Tip());
     // Apply the block atomically to the chain state.
@@ -4107,22 +4768,30 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     int64_t nTime3;
     {
         CCoinsViewCache view(pcoinsTip);
-        bool rv = ConnectBlock(*pblock, state, pindexNew, view, chainparams);
-        GetMainSignals().BlockChecked(*pblock, state);
+        size_t nDeferredBlocks = pshieldedBatch ? pshieldedBatch->vBlocks.size() : 0;
+        bool rv = ConnectBlock(*pblock, state, pindexNew, view, chainparams, false, CheckAs::Block, pshieldedBatch);
+        bool fDeferred = rv && pshieldedBatch && pshieldedBatch->vBlocks.size() > nDeferredBlocks;
+        if (!fDeferred)
+            GetMainSignals().BlockChecked(*pblock, state);
         if (!rv) {
             if (state.IsInvalid())
                 InvalidBlockFound(pindexNew, state, chainparams);
             return error("ConnectTip(): ConnectBlock %s failed", pindexNew->GetBlockHash().ToString());
         }
-        mapBlockSource.erase(pindexNew->GetBlockHash());
+        if (fDeferred) {
+            pshieldedBatch->vBlocks.back().pblock = pblock;
+        } else {
+            BlockSourceValidated(chainparams, pindexNew);
+        }
         nTime3 = GetTimeMicros(); nTimeConnectTotal += nTime3 - nTime2;
         LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
         assert(view.Flush());
     }
     int64_t nTime4 = GetTimeMicros(); nTimeFlush += nTime4 - nTime3;
     LogPrint("bench", "  - Flush: %.2fms [%.2fs]\n", (nTime4 - nTime3) * 0.001, nTimeFlush * 0.000001);
-    // Write the chain state to disk, if necessary.
-    if (!FlushStateToDisk(chainparams, state, FLUSH_STATE_IF_NEEDED))
+    // Write the chain state to disk, if necessary. This must wait until any
+    // deferred shielded authorizations have been validated.
+    if (!pshieldedBatch && !FlushStateToDisk(chainparams, state, FLUSH_STATE_IF_NEEDED))
         return false;
     int64_t nTime5 = GetTimeMicros(); nTimeChainState += nTime5 - nTime4;
     LogPrint("bench", "  - Writing chainstate: %.2fms [%.2fs]\n", (nTime5 - nTime4) * 0.001, nTimeChainState * 0.000001);
@@ -4263,46 +4932,199 @@ static void PruneBlockIndexCandidates() {
 }
 
 /**
- * Try to make some progress towards making pindexMostWork the active block.
- * pblock is either NULL or a pointer to a CBlock corresponding to pindexMostWork.
+ * Queue the Sapling and Orchard bundles of a block of a failed batch into the
+ * given batch validators again, with the signature hashes kept when it was
+ * connected. Returns false if a bundle can't be queued.
  */
-static bool ActivateBestChainStep(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexMostWork, const CBlock* pblock, bool& fInvalidFound)
+static bool QueueShieldedAuth(
+    const CShieldedAuthBatch::Block& deferred,
+    sapling::BatchValidator& saplingAuth,
+    orchard::BatchValidator& orchardAuth)
 {
-    AssertLockHeld(cs_main);
-    const CBlockIndex *pindexOldTip = chainActive.Tip();
-    const CBlockIndex *pindexFork = chainActive.FindFork(pindexMostWork);
-
-    // - On ChainDB initialization, pindexOldTip will be null, so there are no removable blocks.
-    // - If pindexMostWork is in a chain that doesn't have the same genesis block as our chain,
-    //   then pindexFork will be null, and we would need to remove the entire chain including
-    //   our genesis block. In practice this (probably) won't happen because of checks elsewhere.
-    auto reorgLength = pindexOldTip ? pindexOldTip->nHeight - (pindexFork ? pindexFork->nHeight : -1) : 0;
-    static_assert(MAX_REORG_LENGTH > 0, "We must be able to reorg some distance");
-    if (reorgLength > MAX_REORG_LENGTH) {
-        auto msg = strprintf(_(
-            "A block chain reorganization has been detected that would roll back %d blocks! "
-            "This is larger than the maximum of %d blocks, and so the node is shutting down for your safety."
-            ), reorgLength, MAX_REORG_LENGTH) + "\n\n" +
-            _("Reorganization details") + ":\n" +
-            "- " + strprintf(_("Current tip: %s, height %d, work %s"),
-                pindexOldTip->phashBlock->GetHex(), pindexOldTip->nHeight, pindexOldTip->nChainWork.GetHex()) + "\n" +
-            "- " + strprintf(_("New tip:     %s, height %d, work %s"),
-                pindexMostWork->phashBlock->GetHex(), pindexMostWork->nHeight, pindexMostWork->nChainWork.GetHex()) + "\n" +
-            "- " + strprintf(_("Fork point:  %s, height %d"),
-                pindexFork->phashBlock->GetHex(), pindexFork->nHeight) + "\n\n" +
-            _("Please help, human!");
-        LogError("main", "*** %s\n", msg);
-        uiInterface.ThreadSafeMessageBox(msg, "", CClientUIInterface::MSG_ERROR);
-        StartShutdown();
-        return false;
+    bool fQueued = true;
+    for (const auto& sigHash : deferred.vSigHashes) {
+        const CTransaction& tx = deferred.pblock->vtx[sigHash.first];
+        if (tx.GetSaplingBundle().IsPresent() &&
+            !tx.GetSaplingBundle().QueueAuthValidation(saplingAuth, sigHash.second))
+        {
+            fQueued = false;
+        }
+        if (tx.GetOrchardBundle().IsPresent()) {
+            tx.GetOrchardBundle().QueueAuthValidation(orchardAuth, sigHash.second);
+        }
     }
+    return fQueued;
+}
 
-    // Disconnect active blocks which are no longer in the best chain.
-    bool fBlocksDisconnected = false;
-    while (chainActive.Tip() && chainActive.Tip() != pindexFork) {
-        if (!DisconnectTip(state, chainparams))
-            return false;
-        fBlocksDisconnected = true;
+/**
+ * Finish validating a block whose shielded authorizations were deferred, now
+ * that they have passed.
+ */
+static void DeferredBlockValidated(const CChainParams& chainparams, const CShieldedAuthBatch::Block& deferred)
+{
+    deferred.pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
+    setDirtyBlockIndex.insert(deferred.pindex);
+    GetMainSignals().BlockChecked(*deferred.pblock, CValidationState());
+    BlockSourceValidated(chainparams, deferred.pindex);
+}
+
+/**
+ * Validate the Sapling and Orchard authorizations that were deferred while
+ * connecting the blocks in batch, then reset it. The blocks that pass are
+ * marked as having valid scripts, and listeners are told they were checked.
+ *
+ * If the batch is invalid, the blocks are bisected to find the first block
+ * containing an invalid bundle. That block is marked invalid and it and its
+ * descendants are disconnected, and stateInvalid is set to the reason it is
+ * invalid. The chain state is not written to disk until all of this is done,
+ * as the blocks being disconnected were never fully validated; the caller
+ * must call FlushStateToDisk afterwards.
+ */
+static bool ValidateShieldedAuthBatch(
+    CValidationState& state,
+    const CChainParams& chainparams,
+    CShieldedAuthBatch& batch,
+    CValidationState& stateInvalid)
+{
+    AssertLockHeld(cs_main);
+
+    std::vector<CShieldedAuthBatch::Block> vBlocks;
+    vBlocks.swap(batch.vBlocks);
+    bool fSaplingValid = batch.saplingAuth.value()->validate();
+    bool fOrchardValid = batch.orchardAuth.value()->validate();
+    batch = CShieldedAuthBatch();
+    if (vBlocks.empty()) {
+        return true;
+    }
+    if (fSaplingValid && fOrchardValid) {
+        for (const auto& deferred : vBlocks) {
+            DeferredBlockValidated(chainparams, deferred);
+        }
+        return true;
+    }
+
+    LogPrintf("%s: shielded authorizations of blocks %d to %d are invalid, searching for the invalid block\n",
+        __func__, vBlocks.front().pindex->nHeight, vBlocks.back().pindex->nHeight);
+
+    // Find the first block whose bundles are invalid by bisection. The
+    // invariant is that the blocks before vBlocks[nFirst] are valid, and that
+    // vBlocks[nLast] or a block before it is invalid, unless the failure
+    // cannot be reproduced (which is checked below).
+    size_t nFirst = 0;
+    size_t nLast = vBlocks.size() - 1;
+    while (true) {
+        size_t nMid = nFirst + (nLast - nFirst) / 2;
+        auto saplingAuth = sapling::init_batch_validator(false);
+        auto orchardAuth = orchard::init_batch_validator(false);
+        bool fQueued = true;
+        for (size_t i = nFirst; i <= nMid && fQueued; i++) {
+            fQueued = QueueShieldedAuth(vBlocks[i], *saplingAuth, *orchardAuth);
+        }
+        fSaplingValid = fQueued && saplingAuth->validate();
+        fOrchardValid = fQueued && orchardAuth->validate();
+        bool fValid = fSaplingValid && fOrchardValid;
+        if (nFirst == nLast) {
+            if (fValid) {
+                LogPrintf("%s: could not find an invalid block; continuing\n", __func__);
+                for (const auto& deferred : vBlocks) {
+                    DeferredBlockValidated(chainparams, deferred);
+                }
+                return true;
+            }
+            break;
+        }
+        if (fValid) {
+            nFirst = nMid + 1;
+        } else {
+            nLast = nMid;
+        }
+    }
+
+    for (size_t i = 0; i < nFirst; i++) {
+        DeferredBlockValidated(chainparams, vBlocks[i]);
+    }
+
+    const CShieldedAuthBatch::Block& invalid = vBlocks[nFirst];
+    if (!fSaplingValid) {
+        stateInvalid.DoS(100,
+            error("%s: a Sapling bundle within block %s is invalid", __func__, invalid.pindex->GetBlockHash().ToString()),
+            REJECT_INVALID, "bad-sapling-bundle-authorization");
+    } else {
+        stateInvalid.DoS(100,
+            error("%s: an Orchard bundle within block %s is invalid", __func__, invalid.pindex->GetBlockHash().ToString()),
+            REJECT_INVALID, "bad-orchard-bundle-authorization");
+    }
+    GetMainSignals().BlockChecked(*invalid.pblock, stateInvalid);
+    InvalidBlockFound(invalid.pindex, stateInvalid, chainparams);
+
+    // Disconnect the invalid block and its descendants, as InvalidateBlock does.
+    while (chainActive.Contains(invalid.pindex)) {
+        CBlockIndex *pindexWalk = chainActive.Tip();
+        if (pindexWalk != invalid.pindex) {
+            pindexWalk->nStatus |= BLOCK_FAILED_CHILD;
+            setDirtyBlockIndex.insert(pindexWalk);
+            setBlockIndexCandidates.erase(pindexWalk);
+        }
+        if (!DisconnectTip(state, chainparams, false, false))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Try to make some progress towards making pindexMostWork the active block.
+ * pblock is either NULL or a pointer to a CBlock corresponding to pindexMostWork.
+ */
+static bool ActivateBestChainStep(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexMostWork, const CBlock* pblock, bool& fInvalidFound)
+{
+    AssertLockHeld(cs_main);
+    const CBlockIndex *pindexOldTip = chainActive.Tip();
+    const CBlockIndex *pindexFork = chainActive.FindFork(pindexMostWork);
+
+    // - On ChainDB initialization, pindexOldTip will be null, so there are no removable blocks.
+    // - If pindexMostWork is in a chain that doesn't have the same genesis block as our chain,
+    //   then pindexFork will be null, and we would need to remove the entire chain including
+    //   our genesis block. In practice this (probably) won't happen because of checks elsewhere.
+    auto reorgLength = pindexOldTip ? pindexOldTip->nHeight - (pindexFork ? pindexFork->nHeight : -1) : 0;
+    static_assert(MAX_REORG_LENGTH > 0, "We must be able to reorg some distance");
+    if (reorgLength > MAX_REORG_LENGTH) {
+        auto msg = strprintf(_(
+            "A block chain reorganization has been detected that would roll back %d blocks! "
+            "This is larger than the maximum of %d blocks, and so the node is shutting down for your safety."
+            ), reorgLength, MAX_REORG_LENGTH) + "\n\n" +
+            _("Reorganization details") + ":\n" +
+            "- " + strprintf(_("Current tip: %s, height %d, work %s"),
+                pindexOldTip->phashBlock->GetHex(), pindexOldTip->nHeight, pindexOldTip->nChainWork.GetHex()) + "\n" +
+            "- " + strprintf(_("New tip:     %s, height %d, work %s"),
+                pindexMostWork->phashBlock->GetHex(), pindexMostWork->nHeight, pindexMostWork->nChainWork.GetHex()) + "\n" +
+            "- " + strprintf(_("Fork point:  %s, height %d"),
+                pindexFork->phashBlock->GetHex(), pindexFork->nHeight) + "\n\n" +
+            _("Please help, human!");
+        LogError("main", "*** %s\n", msg);
+        uiInterface.ThreadSafeMessageBox(msg, "", CClientUIInterface::MSG_ERROR);
+        StartShutdown();
+        return false;
+    }
+
+    // Disconnect active blocks which are no longer in the best chain.
+    bool fBlocksDisconnected = false;
+    while (chainActive.Tip() && chainActive.Tip() != pindexFork) {
+        if (!DisconnectTip(state, chainparams))
+            return false;
+        fBlocksDisconnected = true;
+    }
+
+    // During initial block download, the Sapling and Orchard authorizations
+    // of up to nShieldedBatchWindow consecutive blocks are validated in a
+    // single batch, and we keep connecting blocks until the batch is full
+    // instead of releasing the lock after each block. The batch is validated
+    // early if connecting its blocks takes longer than
+    // MAX_SHIELDED_BATCH_MICROS, to bound how long cs_main is held.
+    std::optional<CShieldedAuthBatch> shieldedBatch;
+    int nBatchedBlocks = 0;
+    int64_t nBatchStart = GetTimeMicros();
+    if (nShieldedBatchWindow > 1 && IsInitialBlockDownload(chainparams.GetConsensus())) {
+        shieldedBatch.emplace();
     }
 
     // Build list of new blocks to connect.
@@ -4325,20 +5147,31 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
         // Connect new blocks.
         for (CBlockIndex *pindexConnect : reverse_iterate(vpindexToConnect)) {
             int64_t nTime1 = GetTimeMicros();
-            const CBlock* pconnectBlock;
-            CBlock block;
+            std::shared_ptr<const CBlock> pconnectBlock;
+            if (nBlockPrefetchDepth > 0) {
+                // Start loading the blocks that follow this one, so that they
+                // are ready by the time we get to connect them. The block we
+                // were given (if any) doesn't need to be loaded.
+                const CBlockIndex* pindexLast = pblock ? pindexMostWork->pprev : pindexMostWork;
+                if (pindexLast && pindexLast->nHeight >= pindexConnect->nHeight) {
+                    blockPrefetcher.Prefetch(chainparams, pindexLast, pindexConnect->nHeight, nBlockPrefetchDepth);
+                }
+            }
             if (pblock && pindexConnect == pindexMostWork) {
-                pconnectBlock = pblock;
-            } else {
+                // The caller owns pblock. It may be kept by the shielded
+                // batch, which is always validated before we return.
+                pconnectBlock = std::shared_ptr<const CBlock>(std::shared_ptr<const CBlock>(), pblock);
+            } else if (!(pconnectBlock = blockPrefetcher.Take(pindexConnect))) {
                 // read the block to be connected from disk
-                if (!ReadBlockFromDisk(block, pindexConnect, chainparams.GetConsensus()))
+                auto pdiskBlock = std::make_shared<CBlock>();
+                if (!ReadBlockFromDisk(*pdiskBlock, pindexConnect, chainparams.GetConsensus()))
                     return AbortNode(state, "Failed to read block");
-                pconnectBlock = &block;
+                pconnectBlock = pdiskBlock;
             }
             int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
             LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
 
-            if (!ConnectTip(state, chainparams, pindexConnect, pconnectBlock)) {
+            if (!ConnectTip(state, chainparams, pindexConnect, pconnectBlock, shieldedBatch ? &shieldedBatch.value() : nullptr)) {
                 if (state.IsInvalid()) {
                     // The block violates a consensus rule.
                     if (!state.CorruptionPossible())
@@ -4349,6 +5182,17 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
                     break;
                 } else {
                     // A system error occurred (disk space, database error, ...).
+                    // Still check the blocks that were connected before it.
+                    if (shieldedBatch) {
+                        CValidationState stateBatch;
+                        CValidationState stateBatchInvalid;
+                        if (!ValidateShieldedAuthBatch(stateBatch, chainparams, *shieldedBatch, stateBatchInvalid))
+                            LogPrintf("%s: failed to validate shielded authorization batch: %s\n",
+                                __func__, FormatStateMessage(stateBatch));
+                        if (stateBatchInvalid.IsInvalid())
+                            LogPrintf("%s: shielded authorization batch is invalid: %s\n",
+                                __func__, FormatStateMessage(stateBatchInvalid));
+                    }
                     return false;
                 }
             } else {
@@ -4357,6 +5201,27 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
                 MetricsHistogram("zcash.chain.verified.block.seconds", (nTime3 - nTime1) * 0.000001);
 
                 PruneBlockIndexCandidates();
+                if (shieldedBatch) {
+                    if (++nBatchedBlocks < nShieldedBatchWindow &&
+                        GetTimeMicros() - nBatchStart < MAX_SHIELDED_BATCH_MICROS) {
+                        continue;
+                    }
+                    nBatchedBlocks = 0;
+                    nBatchStart = GetTimeMicros();
+                    CValidationState stateBatchInvalid;
+                    if (!ValidateShieldedAuthBatch(state, chainparams, *shieldedBatch, stateBatchInvalid))
+                        return false;
+                    if (!FlushStateToDisk(chainparams, state, FLUSH_STATE_IF_NEEDED))
+                        return false;
+                    if (stateBatchInvalid.IsInvalid()) {
+                        // As for a block that fails in ConnectTip, the peer
+                        // that sent it was dealt with by InvalidBlockFound.
+                        LogPrintf("%s: %s\n", __func__, FormatStateMessage(stateBatchInvalid));
+                        fInvalidFound = true;
+                        fContinue = false;
+                        break;
+                    }
+                }
                 if (!pindexOldTip || chainActive.Tip()->nChainWork > pindexOldTip->nChainWork) {
                     // We're in a better position than we were. Return temporarily to release the lock.
                     fContinue = false;
@@ -4366,6 +5231,20 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
         }
     }
 
+    // Validate the shielded authorizations of any blocks that were connected
+    // since the batch was last validated.
+    if (shieldedBatch) {
+        CValidationState stateBatchInvalid;
+        if (!ValidateShieldedAuthBatch(state, chainparams, *shieldedBatch, stateBatchInvalid))
+            return false;
+        if (!FlushStateToDisk(chainparams, state, FLUSH_STATE_IF_NEEDED))
+            return false;
+        if (stateBatchInvalid.IsInvalid()) {
+            LogPrintf("%s: %s\n", __func__, FormatStateMessage(stateBatchInvalid));
+            fInvalidFound = true;
+        }
+    }
+
     if (fBlocksDisconnected) {
         mempool.removeForReorg(pcoinsTip, chainActive.Tip()->nHeight + 1, STANDARD_LOCKTIME_VERIFY_FLAGS);
     }
@@ -4449,6 +5328,12 @@ bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams,
             pindexNewTip = chainActive.Tip();
             fInitialDownload = IsInitialBlockDownload(chainparams.GetConsensus());
             nNewHeight = chainActive.Height();
+
+            if (!fInitialDownload && pblock && pblock->GetHash() == pindexNewTip->GetBlockHash()) {
+                pMostRecentBlock = std::make_shared<const CBlock>(*pblock);
+                pMostRecentCompactBlock = std::make_shared<const CBlockHeaderAndShortTxIDs>(*pblock);
+                pMostRecentCompactBlockMsg = CSharedMessage::Make("cmpctblock", *pMostRecentCompactBlock);
+            }
         }
         // When we reach this point, we switched to a new tip (stored in pindexNewTip).
 
@@ -4939,6 +5824,37 @@ bool CheckBlockHeader(
     return true;
 }
 
+size_t CheckHeadersProofOfWork(const std::vector<CBlockHeader>& headers, size_t nStart, const Consensus::Params& params)
+{
+    std::vector<char> vValid(headers.size(), false);
+    auto check = [&](size_t i) {
+        vValid[i] = CheckEquihashSolution(&headers[i], params) &&
+                    CheckProofOfWork(headers[i].GetHash(), headers[i].nBits, params);
+    };
+
+    if (nScriptCheckThreads) {
+        std::vector<CPrecheck> vChecks;
+        vChecks.reserve(headers.size());
+        for (size_t i = nStart; i < headers.size(); i++) {
+            vChecks.emplace_back([&check, i]() { check(i); });
+        }
+        CCheckQueueControl<CPrecheck> control(&precheckqueue);
+        control.Add(vChecks);
+        control.Wait();
+    } else {
+        for (size_t i = nStart; i < headers.size(); i++) {
+            check(i);
+            if (!vValid[i])
+                break;
+        }
+    }
+
+    size_t nValid = nStart;
+    while (nValid < headers.size() && vValid[nValid])
+        nValid++;
+    return nValid - nStart;
+}
+
 bool CheckBlock(const CBlock& block,
                 CValidationState& state,
                 const CChainParams& chainparams,
@@ -5165,7 +6081,12 @@ bool ContextualCheckBlock(
     return true;
 }
 
-static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL)
+/**
+ * Add a block header to the block index, if it is valid. If fCheckPOW is
+ * false, the caller has already checked its Equihash solution and proof of
+ * work.
+ */
+static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL, bool fCheckPOW=true)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
@@ -5182,7 +6103,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
         return true;
     }
 
-    if (!CheckBlockHeader(block, state, chainparams))
+    if (!CheckBlockHeader(block, state, chainparams, fCheckPOW))
         return false;
 
     // Get prev block index
@@ -5544,6 +6465,64 @@ CBlockIndex * InsertBlockIndex(const uint256& hash)
     return pindexNew;
 }
 
+/**
+ * Set nChainTx and the chain supply and value pool totals of `pindex` from
+ * its per-block values and the totals of its parent, which must already
+ * have nChainTx set.
+ */
+static void SetChainTotals(CBlockIndex* pindex)
+{
+    if (pindex->pprev == nullptr) {
+        pindex->nChainTx = pindex->nTx;
+        pindex->nChainTotalSupply = pindex->nChainSupplyDelta;
+        pindex->nChainTransparentValue = pindex->nTransparentValue;
+        pindex->nChainSproutValue = pindex->nSproutValue;
+        pindex->nChainSaplingValue = pindex->nSaplingValue;
+        pindex->nChainOrchardValue = pindex->nOrchardValue;
+        pindex->nChainLockboxValue = pindex->nLockboxValue;
+        return;
+    }
+
+    assert(pindex->pprev->nChainTx);
+    pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
+
+    if (pindex->pprev->nChainTotalSupply && pindex->nChainSupplyDelta) {
+        pindex->nChainTotalSupply = *pindex->pprev->nChainTotalSupply + *pindex->nChainSupplyDelta;
+    } else {
+        pindex->nChainTotalSupply = std::nullopt;
+    }
+
+    if (pindex->pprev->nChainTransparentValue && pindex->nTransparentValue) {
+        pindex->nChainTransparentValue = *pindex->pprev->nChainTransparentValue + *pindex->nTransparentValue;
+    } else {
+        pindex->nChainTransparentValue = std::nullopt;
+    }
+
+    if (pindex->pprev->nChainSproutValue && pindex->nSproutValue) {
+        pindex->nChainSproutValue = *pindex->pprev->nChainSproutValue + *pindex->nSproutValue;
+    } else {
+        pindex->nChainSproutValue = std::nullopt;
+    }
+
+    if (pindex->pprev->nChainSaplingValue) {
+        pindex->nChainSaplingValue = *pindex->pprev->nChainSaplingValue + pindex->nSaplingValue;
+    } else {
+        pindex->nChainSaplingValue = std::nullopt;
+    }
+
+    if (pindex->pprev->nChainOrchardValue) {
+        pindex->nChainOrchardValue = *pindex->pprev->nChainOrchardValue + pindex->nOrchardValue;
+    } else {
+        pindex->nChainOrchardValue = std::nullopt;
+    }
+
+    if (pindex->pprev->nChainLockboxValue) {
+        pindex->nChainLockboxValue = *pindex->pprev->nChainLockboxValue + pindex->nLockboxValue;
+    } else {
+        pindex->nChainLockboxValue = std::nullopt;
+    }
+}
+
 bool static LoadBlockIndexDB(const CChainParams& chainparams)
 {
     if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex, chainparams))
@@ -5565,63 +6544,17 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
         // We can link the chain of blocks for which we've received transactions at some point.
         // Pruned nodes may have deleted the block.
         if (pindex->nTx > 0) {
-            if (pindex->pprev) {
-                if (pindex->pprev->nChainTx) {
-                    pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
-
-                    if (pindex->pprev->nChainTotalSupply && pindex->nChainSupplyDelta) {
-                        pindex->nChainTotalSupply = *pindex->pprev->nChainTotalSupply + *pindex->nChainSupplyDelta;
-                    } else {
-                        pindex->nChainTotalSupply = std::nullopt;
-                    }
-
-                    if (pindex->pprev->nChainTransparentValue && pindex->nTransparentValue) {
-                        pindex->nChainTransparentValue = *pindex->pprev->nChainTransparentValue + *pindex->nTransparentValue;
-                    } else {
-                        pindex->nChainTransparentValue = std::nullopt;
-                    }
-
-                    if (pindex->pprev->nChainSproutValue && pindex->nSproutValue) {
-                        pindex->nChainSproutValue = *pindex->pprev->nChainSproutValue + *pindex->nSproutValue;
-                    } else {
-                        pindex->nChainSproutValue = std::nullopt;
-                    }
-
-                    if (pindex->pprev->nChainSaplingValue) {
-                        pindex->nChainSaplingValue = *pindex->pprev->nChainSaplingValue + pindex->nSaplingValue;
-                    } else {
-                        pindex->nChainSaplingValue = std::nullopt;
-                    }
-
-                    if (pindex->pprev->nChainOrchardValue) {
-                        pindex->nChainOrchardValue = *pindex->pprev->nChainOrchardValue + pindex->nOrchardValue;
-                    } else {
-                        pindex->nChainOrchardValue = std::nullopt;
-                    }
-
-                    if (pindex->pprev->nChainLockboxValue) {
-                        pindex->nChainLockboxValue = *pindex->pprev->nChainLockboxValue + pindex->nLockboxValue;
-                    } else {
-                        pindex->nChainLockboxValue = std::nullopt;
-                    }
-                } else {
-                    pindex->nChainTx = 0;
-                    pindex->nChainTotalSupply = std::nullopt;
-                    pindex->nChainTransparentValue = std::nullopt;
-                    pindex->nChainSproutValue = std::nullopt;
-                    pindex->nChainSaplingValue = std::nullopt;
-                    pindex->nChainOrchardValue = std::nullopt;
-                    pindex->nChainLockboxValue = std::nullopt;
-                    mapBlocksUnlinked.insert(std::make_pair(pindex->pprev, pindex));
-                }
+            if (pindex->pprev && !pindex->pprev->nChainTx) {
+                pindex->nChainTx = 0;
+                pindex->nChainTotalSupply = std::nullopt;
+                pindex->nChainTransparentValue = std::nullopt;
+                pindex->nChainSproutValue = std::nullopt;
+                pindex->nChainSaplingValue = std::nullopt;
+                pindex->nChainOrchardValue = std::nullopt;
+                pindex->nChainLockboxValue = std::nullopt;
+                mapBlocksUnlinked.insert(std::make_pair(pindex->pprev, pindex));
             } else {
-                pindex->nChainTx = pindex->nTx;
-                pindex->nChainTotalSupply = pindex->nChainSupplyDelta;
-                pindex->nChainTransparentValue = pindex->nTransparentValue;
-                pindex->nChainSproutValue = pindex->nSproutValue;
-                pindex->nChainSaplingValue = pindex->nSaplingValue;
-                pindex->nChainOrchardValue = pindex->nOrchardValue;
-                pindex->nChainLockboxValue = pindex->nLockboxValue;
+                SetChainTotals(pindex);
             }
 
             // Fall back to hardcoded Sprout value pool balance
@@ -5699,6 +6632,18 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
     if (fHavePruned)
         LogPrintf("LoadBlockIndexDB(): Block files have previously been pruned\n");
 
+    // Check whether the chain state was loaded from a snapshot. If so, we
+    // lack the blocks before the snapshot, just as if they had been pruned.
+    bool fLoadingSnapshot = false;
+    pblocktree->ReadFlag("loadingsnapshot", fLoadingSnapshot);
+    if (fLoadingSnapshot)
+        return error("LoadBlockIndexDB(): Loading a chain state snapshot was interrupted");
+    pblocktree->ReadFlag("snapshotchainstate", fSnapshotChainState);
+    if (fSnapshotChainState) {
+        LogPrintf("LoadBlockIndexDB(): Chain state was loaded from a snapshot\n");
+        fHavePruned = true;
+    }
+
     // Check whether we need to continue reindexing
     bool fReindexing = false;
     pblocktree->ReadReindexing(fReindexing);
@@ -5759,6 +6704,507 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
     return true;
 }
 
+bool DumpSnapshot(
+    const CChainParams& chainparams,
+    const fs::path& path,
+    CSnapshotMetadata& metadata,
+    uint256& hashSnapshot,
+    uint64_t& nRecords,
+    std::string& strError)
+{
+    std::vector<CSnapshotBlockInfo> vBlockInfo;
+    boost::scoped_ptr<CDBIterator> pcursor;
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        if (!FlushStateToDisk(chainparams, state, FLUSH_STATE_ALWAYS)) {
+            strError = "Failed to flush the chain state: " + FormatStateMessage(state);
+            return false;
+        }
+
+        CBlockIndex* pindexBase = chainActive.Tip();
+        if (pindexBase == nullptr || pcoinsdbview->GetBestBlock() != pindexBase->GetBlockHash()) {
+            strError = "The coins database does not match the chain tip";
+            return false;
+        }
+
+        metadata = CSnapshotMetadata();
+        metadata.vMessageStart.assign(
+            chainparams.MessageStart(),
+            chainparams.MessageStart() + CMessageHeader::MESSAGE_START_SIZE);
+        metadata.hashBase = pindexBase->GetBlockHash();
+        metadata.nHeight = pindexBase->nHeight;
+        metadata.hashSproutAnchor = pindexBase->hashSproutAnchor;
+        metadata.hashFinalSproutRoot = pindexBase->hashFinalSproutRoot;
+        metadata.hashFinalSaplingRoot = pindexBase->hashFinalSaplingRoot;
+        metadata.hashFinalOrchardRoot = pindexBase->hashFinalOrchardRoot;
+        metadata.hashAuthDataRoot = pindexBase->hashAuthDataRoot;
+        metadata.hashChainHistoryRoot = pindexBase->hashChainHistoryRoot;
+
+        vBlockInfo.reserve(pindexBase->nHeight + 1);
+        for (int nHeight = 0; nHeight <= pindexBase->nHeight; nHeight++) {
+            vBlockInfo.emplace_back(*chainActive[nHeight]);
+        }
+
+        // The cursor reads from a snapshot of the database as of now, so the
+        // records can be written out after releasing cs_main.
+        pcursor.reset(pcoinsdbview->RawCursor());
+    }
+
+    fs::path pathTmp = path;
+    pathTmp += ".incomplete";
+    CAutoFile file(fsbridge::fopen(pathTmp, "wb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        strError = strprintf("Unable to open %s for writing", pathTmp.string());
+        return false;
+    }
+
+    LogPrintf("%s: Writing chain state snapshot at height %d (%s) to %s\n", __func__,
+        metadata.nHeight, metadata.hashBase.GetHex(), path.string());
+    try {
+        CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+        file << metadata;
+        hasher << metadata;
+        for (const CSnapshotBlockInfo& info : vBlockInfo) {
+            file << info;
+            hasher << info;
+        }
+
+        nRecords = 0;
+        std::vector<unsigned char> key;
+        std::vector<unsigned char> value;
+        for (; pcursor->Valid(); pcursor->Next()) {
+            pcursor->GetRawKey(key);
+            pcursor->GetRawValue(value);
+            file << key << value;
+            hasher << key << value;
+            nRecords++;
+        }
+        key.clear();
+        file << key;
+        hasher << key;
+
+        hashSnapshot = hasher.GetHash();
+        file << hashSnapshot;
+    } catch (const std::exception& e) {
+        strError = strprintf("Failed to write %s: %s", pathTmp.string(), e.what());
+        return false;
+    }
+    FileCommit(file.Get());
+    file.fclose();
+
+    if (!RenameOver(pathTmp, path)) {
+        strError = strprintf("Unable to rename %s to %s", pathTmp.string(), path.string());
+        return false;
+    }
+    LogPrintf("%s: Wrote %u records, snapshot hash %s\n", __func__, nRecords, hashSnapshot.GetHex());
+    return true;
+}
+
+static bool CheckSnapshotMetadata(
+    const CChainParams& chainparams,
+    const CSnapshotMetadata& metadata,
+    std::string& strError)
+{
+    if (metadata.nVersion != SNAPSHOT_VERSION) {
+        strError = strprintf("Unsupported snapshot version %d", metadata.nVersion);
+        return false;
+    }
+    if (metadata.vMessageStart.size() != CMessageHeader::MESSAGE_START_SIZE ||
+        memcmp(metadata.vMessageStart.data(), chainparams.MessageStart(), CMessageHeader::MESSAGE_START_SIZE) != 0)
+    {
+        strError = "The snapshot is for a different network";
+        return false;
+    }
+    if (metadata.nHeight < 0) {
+        strError = "The snapshot has an invalid base height";
+        return false;
+    }
+    // The blocks before the snapshot are never validated, so only snapshots
+    // whose hash is part of the chain parameters can be loaded.
+    if (chainparams.SnapshotHashes().count(metadata.hashBase) == 0) {
+        strError = strprintf("No snapshot hash is known for the base block %s", metadata.hashBase.GetHex());
+        return false;
+    }
+    return true;
+}
+
+bool ReadSnapshotMetadata(
+    const CChainParams& chainparams,
+    const fs::path& path,
+    CSnapshotMetadata& metadata,
+    std::string& strError)
+{
+    CAutoFile file(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        strError = strprintf("Unable to open snapshot file %s", path.string());
+        return false;
+    }
+    try {
+        file >> metadata;
+    } catch (const std::exception& e) {
+        strError = strprintf("Unable to read snapshot file %s: %s", path.string(), e.what());
+        return false;
+    }
+    return CheckSnapshotMetadata(chainparams, metadata, strError);
+}
+
+bool LoadSnapshot(
+    const CChainParams& chainparams,
+    const fs::path& path,
+    CSnapshotMetadata& metadata,
+    uint64_t& nRecords,
+    std::string& strError)
+{
+    static const size_t nBatchRecords = 100000;
+
+    if (fTxIndex || fAddressIndex || fSpentIndex || fTimestampIndex) {
+        strError = "Chain state snapshots cannot be loaded with -txindex, -insightexplorer or -lightwalletd";
+        return false;
+    }
+
+    // The snapshot is read once, hashing it as it is applied, so that what is
+    // written is exactly what was hashed. Its hash can only be checked once it
+    // has been read in full, so a snapshot that doesn't match leaves the chain
+    // state unusable, as when loading is interrupted.
+    CAutoFile file(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        strError = strprintf("Unable to open snapshot file %s", path.string());
+        return false;
+    }
+    CHashVerifier<CAutoFile> verifier(&file);
+    std::vector<CSnapshotBlockInfo> vBlockInfo;
+    try {
+        verifier >> metadata;
+        if (!CheckSnapshotMetadata(chainparams, metadata, strError)) {
+            return false;
+        }
+        vBlockInfo.resize(metadata.nHeight + 1);
+        for (CSnapshotBlockInfo& info : vBlockInfo) {
+            verifier >> info;
+        }
+    } catch (const std::exception& e) {
+        strError = strprintf("Unable to read snapshot file %s: %s", path.string(), e.what());
+        return false;
+    }
+
+    LOCK(cs_main);
+
+    BlockMap::iterator mi = mapBlockIndex.find(metadata.hashBase);
+    if (mi == mapBlockIndex.end()) {
+        strError = strprintf("The header of the snapshot base block %s is not known yet", metadata.hashBase.GetHex());
+        return false;
+    }
+    CBlockIndex* pindexBase = mi->second;
+    if (pindexBase->nHeight != metadata.nHeight) {
+        strError = "The snapshot base height does not match the block index";
+        return false;
+    }
+    if (pindexBase->nStatus & BLOCK_FAILED_MASK) {
+        strError = "The snapshot base block is marked invalid";
+        return false;
+    }
+    if (pindexBestHeader->GetAncestor(pindexBase->nHeight) != pindexBase) {
+        strError = "The snapshot base block is not on the best header chain";
+        return false;
+    }
+    if (chainActive.Height() >= pindexBase->nHeight) {
+        strError = strprintf("The active chain is already at height %d, at or past the snapshot", chainActive.Height());
+        return false;
+    }
+
+    CValidationState state;
+    if (!FlushStateToDisk(chainparams, state, FLUSH_STATE_ALWAYS)) {
+        strError = "Failed to flush the chain state: " + FormatStateMessage(state);
+        return false;
+    }
+    mempool.clear();
+
+    // From here on, a failure leaves the chain state unusable. The flag is
+    // checked by LoadBlockIndexDB so that an interrupted load is noticed.
+    LogPrintf("%s: Loading chain state snapshot %s at height %d (%s)\n", __func__,
+        path.string(), metadata.nHeight, metadata.hashBase.GetHex());
+    pblocktree->WriteFlag("loadingsnapshot", true);
+    if (!pcoinsdbview->EraseAll()) {
+        return AbortNode(state, "Failed to erase the coins database");
+    }
+    try {
+        nRecords = 0;
+        std::vector<std::pair<std::vector<unsigned char>, std::vector<unsigned char>>> vRecords;
+        vRecords.reserve(nBatchRecords);
+        while (true) {
+            std::pair<std::vector<unsigned char>, std::vector<unsigned char>> record;
+            verifier >> record.first;
+            if (!record.first.empty()) {
+                verifier >> record.second;
+                vRecords.push_back(std::move(record));
+                nRecords++;
+            }
+            if (vRecords.size() == nBatchRecords || (record.first.empty() && !vRecords.empty())) {
+                if (!pcoinsdbview->WriteRawRecords(vRecords)) {
+                    return AbortNode(state, "Failed to write to the coins database");
+                }
+                vRecords.clear();
+            }
+            if (record.first.empty()) {
+                break;
+            }
+        }
+
+        uint256 hashSnapshot = verifier.GetHash();
+        uint256 hashFile;
+        file >> hashFile;
+        if (hashFile != hashSnapshot) {
+            pcoinsdbview->EraseAll();
+            return AbortNode(state, "The snapshot file is corrupt; restart with -reindex");
+        }
+        const uint256& hashExpected = chainparams.SnapshotHashes().at(metadata.hashBase);
+        if (hashSnapshot != hashExpected) {
+            pcoinsdbview->EraseAll();
+            return AbortNode(state, strprintf("The snapshot hash %s does not match the expected hash %s; restart with -reindex",
+                hashSnapshot.GetHex(), hashExpected.GetHex()));
+        }
+    } catch (const std::exception& e) {
+        return AbortNode(state, strprintf("Unable to read snapshot file %s: %s", path.string(), e.what()));
+    }
+
+    pcoinsTip->ResetBestState();
+    if (pcoinsTip->GetBestBlock() != pindexBase->GetBlockHash()) {
+        return AbortNode(state, "The snapshot coins database does not match its base block");
+    }
+    pcoinsdbview->LoadNullifierFilters(nCoinCacheUsage / 100 * NULLIFIER_FILTER_MAX_CACHE_PERCENT);
+
+    // Fill in the block index entries of the base block and its ancestors,
+    // which up to now only had headers (or were unlinked).
+    const Consensus::Params& consensusParams = chainparams.GetConsensus();
+    for (int nHeight = 0; nHeight <= pindexBase->nHeight; nHeight++) {
+        CBlockIndex* pindex = pindexBase->GetAncestor(nHeight);
+        vBlockInfo[nHeight].ApplyTo(*pindex);
+        if (pindex->pprev == nullptr) {
+            pindex->nCachedBranchId = SPROUT_BRANCH_ID;
+        } else if (IsActivationHeightForAnyUpgrade(pindex->nHeight, consensusParams)) {
+            pindex->nStatus |= BLOCK_ACTIVATES_UPGRADE;
+            pindex->nCachedBranchId = CurrentEpochBranchId(pindex->nHeight, consensusParams);
+        } else {
+            pindex->nCachedBranchId = pindex->pprev->nCachedBranchId;
+        }
+        pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
+        SetChainTotals(pindex);
+        FallbackSproutValuePoolBalance(pindex, chainparams);
+        setDirtyBlockIndex.insert(pindex);
+    }
+    pindexBase->hashSproutAnchor = metadata.hashSproutAnchor;
+    pindexBase->hashFinalSproutRoot = metadata.hashFinalSproutRoot;
+    pindexBase->hashFinalSaplingRoot = metadata.hashFinalSaplingRoot;
+    pindexBase->hashFinalOrchardRoot = metadata.hashFinalOrchardRoot;
+    pindexBase->hashAuthDataRoot = metadata.hashAuthDataRoot;
+    pindexBase->hashChainHistoryRoot = metadata.hashChainHistoryRoot;
+
+    // Link any blocks that were already received on top of the ancestors.
+    std::deque<CBlockIndex*> queue;
+    for (int nHeight = 0; nHeight < pindexBase->nHeight; nHeight++) {
+        CBlockIndex* pindex = pindexBase->GetAncestor(nHeight);
+        auto range = mapBlocksUnlinked.equal_range(pindex);
+        while (range.first != range.second) {
+            if (pindexBase->GetAncestor(range.first->second->nHeight) != range.first->second) {
+                queue.push_back(range.first->second);
+            }
+            range.first = mapBlocksUnlinked.erase(range.first);
+        }
+    }
+    queue.push_back(pindexBase);
+    while (!queue.empty()) {
+        CBlockIndex* pindex = queue.front();
+        queue.pop_front();
+        if (pindex != pindexBase) {
+            SetChainTotals(pindex);
+            FallbackSproutValuePoolBalance(pindex, chainparams);
+        }
+        {
+            LOCK(cs_nBlockSequenceId);
+            pindex->nSequenceId = nBlockSequenceId++;
+        }
+        setBlockIndexCandidates.insert(pindex);
+        auto range = mapBlocksUnlinked.equal_range(pindex);
+        while (range.first != range.second) {
+            queue.push_back(range.first->second);
+            range.first = mapBlocksUnlinked.erase(range.first);
+        }
+    }
+
+    UpdateTip(pindexBase, chainparams);
+    PruneBlockIndexCandidates();
+
+    // We lack the blocks before the snapshot, just as if they had been pruned.
+    fHavePruned = true;
+    fSnapshotChainState = true;
+    pblocktree->WriteFlag("snapshotchainstate", true);
+    if (!FlushStateToDisk(chainparams, state, FLUSH_STATE_ALWAYS)) {
+        return AbortNode(state, "Failed to write the block index after loading a snapshot");
+    }
+    pblocktree->WriteFlag("loadingsnapshot", false);
+
+    LogPrintf("Unsetting NODE_NETWORK after loading a chain state snapshot\n");
+    nLocalServices &= ~NODE_NETWORK;
+
+    LogPrintf("%s: Loaded %u records, new tip at height %d\n", __func__, nRecords, pindexBase->nHeight);
+    return true;
+}
+
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMicros();
+
+    std::vector<TxMempoolInfo> vInfo;
+    std::map<uint256, CAmount> mapDeltas;
+    std::vector<std::pair<uint256, int64_t>> vEvicted;
+    {
+        LOCK(mempool.cs);
+        vInfo = mempool.infoAll();
+        mapDeltas = mempool.mapDeltas;
+        vEvicted = mempool.GetRecentlyEvicted();
+    }
+
+    int64_t nMid = GetTimeMicros();
+
+    fs::path path = GetDataDir() / "mempool.dat";
+    fs::path pathTmp = GetDataDir() / "mempool.dat.new";
+    CAutoFile file(fsbridge::fopen(pathTmp, "wb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        return error("%s: Unable to open %s for writing", __func__, pathTmp.string());
+    }
+    try {
+        CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+        file << MEMPOOL_DUMP_VERSION << (uint64_t)vInfo.size();
+        hasher << MEMPOOL_DUMP_VERSION << (uint64_t)vInfo.size();
+        for (const TxMempoolInfo& info : vInfo) {
+            CAmount nFeeDelta = 0;
+            auto it = mapDeltas.find(info.tx->GetHash());
+            if (it != mapDeltas.end()) {
+                nFeeDelta = it->second;
+                mapDeltas.erase(it);
+            }
+            file << *info.tx << info.nTime << nFeeDelta;
+            hasher << *info.tx << info.nTime << nFeeDelta;
+        }
+        // Fee deltas of transactions that are not in the mempool.
+        file << mapDeltas << vEvicted;
+        hasher << mapDeltas << vEvicted;
+        file << hasher.GetHash();
+    } catch (const std::exception& e) {
+        return error("%s: Failed to write %s: %s", __func__, pathTmp.string(), e.what());
+    }
+    FileCommit(file.Get());
+    file.fclose();
+    if (!RenameOver(pathTmp, path)) {
+        return error("%s: Unable to rename %s to %s", __func__, pathTmp.string(), path.string());
+    }
+
+    int64_t nLast = GetTimeMicros();
+    LogPrintf("Dumped %u mempool transactions to disk: %.3fs to copy, %.3fs to write\n",
+        vInfo.size(), (nMid - nStart) * 0.000001, (nLast - nMid) * 0.000001);
+    return true;
+}
+
+bool LoadMempool(const CChainParams& chainparams)
+{
+    int64_t nStart = GetTimeMicros();
+
+    fs::path path = GetDataDir() / "mempool.dat";
+    CAutoFile file(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
+        return false;
+    }
+
+    // Read the whole file, and check it is intact, before accepting any of
+    // it. The checksum only detects corruption: anyone who can write to the
+    // data directory can recompute it, so the transactions are checked in
+    // full like any others.
+    uint64_t nVersion;
+    std::vector<std::tuple<std::shared_ptr<CMessagePrecheck>, int64_t, CAmount>> vTxs;
+    std::map<uint256, CAmount> mapDeltas;
+    std::vector<std::pair<uint256, int64_t>> vEvicted;
+    try {
+        CHashVerifier<CAutoFile> verifier(&file);
+        verifier >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION) {
+            return error("%s: Unsupported mempool file version %d", __func__, nVersion);
+        }
+        uint64_t nTxs;
+        verifier >> nTxs;
+        for (uint64_t i = 0; i < nTxs; i++) {
+            auto precheck = std::make_shared<CMessagePrecheck>();
+            int64_t nTime;
+            CAmount nFeeDelta;
+            verifier >> precheck->tx >> nTime >> nFeeDelta;
+            precheck->fDeserialized = true;
+            vTxs.emplace_back(std::move(precheck), nTime, nFeeDelta);
+        }
+        verifier >> mapDeltas >> vEvicted;
+        uint256 hashFile;
+        file >> hashFile;
+        if (hashFile != verifier.GetHash()) {
+            return error("%s: The mempool file %s is corrupt", __func__, path.string());
+        }
+    } catch (const std::exception& e) {
+        return error("%s: Failed to read %s: %s", __func__, path.string(), e.what());
+    }
+
+    // As for transactions relayed by peers, the transactions are checked, and
+    // their inputs verified in batches, on the precheck threads, so that
+    // under cs_main only their inputs are checked against the chain state and
+    // the mempool.
+    static const size_t nPrecheckBatch = 1000;
+    uint64_t nAccepted = 0, nFailed = 0, nAlreadyThere = 0;
+    for (size_t nBatchStart = 0; nBatchStart < vTxs.size(); nBatchStart += nPrecheckBatch) {
+        size_t nBatchEnd = std::min(vTxs.size(), nBatchStart + nPrecheckBatch);
+        std::vector<std::shared_ptr<CMessagePrecheck>> vPrechecks;
+        for (size_t i = nBatchStart; i < nBatchEnd; i++) {
+            vPrechecks.push_back(std::get<0>(vTxs[i]));
+        }
+        PrecheckTransactions(chainparams, vPrechecks);
+
+        for (size_t i = nBatchStart; i < nBatchEnd; i++) {
+            const CMessagePrecheck& precheck = *std::get<0>(vTxs[i]);
+            const CTransaction& tx = precheck.tx;
+            const CAmount nFeeDelta = std::get<2>(vTxs[i]);
+            if (nFeeDelta != 0) {
+                mempool.PrioritiseTransaction(tx.GetHash(), tx.GetHash().ToString(), nFeeDelta);
+            }
+            CValidationState state;
+            {
+                LOCK(cs_main);
+                bool fInputsVerified = precheck.fInputsVerified &&
+                    precheck.nInputsBranchId == CurrentEpochBranchId(chainActive.Height() + 1, chainparams.GetConsensus());
+                if (AcceptToMemoryPoolWithTime(chainparams, mempool, state, tx, true, NULL, std::get<1>(vTxs[i]),
+                        precheck.fTxChecked, fInputsVerified)) {
+                    nAccepted++;
+                } else if (state.GetRejectCode() == REJECT_ALREADY_KNOWN) {
+                    nAlreadyThere++;
+                } else {
+                    nFailed++;
+                }
+            }
+            if (ShutdownRequested()) {
+                return false;
+            }
+        }
+    }
+    for (const auto& delta : mapDeltas) {
+        mempool.PrioritiseTransaction(delta.first, delta.first.ToString(), delta.second);
+    }
+    for (const auto& evicted : vEvicted) {
+        mempool.AddRecentlyEvicted(evicted.first, evicted.second);
+    }
+
+    LogPrintf("Imported mempool transactions from disk in %.3fs: %u succeeded, %u failed, %u already there\n",
+        (GetTimeMicros() - nStart) * 0.000001, nAccepted, nFailed, nAlreadyThere);
+    return true;
+}
+
 CVerifyDB::CVerifyDB()
 {
     uiInterface.ShowProgress(_("Verifying blocks..."), 0);
@@ -6276,6 +7722,7 @@ void UnloadBlockIndex()
     }
     mapBlockIndex.clear();
     fHavePruned = false;
+    fSnapshotChainState = false;
 }
 
 bool LoadBlockIndex()
@@ -6671,6 +8118,39 @@ CInv static InvForTransaction(const std::shared_ptr<const CTransaction> tx)
     }
 }
 
+// Requires pto->cs_inventory.
+// Take the transactions waiting to be reconciled with a peer, by short ID,
+// leaving out the ones the peer announced to us or that left the mempool.
+static std::map<uint32_t, uint256> TakeReconciliationSet(CNode* pto)
+{
+    std::map<uint32_t, uint256> mapShortIDs;
+    for (const uint256& txid : pto->txReconciliation->setToReconcile) {
+        if (!pto->HasKnownTxId(txid) && mempool.exists(txid)) {
+            mapShortIDs[pto->txReconciliation->GetShortID(txid)] = txid;
+        }
+    }
+    pto->txReconciliation->setToReconcile.clear();
+    return mapShortIDs;
+}
+
+// Announce the transactions a peer turned out to be missing when reconciling.
+static void AnnounceReconciledTransactions(CNode* pto, const std::vector<uint256>& vTxid)
+{
+    vector<CInv> vInv;
+    for (const uint256& txid : vTxid) {
+        auto txinfo = mempool.info(txid);
+        if (!txinfo.tx || pto->HasKnownTxId(txid)) continue;
+        vInv.push_back(InvForTransaction(txinfo.tx));
+        pto->AddKnownTxId(txid);
+        if (vInv.size() == MAX_INV_SZ) {
+            pto->PushMessage("inv", vInv);
+            vInv.clear();
+        }
+    }
+    if (!vInv.empty())
+        pto->PushMessage("inv", vInv);
+}
+
 bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
     switch (inv.type)
@@ -6705,6 +8185,45 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     return true;
 }
 
+/**
+ * The "block" messages most recently sent to peers, so that a block requested
+ * by many peers (usually a new tip) is read from disk and checksummed once,
+ * never deserialized, and queued to all of them without being copied.
+ */
+class CRawBlockCache
+{
+private:
+    typedef std::shared_ptr<const CSharedMessage> RawBlock;
+    //! Most recently used first.
+    std::list<std::pair<uint256, RawBlock>> entries;
+    std::map<uint256, std::list<std::pair<uint256, RawBlock>>::iterator> index;
+
+public:
+    RawBlock Get(const CBlockIndex* pindex)
+    {
+        const uint256 hash = pindex->GetBlockHash();
+        auto it = index.find(hash);
+        if (it != index.end()) {
+            entries.splice(entries.begin(), entries, it->second);
+            return it->second->second;
+        }
+
+        std::vector<unsigned char> vBlock;
+        if (!ReadRawBlockFromDisk(vBlock, pindex->GetBlockPos(), Params().MessageStart()))
+            return nullptr;
+        auto block = std::make_shared<const CSharedMessage>("block", std::move(vBlock));
+        entries.emplace_front(hash, block);
+        index.emplace(hash, entries.begin());
+        if (entries.size() > RAW_BLOCK_CACHE_SIZE) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+        return block;
+    }
+};
+
+static CRawBlockCache rawBlockCache GUARDED_BY(cs_main);
+
 void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParams)
 {
     int currentHeight = GetHeight();
@@ -6725,7 +8244,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
@@ -6766,14 +8285,37 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                 // it's available before trying to send.
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    // Only send compact blocks of recent blocks, whose
+                    // transactions the peer is likely to have.
+                    bool fCompact = inv.type == MSG_CMPCT_BLOCK &&
+                        mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+                    if (fCompact)
+                    {
+                        if (pMostRecentCompactBlock && pMostRecentCompactBlock->header.GetHash() == inv.hash) {
+                            pfrom->PushSharedMessage(pMostRecentCompactBlockMsg);
+                        } else {
+                            CBlock block;
+                            if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
+                                assert(!"cannot load block from disk");
+                            pfrom->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+                        }
+                    }
+                    else if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK)
+                    {
+                        // Send the block as it is stored on disk. Its hash
+                        // and proof of work were checked when it was
+                        // accepted.
+                        auto blockMsg = rawBlockCache.Get(mi->second);
+                        if (!blockMsg)
+                            assert(!"cannot load block from disk");
+                        pfrom->PushSharedMessage(blockMsg);
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
+                        // Send block from disk
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
+                            assert(!"cannot load block from disk");
                         bool send = false;
                         CMerkleBlock merkleBlock;
                         {
@@ -6817,11 +8359,11 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                 // Send stream from relay memory
                 bool push = false;
                 auto mi = mapRelay.find(inv.hash);
-                if (mi != mapRelay.end() && !IsExpiringSoonTx(*mi->second, currentHeight + 1)) {
+                if (mi != mapRelay.end() && !IsExpiringSoonTx(*mi->second.tx, currentHeight + 1)) {
                     // ZIP 239: MSG_TX should be used if and only if the tx is v4 or earlier.
-                    if ((mi->second->nVersion <= 4) != (inv.type == MSG_TX)) {
+                    if ((mi->second.tx->nVersion <= 4) != (inv.type == MSG_TX)) {
                         Misbehaving(pfrom->GetId(), 100);
-                        LogPrint("net", "Wrong INV message type used for v%d tx", mi->second->nVersion);
+                        LogPrint("net", "Wrong INV message type used for v%d tx", mi->second.tx->nVersion);
                         // Break so that this inv message will be erased from the queue
                         // (otherwise the peer would repeatedly hit this case until its
                         // Misbehaving level rises above -banscore, no matter what the
@@ -6830,8 +8372,11 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                     }
                     // Ensure we only reply with a transaction if it is exactly what the
                     // peer requested from us. Otherwise we add it to vNotFound below.
-                    if (inv.hashAux == mi->second->GetAuthDigest()) {
-                        pfrom->PushMessage("tx", *mi->second);
+                    if (inv.hashAux == mi->second.tx->GetAuthDigest()) {
+                        if (!mi->second.msg) {
+                            mi->second.msg = CSharedMessage::Make("tx", *mi->second.tx);
+                        }
+                        pfrom->PushSharedMessage(mi->second.msg);
                         push = true;
                     }
                 } else if (pfrom->timeLastMempoolReq) {
@@ -6860,7 +8405,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                 }
             }
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -6938,7 +8483,7 @@ void static ProcessOrphanTx(const CChainParams& chainparams, std::set<uint256>&
     }
 }
 
-bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived, CMessagePrecheck* precheck)
 {
     LogPrint("net", "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->id);
     if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
@@ -7160,6 +8705,23 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
         if (pfrom->fNetworkNode) {
             state->fCurrentlyConnected = true;
         }
+
+        // Tell the peer to announce new blocks to us with headers.
+        pfrom->PushMessage("sendheaders");
+
+        // Tell the peer that we can receive compact blocks. We only ask some
+        // peers to announce new blocks as compact blocks, once they have
+        // given us a new tip (see MaybeSetPeerAsAnnouncingHeaderAndIDs).
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 1;
+        pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+
+        // Offer to relay transactions by reconciliation.
+        if (fTxReconciliation) {
+            LOCK(pfrom->cs_inventory);
+            pfrom->nReconciliationSalt = GetRand(std::numeric_limits<uint64_t>::max() - 1) + 1;
+            pfrom->PushMessage("sendrecon", TXRECONCILIATION_VERSION, pfrom->nReconciliationSalt);
+        }
     }
 
 
@@ -7446,6 +9008,11 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
                 break;
         }
+        // pindex can be NULL either if we sent chainActive.Tip() OR
+        // if our peer has chainActive.Tip() (and thus we are sending an empty
+        // headers message). In both cases it's safe to update
+        // pindexBestHeaderSent to be our tip.
+        State(pfrom->GetId())->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
         pfrom->PushMessage("headers", vHeaders);
     }
 
@@ -7460,8 +9027,11 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
             return true;
         }
 
-        CTransaction tx;
-        vRecv >> tx;
+        CTransaction txRecv;
+        if (!(precheck && precheck->fDeserialized))
+            vRecv >> txRecv;
+        const CTransaction& tx = precheck && precheck->fDeserialized ? precheck->tx : txRecv;
+        bool fTxChecked = precheck && precheck->fTxChecked;
 
         const uint256& txid = tx.GetHash();
         const WTxId& wtxid = tx.GetWTxId();
@@ -7470,6 +9040,11 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
 
         pfrom->AddKnownWTxId(wtxid);
 
+        // The inputs were verified for the consensus branch of the next block
+        // at the time; that is only of use if it is still the same.
+        bool fInputsVerified = precheck && precheck->fInputsVerified &&
+            precheck->nInputsBranchId == CurrentEpochBranchId(chainActive.Height() + 1, chainparams.GetConsensus());
+
         bool fMissingInputs = false;
         CValidationState state;
 
@@ -7480,7 +9055,7 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
         // because for pre-v5 transactions wtxid.authDigest is set to the same
         // placeholder as is used for the CInv.hashAux field for MSG_TX.
         if (!AlreadyHave(CInv(MSG_WTX, txid, wtxid.authDigest)) &&
-            AcceptToMemoryPool(chainparams, mempool, state, tx, true, &fMissingInputs))
+            AcceptToMemoryPool(chainparams, mempool, state, tx, true, &fMissingInputs, false, fTxChecked, fInputsVerified))
         {
             mempool.check(pcoinsTip);
             RelayTransaction(tx);
@@ -7590,6 +9165,26 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
+        // Check the Equihash solutions of a batch of headers in parallel,
+        // without holding cs_main. Headers we already know are skipped, as
+        // is a batch that doesn't connect to a header we know, since it is
+        // rejected below. A single header is usually an announcement of a
+        // block we may already have, so it is left to AcceptBlockHeader.
+        // Headers before nPoWChecked are either known or have been checked.
+        size_t nPoWChecked = 0;
+        if (nCount > 1) {
+            size_t nFirstNew = 0;
+            bool fConnects;
+            {
+                LOCK(cs_main);
+                fConnects = mapBlockIndex.count(headers[0].hashPrevBlock) > 0;
+                while (fConnects && nFirstNew < nCount && mapBlockIndex.count(headers[nFirstNew].GetHash()))
+                    nFirstNew++;
+            }
+            if (fConnects)
+                nPoWChecked = nFirstNew + CheckHeadersProofOfWork(headers, nFirstNew, chainparams.GetConsensus());
+        }
+
         {
         LOCK(cs_main);
 
@@ -7598,6 +9193,35 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
             return true;
         }
 
+        CNodeState *nodestate = State(pfrom->GetId());
+
+        // If this looks like it could be a block announcement (nCount <
+        // MAX_BLOCKS_TO_ANNOUNCE), use special logic for handling headers that
+        // don't connect:
+        // - Send a getheaders message in response to try to connect the chain.
+        // - The peer can send up to MAX_UNCONNECTING_HEADERS in a row that
+        //   don't connect before giving DoS points
+        // - Once a headers message is received that is valid and does connect,
+        //   nUnconnectingHeaders gets reset back to 0.
+        if (mapBlockIndex.find(headers[0].hashPrevBlock) == mapBlockIndex.end() && nCount < MAX_BLOCKS_TO_ANNOUNCE) {
+            nodestate->nUnconnectingHeaders++;
+            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+            LogPrint("net", "received header %s: missing prev block %s, sending getheaders (%d) to end (peer=%d, nUnconnectingHeaders=%d)\n",
+                    headers[0].GetHash().ToString(),
+                    headers[0].hashPrevBlock.ToString(),
+                    pindexBestHeader->nHeight,
+                    pfrom->id, nodestate->nUnconnectingHeaders);
+            // Set hashLastUnknownBlock for this peer, so that if we
+            // eventually get the headers - even from a different peer -
+            // we can use this peer to download.
+            UpdateBlockAvailability(pfrom->GetId(), headers.back().GetHash());
+
+            if (nodestate->nUnconnectingHeaders % MAX_UNCONNECTING_HEADERS == 0) {
+                Misbehaving(pfrom->GetId(), 20);
+            }
+            return true;
+        }
+
         // If we already know the last header in the message, then it contains
         // no new information for us.  In this case, we do not request
         // more headers later.  This prevents multiple chains of redundant
@@ -7611,13 +9235,14 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
         }
 
         CBlockIndex *pindexLast = NULL;
-        for (const CBlockHeader& header : headers) {
+        for (size_t i = 0; i < headers.size(); i++) {
+            const CBlockHeader& header = headers[i];
             CValidationState state;
             if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
                 Misbehaving(pfrom->GetId(), 20);
                 return error("non-continuous headers sequence");
             }
-            if (!AcceptBlockHeader(header, state, chainparams, &pindexLast)) {
+            if (!AcceptBlockHeader(header, state, chainparams, &pindexLast, i >= nPoWChecked)) {
                 int nDoS;
                 if (state.IsInvalid(nDoS)) {
                     if (nDoS > 0)
@@ -7627,6 +9252,11 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
             }
         }
 
+        if (nodestate->nUnconnectingHeaders > 0) {
+            LogPrint("net", "peer=%d: resetting nUnconnectingHeaders (%d -> 0)\n", pfrom->id, nodestate->nUnconnectingHeaders);
+        }
+        nodestate->nUnconnectingHeaders = 0;
+
         if (pindexLast)
             UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
 
@@ -7652,10 +9282,18 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
     else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
     {
         CBlock block;
-        vRecv >> block;
+        if (precheck && precheck->fDeserialized)
+            block = std::move(precheck->block);
+        else
+            vRecv >> block;
 
         LogPrint("net", "received block %s peer=%d\n", block.GetHash().ToString(), pfrom->id);
 
+        {
+            LOCK(cs_main);
+            UpdateBlockDeliveryTime(pfrom->GetId(), block.GetHash(), nTimeReceived);
+        }
+
         CValidationState state;
         // Process all blocks from whitelisted peers, even if not requested,
         // unless we're still syncing with the network.
@@ -7677,6 +9315,364 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
     }
 
 
+    else if (strCommand == "sendheaders")
+    {
+        LOCK(cs_main);
+        State(pfrom->GetId())->fPreferHeaders = true;
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == 1) {
+            LOCK(cs_main);
+            CNodeState* nodestate = State(pfrom->GetId());
+            nodestate->fProvidesHeaderAndIDs = true;
+            nodestate->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
+    }
+
+
+    else if (strCommand == "sendrecon")
+    {
+        uint32_t nReconciliationVersion = 0;
+        uint64_t nRemoteSalt = 0;
+        vRecv >> nReconciliationVersion >> nRemoteSalt;
+        LOCK(pfrom->cs_inventory);
+        // We only reconcile with peers we sent "sendrecon" to ourselves. The
+        // peer that made the connection requests the reconciliations.
+        if (nReconciliationVersion >= TXRECONCILIATION_VERSION && pfrom->nReconciliationSalt != 0 && !pfrom->txReconciliation) {
+            pfrom->txReconciliation.reset(new TxReconciliationState(!pfrom->fInbound, pfrom->nReconciliationSalt, nRemoteSalt));
+            LogPrint("net", "Relaying transactions to peer=%d by reconciliation\n", pfrom->id);
+        }
+    }
+
+
+    else if (strCommand == "reqrecon")
+    {
+        uint16_t nRemoteSetSize = 0, nQ = 0;
+        vRecv >> nRemoteSetSize >> nQ;
+        LOCK(pfrom->cs_inventory);
+        TxReconciliationState* recon = pfrom->txReconciliation.get();
+        if (!recon || recon->fInitiator) {
+            LogPrint("net", "Unexpected reqrecon from peer=%d\n", pfrom->id);
+            return true;
+        }
+        // If the previous reconciliation never finished, announce what we
+        // sketched for it.
+        std::vector<uint256> vAnnounce;
+        for (const auto& entry : recon->mapSketched) {
+            vAnnounce.push_back(entry.second);
+        }
+        AnnounceReconciledTransactions(pfrom, vAnnounce);
+
+        recon->mapSketched = TakeReconciliationSet(pfrom);
+        PinSketch sketch(EstimateSketchCapacity(recon->mapSketched.size(), nRemoteSetSize, nQ));
+        for (const auto& entry : recon->mapSketched) {
+            sketch.Add(entry.first);
+        }
+        pfrom->PushMessage("sketch", sketch.Serialize());
+    }
+
+
+    else if (strCommand == "sketch")
+    {
+        std::vector<unsigned char> vSketch;
+        vRecv >> vSketch;
+        PinSketch remoteSketch(0);
+        if (!remoteSketch.Deserialize(vSketch)) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), 10);
+            return error("sketch message size = %u", vSketch.size());
+        }
+
+        LOCK(pfrom->cs_inventory);
+        TxReconciliationState* recon = pfrom->txReconciliation.get();
+        if (!recon || !recon->fRequestPending) {
+            LogPrint("net", "Unexpected sketch from peer=%d\n", pfrom->id);
+            return true;
+        }
+        recon->fRequestPending = false;
+
+        std::map<uint32_t, uint256> mapLocal = TakeReconciliationSet(pfrom);
+        PinSketch sketch(remoteSketch.GetCapacity());
+        for (const auto& entry : mapLocal) {
+            sketch.Add(entry.first);
+        }
+        sketch.Merge(remoteSketch);
+
+        // Announce what the peer is missing, and ask it for what we are
+        // missing. If the sets differ by more than the capacity of the
+        // sketch, both sides announce their whole set instead.
+        std::vector<uint32_t> vDifference, vAsk;
+        std::vector<uint256> vAnnounce;
+        bool fSuccess = sketch.Decode(vDifference) && vDifference.size() < sketch.GetCapacity();
+        if (fSuccess) {
+            for (uint32_t nShortID : vDifference) {
+                auto it = mapLocal.find(nShortID);
+                if (it != mapLocal.end()) {
+                    vAnnounce.push_back(it->second);
+                } else {
+                    vAsk.push_back(nShortID);
+                }
+            }
+        } else {
+            for (const auto& entry : mapLocal) {
+                vAnnounce.push_back(entry.second);
+            }
+        }
+        LogPrint("net", "Reconciled %u transactions with peer=%d: %s, announcing %u, asking for %u\n",
+            mapLocal.size(), pfrom->id, fSuccess ? "decoded" : "failed", vAnnounce.size(), vAsk.size());
+        pfrom->PushMessage("reconcildiff", fSuccess, vAsk);
+        AnnounceReconciledTransactions(pfrom, vAnnounce);
+    }
+
+
+    else if (strCommand == "reconcildiff")
+    {
+        bool fSuccess = false;
+        std::vector<uint32_t> vAsk;
+        vRecv >> fSuccess >> vAsk;
+        LOCK(pfrom->cs_inventory);
+        TxReconciliationState* recon = pfrom->txReconciliation.get();
+        if (!recon || recon->fInitiator) {
+            LogPrint("net", "Unexpected reconcildiff from peer=%d\n", pfrom->id);
+            return true;
+        }
+        std::vector<uint256> vAnnounce;
+        if (fSuccess) {
+            for (uint32_t nShortID : vAsk) {
+                auto it = recon->mapSketched.find(nShortID);
+                if (it != recon->mapSketched.end()) {
+                    vAnnounce.push_back(it->second);
+                }
+            }
+        } else {
+            for (const auto& entry : recon->mapSketched) {
+                vAnnounce.push_back(entry.second);
+            }
+        }
+        recon->mapSketched.clear();
+        AnnounceReconciledTransactions(pfrom, vAnnounce);
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+        LOCK(cs_main);
+
+        if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+            // Doesn't connect (or is genesis), instead of DoSing in AcceptBlockHeader, request deeper headers
+            if (!IsInitialBlockDownload(chainparams.GetConsensus()))
+                pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+            return true;
+        }
+
+        CBlockIndex *pindex = NULL;
+        CValidationState state;
+        if (!AcceptBlockHeader(cmpctblock.header, state, chainparams, &pindex)) {
+            int nDoS;
+            if (state.IsInvalid(nDoS)) {
+                if (nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                LogPrintf("Peer %d sent us invalid header via cmpctblock\n", pfrom->id);
+                return true;
+            }
+        }
+        UpdateBlockAvailability(pfrom->GetId(), pindex->GetBlockHash());
+
+        uint256 hash = pindex->GetBlockHash();
+        auto itInFlight = mapBlocksInFlight.find(hash);
+        bool fAlreadyInFlight = itInFlight != mapBlocksInFlight.end();
+
+        if (pindex->nStatus & BLOCK_HAVE_DATA) {
+            return true;
+        }
+        // Don't race another peer that the block is requested from.
+        if (fAlreadyInFlight && itInFlight->second.first != pfrom->GetId()) {
+            return true;
+        }
+
+        // Only reconstruct new tips while we are in sync. Other blocks are
+        // downloaded in full, now that their headers are known.
+        if (pindex->pprev != chainActive.Tip() || pindex->nChainWork <= chainActive.Tip()->nChainWork ||
+                IsInitialBlockDownload(chainparams.GetConsensus())) {
+            if (fAlreadyInFlight) {
+                // We asked this peer for the compact block, so ask for the
+                // whole block instead.
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                pfrom->PushMessage("getdata", vInv);
+            }
+            return true;
+        }
+
+        CNodeState *nodestate = State(pfrom->GetId());
+        if (!fAlreadyInFlight) {
+            if (nodestate->nBlocksInFlight >= nodestate->nMaxBlocksInFlight)
+                return true;
+            MarkBlockAsInFlight(pfrom->GetId(), hash, chainparams.GetConsensus(), pindex);
+        }
+        QueuedBlock& queuedBlock = *mapBlocksInFlight[hash].second;
+
+        // From NU5 the block commits to the auth data of its transactions,
+        // along with the chain history up to the tip it builds on.
+        std::optional<uint256> hashChainHistoryRoot;
+        if (chainparams.GetConsensus().NetworkUpgradeActive(pindex->nHeight, Consensus::UPGRADE_NU5)) {
+            hashChainHistoryRoot = pcoinsTip->GetHistoryRoot(
+                CurrentEpochBranchId(pindex->pprev->nHeight, chainparams.GetConsensus()));
+        }
+
+        auto partialBlock = std::make_shared<PartiallyDownloadedBlock>(&mempool);
+        ReadStatus status = partialBlock->InitData(cmpctblock, hashChainHistoryRoot);
+        if (status == READ_STATUS_INVALID) {
+            MarkBlockAsReceived(hash); // Reset in-flight state in case of whitelist
+            Misbehaving(pfrom->GetId(), 100);
+            LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
+            return true;
+        } else if (status == READ_STATUS_FAILED) {
+            // Duplicate short IDs, ask for the full block.
+            vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+            pfrom->PushMessage("getdata", vInv);
+            return true;
+        }
+
+        BlockTransactionsRequest req;
+        for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+            if (!partialBlock->IsTxAvailable(i))
+                req.indexes.push_back(i);
+        }
+        if (req.indexes.empty()) {
+            // We have every transaction.
+            fBlockReconstructed = partialBlock->FillBlock(block, {}) == READ_STATUS_OK;
+            if (fBlockReconstructed) {
+                UpdateBlockDeliveryTime(pfrom->GetId(), hash, nTimeReceived);
+            } else {
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                pfrom->PushMessage("getdata", vInv);
+            }
+        } else {
+            queuedBlock.partialBlock = partialBlock;
+            req.blockhash = hash;
+            pfrom->PushMessage("getblocktxn", req);
+        }
+        }
+
+        if (fBlockReconstructed) {
+            CValidationState state;
+            ProcessNewBlock(state, chainparams, pfrom, &block, true, NULL);
+            int nDoS;
+            if (state.IsInvalid(nDoS) && nDoS > 0) {
+                LOCK(cs_main);
+                Misbehaving(pfrom->GetId(), nDoS);
+            }
+        }
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrintf("Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        if (mi->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            // If an older block is requested (should never happen in practice,
+            // but can happen in tests) send a block response instead of a
+            // blocktxn response. Sending a full block response instead of a
+            // small blocktxn response is preferable in the case where a peer
+            // might maliciously send lots of getblocktxn requests to trigger
+            // expensive disk reads, because it will require the peer to
+            // actually receive all the data read from disk over the network.
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom, chainparams.GetConsensus());
+            return true;
+        }
+
+        std::shared_ptr<const CBlock> pblock = pMostRecentBlock;
+        if (!pblock || pblock->GetHash() != req.blockhash) {
+            auto pblockRead = std::make_shared<CBlock>();
+            if (!ReadBlockFromDisk(*pblockRead, mi->second, chainparams.GetConsensus()))
+                assert(!"cannot load block from disk");
+            pblock = pblockRead;
+        }
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= pblock->vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us a getblocktxn with out-of-bounds tx indices\n", pfrom->id);
+                return true;
+            }
+            resp.txn[i] = pblock->vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        bool fBlockRead = false;
+        {
+        LOCK(cs_main);
+
+        auto itInFlight = mapBlocksInFlight.find(resp.blockhash);
+        if (itInFlight == mapBlocksInFlight.end() || !itInFlight->second.second->partialBlock ||
+                itInFlight->second.first != pfrom->GetId()) {
+            LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+            return true;
+        }
+
+        std::shared_ptr<PartiallyDownloadedBlock> partialBlock = itInFlight->second.second->partialBlock;
+        itInFlight->second.second->partialBlock.reset();
+        ReadStatus status = partialBlock->FillBlock(block, resp.txn);
+        if (status == READ_STATUS_INVALID) {
+            MarkBlockAsReceived(resp.blockhash); // Reset in-flight state in case of whitelist
+            Misbehaving(pfrom->GetId(), 100);
+            LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->id);
+            return true;
+        } else if (status == READ_STATUS_FAILED) {
+            // Might have collided, fall back to getdata now :(
+            vector<CInv> vInv(1, CInv(MSG_BLOCK, resp.blockhash));
+            pfrom->PushMessage("getdata", vInv);
+        } else {
+            UpdateBlockDeliveryTime(pfrom->GetId(), resp.blockhash, nTimeReceived);
+            fBlockRead = true;
+        }
+        }
+
+        if (fBlockRead) {
+            CValidationState state;
+            ProcessNewBlock(state, chainparams, pfrom, &block, true, NULL);
+            int nDoS;
+            if (state.IsInvalid(nDoS) && nDoS > 0) {
+                LOCK(cs_main);
+                Misbehaving(pfrom->GetId(), nDoS);
+            }
+        }
+    }
+
+
     // This asymmetric behavior for inbound and outbound connections was introduced
     // to prevent a fingerprinting attack: an attacker can send specific fake addresses
     // to users' AddrMan and later request them by sending getaddr messages.
@@ -7929,7 +9925,8 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
         // message would be undesirable as we transmit it ourselves.
     }
 
-    else if (!(strCommand == "tx" || strCommand == "block" || strCommand == "headers" || strCommand == "alert")) {
+    else if (!(strCommand == "tx" || strCommand == "block" || strCommand == "headers" || strCommand == "alert" ||
+               strCommand == "cmpctblock" || strCommand == "blocktxn")) {
         // Ignore unknown commands for extensibility
         LogPrint("net", "Unknown command \"%s\" from peer=%d\n", SanitizeString(strCommand), pfrom->id);
     }
@@ -7939,6 +9936,194 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
     return true;
 }
 
+/**
+ * Deserialize the payload of a "tx" or "block" message, filling in precheck,
+ * and run the checks of a block that don't depend on context. The checks of
+ * a transaction are left until it is known not to be a duplicate or a recent
+ * reject. Runs on the precheck queue, so it must not need cs_main.
+ */
+static void PrecheckMessage(CMessagePrecheck& precheck, const std::string& strCommand, CDataStream& vRecv)
+{
+    try {
+        if (strCommand == "tx") {
+            vRecv >> precheck.tx;
+            precheck.fDeserialized = true;
+        } else if (strCommand == "block") {
+            vRecv >> precheck.block;
+            precheck.fDeserialized = true;
+
+            // AcceptBlock() skips transaction checks for blocks below the last
+            // checkpoint if -ibdskiptxverification is set, which we can't
+            // tell from here.
+            if (!fIBDSkipTxVerification) {
+                CValidationState state;
+                auto verifier = ProofVerifier::Disabled();
+                CheckBlock(precheck.block, state, Params(), verifier, true, true, true);
+            }
+        }
+    } catch (const std::exception&) {
+        // The message is deserialized again when it is processed, which
+        // handles the error.
+        precheck.fDeserialized = false;
+        precheck.fTxChecked = false;
+    }
+}
+
+/**
+ * A group of transactions whose inputs are verified together on the precheck
+ * queue, with what that needs from the chain state and the mempool, copied
+ * under cs_main so that the verification itself can run without it.
+ */
+struct CTxInputsSnapshot
+{
+    CCoinsViewDummy dummy;
+    //! The coins the transactions spend, and the anchors and nullifiers of
+    //! their shielded spends, cached over a view that has nothing else.
+    CCoinsViewCache view;
+    //! Height of the next block at the time.
+    int nHeight = 0;
+    //! The transactions of the group, which are checked first.
+    std::vector<std::shared_ptr<CMessagePrecheck>> vGroup;
+    //! Those of them whose inputs are in view.
+    std::vector<std::shared_ptr<CMessagePrecheck>> vPrechecks;
+
+    CTxInputsSnapshot() : view(&dummy) {}
+};
+
+/**
+ * Add the transaction of precheck to snapshot, caching what it needs from
+ * view. Leaves it out if it is missing inputs or its shielded requirements
+ * aren't met; it is then handled entirely under cs_main.
+ */
+static void SnapshotTxInputs(const std::shared_ptr<CMessagePrecheck>& precheck, CTxInputsSnapshot& snapshot)
+{
+    const CTransaction& tx = precheck->tx;
+    if (!tx.IsCoinBase() && snapshot.view.HaveInputs(tx) && snapshot.view.CheckShieldedRequirements(tx).has_value())
+        snapshot.vPrechecks.push_back(precheck);
+}
+
+void PrecheckMessages(const CChainParams& chainparams, const std::vector<CNode*>& vNodes)
+{
+    if (!nScriptCheckThreads)
+        return;
+
+    bool fBlocksOnly = GetBoolArg("-blocksonly", DEFAULT_BLOCKSONLY);
+    std::vector<CPrecheck> vChecks;
+    std::vector<std::shared_ptr<CMessagePrecheck>> vTxPrechecks;
+    for (CNode* pnode : vNodes) {
+        if (pnode->fDisconnect)
+            continue;
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (!lockRecv)
+            continue;
+        for (CNetMessage& msg : pnode->vRecvMsg) {
+            if (!msg.complete())
+                break;
+            if (msg.precheck || !msg.hdr.IsValid(chainparams.MessageStart()))
+                continue;
+            std::string strCommand = msg.hdr.GetCommand();
+            if ((strCommand == "tx" && !fBlocksOnly) ||
+                (strCommand == "block" && !fImporting && !fReindex)) {
+                auto precheck = std::make_shared<CMessagePrecheck>();
+                auto vRecv = std::make_shared<CDataStream>(msg.vRecv);
+                msg.precheck = precheck;
+                vChecks.emplace_back([precheck, strCommand, vRecv]() {
+                    PrecheckMessage(*precheck, strCommand, *vRecv);
+                });
+                if (strCommand == "tx")
+                    vTxPrechecks.push_back(precheck);
+            }
+        }
+    }
+    if (vChecks.empty())
+        return;
+
+    {
+        CCheckQueueControl<CPrecheck> control(&precheckqueue);
+        control.Add(vChecks);
+        control.Wait();
+    }
+
+    if (!IsInitialBlockDownload(chainparams.GetConsensus()))
+        PrecheckTransactions(chainparams, vTxPrechecks);
+}
+
+void PrecheckTransactions(const CChainParams& chainparams, const std::vector<std::shared_ptr<CMessagePrecheck>>& vTxPrechecks)
+{
+    if (!nScriptCheckThreads)
+        return;
+
+    // Check the transactions that we don't already have and haven't recently
+    // rejected, and verify the inputs of those that pass against a snapshot of
+    // what they spend taken in one go, so that under cs_main
+    // AcceptToMemoryPool() only has to check them against the chain state and
+    // the mempool of the time. The transactions are split into one group per
+    // thread, and the shielded components of each group are verified in one
+    // batch.
+    std::vector<std::shared_ptr<CTxInputsSnapshot>> vSnapshots;
+    if (!vTxPrechecks.empty()) {
+        LOCK2(cs_main, mempool.cs);
+        std::vector<std::shared_ptr<CMessagePrecheck>> vPending;
+        std::set<WTxId> setPendingWTxIds;
+        for (const auto& precheck : vTxPrechecks) {
+            if (!precheck->fDeserialized)
+                continue;
+            // As in the "tx" handler, a MSG_WTX inv covers pre-v5
+            // transactions too. Copies of a transaction from several peers
+            // are only checked once; the others are then found in the
+            // mempool or the reject filter when they are processed.
+            const WTxId& wtxid = precheck->tx.GetWTxId();
+            if (!AlreadyHave(CInv(MSG_WTX, wtxid.hash, wtxid.authDigest)) && setPendingWTxIds.insert(wtxid).second)
+                vPending.push_back(precheck);
+        }
+        size_t nGroups = std::min(vPending.size(), (size_t)nScriptCheckThreads);
+        CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+        for (size_t i = 0; i < nGroups; i++) {
+            auto snapshot = std::make_shared<CTxInputsSnapshot>();
+            snapshot->nHeight = chainActive.Height() + 1;
+            snapshot->view.SetBackend(viewMemPool);
+            for (size_t j = i * vPending.size() / nGroups; j < (i + 1) * vPending.size() / nGroups; j++) {
+                snapshot->vGroup.push_back(vPending[j]);
+                SnapshotTxInputs(vPending[j], *snapshot);
+            }
+            snapshot->view.SetBackend(snapshot->dummy);
+            vSnapshots.push_back(snapshot);
+        }
+    }
+    if (vSnapshots.empty())
+        return;
+
+    std::vector<CPrecheck> vInputChecks;
+    for (const auto& snapshot : vSnapshots) {
+        vInputChecks.emplace_back([&chainparams, snapshot]() {
+            for (const auto& precheck : snapshot->vGroup) {
+                CValidationState state;
+                auto verifier = ProofVerifier::Strict();
+                precheck->fTxChecked = CheckTransaction(precheck->tx, state, verifier);
+            }
+            std::vector<std::shared_ptr<CMessagePrecheck>> vChecked;
+            std::vector<const CTransaction*> vtx;
+            for (const auto& precheck : snapshot->vPrechecks) {
+                if (precheck->fTxChecked) {
+                    vChecked.push_back(precheck);
+                    vtx.push_back(&precheck->tx);
+                }
+            }
+            if (vtx.empty())
+                return;
+            std::vector<bool> vVerified = VerifyTransactionInputs(chainparams, vtx, snapshot->view, snapshot->nHeight);
+            uint32_t consensusBranchId = CurrentEpochBranchId(snapshot->nHeight, chainparams.GetConsensus());
+            for (size_t i = 0; i < vtx.size(); i++) {
+                vChecked[i]->fInputsVerified = vVerified[i];
+                vChecked[i]->nInputsBranchId = consensusBranchId;
+            }
+        });
+    }
+    CCheckQueueControl<CPrecheck> control(&precheckqueue);
+    control.Add(vInputChecks);
+    control.Wait();
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(const CChainParams& chainparams, CNode* pfrom)
 {
@@ -8023,7 +10208,7 @@ bool ProcessMessages(const CChainParams& chainparams, CNode* pfrom)
         bool fRet = false;
         try
         {
-            fRet = ProcessMessage(chainparams, pfrom, strCommand, vRecv, msg.nTime);
+            fRet = ProcessMessage(chainparams, pfrom, strCommand, vRecv, msg.nTime, msg.precheck.get());
             boost::this_thread::interruption_point();
         }
         catch (const std::ios_base::failure& e)
@@ -8221,12 +10406,82 @@ bool SendMessages(const Consensus::Params& params, CNode* pto)
             }
             vInv.reserve(std::max<size_t>(pto->vInventoryBlockToSend.size(), INVENTORY_BROADCAST_MAX));
 
-            // Add blocks
-            for (const uint256& hash : pto->vInventoryBlockToSend) {
-                vInv.push_back(CInv(MSG_BLOCK, hash));
-                if (vInv.size() == MAX_INV_SZ) {
-                    pto->PushMessage("inv", vInv);
-                    vInv.clear();
+            // Add blocks. If the peer asked for new blocks to be announced
+            // as compact blocks or headers, and there are not too many, find
+            // the first block whose header the peer doesn't have but whose
+            // parent it does, and announce it and the blocks after it that
+            // way. Otherwise, or if none would connect, announce by inv.
+            vector<CBlock> vHeaders;
+            bool fRevertToInv = (!state.fPreferHeaders && !state.fPreferHeaderAndIDs) ||
+                pto->vInventoryBlockToSend.size() > MAX_BLOCKS_TO_ANNOUNCE;
+            CBlockIndex *pBestIndex = NULL; // last header queued for delivery
+            ProcessBlockAvailability(pto->id); // ensure pindexBestKnownBlock is up-to-date
+
+            if (!fRevertToInv) {
+                bool fFoundStartingHeader = false;
+                for (const uint256& hash : pto->vInventoryBlockToSend) {
+                    BlockMap::iterator mi = mapBlockIndex.find(hash);
+                    assert(mi != mapBlockIndex.end());
+                    CBlockIndex *pindex = mi->second;
+                    if (chainActive[pindex->nHeight] != pindex) {
+                        // Bail out if we reorged away from this block
+                        fRevertToInv = true;
+                        break;
+                    }
+                    if (pBestIndex != NULL && pindex->pprev != pBestIndex) {
+                        // The blocks to announce don't connect to each other,
+                        // which can happen if invalidateblock and
+                        // reconsiderblock are used repeatedly on the tip.
+                        fRevertToInv = true;
+                        break;
+                    }
+                    pBestIndex = pindex;
+                    if (fFoundStartingHeader) {
+                        vHeaders.push_back(pindex->GetBlockHeader());
+                    } else if (PeerHasHeader(&state, pindex)) {
+                        continue; // keep looking for the first new block
+                    } else if (pindex->pprev == NULL || PeerHasHeader(&state, pindex->pprev)) {
+                        // The peer has the header before this one, so start
+                        // sending headers from here.
+                        fFoundStartingHeader = true;
+                        vHeaders.push_back(pindex->GetBlockHeader());
+                    } else {
+                        // The peer has neither this header nor the one before
+                        // it, so nothing we send would connect.
+                        fRevertToInv = true;
+                        break;
+                    }
+                }
+            }
+            if (!fRevertToInv && !vHeaders.empty()) {
+                if (state.fPreferHeaderAndIDs && vHeaders.size() == 1 &&
+                        pMostRecentCompactBlock && pMostRecentCompactBlock->header.GetHash() == pBestIndex->GetBlockHash()) {
+                    LogPrint("net", "%s: sending cmpctblock %s to peer=%d\n", __func__,
+                            pBestIndex->GetBlockHash().ToString(), pto->id);
+                    pto->PushSharedMessage(pMostRecentCompactBlockMsg);
+                    state.pindexBestHeaderSent = pBestIndex;
+                } else if (state.fPreferHeaders) {
+                    LogPrint("net", "%s: sending %u headers, up to %s, to peer=%d\n", __func__,
+                            vHeaders.size(), pBestIndex->GetBlockHash().ToString(), pto->id);
+                    pto->PushMessage("headers", vHeaders);
+                    state.pindexBestHeaderSent = pBestIndex;
+                } else {
+                    fRevertToInv = true;
+                }
+            }
+            if (fRevertToInv) {
+                for (const uint256& hash : pto->vInventoryBlockToSend) {
+                    // If the peer announced this block to us, don't inv it
+                    // back. Blocks may be announced by headers, so we can't
+                    // rely on the known inventory filter for this.
+                    BlockMap::iterator mi = mapBlockIndex.find(hash);
+                    if (mi != mapBlockIndex.end() && PeerHasHeader(&state, mi->second))
+                        continue;
+                    vInv.push_back(CInv(MSG_BLOCK, hash));
+                    if (vInv.size() == MAX_INV_SZ) {
+                        pto->PushMessage("inv", vInv);
+                        vInv.clear();
+                    }
                 }
             }
             pto->vInventoryBlockToSend.clear();
@@ -8316,9 +10571,6 @@ bool SendMessages(const Consensus::Params& params, CNode* pto)
                     if (inv.type == MSG_WTX) assert(pto->nVersion >= CINV_WTX_VERSION);
                     if (IsExpiringSoonTx(*txinfo.tx, currentHeight + 1)) continue;
                     if (pto->pfilter && !pto->pfilter->IsRelevantAndUpdate(*txinfo.tx)) continue;
-                    // Send
-                    vInv.push_back(inv);
-                    nRelayedTransactions++;
                     {
                         // Expire old relay messages
                         while (!vRelayExpiration.empty() && vRelayExpiration.front().first < nNow)
@@ -8327,11 +10579,24 @@ bool SendMessages(const Consensus::Params& params, CNode* pto)
                             vRelayExpiration.pop_front();
                         }
 
-                        auto ret = mapRelay.insert(std::make_pair(hash, std::move(txinfo.tx)));
+                        auto ret = mapRelay.insert(std::make_pair(hash, CRelayEntry{std::move(txinfo.tx), nullptr}));
                         if (ret.second) {
                             vRelayExpiration.push_back(std::make_pair(nNow + 15 * 60 * 1000000, ret.first));
                         }
                     }
+                    {
+                        // Leave it to the next reconciliation with the peer, unless
+                        // it is one of the few we still flood.
+                        LOCK(pto->cs_inventory);
+                        TxReconciliationState* recon = pto->txReconciliation.get();
+                        if (recon && !recon->ShouldFlood(hash) && recon->setToReconcile.size() < MAX_RECONCILIATION_SET_SIZE) {
+                            recon->setToReconcile.insert(hash);
+                            continue;
+                        }
+                    }
+                    // Send
+                    vInv.push_back(inv);
+                    nRelayedTransactions++;
                     if (vInv.size() == MAX_INV_SZ) {
                         pto->PushMessage("inv", vInv);
                         vInv.clear();
@@ -8343,6 +10608,20 @@ bool SendMessages(const Consensus::Params& params, CNode* pto)
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
 
+        //
+        // Message: reqrecon
+        //
+        if (!pto->fDisconnect) {
+            LOCK(pto->cs_inventory);
+            TxReconciliationState* recon = pto->txReconciliation.get();
+            if (recon && recon->fInitiator && !recon->fRequestPending && recon->nNextRequest < nNow) {
+                uint16_t nSetSize = std::min<size_t>(recon->setToReconcile.size(), std::numeric_limits<uint16_t>::max());
+                pto->PushMessage("reqrecon", nSetSize, DEFAULT_RECON_Q);
+                recon->fRequestPending = true;
+                recon->nNextRequest = PoissonNextSend(nNow, RECON_REQUEST_INTERVAL);
+            }
+        }
+
         // Detect whether we're stalling
         nNow = GetTimeMicros();
         if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
@@ -8379,12 +10658,16 @@ bool SendMessages(const Consensus::Params& params, CNode* pto)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload(params)) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        UpdateMaxBlocksInFlight(&state, pto->nMinPingUsecTime);
+        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload(params)) && state.nBlocksInFlight < state.nMaxBlocksInFlight) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            FindNextBlocksToDownload(pto->GetId(), state.nMaxBlocksInFlight - state.nBlocksInFlight, vToDownload, staller);
             for (CBlockIndex *pindex : vToDownload) {
-                vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                // Ask for a new tip as a compact block if the peer can send
+                // one, as we likely have most of its transactions.
+                bool fCompact = state.fProvidesHeaderAndIDs && pindex->pprev == chainActive.Tip() && !IsInitialBlockDownload(params);
+                vGetData.push_back(CInv(fCompact ? MSG_CMPCT_BLOCK : MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), params, pindex);
                 LogPrint("net", "Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                     pindex->nHeight, pto->id);
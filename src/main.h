@@ -34,13 +34,16 @@
 #include "timestampindex.h"
 
 #include <algorithm>
+#include <atomic>
 #include <exception>
 #include <map>
+#include <memory>
 #include <optional>
 #include <set>
 #include <stdint.h>
 #include <string>
 #include <utility>
+#include <variant>
 #include <vector>
 
 #include <rust/bridge.h>
@@ -52,8 +55,10 @@ class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
 class CChainParams;
+class CCoinsViewAsyncWriter;
 class CInv;
 class CScriptCheck;
+class CSnapshotMetadata;
 class CValidationInterface;
 class CValidationState;
 class PrecomputedTransactionData;
@@ -108,8 +113,27 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
-static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Maximum number of blocks that may be read ahead of the tip while connecting blocks */
+static const int MAX_BLOCK_PREFETCH_DEPTH = 128;
+/** -blockprefetch default (number of blocks to read ahead of the tip while connecting blocks, 0 = disabled) */
+static const int DEFAULT_BLOCK_PREFETCH_DEPTH = 16;
+/** Maximum number of blocks whose shielded authorizations may be validated in one batch */
+static const int MAX_SHIELDED_BATCH_WINDOW = 64;
+/** -shieldedbatchwindow default (number of blocks whose shielded authorizations are validated in one batch during IBD, 1 = disabled) */
+static const int DEFAULT_SHIELDED_BATCH_WINDOW = 16;
+/** Maximum time (in microseconds) spent connecting the blocks of one shielded authorization batch, with cs_main held */
+static const int64_t MAX_SHIELDED_BATCH_MICROS = 500000;
+/** Number of threads that read and check blocks ahead of the tip */
+static const int BLOCK_PREFETCH_THREADS = 2;
+/** Number of blocks that can be requested at any given time from a single peer, until we have measured
+ *  how fast it delivers them. After that the number is sized to keep the peer's link busy for a round trip. */
+static const int DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Bounds on the number of blocks that can be requested at any given time from a single peer. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 128;
+/** Peers that would take longer than this (in seconds) to deliver DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER blocks at their
+ *  measured rate may have fewer than that in flight, down to MIN_BLOCKS_IN_TRANSIT_PER_PEER. */
+static const int64_t BLOCK_SLOW_DELIVERY_TIMEOUT = 30;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
@@ -118,12 +142,26 @@ static const unsigned int MAX_HEADERS_RESULTS = 160;
 /** Size of the "block download window": how far ahead of our current height do we fetch?
  *  Larger windows tolerate larger download speed differences between peer, but increase the potential
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
- *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
+ *  harder). It is scaled up for peers that may have more than DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER blocks in flight. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Maximum depth of blocks we send as compact blocks when they are requested. */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Maximum depth of blocks we send the transactions of in response to getblocktxn. */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Number of peers we ask to announce new blocks to us as compact blocks. */
+static const unsigned int MAX_HIGH_BANDWIDTH_COMPACT_PEERS = 3;
+/** Maximum number of new blocks announced to a peer with headers (or a compact block) rather than inv. */
+static const unsigned int MAX_BLOCKS_TO_ANNOUNCE = 8;
+/** Maximum number of unconnecting headers announcements before the peer is given DoS points. */
+static const int MAX_UNCONNECTING_HEADERS = 10;
+/** Number of serialized blocks kept in memory for serving to peers. */
+static const unsigned int RAW_BLOCK_CACHE_SIZE = 8;
 /** Time to wait (in seconds) between writing blocks/block index to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
 static const unsigned int DATABASE_FLUSH_INTERVAL = 24 * 60 * 60;
+/** Percentage of -dbcache that the coins cache is trimmed to when it outgrows it. */
+static const unsigned int COINS_CACHE_EVICT_TARGET_PERCENT = 50;
 /** Time to wait (in seconds) between writing wallet witness data to disk. */
 static const unsigned int WITNESS_WRITE_INTERVAL = 10 * 60;
 /** Number of updates between writing wallet witness data to disk. */
@@ -159,6 +197,9 @@ static const bool DEFAULT_NU_REJECT_OLD_VERSIONS = true;
 
 static const bool DEFAULT_PEERBLOOMFILTERS = true;
 static const bool DEFAULT_ENFORCENODEBLOOM = false;
+static const bool DEFAULT_TXRECONCILIATION = false;
+/** Default for -persistmempool */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
 
 struct BlockHasher
 {
@@ -190,6 +231,8 @@ extern uint256 g_best_block;
 extern std::atomic_bool fImporting;
 extern std::atomic_bool fReindex;
 extern int nScriptCheckThreads;
+extern int nBlockPrefetchDepth;
+extern int nShieldedBatchWindow;
 extern bool fTxIndex;
 
 // The following flags enable specific indices (DB tables), but are not exposed as
@@ -207,9 +250,13 @@ extern bool fTimestampIndex;
 // END insightexplorer
 
 extern bool fIsBareMultisigStd;
+/** Whether we relay transactions by set reconciliation to peers that support it. */
+extern bool fTxReconciliation;
 extern bool fCheckBlockIndex;
 extern bool fCheckpointsEnabled;
 extern bool fIBDSkipTxVerification;
+/** Block hash whose ancestors we will assume to have valid scripts and proofs, if any. */
+extern uint256 hashAssumeValid;
 // TODO: remove this flag by structuring our code such that
 // it is unneeded for testing
 extern bool fCoinbaseEnforcedShieldingEnabled;
@@ -234,6 +281,8 @@ static const uint64_t nMinDiskSpace = 52428800;
 /** Pruning-related variables and constants */
 /** True if any block files have ever been pruned. */
 extern bool fHavePruned;
+/** True if the chain state was loaded from a snapshot, so we lack the blocks before the snapshot base */
+extern bool fSnapshotChainState;
 /** True if we're running in -prune mode. */
 extern bool fPruneMode;
 /** Number of MiB of block files that we're trying to stay below. */
@@ -293,6 +342,43 @@ bool InitBlockIndex(const CChainParams& chainparams);
 bool LoadBlockIndex();
 /** Unload database information */
 void UnloadBlockIndex();
+/**
+ * The payload of a "tx" or "block" message, deserialized and checked without
+ * context before the message is processed. Only the outcome of the checks is
+ * kept: a message that fails them is checked again under cs_main, which then
+ * handles the failure as usual.
+ */
+struct CMessagePrecheck
+{
+    //! Whether the payload was deserialized into tx or block.
+    bool fDeserialized = false;
+    //! Whether tx passed CheckTransaction(). A block that passed CheckBlock()
+    //! records that in its fChecked flag.
+    bool fTxChecked = false;
+    //! Whether the scripts of tx, and the signatures and proofs of its
+    //! shielded components, passed against the outputs it spends, for the
+    //! consensus branch nInputsBranchId.
+    bool fInputsVerified = false;
+    uint32_t nInputsBranchId = 0;
+    CTransaction tx;
+    CBlock block;
+};
+
+/**
+ * Precheck the complete "tx" and "block" messages queued by the given nodes,
+ * in parallel on the precheck threads, and wait for the checks to finish.
+ * The transactions that we don't already have and haven't recently rejected
+ * are then checked the same way, and their inputs verified against a
+ * snapshot of the outputs, anchors and nullifiers they need taken under
+ * cs_main. Does nothing if there are no such threads.
+ */
+void PrecheckMessages(const CChainParams& chainparams, const std::vector<CNode*>& vNodes);
+/**
+ * Check the deserialized transactions that we don't already have and haven't
+ * recently rejected, and verify their inputs, as PrecheckMessages() does, and
+ * wait for the checks to finish. Must not be called with cs_main held.
+ */
+void PrecheckTransactions(const CChainParams& chainparams, const std::vector<std::shared_ptr<CMessagePrecheck>>& vTxPrechecks);
 /** Process protocol messages received from a given node */
 bool ProcessMessages(const CChainParams& chainparams, CNode* pfrom);
 /**
@@ -304,6 +390,13 @@ bool ProcessMessages(const CChainParams& chainparams, CNode* pfrom);
 bool SendMessages(const Consensus::Params& params, CNode* pto);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/**
+ * Run an instance of the precheck thread, which runs checks that don't depend
+ * on context for the message handler.
+ */
+void ThreadPrecheck();
+/** Run an instance of the block prefetching thread */
+void ThreadBlockPrefetch();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload(const Consensus::Params& params);
 /** testing-only, set or reset initial block down (IBD) state, return previous */
@@ -342,6 +435,18 @@ void UnlinkPrunedFiles(std::set<int>& setFilesToPrune);
 CBlockIndex * InsertBlockIndex(const uint256& hash);
 /** Get statistics from node state */
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
+/**
+ * The number of blocks to keep in flight from a peer that delivers a block
+ * every nBlockDeliveryTime microseconds on average (0 if we haven't measured
+ * it yet), and whose minimum ping time is nPingUsecTime microseconds.
+ */
+int GetMaxBlocksInFlight(int64_t nBlockDeliveryTime, int64_t nPingUsecTime);
+/**
+ * Whether a block holding back the download window, in flight from a peer
+ * that delivers a block every nSlowBlockDeliveryTime microseconds, should be
+ * requested from a peer that delivers one every nBlockDeliveryTime instead.
+ */
+bool ShouldMoveBlockFromPeer(int64_t nSlowBlockDeliveryTime, int64_t nBlockDeliveryTime);
 /** Increase a node's misbehavior score. */
 void Misbehaving(NodeId nodeid, int howmuch);
 /** Flush all state, indexes and buffers to disk. */
@@ -349,11 +454,27 @@ void FlushStateToDisk();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
 
-/** (try to) add transaction to memory pool **/
+/**
+ * (try to) add transaction to memory pool. fTxChecked means that tx is already
+ * known to pass CheckTransaction(). fInputsVerified means that its scripts,
+ * and the signatures and proofs of its shielded components, are known to pass
+ * for the consensus branch of the next block, so that only the cheap checks
+ * of its inputs against the chain state and the mempool are made.
+ */
 bool AcceptToMemoryPool(
         const CChainParams& chainparams,
         CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-        bool* pfMissingInputs, bool fRejectAbsurdFee=false);
+        bool* pfMissingInputs, bool fRejectAbsurdFee=false, bool fTxChecked=false,
+        bool fInputsVerified=false);
+
+/**
+ * (try to) add transaction to memory pool with a specified acceptance time.
+ * fTxChecked and fInputsVerified are as for AcceptToMemoryPool().
+ */
+bool AcceptToMemoryPoolWithTime(
+        const CChainParams& chainparams,
+        CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+        bool* pfMissingInputs, int64_t nAcceptTime, bool fTxChecked=false, bool fInputsVerified=false);
 
 /** Convert CValidationState to a human-readable message for logging */
 std::string FormatStateMessage(const CValidationState &state);
@@ -430,6 +551,24 @@ bool ContextualCheckTransaction(const CTransaction& tx, CValidationState &state,
                                 const CChainParams& chainparams, int nHeight, bool isMined,
                                 bool (*isInitBlockDownload)(const Consensus::Params&) = IsInitialBlockDownload);
 
+/**
+ * Verify the scripts of the given transactions, and the signatures and proofs
+ * of their shielded components, for a block at height nHeight. The coins they
+ * spend, and the anchors and nullifiers of their shielded spends, must be
+ * cached in view; nothing else of the chain state is used, so this doesn't
+ * need cs_main. The Sapling and Orchard bundles of all the transactions are
+ * verified in one batch each, and if a batch fails, each transaction is
+ * verified again on its own. Returns whether each transaction passed.
+ * cacheStore sets whether what passes is added to the signature and bundle
+ * validity caches.
+ */
+std::vector<bool> VerifyTransactionInputs(
+    const CChainParams& chainparams,
+    const std::vector<const CTransaction*>& vtx,
+    const CCoinsViewCache& view,
+    int nHeight,
+    bool cacheStore = true);
+
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight);
 
@@ -536,6 +675,57 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+/**
+ * Closure representing the verification of one Sprout JoinSplit proof
+ * Note that this stores references to the transaction containing the JoinSplit
+ * If the proof doesn't verify, the transaction is recorded in *pFailedTx (if
+ * no other failure was recorded there first), so that the caller can report
+ * which transaction failed once the check queue has been waited for.
+ */
+class CSproutProofCheck
+{
+private:
+    const CTransaction *ptx;
+    size_t nJoinSplit;
+    std::atomic<const CTransaction*> *pFailedTx;
+
+public:
+    CSproutProofCheck(): ptx(nullptr), nJoinSplit(0), pFailedTx(nullptr) {}
+    CSproutProofCheck(const CTransaction& txIn, size_t nJoinSplitIn, std::atomic<const CTransaction*> *pFailedTxIn = nullptr) :
+        ptx(&txIn), nJoinSplit(nJoinSplitIn), pFailedTx(pFailedTxIn) { }
+
+    bool operator()();
+
+    void swap(CSproutProofCheck &check) {
+        std::swap(ptx, check.ptx);
+        std::swap(nJoinSplit, check.nJoinSplit);
+        std::swap(pFailedTx, check.pFailedTx);
+    }
+};
+
+/**
+ * Closure queued by ConnectBlock onto the script check queue: either a
+ * transparent script check or a Sprout proof check.
+ */
+class CBlockCheck
+{
+private:
+    std::variant<CScriptCheck, CSproutProofCheck> check;
+
+public:
+    CBlockCheck() {}
+    explicit CBlockCheck(CScriptCheck& checkIn) { std::get<CScriptCheck>(check).swap(checkIn); }
+    explicit CBlockCheck(CSproutProofCheck& checkIn) : check(CSproutProofCheck()) {
+        std::get<CSproutProofCheck>(check).swap(checkIn);
+    }
+
+    bool operator()() {
+        return std::visit([](auto& c) { return c(); }, check);
+    }
+
+    void swap(CBlockCheck &other) { check.swap(other.check); }
+};
+
 bool GetSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value);
 bool GetAddressIndex(const uint160& addressHash, int type,
         std::vector<CAddressIndexDbEntry> &addressIndex,
@@ -549,6 +739,8 @@ bool GetTimestampIndex(unsigned int high, unsigned int low, bool fActiveOnly,
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/** Read a block as it is serialized on disk, without checking it. */
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& block, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -558,6 +750,13 @@ bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state,
     const CChainParams& chainparams,
     bool fCheckPOW = true);
 
+/**
+ * Check the Equihash solutions and proof of work of the headers of a batch
+ * from position nStart on, in parallel on the precheck threads if there are
+ * any. Returns the number of headers from nStart on that are valid.
+ */
+size_t CheckHeadersProofOfWork(const std::vector<CBlockHeader>& headers, size_t nStart, const Consensus::Params& params);
+
 bool CheckBlock(const CBlock& block, CValidationState& state,
                 const CChainParams& chainparams,
                 ProofVerifier& verifier,
@@ -592,12 +791,53 @@ enum class CheckAs {
     SlowBenchmark,
 };
 
+/**
+ * Sapling and Orchard authorization batches that span several consecutive
+ * blocks, so that their proofs and signatures can be validated together.
+ *
+ * When one of these is passed to ConnectBlock(), the block's bundles are
+ * queued into it instead of being validated at the end of ConnectBlock(), and
+ * the block is appended to vBlocks without being raised to
+ * BLOCK_VALID_SCRIPTS. The caller must then validate the batches before the
+ * connected blocks are written to the coins database.
+ */
+struct CShieldedAuthBatch
+{
+    struct Block
+    {
+        CBlockIndex* pindex;
+        //! Set by the caller of ConnectBlock(), so that the bundles can be
+        //! queued again if the batch fails.
+        std::shared_ptr<const CBlock> pblock;
+        //! The signature hashes of the transactions with Sapling or Orchard
+        //! bundles, by their position in the block.
+        std::vector<std::pair<size_t, uint256>> vSigHashes;
+    };
+
+    std::optional<rust::Box<sapling::BatchValidator>> saplingAuth;
+    std::optional<rust::Box<orchard::BatchValidator>> orchardAuth;
+    //! The blocks whose bundles have been queued, in chain order.
+    std::vector<Block> vBlocks;
+
+    CShieldedAuthBatch() :
+        saplingAuth(sapling::init_batch_validator(false)),
+        orchardAuth(orchard::init_batch_validator(false)) {}
+};
+
 /** Apply the effects of this block (with given index) on the UTXO set represented by coins.
  *  Validity checks that depend on the UTXO set are also done; ConnectBlock()
- *  can fail if those validity checks fail (among other reasons). */
+ *  can fail if those validity checks fail (among other reasons).
+ *  If pshieldedBatch is set, Sapling and Orchard authorizations are deferred to it. */
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins,
                   const CChainParams& chainparams,
-                  bool fJustCheck = false, CheckAs blockChecks = CheckAs::Block);
+                  bool fJustCheck = false, CheckAs blockChecks = CheckAs::Block,
+                  CShieldedAuthBatch* pshieldedBatch = nullptr);
+
+/**
+ * Compute the effect of `block` on the chain supply and the value in each value
+ * pool. This requires `pindex->nHeight` and `pindex->pprev` to be set.
+ */
+void SetChainPoolValues(const CChainParams& chainparams, const CBlock& block, CBlockIndex* pindex);
 
 /**
  * Check a block is completely valid from start to finish (only works on top
@@ -642,12 +882,66 @@ bool InvalidateBlock(CValidationState& state, const CChainParams& chainparams, C
 /** Remove invalidity status from a block and its descendants. */
 bool ReconsiderBlock(CValidationState& state, CBlockIndex *pindex);
 
+/**
+ * Write a snapshot of the chain state at the current tip to `path` (see
+ * snapshot.h), returning its metadata, its hash and the number of chain
+ * state database records written.
+ */
+bool DumpSnapshot(
+    const CChainParams& chainparams,
+    const fs::path& path,
+    CSnapshotMetadata& metadata,
+    uint256& hashSnapshot,
+    uint64_t& nRecords,
+    std::string& strError);
+
+/** Read and check the metadata at the start of a chain state snapshot file. */
+bool ReadSnapshotMetadata(
+    const CChainParams& chainparams,
+    const fs::path& path,
+    CSnapshotMetadata& metadata,
+    std::string& strError);
+
+/**
+ * Replace the chain state with the snapshot at `path`, whose hash must be the
+ * one the chain parameters give for its base block. The header of the
+ * snapshot base block must already be on the best header chain, and the
+ * active chain must not have reached it yet. The file is read once, and its
+ * hash is checked after it has been written to the coins database; if it
+ * doesn't match, the node is shut down and must be reindexed. Afterwards the
+ * node behaves as if the blocks before the snapshot base had been pruned.
+ * Must not be called with cs_main held.
+ */
+bool LoadSnapshot(
+    const CChainParams& chainparams,
+    const fs::path& path,
+    CSnapshotMetadata& metadata,
+    uint64_t& nRecords,
+    std::string& strError);
+
+/** Dump the mempool to mempool.dat in the data directory. */
+bool DumpMempool();
+
+/**
+ * Load the mempool from mempool.dat in the data directory. Transactions are
+ * accepted with their original entry times and fee deltas, and checked in
+ * full, as the file is not authenticated; their proofs and signatures are
+ * verified in batches on the precheck threads.
+ */
+bool LoadMempool(const CChainParams& chainparams);
+
 /** The currently-connected chain of blocks (protected by cs_main). */
 extern CChain chainActive;
 
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the coins database (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
+/** Global variable that points to the view writing to the coins database in the background (protected by cs_main) */
+extern CCoinsViewAsyncWriter *pcoinswriter;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
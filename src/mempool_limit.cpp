@@ -23,13 +23,21 @@ void RecentlyEvictedList::pruneList()
 }
 
 void RecentlyEvictedList::add(const uint256& txId)
+{
+    add(txId, clock->GetTime());
+}
+
+void RecentlyEvictedList::add(const uint256& txId, int64_t time)
 {
     pruneList();
+    if (clock->GetTime() - time > timeToKeep) {
+        return;
+    }
     if (txIdsAndTimes.size() == capacity) {
         txIdSet.erase(txIdsAndTimes.front().first);
         txIdsAndTimes.pop_front();
     }
-    txIdsAndTimes.push_back(std::make_pair(txId, clock->GetTime()));
+    txIdsAndTimes.push_back(std::make_pair(txId, time));
     txIdSet.insert(txId);
 }
 
@@ -39,6 +47,12 @@ bool RecentlyEvictedList::contains(const uint256& txId)
     return txIdSet.count(txId) > 0;
 }
 
+std::vector<std::pair<uint256, int64_t>> RecentlyEvictedList::entries()
+{
+    pruneList();
+    return std::vector<std::pair<uint256, int64_t>>(txIdsAndTimes.begin(), txIdsAndTimes.end());
+}
+
 std::pair<int64_t, int64_t> MempoolCostAndEvictionWeight(const CTransaction& tx, const CAmount& fee)
 {
     size_t memUsage = RecursiveDynamicUsage(tx);
@@ -52,7 +52,12 @@ public:
         RecentlyEvictedList(clock_, EVICTION_MEMORY_ENTRIES, timeToKeep_) {}
 
     void add(const uint256& txId);
+    // Remember a transaction evicted at the given time (seconds since epoch),
+    // such as one evicted before the node restarted.
+    void add(const uint256& txId, int64_t time);
     bool contains(const uint256& txId);
+    // The evicted transactions still remembered, with their eviction times.
+    std::vector<std::pair<uint256, int64_t>> entries();
 };
 
 
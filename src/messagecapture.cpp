@@ -0,0 +1,237 @@
+// Copyright (c) 2026 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "messagecapture.h"
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "hash.h"
+#include "init.h"
+#include "main.h"
+#include "streams.h"
+#include "sync.h"
+#include "util/system.h"
+#include "util/time.h"
+
+#include <map>
+
+bool fCaptureMessages = DEFAULT_CAPTURE_MESSAGES;
+
+namespace {
+
+CCriticalSection cs_capture;
+FILE* fileCapture = NULL;
+
+// Handling time of the replayed messages of one command.
+struct CReplayStats {
+    uint64_t nCount = 0;
+    int64_t nTotalTime = 0;
+    int64_t nMaxTime = 0;
+
+    void Add(int64_t nTime) {
+        nCount++;
+        nTotalTime += nTime;
+        nMaxTime = std::max(nMaxTime, nTime);
+    }
+};
+
+// Discard what the message handler queued to send to a replayed peer.
+void DiscardSendBuffer(CNode* pnode)
+{
+    LOCK(pnode->cs_vSend);
+    pnode->vSendMsg.clear();
+    pnode->nSendSize = 0;
+    pnode->nSendOffset = 0;
+}
+
+} // anon namespace
+
+bool OpenMessageCapture()
+{
+    fs::path pathDir = GetDataDir() / "message_capture";
+    TryCreateDirectory(pathDir);
+    // Name the file after the time the capture started, with a counter if
+    // the node was started more than once within that second.
+    int64_t nStartTime = GetTime();
+    fs::path path = pathDir / strprintf("%d.dat", nStartTime);
+    for (int n = 1; fs::exists(path); n++) {
+        path = pathDir / strprintf("%d-%d.dat", nStartTime, n);
+    }
+
+    LOCK(cs_capture);
+    CAutoFile file(fsbridge::fopen(path, "wb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        return error("%s: failed to open %s", __func__, path.string());
+    }
+    try {
+        file.write((const char*)Params().MessageStart(), CMessageHeader::MESSAGE_START_SIZE);
+        file << MESSAGE_CAPTURE_VERSION;
+    } catch (const std::exception& e) {
+        return error("%s: failed to write to %s: %s", __func__, path.string(), e.what());
+    }
+    fileCapture = file.release();
+    LogPrintf("Capturing received messages to %s\n", path.string());
+    return true;
+}
+
+void CaptureMessage(const CNode* pnode, const CNetMessage& msg)
+{
+    CCapturedMessage captured;
+    captured.nTime = msg.nTime;
+    captured.nodeId = pnode->GetId();
+    captured.fInbound = pnode->fInbound;
+    captured.strCommand = msg.hdr.GetCommand();
+    captured.vPayload.assign(msg.vRecv.begin(), msg.vRecv.begin() + msg.hdr.nMessageSize);
+
+    CDataStream ssCaptured(SER_DISK, CLIENT_VERSION);
+    ssCaptured << captured;
+
+    LOCK(cs_capture);
+    if (fileCapture == NULL) return;
+    if (fwrite(ssCaptured.data(), 1, ssCaptured.size(), fileCapture) != ssCaptured.size()) {
+        LogPrintf("%s: failed to write to the message capture, stopping capture\n", __func__);
+        fclose(fileCapture);
+        fileCapture = NULL;
+    }
+}
+
+void CloseMessageCapture()
+{
+    LOCK(cs_capture);
+    if (fileCapture != NULL) {
+        fclose(fileCapture);
+        fileCapture = NULL;
+    }
+}
+
+bool ReplayMessages(const CChainParams& chainparams, const fs::path& path)
+{
+    CAutoFile file(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        return error("%s: failed to open %s", __func__, path.string());
+    }
+    CMessageHeader::MessageStartChars pchMessageStart;
+    uint32_t nVersion;
+    try {
+        file.read((char*)pchMessageStart, CMessageHeader::MESSAGE_START_SIZE);
+        file >> nVersion;
+    } catch (const std::exception& e) {
+        return error("%s: failed to read %s: %s", __func__, path.string(), e.what());
+    }
+    if (memcmp(pchMessageStart, chainparams.MessageStart(), CMessageHeader::MESSAGE_START_SIZE) != 0) {
+        return error("%s: %s was captured on a different network", __func__, path.string());
+    }
+    if (nVersion != MESSAGE_CAPTURE_VERSION) {
+        return error("%s: %s has unsupported version %d", __func__, path.string(), nVersion);
+    }
+
+    // When the node runs on a fixed clock (-mocktime), follow the clock of
+    // the capture, so that time-dependent handling is reproduced.
+    bool fFollowClock = GetNodeClock() == FixedClock::Instance();
+
+    LogPrintf("Replaying messages from %s\n", path.string());
+    std::map<int64_t, CNode*> mapReplayNodes;
+    std::map<std::string, CReplayStats> mapStats;
+    CReplayStats totalStats;
+    uint64_t nSkipped = 0;
+    int64_t nStart = GetTimeMicros();
+    while (!ShutdownRequested()) {
+        CCapturedMessage captured;
+        try {
+            file >> captured;
+        } catch (const std::ios_base::failure&) {
+            // End of the capture, or a record cut short when it was written.
+            break;
+        }
+
+        // Replay the messages of each captured peer from a peer of its own,
+        // without a socket, so that nothing is sent.
+        CNode* pnode = mapReplayNodes[captured.nodeId];
+        if (pnode == NULL) {
+            CAddress addr(CService(CNetAddr("127.0.0.1"), chainparams.GetDefaultPort()));
+            pnode = new CNode(INVALID_SOCKET, addr, strprintf("replay-%d", captured.nodeId), captured.fInbound);
+            pnode->AddRef();
+            mapReplayNodes[captured.nodeId] = pnode;
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+        if (pnode->fDisconnect) {
+            nSkipped++;
+            continue;
+        }
+
+        if (fFollowClock) {
+            LOCK2(cs_main, cs_vNodes);
+            FixedClock::Instance()->Set(std::chrono::seconds(captured.nTime / 1000000));
+            for (CNode* pnodeReplay : vNodes) {
+                pnodeReplay->nLastSend = pnodeReplay->nLastRecv = GetTime();
+            }
+        }
+
+        // Frame the message the way it was received.
+        CMessageHeader hdr(chainparams.MessageStart(), captured.strCommand.c_str(), captured.vPayload.size());
+        uint256 hash = Hash(captured.vPayload.begin(), captured.vPayload.end());
+        memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+        CDataStream ssMessage(SER_NETWORK, PROTOCOL_VERSION);
+        ssMessage << hdr;
+        ssMessage.write((const char*)captured.vPayload.data(), captured.vPayload.size());
+        {
+            LOCK(pnode->cs_vRecvMsg);
+            if (!pnode->ReceiveMsgBytes(ssMessage.data(), ssMessage.size())) {
+                pnode->CloseSocketDisconnect();
+                continue;
+            }
+            pnode->vRecvMsg.back().nTime = captured.nTime;
+        }
+
+        int64_t nMessageStart = GetTimeMicros();
+        GetNodeSignals().PrecheckMessages(chainparams, std::vector<CNode*>(1, pnode));
+        // Handle the message, then anything it left to do, such as answering
+        // a getdata, the way the message handler thread does.
+        while (!pnode->fDisconnect) {
+            {
+                LOCK(pnode->cs_vRecvMsg);
+                if (pnode->vRecvMsg.empty() && pnode->vRecvGetData.empty() && pnode->orphan_work_set.empty()) {
+                    break;
+                }
+                if (!GetNodeSignals().ProcessMessages(chainparams, pnode)) {
+                    pnode->CloseSocketDisconnect();
+                }
+            }
+            {
+                LOCK(pnode->cs_sendProcessing);
+                GetNodeSignals().SendMessages(chainparams.GetConsensus(), pnode);
+            }
+            DiscardSendBuffer(pnode);
+        }
+        int64_t nTime = GetTimeMicros() - nMessageStart;
+        mapStats[SanitizeString(captured.strCommand)].Add(nTime);
+        totalStats.Add(nTime);
+    }
+    int64_t nElapsed = GetTimeMicros() - nStart;
+
+    LogPrintf("Replayed %u messages from %u peers in %.3fs (%.3fs handling them, %.1f messages/s), skipped %u from disconnected peers\n",
+        totalStats.nCount, mapReplayNodes.size(), nElapsed * 0.000001, totalStats.nTotalTime * 0.000001,
+        totalStats.nTotalTime > 0 ? totalStats.nCount * 1000000.0 / totalStats.nTotalTime : 0.0, nSkipped);
+    // Handlers take cs_main for almost all of the time they run, so this is
+    // also how long each kind of message held it.
+    for (const auto& entry : mapStats) {
+        const CReplayStats& stats = entry.second;
+        LogPrintf("  %-12s %8u messages, %10.3fms total, %8.3fms mean, %8.3fms max\n",
+            entry.first, stats.nCount, stats.nTotalTime * 0.001,
+            stats.nTotalTime * 0.001 / stats.nCount, stats.nMaxTime * 0.001);
+    }
+
+    {
+        LOCK(cs_vNodes);
+        for (const auto& entry : mapReplayNodes) {
+            vNodes.erase(std::remove(vNodes.begin(), vNodes.end(), entry.second), vNodes.end());
+        }
+    }
+    for (const auto& entry : mapReplayNodes) {
+        entry.second->Release();
+        delete entry.second;
+    }
+    return true;
+}
@@ -0,0 +1,75 @@
+// Copyright (c) 2026 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#ifndef ZCASH_MESSAGECAPTURE_H
+#define ZCASH_MESSAGECAPTURE_H
+
+#include "fs.h"
+#include "net.h"
+#include "serialize.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * Capture and replay of received P2P messages.
+ *
+ * With -capturemessages, every complete message received from a peer is
+ * appended to a file in the message_capture directory of the datadir, with
+ * the time it was received and the peer it came from. With
+ * -replaymessages=<file>, the node does not connect to the network; instead
+ * it feeds the messages of a capture to the message handler, as if they had
+ * been received from the same peers, and logs how long handling them took.
+ */
+
+/** Default for -capturemessages. */
+static const bool DEFAULT_CAPTURE_MESSAGES = false;
+/** Version of the capture file format. */
+static const uint32_t MESSAGE_CAPTURE_VERSION = 1;
+
+extern bool fCaptureMessages;
+
+/** A received message, as recorded in a capture file. */
+class CCapturedMessage
+{
+public:
+    //! Time the message was received, in microseconds.
+    int64_t nTime;
+    //! Id of the peer it was received from.
+    int64_t nodeId;
+    //! Whether the peer had connected to us.
+    bool fInbound;
+    std::string strCommand;
+    std::vector<unsigned char> vPayload;
+
+    CCapturedMessage() : nTime(0), nodeId(-1), fInbound(false) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(nTime);
+        READWRITE(nodeId);
+        READWRITE(fInbound);
+        READWRITE(LIMITED_STRING(strCommand, CMessageHeader::COMMAND_SIZE));
+        READWRITE(vPayload);
+    }
+};
+
+/** Start capturing received messages to a new file. Returns false on failure. */
+bool OpenMessageCapture();
+/** Append a complete message received from pnode to the capture. */
+void CaptureMessage(const CNode* pnode, const CNetMessage& msg);
+/** Stop capturing and close the capture file. */
+void CloseMessageCapture();
+
+/**
+ * Feed the messages captured in the file at path to the message handler, and
+ * log the time spent handling them. Returns false if the file could not be
+ * read.
+ */
+bool ReplayMessages(const CChainParams& chainparams, const fs::path& path);
+
+#endif // ZCASH_MESSAGECAPTURE_H
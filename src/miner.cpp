@@ -65,6 +65,153 @@ using namespace std;
 std::optional<uint64_t> last_block_num_txs;
 std::optional<uint64_t> last_block_size;
 
+namespace {
+
+// The fee and sigop count (legacy and P2SH) of a transaction, as found when it
+// was connected to the tip as part of a block template. Both depend only on
+// the transaction and on the outputs it spends, which can't change while the
+// tip stays the same.
+struct CValidatedTemplateTx
+{
+    CAmount nFee;
+    unsigned int nSigOps;
+};
+
+// Transactions of the block templates that passed TestBlockValidity() on top
+// of hashValidatedTemplatePrev. Guarded by cs_main.
+uint256 hashValidatedTemplatePrev;
+std::map<WTxId, CValidatedTemplateTx> mapValidatedTemplateTxs;
+
+// Return true if every transaction of the template has been validated in an
+// earlier template on the same tip, and the transactions can't conflict with
+// or depend on each other in ways that per-transaction validity misses.
+bool IsValidatedTemplateDelta(const CBlock& block)
+{
+    std::set<uint256> setTxids;
+    std::set<COutPoint> setSpent;
+    std::set<libzcash::nullifier_t> setSaplingNullifiers;
+    std::set<uint256> setOrchardNullifiers;
+    for (size_t i = 1; i < block.vtx.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+        // Sprout JoinSplits may be anchored to earlier transactions of the block.
+        if (!tx.vJoinSplit.empty() || !mapValidatedTemplateTxs.count(tx.GetWTxId())) {
+            return false;
+        }
+        for (const CTxIn& txin : tx.vin) {
+            // A transaction of the template must follow the ones it spends
+            // from. An output that is neither in the UTXO set nor created
+            // earlier in the template came from a transaction that was
+            // validated together with the spender, and is missing here.
+            if (!setSpent.insert(txin.prevout).second ||
+                (!setTxids.count(txin.prevout.hash) && !pcoinsTip->HaveCoins(txin.prevout.hash))) {
+                return false;
+            }
+        }
+        for (const auto& spend : tx.GetSaplingSpends()) {
+            if (!setSaplingNullifiers.insert(spend.nullifier()).second) return false;
+        }
+        for (const uint256& nf : tx.GetOrchardBundle().GetNullifiers()) {
+            if (!setOrchardNullifiers.insert(nf).second) return false;
+        }
+        setTxids.insert(tx.GetHash());
+    }
+    return true;
+}
+
+// Run the checks of ConnectBlock() that depend on the template as a whole,
+// using the fees and sigop counts cached for its transactions.
+bool CheckValidatedTemplateDelta(CValidationState& state, const CChainParams& chainparams, const CBlock& block, CBlockIndex* pindexPrev)
+{
+    const Consensus::Params& consensusParams = chainparams.GetConsensus();
+    const CTransaction& coinbase = block.vtx[0];
+
+    CBlockIndex indexDummy(block);
+    indexDummy.pprev = pindexPrev;
+    indexDummy.nHeight = pindexPrev->nHeight + 1;
+    SetChainPoolValues(chainparams, block, &indexDummy);
+
+    if (chainparams.ZIP209Enabled() &&
+        ((indexDummy.nChainSproutValue && *indexDummy.nChainSproutValue < 0) ||
+         (indexDummy.nChainSaplingValue && *indexDummy.nChainSaplingValue < 0) ||
+         (indexDummy.nChainOrchardValue && *indexDummy.nChainOrchardValue < 0))) {
+        return state.DoS(100, error("%s: turnstile violation in a shielded value pool", __func__),
+                         REJECT_INVALID, "turnstile-violation");
+    }
+
+    const CCoins* coins = pcoinsTip->AccessCoins(coinbase.GetHash());
+    if (coins && !coins->IsPruned()) {
+        return state.DoS(100, error("%s: tried to overwrite transaction", __func__),
+                         REJECT_INVALID, "bad-txns-BIP30");
+    }
+
+    unsigned int nSigOps = GetLegacySigOpCount(coinbase);
+    CAmount nFees = 0;
+    for (size_t i = 1; i < block.vtx.size(); i++) {
+        const CValidatedTemplateTx& validated = mapValidatedTemplateTxs.at(block.vtx[i].GetWTxId());
+        nSigOps += validated.nSigOps;
+        nFees += validated.nFee;
+    }
+    if (nSigOps > MAX_BLOCK_SIGOPS) {
+        return state.DoS(100, error("%s: too many sigops", __func__),
+                         REJECT_INVALID, "bad-blk-sigops");
+    }
+
+    CAmount cbTotalOutputValue = coinbase.GetValueOut() + indexDummy.nLockboxValue;
+    CAmount cbTotalInputValue = consensusParams.GetBlockSubsidy(indexDummy.nHeight) + nFees;
+    if (cbTotalOutputValue > cbTotalInputValue) {
+        return state.DoS(100, error("%s: coinbase pays too much", __func__),
+                         REJECT_INVALID, "bad-cb-amount");
+    } else if (consensusParams.NetworkUpgradeActive(indexDummy.nHeight, Consensus::UPGRADE_NU6) &&
+               cbTotalOutputValue != cbTotalInputValue) {
+        return state.DoS(100, error("%s: coinbase pays the wrong amount", __func__),
+                         REJECT_INVALID, "bad-cb-not-exact");
+    }
+    return true;
+}
+
+// Check a block template like TestBlockValidity(), but only connect it to the
+// tip when it has transactions that no earlier template on this tip had.
+//
+// Before Heartwood, hashBlockCommitments is the Sapling tree root after the
+// block's transactions, which only ConnectBlock() checks, so templates for
+// those heights are always checked in full. Templates with Sprout JoinSplits
+// are too, because of their intra-block anchors.
+bool TestBlockTemplateValidity(CValidationState& state, const CChainParams& chainparams, const CBlock& block, CBlockIndex* pindexPrev)
+{
+    AssertLockHeld(cs_main);
+    if (hashValidatedTemplatePrev != pindexPrev->GetBlockHash()) {
+        hashValidatedTemplatePrev = pindexPrev->GetBlockHash();
+        mapValidatedTemplateTxs.clear();
+    }
+
+    int nHeight = pindexPrev->nHeight + 1;
+    if (chainparams.GetConsensus().NetworkUpgradeActive(nHeight, Consensus::UPGRADE_HEARTWOOD) &&
+        IsValidatedTemplateDelta(block)) {
+        auto verifier = ProofVerifier::Disabled();
+        return ContextualCheckBlockHeader(block, state, chainparams, pindexPrev) &&
+               CheckBlock(block, state, chainparams, verifier, false, false, true) &&
+               ContextualCheckBlock(block, state, chainparams, pindexPrev, true) &&
+               CheckValidatedTemplateDelta(state, chainparams, block, pindexPrev);
+    }
+
+    if (!TestBlockValidity(state, chainparams, block, pindexPrev, true)) {
+        return false;
+    }
+
+    CCoinsViewCache view(pcoinsTip);
+    for (size_t i = 1; i < block.vtx.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+        CValidatedTemplateTx validated;
+        validated.nFee = view.GetValueIn(tx) - tx.GetValueOut();
+        validated.nSigOps = GetLegacySigOpCount(tx) + GetP2SHSigOpCount(tx, view);
+        mapValidatedTemplateTxs[tx.GetWTxId()] = validated;
+        UpdateCoins(tx, view, nHeight);
+    }
+    return true;
+}
+
+} // anon namespace
+
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
 {
     int64_t nOldTime = pblock->nTime;
@@ -479,7 +626,7 @@ CBlockTemplate* BlockAssembler::CreateNewBlock(
     pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
 
     CValidationState state;
-    if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, true)) {
+    if (!TestBlockTemplateValidity(state, chainparams, *pblock, pindexPrev)) {
         throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
     }
 
@@ -615,41 +762,35 @@ void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
 
 void BlockAssembler::constructZIP317BlockTemplate()
 {
-    CTxMemPool::weightedCandidates candidatesPayingConventionalFee;
-    CTxMemPool::weightedCandidates candidatesNotPayingConventionalFee;
-
-    for (auto mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
-    {
-        int128_t weightRatio = mi->GetWeightRatio();
-        if (weightRatio >= WEIGHT_RATIO_SCALE) {
-            candidatesPayingConventionalFee.add(mi->GetTx().GetHash(), mi, weightRatio);
-        } else {
-            candidatesNotPayingConventionalFee.add(mi->GetTx().GetHash(), mi, weightRatio);
-        }
-    }
-
+    // The mempool keeps the candidate sets up to date. They are sampled in
+    // place, and what was taken is put back afterwards, so that the cost
+    // depends on the size of the block rather than of the mempool.
     CTxMemPool::queueEntries waiting;
     CTxMemPool::queueEntries cleared;
-    addTransactions(candidatesPayingConventionalFee, waiting, cleared);
-    addTransactions(candidatesNotPayingConventionalFee, waiting, cleared);
+    addTransactions(true, waiting, cleared);
+    addTransactions(false, waiting, cleared);
+    mempool.RestoreCandidates();
 }
 
 void BlockAssembler::addTransactions(
-    CTxMemPool::weightedCandidates& candidates,
+    bool fPayingConventionalFee,
     CTxMemPool::queueEntries& waiting,
     CTxMemPool::queueEntries& cleared)
 {
     size_t nBlockUnpaidActions = 0;
 
-    while (!blockFinished && !(candidates.empty() && cleared.empty()))
+    while (!blockFinished)
     {
         CTxMemPool::txiter iter;
         if (cleared.empty()) {
             // If no txs that were previously postponed are available to try
             // again, then select the next transaction randomly by weight ratio
             // from the candidate set.
-            assert(!candidates.empty());
-            iter = std::get<1>(candidates.takeRandom().value());
+            auto candidate = mempool.TakeRandomCandidate(fPayingConventionalFee);
+            if (!candidate.has_value()) {
+                break;
+            }
+            iter = candidate.value();
         } else {
             // If a previously postponed tx is available to try again, then it
             // has already been randomly sampled, so just take it in order.
@@ -143,7 +143,7 @@ public:
 private:
     void constructZIP317BlockTemplate();
     void addTransactions(
-        CTxMemPool::weightedCandidates& candidates,
+        bool fPayingConventionalFee,
         CTxMemPool::queueEntries& waiting,
         CTxMemPool::queueEntries& cleared);
 
@@ -19,6 +19,7 @@
 #include "crypto/common.h"
 #include "crypto/sha256.h"
 #include "hash.h"
+#include "messagecapture.h"
 #include "primitives/transaction.h"
 #include "scheduler.h"
 #include "ui_interface.h"
@@ -27,6 +28,11 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
 #endif
 
 #include <boost/thread.hpp>
@@ -38,6 +44,9 @@
 // Dump addresses to peers.dat and banlist.dat every 15 minutes (900s)
 #define DUMP_ADDRESSES_INTERVAL 900
 
+// Most buffers of queued messages handed to the socket in one call
+#define MAX_SEND_BUFFERS 64
+
 #if !defined(HAVE_MSG_NOSIGNAL) && !defined(MSG_NOSIGNAL)
 #define MSG_NOSIGNAL 0
 #endif
@@ -46,6 +55,9 @@ using namespace std;
 
 namespace {
     const int MAX_OUTBOUND_CONNECTIONS = 8;
+    // How long the network thread waits for socket events before checking
+    // whether there is data to send.
+    const int SOCKET_EVENTS_TIMEOUT_MS = 50;
 
     struct ListenSocket {
         SOCKET socket;
@@ -67,6 +79,10 @@ static bool vfLimited[NET_MAX] = {};
 static CNode* pnodeLocalHost = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
+#ifdef USE_EPOLL
+// The epoll instance that the network thread waits on.
+static int hEpoll = -1;
+#endif
 CAddrMan addrman;
 int nMaxConnections = DEFAULT_MAX_PEER_CONNECTIONS;
 bool fAddressesInitialized = false;
@@ -748,6 +764,8 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
+            if (fCaptureMessages)
+                CaptureMessage(this, msg);
             std::string strCommand = SanitizeString(msg.hdr.GetCommand());
             MetricsIncrementCounter("zcash.net.in.messages", "command", strCommand.c_str());
             MetricsCounter(
@@ -818,17 +836,54 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSendMessage>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
+        assert(it->size() > pnode->nSendOffset);
+
+        // Gather the unsent bytes of as many queued messages as one call can
+        // take: the bytes of each message, then its shared payload, if any.
+        std::pair<const char*, size_t> vBuffers[MAX_SEND_BUFFERS];
+        size_t nBuffers = 0;
+        size_t nRequested = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (auto itMsg = it; itMsg != pnode->vSendMsg.end() && nBuffers + 2 <= MAX_SEND_BUFFERS; itMsg++) {
+            const CSendMessage& msg = *itMsg;
+            if (nOffset < msg.vData.size()) {
+                vBuffers[nBuffers++] = std::make_pair(&msg.vData[nOffset], msg.vData.size() - nOffset);
+                nOffset = 0;
+            } else {
+                nOffset -= msg.vData.size();
+            }
+            if (msg.shared && nOffset < msg.shared->vPayload.size()) {
+                const std::vector<unsigned char>& vPayload = msg.shared->vPayload;
+                vBuffers[nBuffers++] = std::make_pair((const char*)&vPayload[nOffset], vPayload.size() - nOffset);
+            }
+            nOffset = 0;
+        }
+        for (size_t i = 0; i < nBuffers; i++) {
+            nRequested += vBuffers[i].second;
+        }
+
         int nBytes = 0;
         {
             LOCK(pnode->cs_hSocket);
             if (pnode->hSocket == INVALID_SOCKET)
                 break;
-            nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#ifdef WIN32
+            nRequested = vBuffers[0].second;
+            nBytes = send(pnode->hSocket, vBuffers[0].first, vBuffers[0].second, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+            struct iovec iov[MAX_SEND_BUFFERS];
+            for (size_t i = 0; i < nBuffers; i++) {
+                iov[i].iov_base = (void*)vBuffers[i].first;
+                iov[i].iov_len = vBuffers[i].second;
+            }
+            struct msghdr msghdr = {};
+            msghdr.msg_iov = iov;
+            msghdr.msg_iovlen = nBuffers;
+            nBytes = sendmsg(pnode->hSocket, &msghdr, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         }
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
@@ -836,14 +891,22 @@ void SocketSendData(CNode *pnode)
                 LOCK(pnode->cs_vSend);
                 pnode->nSendBytes += nBytes;
             }
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            // Drop the messages that were sent completely.
+            size_t nSent = nBytes;
+            while (nSent > 0) {
+                size_t nRemaining = it->size() - pnode->nSendOffset;
+                if (nSent < nRemaining) {
+                    pnode->nSendOffset += nSent;
+                    break;
+                }
+                nSent -= nRemaining;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= it->size();
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+            if ((size_t)nBytes < nRequested) {
+                // could not send everything; stop sending more
                 break;
             }
         } else {
@@ -1092,6 +1155,192 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
     }
 }
 
+/**
+ * Decide whether to wait for pnode's socket to become writable or readable.
+ *
+ * Implements the following logic:
+ * - If there is data to send, wait for sending data. As this only happens when
+ *   optimistic write failed, we choose to first drain the write buffer in this
+ *   case before receiving more. This avoids needlessly queueing received data,
+ *   if the remote peer is not themselves receiving data. This means properly
+ *   utilizing TCP flow control signaling.
+ * - Otherwise, if there is no (complete) message in the receive buffer, or
+ *   there is space left in the buffer, wait for receiving data.
+ * - (If neither of the above applies, there is certainly one message in the
+ *   receive buffer ready to be processed.)
+ * Together, that means that at least one of the following is always possible,
+ * so we don't deadlock:
+ * - We send some data.
+ * - We wait for data to be received (and disconnect after timeout).
+ * - We process a message in the buffer (message handler thread).
+ */
+static void GetSocketInterest(CNode* pnode, bool& fWantSend, bool& fWantRecv)
+{
+    {
+        LOCK(pnode->cs_vSend);
+        fWantSend = !pnode->vSendMsg.empty();
+    }
+    fWantRecv = false;
+    if (!fWantSend) {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        fWantRecv = lockRecv && (
+            pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+            pnode->GetTotalRecvSize() <= ReceiveFloodSize());
+    }
+}
+
+#ifdef USE_EPOLL
+/**
+ * Wait for socket events with epoll.
+ *
+ * Sockets stay registered with the epoll instance for as long as they are
+ * open (closing a socket unregisters it), and are only modified when the
+ * events we want to wait for change. So unlike select(), the cost of a wait
+ * depends on the number of ready sockets rather than the number of
+ * connections, and there is no limit on the socket numbers.
+ */
+static void SocketEvents(std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set)
+{
+    if (hEpoll == -1) {
+        hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpoll == -1)
+            throw std::runtime_error(strprintf("epoll_create1 failed: %s", NetworkErrorString(errno)));
+        for (const ListenSocket& hListenSocket : vhListenSocket) {
+            struct epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.fd = hListenSocket.socket;
+            if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0)
+                LogPrintf("epoll_ctl for listening socket failed: %s\n", NetworkErrorString(errno));
+        }
+    }
+
+    size_t nSockets = vhListenSocket.size();
+    {
+        LOCK(cs_vNodes);
+        for (CNode* pnode : vNodes)
+        {
+            bool fWantSend, fWantRecv;
+            GetSocketInterest(pnode, fWantSend, fWantRecv);
+            uint32_t nEvents = fWantSend ? EPOLLOUT : fWantRecv ? EPOLLIN : 0;
+
+            LOCK(pnode->cs_hSocket);
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            nSockets++;
+
+            // Errors and hangups are reported even when no events are requested.
+            if (pnode->fSocketRegistered && pnode->nSocketEvents == nEvents)
+                continue;
+            struct epoll_event event = {};
+            event.events = nEvents;
+            event.data.fd = pnode->hSocket;
+            if (epoll_ctl(hEpoll, pnode->fSocketRegistered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, pnode->hSocket, &event) != 0) {
+                LogPrintf("epoll_ctl for peer=%d failed: %s\n", pnode->id, NetworkErrorString(errno));
+                pnode->fDisconnect = true;
+                continue;
+            }
+            pnode->fSocketRegistered = true;
+            pnode->nSocketEvents = nEvents;
+        }
+    }
+
+    std::vector<struct epoll_event> events(std::max<size_t>(nSockets, 1));
+    int nEvents = epoll_wait(hEpoll, events.data(), events.size(), SOCKET_EVENTS_TIMEOUT_MS);
+    boost::this_thread::interruption_point();
+
+    if (nEvents == -1) {
+        if (errno != EINTR) {
+            LogPrintf("socket epoll error %s\n", NetworkErrorString(errno));
+            MilliSleep(SOCKET_EVENTS_TIMEOUT_MS);
+        }
+        return;
+    }
+
+    for (int i = 0; i < nEvents; i++) {
+        SOCKET hSocket = events[i].data.fd;
+        if (events[i].events & EPOLLIN)
+            recv_set.insert(hSocket);
+        if (events[i].events & EPOLLOUT)
+            send_set.insert(hSocket);
+        if (events[i].events & (EPOLLERR | EPOLLHUP))
+            error_set.insert(hSocket);
+    }
+}
+#else
+static void SocketEvents(std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set)
+{
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = SOCKET_EVENTS_TIMEOUT_MS * 1000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    std::vector<SOCKET> vSockets;
+
+    for (const ListenSocket& hListenSocket : vhListenSocket) {
+        FD_SET(hListenSocket.socket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket.socket);
+        vSockets.push_back(hListenSocket.socket);
+    }
+
+    {
+        LOCK(cs_vNodes);
+        for (CNode* pnode : vNodes)
+        {
+            bool fWantSend, fWantRecv;
+            GetSocketInterest(pnode, fWantSend, fWantRecv);
+
+            LOCK(pnode->cs_hSocket);
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, pnode->hSocket);
+            vSockets.push_back(pnode->hSocket);
+
+            if (fWantSend) {
+                FD_SET(pnode->hSocket, &fdsetSend);
+            } else if (fWantRecv) {
+                FD_SET(pnode->hSocket, &fdsetRecv);
+            }
+        }
+    }
+
+    bool have_fds = !vSockets.empty();
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    boost::this_thread::interruption_point();
+
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            for (SOCKET hSocket : vSockets)
+                FD_SET(hSocket, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(timeout.tv_usec/1000);
+    }
+
+    for (SOCKET hSocket : vSockets) {
+        if (FD_ISSET(hSocket, &fdsetRecv))
+            recv_set.insert(hSocket);
+        if (FD_ISSET(hSocket, &fdsetSend))
+            send_set.insert(hSocket);
+        if (FD_ISSET(hSocket, &fdsetError))
+            error_set.insert(hSocket);
+    }
+}
+#endif
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
@@ -1168,101 +1417,15 @@ void ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        for (const ListenSocket& hListenSocket : vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
-
-        {
-            LOCK(cs_vNodes);
-            for (CNode* pnode : vNodes)
-            {
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signaling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-
-                bool select_send;
-                {
-                    LOCK(pnode->cs_vSend);
-                    select_send = !pnode->vSendMsg.empty();
-                }
-
-                bool select_recv;
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    select_recv = lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize());
-                }
-
-                LOCK(pnode->cs_hSocket);
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                if (select_send) {
-                    FD_SET(pnode->hSocket, &fdsetSend);
-                    continue;
-                }
-                if (select_recv) {
-                    FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
-        }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
-        }
+        std::set<SOCKET> recv_set, send_set, error_set;
+        SocketEvents(recv_set, send_set, error_set);
 
         //
         // Accept new connections
         //
         for (const ListenSocket& hListenSocket : vhListenSocket)
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            if (hListenSocket.socket != INVALID_SOCKET && recv_set.count(hListenSocket.socket))
             {
                 AcceptConnection(hListenSocket);
             }
@@ -1294,9 +1457,9 @@ void ThreadSocketHandler()
                 LOCK(pnode->cs_hSocket);
                 if (pnode->hSocket == INVALID_SOCKET)
                     continue;
-                recvSet = FD_ISSET(pnode->hSocket, &fdsetRecv);
-                sendSet = FD_ISSET(pnode->hSocket, &fdsetSend);
-                errorSet = FD_ISSET(pnode->hSocket, &fdsetError);
+                recvSet = recv_set.count(pnode->hSocket) > 0;
+                sendSet = send_set.count(pnode->hSocket) > 0;
+                errorSet = error_set.count(pnode->hSocket) > 0;
             }
             if (recvSet || errorSet)
             {
@@ -1701,6 +1864,10 @@ void ThreadMessageHandler()
 
         bool fSleep = true;
 
+        // Deserialize and check transactions and blocks in parallel, ahead of
+        // processing them one at a time below.
+        g_signals.PrecheckMessages(chainparams, vNodesCopy);
+
         for (CNode* pnode : vNodesCopy)
         {
             if (pnode->fDisconnect)
@@ -2014,6 +2181,12 @@ public:
             if (hListenSocket.socket != INVALID_SOCKET)
                 if (!CloseSocket(hListenSocket.socket))
                     LogPrintf("CloseSocket(hListenSocket) failed with error %s\n", NetworkErrorString(WSAGetLastError()));
+#ifdef USE_EPOLL
+        if (hEpoll != -1) {
+            close(hEpoll);
+            hEpoll = -1;
+        }
+#endif
 
         // clean up some globals (to help leak detection)
         for (CNode *pnode : vNodes)
@@ -2211,6 +2384,8 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
 {
     nServices = 0;
     hSocket = hSocketIn;
+    fSocketRegistered = false;
+    nSocketEvents = 0;
     nRecvVersion = INIT_PROTO_VERSION;
     nLastSend = 0;
     nLastRecv = 0;
@@ -2233,6 +2408,7 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     hashContinue = uint256();
     nStartingHeight = -1;
     fSendMempool = false;
+    nReconciliationSalt = 0;
     fGetAddr = false;
     nNextLocalAddrSend = 0;
     nNextAddrSend = 0;
@@ -2373,19 +2549,70 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    CSendMessage msg;
+    ssSend.GetAndClear(msg.vData);
+    QueueMessage(std::move(msg));
+
+    LEAVE_CRITICAL_SECTION(cs_vSend);
+}
+
+void CNode::PushSharedMessage(const std::shared_ptr<const CSharedMessage>& msg)
+{
+    try
+    {
+        BeginMessage(msg->strCommand.c_str());
+    }
+    catch (...)
+    {
+        AbortMessage();
+        throw;
+    }
+
+    MetricsIncrementCounter("zcash.net.out.messages", "command", strSendCommand.c_str());
+    if (mapArgs.count("-dropmessagestest") && GetRand(GetArg("-dropmessagestest", 2)) == 0)
+    {
+        LogPrint("net", "dropmessages DROPPING SEND MESSAGE\n");
+        AbortMessage();
+        return;
+    }
+    // -fuzzmessagestest does not apply, as the payload is shared.
+
+    // Only the header is written for this peer.
+    unsigned int nSize = msg->vPayload.size();
+    WriteLE32((uint8_t*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
+    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], msg->pchChecksum, CMessageHeader::CHECKSUM_SIZE);
+
+    LogPrint("net", "(%d bytes, shared) peer=%d\n", nSize, id);
+
+    CSendMessage sendMsg;
+    ssSend.GetAndClear(sendMsg.vData);
+    sendMsg.shared = msg;
+    QueueMessage(std::move(sendMsg));
+
+    LEAVE_CRITICAL_SECTION(cs_vSend);
+}
+
+// requires LOCK(cs_vSend)
+void CNode::QueueMessage(CSendMessage&& msg)
+{
+    size_t nSize = msg.size();
+    vSendMsg.push_back(std::move(msg));
+    nSendSize += nSize;
     MetricsCounter(
-        "zcash.net.out.bytes", (*it).size(),
+        "zcash.net.out.bytes", nSize,
         "command", strSendCommand.c_str());
     strSendCommand.clear();
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         SocketSendData(this);
+}
 
-    LEAVE_CRITICAL_SECTION(cs_vSend);
+CSharedMessage::CSharedMessage(const std::string& strCommandIn, std::vector<unsigned char>&& vPayloadIn) :
+    strCommand(strCommandIn), vPayload(std::move(vPayloadIn))
+{
+    uint256 hash = Hash(vPayload.begin(), vPayload.end());
+    memcpy(pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
 }
 
 /* static */ uint64_t CNode::CalculateKeyedNetGroup(const CAddress& ad)
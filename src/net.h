@@ -17,12 +17,14 @@
 #include "random.h"
 #include "streams.h"
 #include "sync.h"
+#include "txreconciliation.h"
 #include "uint256.h"
 #include "util/strencodings.h"
 #include "chainparams.h"
 
 #include <atomic>
 #include <deque>
+#include <memory>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -35,6 +37,7 @@
 
 class CAddrMan;
 class CBlockIndex;
+struct CMessagePrecheck;
 class CScheduler;
 class CNode;
 
@@ -124,6 +127,7 @@ struct CombinerAll
 struct CNodeSignals
 {
     boost::signals2::signal<int ()> GetHeight;
+    boost::signals2::signal<void (const CChainParams&, const std::vector<CNode*>&)> PrecheckMessages;
     boost::signals2::signal<bool (const CChainParams&, CNode*), CombinerAll> ProcessMessages;
     boost::signals2::signal<bool (const Consensus::Params&, CNode*), CombinerAll> SendMessages;
     boost::signals2::signal<void (NodeId, const CNode*)> InitializeNode;
@@ -219,6 +223,43 @@ public:
 
 
 
+/**
+ * A message payload serialized once, with its checksum, that can be queued
+ * to many peers without being copied again. Used for the transactions and
+ * blocks we relay, whose serialization does not depend on the protocol
+ * version of the peer.
+ */
+class CSharedMessage
+{
+public:
+    const std::string strCommand;
+    const std::vector<unsigned char> vPayload;
+    uint8_t pchChecksum[CMessageHeader::CHECKSUM_SIZE];
+
+    CSharedMessage(const std::string& strCommandIn, std::vector<unsigned char>&& vPayloadIn);
+
+    template<typename T>
+    static std::shared_ptr<const CSharedMessage> Make(const std::string& strCommand, const T& obj)
+    {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << obj;
+        return std::make_shared<const CSharedMessage>(strCommand, std::vector<unsigned char>(ss.begin(), ss.end()));
+    }
+};
+
+/**
+ * A message in the send queue of a peer: either all of its bytes, or just
+ * the header in front of a payload shared with other peers.
+ */
+class CSendMessage
+{
+public:
+    CSerializeData vData;
+    std::shared_ptr<const CSharedMessage> shared;
+
+    size_t size() const { return vData.size() + (shared ? shared->vPayload.size() : 0); }
+};
+
 class CNetMessage {
 public:
     bool in_data;                   // parsing header (false) or data (true)
@@ -232,6 +273,10 @@ public:
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
+    // The payload deserialized and checked ahead of processing, if it has
+    // been. Set and filled in by the message handler thread.
+    std::shared_ptr<CMessagePrecheck> precheck;
+
     CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
         hdrbuf.resize(24);
         in_data = false;
@@ -270,9 +315,13 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSendMessage> vSendMsg;
     CCriticalSection cs_vSend;
     CCriticalSection cs_hSocket;
+    // Whether hSocket is registered with the network thread's epoll instance,
+    // and for which events. Only used by the network thread, under cs_hSocket.
+    bool fSocketRegistered;
+    uint32_t nSocketEvents;
     CCriticalSection cs_vRecv;
 
     CCriticalSection cs_sendProcessing;
@@ -376,6 +425,10 @@ public:
     int64_t nNextInvSend;
     // Used for BIP35 mempool sending, also protected by cs_inventory
     bool fSendMempool;
+    // Transaction reconciliation, also protected by cs_inventory. The salt
+    // we sent in "sendrecon" (or 0), and the state once the peer sent its own.
+    uint64_t nReconciliationSalt;
+    std::unique_ptr<TxReconciliationState> txReconciliation;
 
     // Last time a "MEMPOOL" request was serviced.
     std::atomic<int64_t> timeLastMempoolReq;
@@ -559,6 +612,15 @@ public:
 
     void PushVersion();
 
+    /** Queue a shared message, adding only its header to the send queue. */
+    void PushSharedMessage(const std::shared_ptr<const CSharedMessage>& msg);
+
+private:
+    // requires LOCK(cs_vSend)
+    void QueueMessage(CSendMessage&& msg);
+
+public:
+
 
     void PushMessage(const char* pszCommand)
     {
@@ -127,6 +127,7 @@ std::string CInv::GetCommand() const
     // WTX is not a message type, just an inv type
     case MSG_WTX:            return cmd.append("wtx");
     case MSG_FILTERED_BLOCK: return cmd.append("merkleblock");
+    case MSG_CMPCT_BLOCK:    return cmd.append("cmpctblock");
     default:
         throw std::out_of_range(strprintf("CInv::GetCommand(): type=%d unknown type", type));
     }
@@ -134,7 +135,7 @@ std::string CInv::GetCommand() const
 
 std::vector<unsigned char> CInv::GetWideHash() const
 {
-    assert(type != MSG_BLOCK);
+    assert(type != MSG_BLOCK && type != MSG_CMPCT_BLOCK);
     if (type == MSG_TX) {
         for (auto byte : hashAux) {
             assert(byte == 0xff);
@@ -15,6 +15,7 @@
 #include "metrics.h"
 #include "primitives/transaction.h"
 #include "rpc/server.h"
+#include "snapshot.h"
 #include "streams.h"
 #include "sync.h"
 #include "util/system.h"
@@ -858,8 +859,9 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
     if (fHelp || params.size() != 0)
         throw runtime_error(
             "gettxoutsetinfo\n"
-            "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "\nReturns statistics about the unspent transaction output set and the nullifier sets.\n"
+            "These are maintained as blocks are connected, but the first call after upgrading\n"
+            "from an earlier version may take some time to compute them.\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
@@ -867,8 +869,14 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
             "  \"transactions\": n,      (numeric) The number of transactions\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
             "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
+            "  \"hash_serialized\": \"hash\",   (string) The MuHash3072 of the unspent transaction outputs\n"
             "  \"total_amount\": x.xxx          (numeric) The total amount\n"
+            "  \"nullifiers\": {         (object) The nullifier sets\n"
+            "    \"sprout\"|\"sapling\"|\"orchard\": {\n"
+            "      \"count\": n,         (numeric) The number of revealed nullifiers\n"
+            "      \"hash\": \"hash\"      (string) The MuHash3072 of the nullifier set\n"
+            "    }, ...\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
@@ -887,10 +895,123 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
         ret.pushKV("bytes_serialized", (int64_t)stats.nSerializedSize);
         ret.pushKV("hash_serialized", stats.hashSerialized.GetHex());
         ret.pushKV("total_amount", ValueFromAmount(stats.nTotalAmount));
+
+        UniValue nullifiers(UniValue::VOBJ);
+        for (const auto& [name, nCount, hash] : {
+                std::make_tuple("sprout", stats.nSproutNullifiers, stats.hashSproutNullifiers),
+                std::make_tuple("sapling", stats.nSaplingNullifiers, stats.hashSaplingNullifiers),
+                std::make_tuple("orchard", stats.nOrchardNullifiers, stats.hashOrchardNullifiers)}) {
+            UniValue pool(UniValue::VOBJ);
+            pool.pushKV("count", (int64_t)nCount);
+            pool.pushKV("hash", hash.GetHex());
+            nullifiers.pushKV(name, pool);
+        }
+        ret.pushKV("nullifiers", nullifiers);
     }
     return ret;
 }
 
+UniValue dumptxoutset(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset \"path\"\n"
+            "\nWrites a snapshot of the chain state at the current tip to a file. This includes\n"
+            "the unspent transaction outputs, the Sprout, Sapling and Orchard nullifier sets and\n"
+            "note commitment trees, the chain history trees, and the value pool balances of\n"
+            "every block up to the tip. The snapshot can be loaded by another node with\n"
+            "loadtxoutset or -loadsnapshot.\n"
+            "Note this call may take some time.\n"
+            "\nArguments:\n"
+            "1. \"path\"        (string, required) Path to the output file. If relative, it is\n"
+            "                   prefixed by the data directory.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"height\": n,           (numeric) The height of the snapshot base block\n"
+            "  \"base_hash\": \"hex\",    (string) The hash of the snapshot base block\n"
+            "  \"records\": n,          (numeric) The number of chain state records written\n"
+            "  \"path\": \"path\",        (string) The absolute path of the snapshot file\n"
+            "  \"snapshot_hash\": \"hex\" (string) The hash of the snapshot, which loadtxoutset checks against\n"
+            "                           the chain parameters\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("dumptxoutset", "\"snapshot.dat\"")
+            + HelpExampleRpc("dumptxoutset", "\"snapshot.dat\"")
+        );
+
+    fs::path path = AbsPathForConfigVal(params[0].get_str());
+    if (fs::exists(path)) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, path.string() + " already exists");
+    }
+
+    CSnapshotMetadata metadata;
+    uint256 hashSnapshot;
+    uint64_t nRecords = 0;
+    std::string strError;
+    if (!DumpSnapshot(Params(), path, metadata, hashSnapshot, nRecords, strError)) {
+        throw JSONRPCError(RPC_MISC_ERROR, strError);
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.pushKV("height", metadata.nHeight);
+    ret.pushKV("base_hash", metadata.hashBase.GetHex());
+    ret.pushKV("records", (uint64_t)nRecords);
+    ret.pushKV("path", path.string());
+    ret.pushKV("snapshot_hash", hashSnapshot.GetHex());
+    return ret;
+}
+
+UniValue loadtxoutset(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "loadtxoutset \"path\"\n"
+            "\nReplaces the chain state with a snapshot written by dumptxoutset. The hash of the\n"
+            "snapshot must be the one the chain parameters give for its base block. The header of the\n"
+            "snapshot base block must already be on the best header chain, and the active chain\n"
+            "must not have reached it yet. Blocks before the snapshot base are not downloaded\n"
+            "or validated; the node treats them as pruned.\n"
+            "This is incompatible with the wallet, -txindex, -insightexplorer and -lightwalletd.\n"
+            "Note this call may take some time.\n"
+            "\nArguments:\n"
+            "1. \"path\"           (string, required) Path to the snapshot file. If relative, it is\n"
+            "                      prefixed by the data directory.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"height\": n,         (numeric) The height of the snapshot base block\n"
+            "  \"base_hash\": \"hex\",  (string) The hash of the snapshot base block\n"
+            "  \"records\": n         (numeric) The number of chain state records loaded\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("loadtxoutset", "\"snapshot.dat\"")
+            + HelpExampleRpc("loadtxoutset", "\"snapshot.dat\"")
+        );
+
+#ifdef ENABLE_WALLET
+    if (!GetBoolArg("-disablewallet", false)) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Chain state snapshots cannot be loaded with the wallet enabled");
+    }
+#endif
+
+    fs::path path = AbsPathForConfigVal(params[0].get_str());
+
+    CSnapshotMetadata metadata;
+    uint64_t nRecords = 0;
+    std::string strError;
+    if (!LoadSnapshot(Params(), path, metadata, nRecords, strError)) {
+        throw JSONRPCError(RPC_MISC_ERROR, strError);
+    }
+
+    CValidationState state;
+    ActivateBestChain(state, Params());
+
+    UniValue ret(UniValue::VOBJ);
+    ret.pushKV("height", metadata.nHeight);
+    ret.pushKV("base_hash", metadata.hashBase.GetHex());
+    ret.pushKV("records", (uint64_t)nRecords);
+    return ret;
+}
+
 UniValue gettxout(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -1572,6 +1693,24 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
     return mempoolInfoToJSON();
 }
 
+UniValue savemempool(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "savemempool\n"
+            "\nDumps the mempool to disk, to be loaded on the next start with -persistmempool.\n"
+            "\nExamples:\n"
+            + HelpExampleCli("savemempool", "")
+            + HelpExampleRpc("savemempool", "")
+        );
+
+    if (!DumpMempool()) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to dump mempool to disk");
+    }
+
+    return NullUniValue;
+}
+
 UniValue invalidateblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -1664,9 +1803,12 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getdifficulty",          &getdifficulty,          true  },
     { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true  },
     { "blockchain",         "getrawmempool",          &getrawmempool,          true  },
+    { "blockchain",         "savemempool",            &savemempool,            true  },
     { "blockchain",         "gettxout",               &gettxout,               true  },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true  },
     { "blockchain",         "verifychain",            &verifychain,            true  },
+    { "blockchain",         "dumptxoutset",           &dumptxoutset,           true  },
+    { "blockchain",         "loadtxoutset",           &loadtxoutset,           false },
 
     // insightexplorer
     { "blockchain",         "getblockdeltas",         &getblockdeltas,         false },
@@ -54,6 +54,8 @@ static const CRPCConvertTable rpcCvtTable =
     { "getblockheader",              {{s}, {o}} },
     { "getblock",                    {{s}, {o}} },
     { "gettxoutsetinfo",             {{}, {}} },
+    { "dumptxoutset",                {{s}, {}} },
+    { "loadtxoutset",                {{s}, {}} },
     { "gettxout",                    {{s, o}, {o}} },
     { "verifychain",                 {{}, {o, o}} },
     { "getblockchaininfo",           {{}, {}} },
@@ -61,6 +63,7 @@ static const CRPCConvertTable rpcCvtTable =
     { "z_gettreestate",              {{s}, {}} },
     { "z_getsubtreesbyindex",        {{s, o}, {o}} },
     { "getmempoolinfo",              {{}, {}} },
+    { "savemempool",                 {{}, {}} },
     { "invalidateblock",             {{s}, {}} },
     { "reconsiderblock",             {{s}, {}} },
     // mining
@@ -0,0 +1,122 @@
+// Copyright (c) 2026 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#ifndef ZCASH_SNAPSHOT_H
+#define ZCASH_SNAPSHOT_H
+
+#include "amount.h"
+#include "chain.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <optional>
+#include <vector>
+
+/**
+ * Chain state snapshots, as written by `dumptxoutset` and read by
+ * `loadtxoutset` and `-loadsnapshot`.
+ *
+ * A snapshot file contains, in order:
+ * - a CSnapshotMetadata header;
+ * - one CSnapshotBlockInfo for each block from the genesis block up to and
+ *   including the snapshot base block;
+ * - every record of the chain state database at the base block (coins,
+ *   nullifier sets, anchors and best anchors, history tree nodes and
+ *   subtree caches), each as a pair of serialized key and value bytes,
+ *   terminated by an empty key;
+ * - the SHA256d hash of all of the preceding data.
+ */
+
+static const int SNAPSHOT_VERSION = 1;
+
+/** Header of a chain state snapshot file. */
+class CSnapshotMetadata
+{
+public:
+    int nVersion;
+    //! The network message start bytes, to reject snapshots of other networks.
+    std::vector<unsigned char> vMessageStart;
+    uint256 hashBase;
+    int nHeight;
+
+    //! Fields of the base block's index entry that are computed when the
+    //! block is connected, and are needed to connect its successor.
+    uint256 hashSproutAnchor;
+    uint256 hashFinalSproutRoot;
+    uint256 hashFinalSaplingRoot;
+    uint256 hashFinalOrchardRoot;
+    uint256 hashAuthDataRoot;
+    uint256 hashChainHistoryRoot;
+
+    CSnapshotMetadata() : nVersion(SNAPSHOT_VERSION), nHeight(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(nVersion);
+        READWRITE(vMessageStart);
+        READWRITE(hashBase);
+        READWRITE(nHeight);
+        READWRITE(hashSproutAnchor);
+        READWRITE(hashFinalSproutRoot);
+        READWRITE(hashFinalSaplingRoot);
+        READWRITE(hashFinalOrchardRoot);
+        READWRITE(hashAuthDataRoot);
+        READWRITE(hashChainHistoryRoot);
+    }
+};
+
+/**
+ * The per-block fields of a block index entry that are derived from the
+ * block's transactions (see SetChainPoolValues and ConnectBlock), and from
+ * which the chain supply and value pool totals are computed.
+ */
+class CSnapshotBlockInfo
+{
+public:
+    unsigned int nTx;
+    std::optional<CAmount> nChainSupplyDelta;
+    std::optional<CAmount> nTransparentValue;
+    std::optional<CAmount> nSproutValue;
+    CAmount nSaplingValue;
+    CAmount nOrchardValue;
+    CAmount nLockboxValue;
+
+    CSnapshotBlockInfo() : nTx(0), nSaplingValue(0), nOrchardValue(0), nLockboxValue(0) {}
+
+    explicit CSnapshotBlockInfo(const CBlockIndex& index) :
+        nTx(index.nTx),
+        nChainSupplyDelta(index.nChainSupplyDelta),
+        nTransparentValue(index.nTransparentValue),
+        nSproutValue(index.nSproutValue),
+        nSaplingValue(index.nSaplingValue),
+        nOrchardValue(index.nOrchardValue),
+        nLockboxValue(index.nLockboxValue) {}
+
+    void ApplyTo(CBlockIndex& index) const {
+        index.nTx = nTx;
+        index.nChainSupplyDelta = nChainSupplyDelta;
+        index.nTransparentValue = nTransparentValue;
+        index.nSproutValue = nSproutValue;
+        index.nSaplingValue = nSaplingValue;
+        index.nOrchardValue = nOrchardValue;
+        index.nLockboxValue = nLockboxValue;
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(VARINT(nTx));
+        READWRITE(nChainSupplyDelta);
+        READWRITE(nTransparentValue);
+        READWRITE(nSproutValue);
+        READWRITE(nSaplingValue);
+        READWRITE(nOrchardValue);
+        READWRITE(nLockboxValue);
+    }
+};
+
+#endif // ZCASH_SNAPSHOT_H
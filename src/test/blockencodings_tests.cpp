@@ -0,0 +1,176 @@
+// Copyright (c) 2026 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "blockencodings.h"
+#include "consensus/merkle.h"
+#include "consensus/upgrades.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockencodings_tests, BasicTestingSetup)
+
+static CBlock BuildBlockTestCase() {
+    CBlock block;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig.resize(10);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+
+    block.vtx.resize(3);
+    block.vtx[0] = tx;
+    block.nVersion = 4;
+    block.hashPrevBlock = InsecureRand256();
+    block.nBits = 0x207fffff;
+
+    tx.vin[0].prevout.hash = InsecureRand256();
+    tx.vin[0].prevout.n = 0;
+    block.vtx[1] = tx;
+
+    tx.vin.resize(10);
+    for (size_t i = 0; i < tx.vin.size(); i++) {
+        tx.vin[i].prevout.hash = InsecureRand256();
+        tx.vin[i].prevout.n = 0;
+    }
+    block.vtx[2] = tx;
+
+    bool mutated;
+    block.hashMerkleRoot = BlockMerkleRoot(block, &mutated);
+    assert(!mutated);
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(SimpleRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    CBlock block(BuildBlockTestCase());
+
+    CMutableTransaction tx2(block.vtx[2]);
+    pool.addUnchecked(block.vtx[2].GetHash(), entry.FromTx(tx2));
+
+    // Do a simple ShortTxIDs round-trip
+    {
+        CBlockHeaderAndShortTxIDs shortIDs(block);
+
+        CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+        stream << shortIDs;
+
+        CBlockHeaderAndShortTxIDs shortIDs2;
+        stream >> shortIDs2;
+
+        PartiallyDownloadedBlock partialBlock(&pool);
+        BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_OK);
+        BOOST_CHECK(partialBlock.IsTxAvailable(0));
+        BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+        BOOST_CHECK(partialBlock.IsTxAvailable(2));
+
+        // Missing or extra transactions are invalid.
+        CBlock block2;
+        BOOST_CHECK(partialBlock.FillBlock(block2, {}) == READ_STATUS_INVALID);
+        BOOST_CHECK(partialBlock.FillBlock(block2, {block.vtx[1], block.vtx[1]}) == READ_STATUS_INVALID);
+
+        // A wrong transaction is detected by the Merkle root.
+        BOOST_CHECK(partialBlock.FillBlock(block2, {block.vtx[2]}) == READ_STATUS_FAILED);
+
+        CBlock block3;
+        BOOST_CHECK(partialBlock.FillBlock(block3, {block.vtx[1]}) == READ_STATUS_OK);
+        BOOST_CHECK_EQUAL(block.GetHash().ToString(), block3.GetHash().ToString());
+        BOOST_CHECK_EQUAL(block.hashMerkleRoot.ToString(), BlockMerkleRoot(block3).ToString());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(ShortIDsCommitToAuthDigest)
+{
+    CBlock block(BuildBlockTestCase());
+    CBlockHeaderAndShortTxIDs shortIDs(block);
+
+    const CTransaction& tx = block.vtx[1];
+    uint64_t shortID = shortIDs.GetShortID(tx.GetHash(), tx.GetAuthDigest());
+    BOOST_CHECK(shortID <= 0xffffffffffffULL);
+    BOOST_CHECK(shortID != shortIDs.GetShortID(tx.GetHash(), InsecureRand256()));
+}
+
+BOOST_AUTO_TEST_CASE(EmptyBlockRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+    block.vtx.resize(1);
+    block.hashMerkleRoot = BlockMerkleRoot(block);
+
+    CBlockHeaderAndShortTxIDs shortIDs(block);
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << shortIDs;
+
+    CBlockHeaderAndShortTxIDs shortIDs2;
+    stream >> shortIDs2;
+
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, {}) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block.GetHash().ToString(), block2.GetHash().ToString());
+}
+
+BOOST_AUTO_TEST_CASE(AlteredAuthDataIsNotAccepted)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+
+    // A v5 transaction, whose txid does not commit to its scriptSigs.
+    CMutableTransaction mtx(block.vtx[1]);
+    mtx.fOverwintered = true;
+    mtx.nVersion = ZIP225_TX_VERSION;
+    mtx.nVersionGroupId = ZIP225_VERSION_GROUP_ID;
+    mtx.nConsensusBranchId = NetworkUpgradeInfo[Consensus::UPGRADE_NU5].nBranchId;
+    block.vtx[1] = mtx;
+    mtx.vin[0].scriptSig = CScript() << OP_TRUE;
+    CTransaction altered(mtx);
+    BOOST_CHECK(altered.GetHash() == block.vtx[1].GetHash());
+    BOOST_CHECK(altered.GetAuthDigest() != block.vtx[1].GetAuthDigest());
+
+    uint256 hashChainHistoryRoot = InsecureRand256();
+    block.hashMerkleRoot = BlockMerkleRoot(block);
+    block.hashBlockCommitments = DeriveBlockCommitmentsHash(hashChainHistoryRoot, block.BuildAuthDataMerkleTree());
+
+    CBlockHeaderAndShortTxIDs shortIDs(block);
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(shortIDs, hashChainHistoryRoot) == READ_STATUS_OK);
+    BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+
+    // The altered transaction matches the Merkle root, but not the block
+    // commitments, so the block is requested in full.
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, {altered, block.vtx[2]}) == READ_STATUS_FAILED);
+
+    CBlock block3;
+    BOOST_CHECK(partialBlock.FillBlock(block3, {block.vtx[1], block.vtx[2]}) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block.GetHash().ToString(), block3.GetHash().ToString());
+}
+
+BOOST_AUTO_TEST_CASE(TransactionsRequestSerializationTest)
+{
+    BlockTransactionsRequest req1;
+    req1.blockhash = InsecureRand256();
+    req1.indexes = {0, 1, 3, 4, 0xffff};
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req1;
+
+    BlockTransactionsRequest req2;
+    stream >> req2;
+
+    BOOST_CHECK_EQUAL(req1.blockhash.ToString(), req2.blockhash.ToString());
+    BOOST_CHECK(req1.indexes == req2.indexes);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
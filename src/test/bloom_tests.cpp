@@ -564,4 +564,30 @@ BOOST_AUTO_TEST_CASE(rolling_bloom_reset)
     BOOST_CHECK(rb.contains(d));
 }
 
+BOOST_AUTO_TEST_CASE(blocked_bloom)
+{
+    CBlockedBloomFilter filter(10000, 16);
+    std::vector<uint256> inserted;
+    for (int i = 0; i < 10000; i++) {
+        inserted.push_back(InsecureRand256());
+        filter.insert(inserted.back());
+    }
+    BOOST_CHECK_EQUAL(filter.size(), 10000U);
+    BOOST_CHECK_EQUAL(filter.capacity(), 10000U);
+
+    // Everything inserted is found.
+    for (const uint256& hash : inserted) {
+        BOOST_CHECK(filter.contains(hash));
+    }
+
+    // The false positive rate is about 0.1%; allow for some variance.
+    int nFalsePositives = 0;
+    for (int i = 0; i < 100000; i++) {
+        if (filter.contains(InsecureRand256())) {
+            nFalsePositives++;
+        }
+    }
+    BOOST_CHECK(nFalsePositives < 400);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -14,6 +14,7 @@
 #include "primitives/transaction.h"
 #include "pubkey.h"
 #include "transaction_builder.h"
+#include "txdb.h"
 #include "util/test.h"
 #include "zcash/Note.hpp"
 #include "zcash/address/mnemonic.h"
@@ -160,7 +161,7 @@ public:
 
     uint256 GetBestBlock() const { return hashBestBlock_; }
 
-    void BatchWriteNullifiers(CNullifiersMap& mapNullifiers, std::map<uint256, bool>& cacheNullifiers)
+    void BatchWriteNullifiers(CNullifiersMap& mapNullifiers, std::map<uint256, bool>& cacheNullifiers, bool fErase)
     {
         for (CNullifiersMap::iterator it = mapNullifiers.begin(); it != mapNullifiers.end(); ) {
             if (it->second.flags & CNullifiersCacheEntry::DIRTY) {
@@ -171,12 +172,12 @@ public:
                     cacheNullifiers.erase(it->first);
                 }
             }
-            it = mapNullifiers.erase(it);
+            it = fErase ? mapNullifiers.erase(it) : std::next(it);
         }
     }
 
     template<typename Tree, typename Map, typename MapEntry>
-    void BatchWriteAnchors(Map& mapAnchors, std::map<uint256, Tree>& cacheAnchors)
+    void BatchWriteAnchors(Map& mapAnchors, std::map<uint256, Tree>& cacheAnchors, bool fErase)
     {
         for (auto it = mapAnchors.begin(); it != mapAnchors.end(); ) {
             if (it->second.flags & MapEntry::DIRTY) {
@@ -190,7 +191,7 @@ public:
                     cacheAnchors.erase(it->first);
                 }
             }
-            it = mapAnchors.erase(it);
+            it = fErase ? mapAnchors.erase(it) : std::next(it);
         }
     }
 
@@ -221,7 +222,9 @@ public:
                     CNullifiersMap& mapOrchardNullifiers,
                     CHistoryCacheMap &historyCacheMap,
                     SubtreeCache &cacheSaplingSubtrees,
-                    SubtreeCache &cacheOrchardSubtrees)
+                    SubtreeCache &cacheOrchardSubtrees,
+                    const CCoinsSetStats &statsDelta,
+                    bool fErase)
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
             if (it->second.flags & CCoinsCacheEntry::DIRTY) {
@@ -232,16 +235,16 @@ public:
                     map_.erase(it->first);
                 }
             }
-            it = mapCoins.erase(it);
+            it = fErase ? mapCoins.erase(it) : std::next(it);
         }
 
-        BatchWriteAnchors<SproutMerkleTree, CAnchorsSproutMap, CAnchorsSproutCacheEntry>(mapSproutAnchors, mapSproutAnchors_);
-        BatchWriteAnchors<SaplingMerkleTree, CAnchorsSaplingMap, CAnchorsSaplingCacheEntry>(mapSaplingAnchors, mapSaplingAnchors_);
-        BatchWriteAnchors<OrchardMerkleFrontier, CAnchorsOrchardMap, CAnchorsOrchardCacheEntry>(mapOrchardAnchors, mapOrchardAnchors_);
+        BatchWriteAnchors<SproutMerkleTree, CAnchorsSproutMap, CAnchorsSproutCacheEntry>(mapSproutAnchors, mapSproutAnchors_, fErase);
+        BatchWriteAnchors<SaplingMerkleTree, CAnchorsSaplingMap, CAnchorsSaplingCacheEntry>(mapSaplingAnchors, mapSaplingAnchors_, fErase);
+        BatchWriteAnchors<OrchardMerkleFrontier, CAnchorsOrchardMap, CAnchorsOrchardCacheEntry>(mapOrchardAnchors, mapOrchardAnchors_, fErase);
 
-        BatchWriteNullifiers(mapSproutNullifiers, mapSproutNullifiers_);
-        BatchWriteNullifiers(mapSaplingNullifiers, mapSaplingNullifiers_);
-        BatchWriteNullifiers(mapOrchardNullifiers, mapOrchardNullifiers_);
+        BatchWriteNullifiers(mapSproutNullifiers, mapSproutNullifiers_, fErase);
+        BatchWriteNullifiers(mapSaplingNullifiers, mapSaplingNullifiers_, fErase);
+        BatchWriteNullifiers(mapOrchardNullifiers, mapOrchardNullifiers_, fErase);
 
         if (!hashBlock.IsNull())
             hashBestBlock_ = hashBlock;
@@ -275,13 +278,31 @@ public:
                      memusage::DynamicUsage(cacheOrchardNullifiers) +
                      memusage::DynamicUsage(historyCacheMap) +
                      memusage::DynamicUsage(cacheSaplingSubtrees) +
-                     memusage::DynamicUsage(cacheOrchardSubtrees);
+                     memusage::DynamicUsage(cacheOrchardSubtrees) +
+                     memusage::DynamicUsage(cacheCoinsEvictionQueue);
+        ret -= cacheCoinsMemoryResource.NumFreeBytes() +
+               cacheSproutNullifiersMemoryResource.NumFreeBytes() +
+               cacheSaplingNullifiersMemoryResource.NumFreeBytes() +
+               cacheOrchardNullifiersMemoryResource.NumFreeBytes();
         for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
             ret += it->second.coins.DynamicMemoryUsage();
         }
         BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
     }
 
+    bool HaveCoinInCache(const uint256& txid) const { return cacheCoins.count(txid) > 0; }
+
+    //! Whether every cached coins entry has been modified.
+    bool AllCoinsDirty() const
+    {
+        for (const auto& entry : cacheCoins) {
+            if (!(entry.second.flags & CCoinsCacheEntry::DIRTY)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
 };
 
 class TxWithNullifiers
@@ -469,6 +490,8 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
+    bool synced_a_cache = false;
+    bool evicted_from_a_cache = false;
 
     // A simple map to track what we expect the cache stack to represent.
     std::map<uint256, CCoins> result;
@@ -528,6 +551,19 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
 
         if (InsecureRandRange(100) == 0) {
             // Every 100 iterations, change the cache stack.
+            if (stack.size() > 0 && InsecureRandRange(4) == 0) {
+                // Write the top cache to its base without wiping it, and
+                // sometimes make room in it.
+                stack.back()->Sync();
+                synced_a_cache = true;
+                if (InsecureRandBool()) {
+                    size_t nTargetUsage = stack.back()->DynamicMemoryUsage() / 2;
+                    stack.back()->Evict(nTargetUsage);
+                    BOOST_CHECK(stack.back()->DynamicMemoryUsage() <= nTargetUsage || stack.back()->AllCoinsDirty());
+                    evicted_from_a_cache = true;
+                }
+                stack.back()->SelfTest();
+            }
             if (stack.size() > 0 && InsecureRandBool() == 0) {
                 stack.back()->Flush();
                 delete stack.back();
@@ -557,6 +593,8 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     // Verify coverage.
     BOOST_CHECK(removed_all_caches);
     BOOST_CHECK(reached_4_caches);
+    BOOST_CHECK(synced_a_cache);
+    BOOST_CHECK(evicted_from_a_cache);
     BOOST_CHECK(added_an_entry);
     BOOST_CHECK(removed_an_entry);
     BOOST_CHECK(updated_an_entry);
@@ -564,6 +602,176 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(missed_an_entry);
 }
 
+BOOST_AUTO_TEST_CASE(sync_keeps_nullifiers_and_anchors)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+
+    TxWithNullifiers txWithNullifiers;
+    cache.SetNullifiers(txWithNullifiers.tx, true);
+    SaplingMerkleTree tree;
+    AppendRandomLeaf(tree);
+    cache.PushAnchor(tree);
+    SaplingMerkleTree tree2 = tree;
+    AppendRandomLeaf(tree2);
+    cache.PushAnchor(tree2);
+
+    // Syncing writes the entries to the base view, and keeps them cached.
+    size_t nUsage = cache.DynamicMemoryUsage();
+    BOOST_CHECK(cache.Sync());
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), nUsage);
+    cache.SelfTest();
+    {
+        CCoinsViewCacheTest cacheBase(&base);
+        checkNullifierCache(cacheBase, txWithNullifiers, true);
+        SaplingMerkleTree getTree;
+        BOOST_CHECK(cacheBase.GetSaplingAnchorAt(tree.root(), getTree));
+        BOOST_CHECK(cacheBase.GetBestAnchor(SAPLING) == tree2.root());
+    }
+
+    // Evicting drops the unmodified entries other than the best anchor; they
+    // are then read from the base view again.
+    cache.Evict(0);
+    BOOST_CHECK(cache.DynamicMemoryUsage() < nUsage);
+    cache.SelfTest();
+    checkNullifierCache(cache, txWithNullifiers, true);
+    SaplingMerkleTree getTree;
+    BOOST_CHECK(cache.GetSaplingAnchorAt(tree.root(), getTree));
+    BOOST_CHECK(getTree.root() == tree.root());
+
+    // Later modifications of the kept entries are synced too.
+    cache.SetNullifiers(txWithNullifiers.tx, false);
+    cache.PopAnchor(tree.root(), SAPLING);
+    BOOST_CHECK(cache.Sync());
+    {
+        CCoinsViewCacheTest cacheBase(&base);
+        checkNullifierCache(cacheBase, txWithNullifiers, false);
+        BOOST_CHECK(!cacheBase.GetSaplingAnchorAt(tree2.root(), getTree));
+        BOOST_CHECK(cacheBase.GetBestAnchor(SAPLING) == tree.root());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(evict_oldest_coins_first)
+{
+    CCoinsViewTest base;
+    std::vector<uint256> txids(200);
+    {
+        CCoinsViewCacheTest cache(&base);
+        for (size_t i = 0; i < txids.size(); i++) {
+            txids[i] = InsecureRand256();
+            CCoinsModifier coins = cache.ModifyNewCoins(txids[i]);
+            coins->nVersion = 1;
+            coins->nHeight = i;
+            coins->vout.assign(1, CTxOut(1000, CScript() << OP_TRUE));
+        }
+        BOOST_CHECK(cache.Flush());
+    }
+
+    // Read the coins in random order, and modify one of the oldest.
+    CCoinsViewCacheTest cache(&base);
+    std::vector<uint256> shuffled = txids;
+    for (size_t i = shuffled.size() - 1; i > 0; i--) {
+        std::swap(shuffled[i], shuffled[InsecureRandRange(i + 1)]);
+    }
+    for (const uint256& txid : shuffled) {
+        BOOST_CHECK(cache.HaveCoins(txid));
+    }
+    cache.ModifyCoins(txids[0])->nVersion = 2;
+
+    size_t nTargetUsage = cache.DynamicMemoryUsage() / 2;
+    cache.Evict(nTargetUsage);
+    BOOST_CHECK(cache.DynamicMemoryUsage() <= nTargetUsage);
+    cache.SelfTest();
+
+    // The modified entry is kept, and the unmodified ones that are left are
+    // the most recent.
+    BOOST_CHECK(cache.HaveCoinInCache(txids[0]));
+    size_t nFirstKept = 1;
+    while (nFirstKept < txids.size() && !cache.HaveCoinInCache(txids[nFirstKept])) {
+        nFirstKept++;
+    }
+    BOOST_CHECK(nFirstKept > 1 && nFirstKept < txids.size());
+    for (size_t i = nFirstKept; i < txids.size(); i++) {
+        BOOST_CHECK(cache.HaveCoinInCache(txids[i]));
+    }
+}
+
+// Modify coins through a stack of two caches over a database, flushing and
+// syncing them at random, and check that the statistics the database keeps
+// match those computed by walking it.
+BOOST_AUTO_TEST_CASE(coins_stats_match_recomputed)
+{
+    CCoinsViewDB db(1 << 20, true);
+    CCoinsViewCacheTest parent(&db);
+    std::vector<uint256> txids(50);
+    for (uint256& txid : txids) {
+        txid = InsecureRand256();
+    }
+
+    for (int round = 0; round < 20; round++) {
+        {
+            CCoinsViewCacheTest child(&parent);
+            for (int i = 0; i < 100; i++) {
+                uint256 txid = txids[InsecureRandRange(txids.size())];
+                CCoinsModifier coins = child.ModifyCoins(txid);
+                if (coins->IsPruned()) {
+                    coins->nVersion = 1;
+                    coins->nHeight = round;
+                    coins->vout.resize(1 + InsecureRandRange(4));
+                    for (CTxOut& out : coins->vout) {
+                        out = CTxOut(InsecureRandRange(1000) + 1, CScript() << OP_TRUE);
+                    }
+                } else {
+                    coins->Spend(InsecureRandRange(coins->vout.size()));
+                }
+            }
+            BOOST_CHECK(InsecureRandBool() ? child.Flush() : child.Sync());
+        }
+        // Modify some entries that are already dirty in the parent as well.
+        for (int i = 0; i < 10; i++) {
+            CCoinsModifier coins = parent.ModifyCoins(txids[InsecureRandRange(txids.size())]);
+            if (!coins->IsPruned()) {
+                coins->Spend(InsecureRandRange(coins->vout.size()));
+            }
+        }
+        if (InsecureRandRange(3) == 0) {
+            continue;
+        }
+        parent.SetBestBlock(InsecureRand256());
+        BOOST_CHECK(InsecureRandBool() ? parent.Flush() : parent.Sync());
+
+        CCoinsStats stats;
+        BOOST_CHECK(db.GetStats(stats));
+        CCoinsSetStats setStats;
+        BOOST_CHECK(db.ComputeStats(setStats));
+        CCoinsStats expected;
+        setStats.ToCoinsStats(expected);
+        BOOST_CHECK(stats.hashBlock == expected.hashBlock);
+        BOOST_CHECK_EQUAL(stats.nTransactions, expected.nTransactions);
+        BOOST_CHECK_EQUAL(stats.nTransactionOutputs, expected.nTransactionOutputs);
+        BOOST_CHECK_EQUAL(stats.nSerializedSize, expected.nSerializedSize);
+        BOOST_CHECK_EQUAL(stats.nTotalAmount, expected.nTotalAmount);
+        BOOST_CHECK(stats.hashSerialized == expected.hashSerialized);
+    }
+}
+
+// The nullifier filters that don't fit in the memory they are given are not
+// built.
+BOOST_AUTO_TEST_CASE(nullifier_filters_fit_memory_limit)
+{
+    // An empty database gets filters of the minimum size.
+    const size_t nFilterSize = NULLIFIER_FILTER_MIN_CAPACITY * NULLIFIER_FILTER_BITS_PER_ELEMENT / 8;
+    CCoinsViewDB db(1 << 20, true);
+
+    db.LoadNullifierFilters(0);
+    BOOST_CHECK_EQUAL(db.DynamicMemoryUsage(), 0);
+
+    // Room for two filters, but not for three.
+    db.LoadNullifierFilters(nFilterSize * 5 / 2);
+    BOOST_CHECK(db.DynamicMemoryUsage() >= nFilterSize * 2);
+    BOOST_CHECK(db.DynamicMemoryUsage() < nFilterSize * 3);
+}
+
 BOOST_AUTO_TEST_CASE(coins_coinbase_spends)
 {
     CCoinsViewTest base;
@@ -0,0 +1,126 @@
+// Copyright (c) 2026 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "coinswriter.h"
+#include "script/script.h"
+#include "txdb.h"
+#include "uint256.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+#include <atomic>
+
+namespace {
+
+//! A view whose writes always fail.
+class CCoinsViewFailingWrites : public CCoinsViewBacked
+{
+public:
+    CCoinsViewFailingWrites(CCoinsView *baseIn) : CCoinsViewBacked(baseIn) {}
+
+    bool BatchWrite(CCoinsMap &mapCoins,
+                    const uint256 &hashBlock,
+                    const uint256 &hashSproutAnchor,
+                    const uint256 &hashSaplingAnchor,
+                    const uint256 &hashOrchardAnchor,
+                    CAnchorsSproutMap &mapSproutAnchors,
+                    CAnchorsSaplingMap &mapSaplingAnchors,
+                    CAnchorsOrchardMap &mapOrchardAnchors,
+                    CNullifiersMap &mapSproutNullifiers,
+                    CNullifiersMap &mapSaplingNullifiers,
+                    CNullifiersMap &mapOrchardNullifiers,
+                    CHistoryCacheMap &historyCacheMap,
+                    SubtreeCache &cacheSaplingSubtrees,
+                    SubtreeCache &cacheOrchardSubtrees,
+                    const CCoinsSetStats &statsDelta,
+                    bool fErase) {
+        return false;
+    }
+};
+
+}
+
+BOOST_FIXTURE_TEST_SUITE(coinswriter_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(reads_see_pending_batches)
+{
+    CCoinsViewDB db(1 << 20, true);
+    CCoinsViewAsyncWriter writer(&db);
+
+    uint256 txid = InsecureRand256();
+    uint256 hashBlock1 = InsecureRand256();
+    uint256 hashBlock2 = InsecureRand256();
+    SaplingMerkleTree tree;
+    tree.append(InsecureRand256());
+    SaplingMerkleTree getTree;
+
+    CCoinsViewCache cache(&writer);
+    {
+        CCoinsModifier coins = cache.ModifyNewCoins(txid);
+        coins->nVersion = 1;
+        coins->vout.assign(1, CTxOut(1000, CScript() << OP_TRUE));
+    }
+    cache.PushAnchor(tree);
+    cache.SetBestBlock(hashBlock1);
+
+    // Whether or not the batch has been written to the database yet, reads
+    // through the writer see it.
+    BOOST_CHECK(cache.Sync());
+    BOOST_CHECK(writer.HaveCoins(txid));
+    BOOST_CHECK(writer.GetBestBlock() == hashBlock1);
+    BOOST_CHECK(writer.GetBestAnchor(SAPLING) == tree.root());
+    BOOST_CHECK(writer.GetSaplingAnchorAt(tree.root(), getTree));
+    BOOST_CHECK(getTree.root() == tree.root());
+
+    // The next batch is only queued once the previous one is written.
+    cache.ModifyCoins(txid)->Clear();
+    cache.SetBestBlock(hashBlock2);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!writer.HaveCoins(txid));
+    BOOST_CHECK(writer.GetBestBlock() == hashBlock2);
+    BOOST_CHECK(db.GetBestBlock() == hashBlock1 || db.GetBestBlock() == hashBlock2);
+
+    BOOST_CHECK(writer.Commit());
+    BOOST_CHECK(!db.HaveCoins(txid));
+    BOOST_CHECK(db.GetBestBlock() == hashBlock2);
+    BOOST_CHECK(db.GetBestAnchor(SAPLING) == tree.root());
+    BOOST_CHECK(db.GetSaplingAnchorAt(tree.root(), getTree));
+}
+
+BOOST_AUTO_TEST_CASE(failed_writes_are_reported)
+{
+    CCoinsViewDB db(1 << 20, true);
+    CCoinsViewFailingWrites failing(&db);
+    std::atomic<int> nFailures(0);
+    CCoinsViewAsyncWriter writer(&failing, [&](const std::string&) { nFailures++; });
+    BOOST_CHECK_EQUAL(writer.DynamicMemoryUsage(), 0);
+
+    uint256 txid = InsecureRand256();
+    CCoinsViewCache cache(&writer);
+    {
+        CCoinsModifier coins = cache.ModifyNewCoins(txid);
+        coins->nVersion = 1;
+        coins->vout.assign(1, CTxOut(1000, CScript() << OP_TRUE));
+    }
+    cache.SetBestBlock(InsecureRand256());
+
+    // The failure is reported by the writing thread, without waiting for the
+    // next batch. The failed batch stays pending, and is counted as such.
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!writer.Commit());
+    BOOST_CHECK_EQUAL(nFailures, 1);
+    BOOST_CHECK(!writer.IsWriting());
+    BOOST_CHECK(writer.HaveCoins(txid));
+    BOOST_CHECK(!db.HaveCoins(txid));
+    BOOST_CHECK(writer.DynamicMemoryUsage() > 0);
+
+    // Later writes fail straight away.
+    cache.SetBestBlock(InsecureRand256());
+    BOOST_CHECK(!cache.Flush());
+    BOOST_CHECK_EQUAL(nFailures, 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
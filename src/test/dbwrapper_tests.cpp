@@ -229,6 +229,23 @@ BOOST_AUTO_TEST_CASE(iterator_string_ordering)
     }
 }
 
-
+BOOST_AUTO_TEST_CASE(dbwrapper_estimate_size)
+{
+    const size_t nRecords = 10000;
+    path ph = temp_directory_path() / unique_path();
+    {
+        CDBWrapper dbw(ph, (1 << 20), false, true);
+        CDBBatch batch(dbw);
+        for (size_t i = 0; i < nRecords; i++) {
+            batch.Write(make_pair('n', InsecureRand256()), true);
+        }
+        BOOST_CHECK(dbw.WriteBatch(batch));
+    }
+    // Reopening moves the records from the log into a table file.
+    CDBWrapper dbw(ph, (1 << 20), false, false);
+    // The keys are random, so they take at least their size on disk.
+    BOOST_CHECK_GE(dbw.EstimateSize('n', 'o'), nRecords * 32);
+    BOOST_CHECK_EQUAL(dbw.EstimateSize('a', 'b'), 0U);
+}
 
 BOOST_AUTO_TEST_SUITE_END()
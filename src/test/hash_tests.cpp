@@ -3,6 +3,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or https://www.opensource.org/licenses/mit-license.php .
 
+#include "crypto/common.h"
 #include "hash.h"
 #include "util/strencodings.h"
 #include "test/test_bitcoin.h"
@@ -123,6 +124,19 @@ BOOST_AUTO_TEST_CASE(siphash)
         hasher3.Write(uint64_t(x)|(uint64_t(x+1)<<8)|(uint64_t(x+2)<<16)|(uint64_t(x+3)<<24)|
                      (uint64_t(x+4)<<32)|(uint64_t(x+5)<<40)|(uint64_t(x+6)<<48)|(uint64_t(x+7)<<56));
     }
+
+    // Check the specialized uint256 and uint32_t hash against the generic one
+    for (int i = 0; i < 16; ++i) {
+        uint64_t k0 = InsecureRandBits(64), k1 = InsecureRandBits(64);
+        uint256 x = InsecureRand256();
+        uint32_t n = InsecureRand32();
+        unsigned char nb[4];
+        WriteLE32(nb, n);
+        CSipHasher hasher4(k0, k1);
+        hasher4.Write(x.GetUint64(0)).Write(x.GetUint64(1)).Write(x.GetUint64(2)).Write(x.GetUint64(3));
+        hasher4.Write(nb, 4);
+        BOOST_CHECK_EQUAL(SipHashUint256Extra(k0, k1, x, n), hasher4.Finalize());
+    }
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,11 +3,16 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or https://www.opensource.org/licenses/mit-license.php .
 
+#include "arith_uint256.h"
 #include "chainparams.h"
 #include "main.h"
+#include "streams.h"
+#include "version.h"
 
 #include "test/test_bitcoin.h"
 
+#include <limits>
+
 #include <boost/signals2/signal.hpp>
 #include <boost/test/unit_test.hpp>
 
@@ -123,4 +128,93 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     Test.disconnect(&ReturnTrue);
     BOOST_CHECK(Test());
 }
+
+BOOST_AUTO_TEST_CASE(read_raw_block_from_disk)
+{
+    const CChainParams& chainparams = Params();
+    CBlock block = chainparams.GenesisBlock();
+    CDiskBlockPos pos(99, 0);
+    BOOST_CHECK(WriteBlockToDisk(block, pos, chainparams.MessageStart()));
+
+    std::vector<unsigned char> raw;
+    BOOST_CHECK(ReadRawBlockFromDisk(raw, pos, chainparams.MessageStart()));
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+    BOOST_CHECK(raw == std::vector<unsigned char>(ss.begin(), ss.end()));
+
+    CMessageHeader::MessageStartChars wrongStart = {0, 0, 0, 0};
+    BOOST_CHECK(!ReadRawBlockFromDisk(raw, pos, wrongStart));
+}
+
+BOOST_AUTO_TEST_CASE(check_headers_proof_of_work)
+{
+    const CChainParams& chainparams = Params();
+    CBlockHeader header = chainparams.GenesisBlock().GetBlockHeader();
+    CBlockHeader badHeader = header;
+    badHeader.nNonce = ArithToUint256(UintToArith256(badHeader.nNonce) + 1);
+
+    // Check both the serial path and the precheck threads started by the
+    // fixture.
+    int nScriptCheckThreadsOld = nScriptCheckThreads;
+    for (int nThreads : {0, nScriptCheckThreadsOld}) {
+        nScriptCheckThreads = nThreads;
+        std::vector<CBlockHeader> headers {header, header, badHeader, header};
+        BOOST_CHECK_EQUAL(CheckHeadersProofOfWork(headers, 0, chainparams.GetConsensus()), 2U);
+        BOOST_CHECK_EQUAL(CheckHeadersProofOfWork(headers, 1, chainparams.GetConsensus()), 1U);
+        BOOST_CHECK_EQUAL(CheckHeadersProofOfWork(headers, 2, chainparams.GetConsensus()), 0U);
+        BOOST_CHECK_EQUAL(CheckHeadersProofOfWork(headers, 3, chainparams.GetConsensus()), 1U);
+        BOOST_CHECK_EQUAL(CheckHeadersProofOfWork(headers, 4, chainparams.GetConsensus()), 0U);
+        headers.resize(2);
+        BOOST_CHECK_EQUAL(CheckHeadersProofOfWork(headers, 0, chainparams.GetConsensus()), 2U);
+        headers.clear();
+        BOOST_CHECK_EQUAL(CheckHeadersProofOfWork(headers, 0, chainparams.GetConsensus()), 0U);
+
+        // A large batch, so that the checks are spread over the threads.
+        headers.assign(MAX_HEADERS_RESULTS / 10, header);
+        headers[headers.size() - 3] = badHeader;
+        BOOST_CHECK_EQUAL(CheckHeadersProofOfWork(headers, 0, chainparams.GetConsensus()), headers.size() - 3);
+    }
+    nScriptCheckThreads = nScriptCheckThreadsOld;
+}
+
+BOOST_AUTO_TEST_CASE(max_blocks_in_flight)
+{
+    const int64_t NO_PING = std::numeric_limits<int64_t>::max();
+
+    // Until we have measured the peer, it gets the default.
+    BOOST_CHECK_EQUAL(GetMaxBlocksInFlight(0, 100000), DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(GetMaxBlocksInFlight(10000, NO_PING), DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // A fast peer on a low-latency link keeps the default.
+    BOOST_CHECK_EQUAL(GetMaxBlocksInFlight(10000, 1000), DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(GetMaxBlocksInFlight(1000, 0), DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // A fast peer on a high-latency link gets enough to cover two round trips.
+    BOOST_CHECK_EQUAL(GetMaxBlocksInFlight(10000, 200000), 41);
+    BOOST_CHECK_EQUAL(GetMaxBlocksInFlight(1000, 1000000), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // A peer just fast enough to deliver the default within the timeout keeps it.
+    const int64_t nSlowDeliveryTime = BLOCK_SLOW_DELIVERY_TIMEOUT * 1000000 / DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER;
+    BOOST_CHECK_EQUAL(GetMaxBlocksInFlight(nSlowDeliveryTime, 1000), DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER);
+    // A slower one gets fewer, down to the minimum...
+    BOOST_CHECK_EQUAL(GetMaxBlocksInFlight(nSlowDeliveryTime + 1, 1000), MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(GetMaxBlocksInFlight(4000000, 6000000), 4);
+    // ...unless its latency is high enough to need more.
+    BOOST_CHECK_EQUAL(GetMaxBlocksInFlight(4000000, 100000000), 51);
+}
+
+BOOST_AUTO_TEST_CASE(move_block_from_slow_peer)
+{
+    // Only to a peer we have measured...
+    BOOST_CHECK(!ShouldMoveBlockFromPeer(1000000, 0));
+    BOOST_CHECK(!ShouldMoveBlockFromPeer(0, 0));
+    // ...and that is more than twice as fast.
+    BOOST_CHECK(ShouldMoveBlockFromPeer(1000000, 100000));
+    BOOST_CHECK(ShouldMoveBlockFromPeer(200001, 100000));
+    BOOST_CHECK(!ShouldMoveBlockFromPeer(200000, 100000));
+    BOOST_CHECK(!ShouldMoveBlockFromPeer(100000, 100000));
+    BOOST_CHECK(!ShouldMoveBlockFromPeer(100000, 1000000));
+    // A block waiting on a peer we haven't measured yet stays with it.
+    BOOST_CHECK(!ShouldMoveBlockFromPeer(0, 100000));
+}
 BOOST_AUTO_TEST_SUITE_END()
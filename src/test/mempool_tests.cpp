@@ -7,6 +7,7 @@
 #include "main.h"
 #include "txmempool.h"
 #include "util/system.h"
+#include "zip317.h"
 
 #include "test/test_bitcoin.h"
 
@@ -374,6 +375,66 @@ BOOST_AUTO_TEST_CASE(RemoveWithoutBranchId) {
     BOOST_CHECK_EQUAL(pool.size(), 0);
 }
 
+// Test that the block template candidates follow the transactions in the pool.
+BOOST_AUTO_TEST_CASE(BlockTemplateCandidates) {
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    entry.hadNoDependencies = true;
+
+    auto CheckCandidates = [&](size_t nPaying, size_t nNotPaying) {
+        // The candidates are weighted as if they had been rebuilt from the pool.
+        int128_t payingWeight = 0, notPayingWeight = 0;
+        for (auto it = pool.mapTx.begin(); it != pool.mapTx.end(); it++) {
+            int128_t weightRatio = it->GetWeightRatio();
+            (weightRatio >= WEIGHT_RATIO_SCALE ? payingWeight : notPayingWeight) += weightRatio;
+        }
+        // Taking the candidates must not lose any of them, so check twice.
+        for (int round = 0; round < 2; round++) {
+            LOCK(pool.cs);
+            for (bool fPaying : {true, false}) {
+                size_t nTaken = 0;
+                int128_t takenWeight = 0;
+                while (auto candidate = pool.TakeRandomCandidate(fPaying)) {
+                    BOOST_CHECK_EQUAL(candidate.value()->GetWeightRatio() >= WEIGHT_RATIO_SCALE, fPaying);
+                    takenWeight += candidate.value()->GetWeightRatio();
+                    nTaken++;
+                }
+                BOOST_CHECK_EQUAL(nTaken, fPaying ? nPaying : nNotPaying);
+                BOOST_CHECK(takenWeight == (fPaying ? payingWeight : notPayingWeight));
+            }
+            pool.RestoreCandidates();
+        }
+    };
+
+    // Transactions with one output have a conventional fee of 10000.
+    std::vector<CTransaction> vtx;
+    for (auto i = 1; i < 11; i++) {
+        CMutableTransaction tx = CMutableTransaction();
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[0].nValue = i * COIN;
+        pool.addUnchecked(tx.GetHash(), entry.Fee(i % 2 ? 0 : 10000).FromTx(tx));
+        vtx.push_back(tx);
+    }
+    CheckCandidates(5, 5);
+
+    // Prioritising a transaction can move it to the other set.
+    pool.PrioritiseTransaction(vtx[0].GetHash(), vtx[0].GetHash().ToString(), 10000);
+    CheckCandidates(6, 4);
+    pool.PrioritiseTransaction(vtx[0].GetHash(), vtx[0].GetHash().ToString(), -5000);
+    CheckCandidates(5, 5);
+    pool.PrioritiseTransaction(vtx[2].GetHash(), vtx[2].GetHash().ToString(), 1000);
+    CheckCandidates(5, 5);
+
+    std::list<CTransaction> removed;
+    pool.remove(vtx[1], removed);
+    pool.remove(vtx[2], removed);
+    CheckCandidates(4, 4);
+
+    pool.clear();
+    CheckCandidates(0, 0);
+}
+
 // Test that nCheckFrequency is set correctly when calling setSanityCheck().
 // https://github.com/zcash/zcash/issues/3134
 BOOST_AUTO_TEST_CASE(SetSanityCheck) {
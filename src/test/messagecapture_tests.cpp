@@ -0,0 +1,174 @@
+// Copyright (c) 2026 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "messagecapture.h"
+#include "addrman.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "hash.h"
+#include "random.h"
+#include "streams.h"
+#include "version.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+namespace {
+
+// Feed a message to node, as if it had been received from the network.
+void ReceiveMessage(CNode& node, const std::string& strCommand, const CDataStream& ssPayload)
+{
+    CMessageHeader hdr(Params().MessageStart(), strCommand.c_str(), ssPayload.size());
+    uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+    memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+    CDataStream ssMessage(SER_NETWORK, PROTOCOL_VERSION);
+    ssMessage << hdr;
+    ssMessage.write(ssPayload.data(), ssPayload.size());
+    LOCK(node.cs_vRecvMsg);
+    BOOST_CHECK(node.ReceiveMsgBytes(ssMessage.data(), ssMessage.size()));
+}
+
+std::vector<fs::path> GetCaptureFiles()
+{
+    std::vector<fs::path> vPaths;
+    for (fs::directory_iterator it(GetDataDir() / "message_capture"); it != fs::directory_iterator(); ++it) {
+        vPaths.push_back(it->path());
+    }
+    return vPaths;
+}
+
+} // anon namespace
+
+BOOST_FIXTURE_TEST_SUITE(messagecapture_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(captured_message_roundtrip)
+{
+    CCapturedMessage captured;
+    captured.nTime = 1700000000123456;
+    captured.nodeId = 7;
+    captured.fInbound = true;
+    captured.strCommand = "inv";
+    captured.vPayload = {1, 2, 3};
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << captured;
+    CCapturedMessage captured2;
+    ss >> captured2;
+    BOOST_CHECK_EQUAL(captured2.nTime, captured.nTime);
+    BOOST_CHECK_EQUAL(captured2.nodeId, captured.nodeId);
+    BOOST_CHECK(captured2.fInbound);
+    BOOST_CHECK_EQUAL(captured2.strCommand, captured.strCommand);
+    BOOST_CHECK(captured2.vPayload == captured.vPayload);
+
+    // Commands longer than a message header can hold are rejected.
+    captured.strCommand = "waytoolongcommand";
+    ss << captured;
+    BOOST_CHECK_THROW(ss >> captured2, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(capture_received_messages)
+{
+    CAddress addr(CService(CNetAddr("127.0.0.1"), Params().GetDefaultPort()));
+    CNode node(INVALID_SOCKET, addr, "", true);
+
+    std::vector<unsigned char> vPayload = {0xde, 0xad, 0xbe, 0xef};
+    CMessageHeader hdr(Params().MessageStart(), "ping", vPayload.size());
+    uint256 hash = Hash(vPayload.begin(), vPayload.end());
+    memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+    CDataStream ssMessage(SER_NETWORK, PROTOCOL_VERSION);
+    ssMessage << hdr;
+    ssMessage.write((const char*)vPayload.data(), vPayload.size());
+
+    BOOST_CHECK(OpenMessageCapture());
+    fCaptureMessages = true;
+    {
+        LOCK(node.cs_vRecvMsg);
+        // Split the message, so that it is only captured once complete.
+        BOOST_CHECK(node.ReceiveMsgBytes(ssMessage.data(), 10));
+        BOOST_CHECK(node.ReceiveMsgBytes(ssMessage.data() + 10, ssMessage.size() - 10));
+    }
+    fCaptureMessages = false;
+    CloseMessageCapture();
+
+    fs::directory_iterator it(GetDataDir() / "message_capture");
+    BOOST_REQUIRE(it != fs::directory_iterator());
+    CAutoFile file(fsbridge::fopen(it->path(), "rb"), SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(!file.IsNull());
+
+    CMessageHeader::MessageStartChars pchMessageStart;
+    uint32_t nVersion;
+    file.read((char*)pchMessageStart, CMessageHeader::MESSAGE_START_SIZE);
+    file >> nVersion;
+    BOOST_CHECK(memcmp(pchMessageStart, Params().MessageStart(), CMessageHeader::MESSAGE_START_SIZE) == 0);
+    BOOST_CHECK_EQUAL(nVersion, MESSAGE_CAPTURE_VERSION);
+
+    CCapturedMessage captured;
+    file >> captured;
+    BOOST_CHECK_EQUAL(captured.nodeId, node.GetId());
+    BOOST_CHECK(captured.fInbound);
+    BOOST_CHECK_EQUAL(captured.strCommand, "ping");
+    BOOST_CHECK(captured.vPayload == vPayload);
+    BOOST_CHECK_EQUAL(captured.nTime, node.vRecvMsg.back().nTime);
+    BOOST_CHECK_THROW(file >> captured, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(capture_files_are_not_reused)
+{
+    // Captures started within the same second go to files of their own.
+    BOOST_CHECK(OpenMessageCapture());
+    CloseMessageCapture();
+    BOOST_CHECK(OpenMessageCapture());
+    CloseMessageCapture();
+
+    std::vector<fs::path> vPaths = GetCaptureFiles();
+    BOOST_REQUIRE_EQUAL(vPaths.size(), 2);
+    for (const fs::path& path : vPaths) {
+        BOOST_CHECK_EQUAL(fs::file_size(path), CMessageHeader::MESSAGE_START_SIZE + sizeof(MESSAGE_CAPTURE_VERSION));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(replay_captured_messages)
+{
+    CAddress addr(CService(CNetAddr("127.0.0.1"), Params().GetDefaultPort()));
+    CNode node(INVALID_SOCKET, addr, "", true);
+
+    // A peer introduces itself, then tells us about another node.
+    CDataStream ssVersion(SER_NETWORK, INIT_PROTO_VERSION);
+    ssVersion << PROTOCOL_VERSION << nLocalServices << GetTime() << addr << addr
+              << GetRand(std::numeric_limits<uint64_t>::max()) << std::string("/replay/") << 0 << true;
+    CDataStream ssVerack(SER_NETWORK, PROTOCOL_VERSION);
+    CAddress addrAnnounced(CService(CNetAddr("5.6.7.8"), Params().GetDefaultPort()));
+    addrAnnounced.nTime = GetTime();
+    CDataStream ssAddr(SER_NETWORK, PROTOCOL_VERSION);
+    ssAddr << std::vector<CAddress>(1, addrAnnounced);
+
+    BOOST_CHECK(OpenMessageCapture());
+    fCaptureMessages = true;
+    ReceiveMessage(node, "version", ssVersion);
+    ReceiveMessage(node, "verack", ssVerack);
+    ReceiveMessage(node, "addr", ssAddr);
+    fCaptureMessages = false;
+    CloseMessageCapture();
+
+    std::vector<fs::path> vPaths = GetCaptureFiles();
+    BOOST_REQUIRE_EQUAL(vPaths.size(), 1);
+
+    // Replaying the capture handles the messages as if the peer had sent
+    // them, and leaves no replayed peers behind.
+    size_t nAddresses = addrman.size();
+    BOOST_CHECK(ReplayMessages(Params(), vPaths[0]));
+    BOOST_CHECK_EQUAL(addrman.size(), nAddresses + 1);
+    {
+        LOCK(cs_vNodes);
+        BOOST_CHECK(vNodes.empty());
+    }
+
+    // A capture from another network is refused.
+    SelectParams(CBaseChainParams::TESTNET);
+    BOOST_CHECK(!ReplayMessages(Params(), vPaths[0]));
+    SelectParams(CBaseChainParams::MAIN);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -12,6 +12,10 @@
 #include "net.h"
 #include "chainparams.h"
 
+#ifndef WIN32
+#include <sys/socket.h>
+#endif
+
 using namespace std;
 
 class CAddrManSerializationMock : public CAddrMan
@@ -143,4 +147,84 @@ BOOST_AUTO_TEST_CASE(caddrdb_read_corrupted)
     BOOST_CHECK(addrman2.size() == 0);
 }
 
+BOOST_AUTO_TEST_CASE(shared_message)
+{
+    CAddress addr(CService("127.0.0.1", Params().GetDefaultPort()));
+    CNode node1(INVALID_SOCKET, addr, "", true);
+    CNode node2(INVALID_SOCKET, addr, "", true);
+
+    std::vector<unsigned char> vPayload(5000);
+    for (unsigned char& c : vPayload) c = InsecureRandBits(8);
+    auto msg = CSharedMessage::Make("tx", vPayload);
+
+    // Without a socket, the messages stay queued. Only the header is queued
+    // for each peer, in front of the one shared payload.
+    node1.PushSharedMessage(msg);
+    node2.PushSharedMessage(msg);
+    BOOST_CHECK_EQUAL(msg.use_count(), 3);
+    BOOST_CHECK_EQUAL(node1.vSendMsg.size(), 1);
+    BOOST_CHECK_EQUAL(node1.vSendMsg[0].vData.size(), CMessageHeader::HEADER_SIZE);
+    BOOST_CHECK(node1.vSendMsg[0].shared == node2.vSendMsg[0].shared);
+    BOOST_CHECK_EQUAL(node1.nSendSize, CMessageHeader::HEADER_SIZE + msg->vPayload.size());
+
+    // The shared message is framed exactly like the same message pushed the
+    // usual way.
+    node1.PushMessage("tx", vPayload);
+    BOOST_CHECK_EQUAL(node1.vSendMsg.size(), 2);
+    std::vector<char> vShared(node1.vSendMsg[0].vData.begin(), node1.vSendMsg[0].vData.end());
+    vShared.insert(vShared.end(), msg->vPayload.begin(), msg->vPayload.end());
+    std::vector<char> vPushed(node1.vSendMsg[1].vData.begin(), node1.vSendMsg[1].vData.end());
+    BOOST_CHECK(vShared == vPushed);
+}
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(send_queued_messages)
+{
+    int sockets[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+    CAddress addr(CService("127.0.0.1", Params().GetDefaultPort()));
+    CNode node(INVALID_SOCKET, addr, "", true);
+
+    std::vector<unsigned char> vPayload(3000);
+    for (unsigned char& c : vPayload) c = InsecureRandBits(8);
+    auto msg = CSharedMessage::Make("tx", vPayload);
+
+    // Queue messages before the socket is connected, then send them all at
+    // once.
+    std::vector<char> vExpected;
+    {
+        LOCK(node.cs_vSend);
+        node.PushSharedMessage(msg);
+        node.PushMessage("ping", (uint64_t)42);
+        node.PushSharedMessage(msg);
+        BOOST_CHECK_EQUAL(node.vSendMsg.size(), 3);
+        for (const CSendMessage& sendMsg : node.vSendMsg) {
+            vExpected.insert(vExpected.end(), sendMsg.vData.begin(), sendMsg.vData.end());
+            if (sendMsg.shared) {
+                vExpected.insert(vExpected.end(), sendMsg.shared->vPayload.begin(), sendMsg.shared->vPayload.end());
+            }
+        }
+        // Pretend part of the first message was already sent.
+        node.nSendOffset = 10;
+        vExpected.erase(vExpected.begin(), vExpected.begin() + 10);
+        node.hSocket = sockets[0];
+        SocketSendData(&node);
+        BOOST_CHECK(node.vSendMsg.empty());
+        BOOST_CHECK_EQUAL(node.nSendSize, 0);
+        BOOST_CHECK_EQUAL(node.nSendOffset, 0);
+    }
+
+    std::vector<char> vReceived(vExpected.size() + 1);
+    size_t nReceived = 0;
+    while (nReceived < vExpected.size()) {
+        ssize_t n = recv(sockets[1], vReceived.data() + nReceived, vReceived.size() - nReceived, 0);
+        BOOST_REQUIRE(n > 0);
+        nReceived += n;
+    }
+    vReceived.resize(nReceived);
+    BOOST_CHECK(vReceived == vExpected);
+    close(sockets[1]);
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,92 @@
+// Copyright (c) 2022 The Bitcoin Core developers
+// Copyright (c) 2026 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "memusage.h"
+#include "support/allocators/pool.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+#include <boost/unordered_map.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+BOOST_FIXTURE_TEST_SUITE(pool_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(basic_allocating)
+{
+    auto resource = PoolResource<8, 8>(1024);
+    // No chunk is allocated until a block is,
+    BOOST_CHECK_EQUAL(0, resource.NumAllocatedChunks());
+
+    // so the first allocation allocates the first chunk.
+    void* block = resource.Allocate(8, 8);
+    BOOST_CHECK_EQUAL(1, resource.NumAllocatedChunks());
+
+    // deallocating it puts it into the freelist, and the next allocation of
+    // the same size reuses it.
+    BOOST_CHECK_EQUAL(1024 - 8, resource.NumFreeBytes());
+    resource.Deallocate(block, 8, 8);
+    BOOST_CHECK_EQUAL(1024, resource.NumFreeBytes());
+    void* b = resource.Allocate(8, 8);
+    BOOST_CHECK_EQUAL(b, block);
+    BOOST_CHECK_EQUAL(1024 - 8, resource.NumFreeBytes());
+    resource.Deallocate(b, 8, 8);
+
+    // blocks that are larger than the maximum block size, or more strictly
+    // aligned than the pool, are allocated with new.
+    void* large = resource.Allocate(16, 8);
+    void* aligned = resource.Allocate(8, 16);
+    BOOST_CHECK_EQUAL(1, resource.NumAllocatedChunks());
+    resource.Deallocate(large, 16, 8);
+    resource.Deallocate(aligned, 8, 16);
+
+    // filling the chunk allocates a new one.
+    std::vector<void*> blocks;
+    for (size_t i = 0; i < 1024 / 8 + 1; ++i) {
+        blocks.push_back(resource.Allocate(8, 8));
+    }
+    BOOST_CHECK_EQUAL(2, resource.NumAllocatedChunks());
+    BOOST_CHECK_EQUAL(2 * 1024 - blocks.size() * 8, resource.NumFreeBytes());
+    for (void* p : blocks) {
+        resource.Deallocate(p, 8, 8);
+    }
+    BOOST_CHECK_EQUAL(2 * 1024, resource.NumFreeBytes());
+}
+
+BOOST_AUTO_TEST_CASE(memusage_test)
+{
+    typedef boost::unordered_map<int, int, boost::hash<int>, std::equal_to<int>,
+        PoolAllocator<std::pair<const int, int>, sizeof(std::pair<const int, int>) + sizeof(void*) * 4, alignof(void*)>> Map;
+    auto resource = Map::allocator_type::ResourceType(1024);
+
+    {
+        auto resource_map = Map{0, boost::hash<int>{}, std::equal_to<int>{}, &resource};
+
+        size_t prev_memusage = memusage::DynamicUsage(resource_map);
+        for (int i = 0; i < 1000; ++i) {
+            resource_map[i];
+            size_t memusage = memusage::DynamicUsage(resource_map);
+            // The usage only grows as chunks and bucket arrays are allocated.
+            BOOST_CHECK(memusage >= prev_memusage);
+            prev_memusage = memusage;
+        }
+        BOOST_CHECK(resource.NumAllocatedChunks() > 1);
+        BOOST_CHECK(prev_memusage >= resource.NumAllocatedChunks() * resource.ChunkSizeBytes());
+
+        // Erased nodes stay in the pool's freelists, and are reused.
+        size_t nChunks = resource.NumAllocatedChunks();
+        for (int i = 0; i < 1000; i += 2) {
+            resource_map.erase(i);
+        }
+        for (int i = 0; i < 1000; i += 2) {
+            resource_map[i];
+        }
+        BOOST_CHECK_EQUAL(nChunks, resource.NumAllocatedChunks());
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,243 @@
+// Copyright (c) 2026 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "txreconciliation.h"
+
+#include "test/test_bitcoin.h"
+
+#include <algorithm>
+#include <memory>
+#include <tuple>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(txreconciliation_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(sketch_recovers_difference)
+{
+    for (size_t capacity = 1; capacity <= MAX_SKETCH_CAPACITY; capacity += 7) {
+        PinSketch sketch1(capacity), sketch2(capacity);
+        // Elements in both sets cancel out.
+        for (int i = 0; i < 100; i++) {
+            uint32_t element = InsecureRand32() | 1;
+            sketch1.Add(element);
+            sketch2.Add(element);
+        }
+        std::vector<uint32_t> vDifference;
+        while (vDifference.size() < capacity) {
+            uint32_t element = InsecureRand32() | 1;
+            if (std::count(vDifference.begin(), vDifference.end(), element)) continue;
+            (vDifference.size() % 2 ? sketch1 : sketch2).Add(element);
+            vDifference.push_back(element);
+        }
+
+        PinSketch received(0);
+        BOOST_CHECK(received.Deserialize(sketch2.Serialize()));
+        BOOST_CHECK_EQUAL(received.GetCapacity(), capacity);
+        sketch1.Merge(received);
+
+        std::vector<uint32_t> vDecoded;
+        BOOST_CHECK(sketch1.Decode(vDecoded));
+        std::sort(vDifference.begin(), vDifference.end());
+        std::sort(vDecoded.begin(), vDecoded.end());
+        BOOST_CHECK(vDecoded == vDifference);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sketch_over_capacity)
+{
+    // With well over its capacity of elements, a sketch almost never decodes,
+    // and when it does, the elements it decodes to are consistent with it.
+    PinSketch sketch(16);
+    for (int i = 0; i < 40; i++) {
+        sketch.Add(InsecureRand32() | 1);
+    }
+    std::vector<uint32_t> vDecoded;
+    if (sketch.Decode(vDecoded)) {
+        BOOST_CHECK(vDecoded.size() <= 16);
+        PinSketch check(16);
+        for (uint32_t element : vDecoded) check.Add(element);
+        BOOST_CHECK(check.Serialize() == sketch.Serialize());
+    } else {
+        BOOST_CHECK(vDecoded.empty());
+    }
+
+    PinSketch empty(16);
+    BOOST_CHECK(empty.Decode(vDecoded));
+    BOOST_CHECK(vDecoded.empty());
+
+    PinSketch tooLarge(0);
+    BOOST_CHECK(!tooLarge.Deserialize(std::vector<unsigned char>(4 * MAX_SKETCH_CAPACITY + 4)));
+    BOOST_CHECK(!tooLarge.Deserialize(std::vector<unsigned char>(6)));
+}
+
+BOOST_AUTO_TEST_CASE(short_ids_agree)
+{
+    uint64_t nSalt1 = InsecureRandBits(64), nSalt2 = InsecureRandBits(64);
+    TxReconciliationState initiator(true, nSalt1, nSalt2);
+    TxReconciliationState responder(false, nSalt2, nSalt1);
+    TxReconciliationState other(true, nSalt1, InsecureRandBits(64));
+    uint256 txid = InsecureRand256();
+    BOOST_CHECK_EQUAL(initiator.GetShortID(txid), responder.GetShortID(txid));
+    BOOST_CHECK(initiator.GetShortID(txid) != other.GetShortID(txid));
+    BOOST_CHECK(!responder.ShouldFlood(txid));
+
+    BOOST_CHECK_EQUAL(EstimateSketchCapacity(0, 0, RECON_Q_SCALE), 1);
+    BOOST_CHECK_EQUAL(EstimateSketchCapacity(10, 30, RECON_Q_SCALE / 4), 23);
+    BOOST_CHECK_EQUAL(EstimateSketchCapacity(30, 10, RECON_Q_SCALE / 4), 23);
+    BOOST_CHECK_EQUAL(EstimateSketchCapacity(30, 10, RECON_Q_SCALE), 31);
+    BOOST_CHECK_EQUAL(EstimateSketchCapacity(1000, 0, RECON_Q_SCALE), MAX_SKETCH_CAPACITY);
+
+}
+
+namespace {
+
+// Bytes of the announcement messages, ignoring message headers.
+const size_t INV_ENTRY_SIZE = 36;
+const size_t REQRECON_SIZE = 2;
+const size_t RECONCILDIFF_SIZE = 1 + 1;
+
+// A connection in the simulated network, which node1 made to node2.
+struct SimLink {
+    int nIndex, node1, node2;
+    TxReconciliationState state1, state2;
+    // Transactions both sides know the other has.
+    std::set<uint256> setExchanged;
+
+    SimLink(int nIndexIn, int node1In, int node2In, uint64_t nSalt1, uint64_t nSalt2) :
+        nIndex(nIndexIn), node1(node1In), node2(node2In), state1(true, nSalt1, nSalt2), state2(false, nSalt2, nSalt1) {}
+};
+
+/**
+ * Simulate relaying transactions across a network of nodes that each make
+ * nOutbound connections, by flooding or by reconciliation, until every node
+ * has every transaction. The transactions appear at the given nodes, a few
+ * every tick of a second, and take a tick to be sent to a peer. Returns the
+ * bytes spent announcing transactions.
+ */
+size_t SimulateRelay(bool fReconcile, int nNodes, int nOutbound, const std::vector<std::pair<int, uint256>>& vTxs, int nTxsPerTick, int& nTicks, int& nFailures)
+{
+    std::vector<std::unique_ptr<SimLink>> vLinks;
+    std::vector<std::vector<int>> vNodeLinks(nNodes);
+    for (int node = 0; node < nNodes; node++) {
+        for (int i = 0; i < nOutbound; i++) {
+            int peer = InsecureRandRange(nNodes);
+            bool fConnected = peer == node;
+            for (int link : vNodeLinks[node]) {
+                fConnected |= vLinks[link]->node1 == peer || vLinks[link]->node2 == peer;
+            }
+            if (fConnected) continue;
+            vNodeLinks[node].push_back(vLinks.size());
+            vNodeLinks[peer].push_back(vLinks.size());
+            vLinks.emplace_back(new SimLink(vLinks.size(), node, peer, InsecureRandBits(64), InsecureRandBits(64)));
+        }
+    }
+
+    std::vector<std::set<uint256>> vKnown(nNodes);
+    // Transactions nodes learn at the next tick, and over which link (or -1).
+    std::vector<std::tuple<int, uint256, int>> vArriving;
+    size_t nNextTx = 0;
+
+    size_t nBytes = 0;
+    auto Announce = [&](SimLink& link, int from, const uint256& txid) {
+        nBytes += INV_ENTRY_SIZE;
+        link.setExchanged.insert(txid);
+        int to = from == link.node1 ? link.node2 : link.node1;
+        if (!vKnown[to].count(txid)) {
+            vArriving.emplace_back(to, txid, link.nIndex);
+        }
+    };
+
+    size_t nDelivered = 0;
+    nFailures = 0;
+    for (nTicks = 0; nDelivered < vTxs.size() * nNodes && nTicks < 1000; nTicks++) {
+        for (int i = 0; i < nTxsPerTick && nNextTx < vTxs.size(); i++, nNextTx++) {
+            vArriving.emplace_back(vTxs[nNextTx].first, vTxs[nNextTx].second, -1);
+        }
+        std::vector<std::tuple<int, uint256, int>> vLearned;
+        vLearned.swap(vArriving);
+        for (const auto& arrival : vLearned) {
+            int node = std::get<0>(arrival);
+            const uint256& txid = std::get<1>(arrival);
+            if (std::get<2>(arrival) != -1) vLinks[std::get<2>(arrival)]->setExchanged.insert(txid);
+            if (!vKnown[node].insert(txid).second) continue;
+            nDelivered++;
+            for (int i : vNodeLinks[node]) {
+                SimLink& link = *vLinks[i];
+                if (link.setExchanged.count(txid)) continue;
+                TxReconciliationState& state = node == link.node1 ? link.state1 : link.state2;
+                if (!fReconcile || state.ShouldFlood(txid)) {
+                    Announce(link, node, txid);
+                } else {
+                    state.setToReconcile.insert(txid);
+                }
+            }
+        }
+        if (!fReconcile) continue;
+
+        for (size_t i = 0; i < vLinks.size(); i++) {
+            if ((nTicks + i) % RECON_REQUEST_INTERVAL != 0) continue;
+            SimLink& link = *vLinks[i];
+            std::map<uint32_t, uint256> map1, map2;
+            for (const uint256& txid : link.state1.setToReconcile) {
+                if (!link.setExchanged.count(txid)) map1[link.state1.GetShortID(txid)] = txid;
+            }
+            for (const uint256& txid : link.state2.setToReconcile) {
+                if (!link.setExchanged.count(txid)) map2[link.state2.GetShortID(txid)] = txid;
+            }
+            link.state1.setToReconcile.clear();
+            link.state2.setToReconcile.clear();
+
+            PinSketch sketch2(EstimateSketchCapacity(map2.size(), map1.size(), DEFAULT_RECON_Q));
+            for (const auto& entry : map2) sketch2.Add(entry.first);
+            PinSketch sketch1(sketch2.GetCapacity());
+            for (const auto& entry : map1) sketch1.Add(entry.first);
+            sketch1.Merge(sketch2);
+            nBytes += REQRECON_SIZE + 4 * sketch2.GetCapacity() + RECONCILDIFF_SIZE;
+
+            std::vector<uint32_t> vDifference;
+            if (sketch1.Decode(vDifference) && vDifference.size() < sketch1.GetCapacity()) {
+                for (uint32_t nShortID : vDifference) {
+                    if (map1.count(nShortID)) {
+                        Announce(link, link.node1, map1[nShortID]);
+                    } else if (map2.count(nShortID)) {
+                        nBytes += 4;
+                        Announce(link, link.node2, map2[nShortID]);
+                    }
+                }
+            } else {
+                nFailures++;
+                for (const auto& entry : map1) Announce(link, link.node1, entry.second);
+                for (const auto& entry : map2) Announce(link, link.node2, entry.second);
+            }
+            for (const auto& entry : map1) link.setExchanged.insert(entry.second);
+            for (const auto& entry : map2) link.setExchanged.insert(entry.second);
+        }
+    }
+    BOOST_CHECK_EQUAL(nDelivered, vTxs.size() * nNodes);
+    return nBytes;
+}
+
+} // anon namespace
+
+BOOST_AUTO_TEST_CASE(relay_simulation)
+{
+    const int nNodes = 50;
+    const int nOutbound = 8;
+    const int nTxsPerTick = 3;
+    std::vector<std::pair<int, uint256>> vTxs;
+    for (int i = 0; i < 300; i++) {
+        vTxs.emplace_back(InsecureRandRange(nNodes), InsecureRand256());
+    }
+
+    int nFloodTicks, nReconcileTicks, nFailures;
+    size_t nFloodBytes = SimulateRelay(false, nNodes, nOutbound, vTxs, nTxsPerTick, nFloodTicks, nFailures);
+    size_t nReconcileBytes = SimulateRelay(true, nNodes, nOutbound, vTxs, nTxsPerTick, nReconcileTicks, nFailures);
+    BOOST_TEST_MESSAGE(strprintf("Announcing %d transactions to %d nodes: flooding %u bytes in %d ticks, "
+        "reconciliation %u bytes in %d ticks with %d failed reconciliations",
+        vTxs.size(), nNodes, nFloodBytes, nFloodTicks, nReconcileBytes, nReconcileTicks, nFailures));
+    BOOST_CHECK(nReconcileBytes < nFloodBytes / 2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -9,12 +9,15 @@
 #include "chainparams.h"
 #include "hash.h"
 #include "main.h"
+#include "memusage.h"
 #include "pow.h"
 #include "uint256.h"
 #include "zcash/History.hpp"
 
 #include <stdint.h>
 
+#include <algorithm>
+
 #include <boost/thread.hpp>
 
 #include <rust/metrics.h>
@@ -49,6 +52,8 @@ static const char DB_MMR_ROOT = 'r';
 static const char DB_SUBTREE_LATEST = 'e';
 static const char DB_SUBTREE_DATA = 'n';
 
+static const char DB_COINS_STATS = 'H';
+
 // insightexplorer
 static const char DB_ADDRESSINDEX = 'd';
 static const char DB_ADDRESSUNSPENTINDEX = 'u';
@@ -63,6 +68,46 @@ CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(Get
 {
 }
 
+CCoinsViewDB::~CCoinsViewDB()
+{
+    {
+        LOCK(cs_nullifierFilters);
+        fStopNullifierFilters = true;
+    }
+    condNullifierFilters.notify_all();
+    if (threadNullifierFilters.joinable()) {
+        threadNullifierFilters.join();
+    }
+}
+
+static char NullifierDBChar(ShieldedType type)
+{
+    switch (type) {
+        case SPROUT:
+            return DB_NULLIFIER;
+        case SAPLING:
+            return DB_SAPLING_NULLIFIER;
+        case ORCHARD:
+            return DB_ORCHARD_NULLIFIER;
+        default:
+            throw runtime_error("Unknown shielded type");
+    }
+}
+
+static size_t NullifierFilterIndex(ShieldedType type)
+{
+    switch (type) {
+        case SPROUT:
+            return 0;
+        case SAPLING:
+            return 1;
+        case ORCHARD:
+            return 2;
+        default:
+            throw runtime_error("Unknown shielded type");
+    }
+}
+
 bool CCoinsViewDB::GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const {
     if (rt == SproutMerkleTree::empty_root()) {
         SproutMerkleTree new_tree;
@@ -101,19 +146,13 @@ bool CCoinsViewDB::GetOrchardAnchorAt(const uint256 &rt, OrchardMerkleFrontier &
 
 bool CCoinsViewDB::GetNullifier(const uint256 &nf, ShieldedType type) const {
     bool spent = false;
-    char dbChar;
-    switch (type) {
-        case SPROUT:
-            dbChar = DB_NULLIFIER;
-            break;
-        case SAPLING:
-            dbChar = DB_SAPLING_NULLIFIER;
-            break;
-        case ORCHARD:
-            dbChar = DB_ORCHARD_NULLIFIER;
-            break;
-        default:
-            throw runtime_error("Unknown shielded type");
+    char dbChar = NullifierDBChar(type);
+    {
+        LOCK(cs_nullifierFilters);
+        const auto& filter = nullifierFilters[NullifierFilterIndex(type)].active;
+        if (filter && !filter->contains(nf)) {
+            return false;
+        }
     }
     return db.Read(make_pair(dbChar, nf), spent);
 }
@@ -225,7 +264,7 @@ std::optional<libzcash::SubtreeData> CCoinsViewDB::GetSubtreeData(
     return subtreeData;
 }
 
-void BatchWriteNullifiers(CDBBatch& batch, CNullifiersMap& mapToUse, const char& dbChar)
+void BatchWriteNullifiers(CDBBatch& batch, CNullifiersMap& mapToUse, const char& dbChar, bool fErase)
 {
     for (CNullifiersMap::iterator it = mapToUse.begin(); it != mapToUse.end();) {
         if (it->second.flags & CNullifiersCacheEntry::DIRTY) {
@@ -235,12 +274,12 @@ void BatchWriteNullifiers(CDBBatch& batch, CNullifiersMap& mapToUse, const char&
                 batch.Write(make_pair(dbChar, it->first), true);
             // TODO: changed++? ... See comment in CCoinsViewDB::BatchWrite. If this is needed we could return an int
         }
-        it = mapToUse.erase(it);
+        it = fErase ? mapToUse.erase(it) : std::next(it);
     }
 }
 
 template<typename Map, typename MapIterator, typename MapEntry, typename Tree>
-void BatchWriteAnchors(CDBBatch& batch, Map& mapToUse, const char& dbChar)
+void BatchWriteAnchors(CDBBatch& batch, Map& mapToUse, const char& dbChar, bool fErase)
 {
     for (MapIterator it = mapToUse.begin(); it != mapToUse.end();) {
         if (it->second.flags & MapEntry::DIRTY) {
@@ -253,7 +292,7 @@ void BatchWriteAnchors(CDBBatch& batch, Map& mapToUse, const char& dbChar)
             }
             // TODO: changed++?
         }
-        it = mapToUse.erase(it);
+        it = fErase ? mapToUse.erase(it) : std::next(it);
     }
 }
 
@@ -353,10 +392,36 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
                               CNullifiersMap &mapOrchardNullifiers,
                               CHistoryCacheMap &historyCacheMap,
                               SubtreeCache &cacheSaplingSubtrees,
-                              SubtreeCache &cacheOrchardSubtrees) {
+                              SubtreeCache &cacheOrchardSubtrees,
+                              const CCoinsSetStats &statsDelta,
+                              bool fErase) {
+    // New nullifiers are inserted into the filters before they are written,
+    // so that a filter never rules out a nullifier that is in the database.
+    // Spent nullifiers are never removed from the database outside of
+    // reorgs, and leaving them in the filters only costs a lookup.
+    LOCK(cs_nullifierWrites);
+    {
+        LOCK(cs_nullifierFilters);
+        AddToNullifierFilter(SPROUT, mapSproutNullifiers);
+        AddToNullifierFilter(SAPLING, mapSaplingNullifiers);
+        AddToNullifierFilter(ORCHARD, mapOrchardNullifiers);
+    }
+
     auto latestSaplingSubtree = GetLatestSubtree(SAPLING);
     auto latestOrchardSubtree = GetLatestSubtree(ORCHARD);
 
+    // Apply the change to the chain state statistics, if we have them for
+    // the state this batch applies to. An empty database has empty statistics.
+    // The change passed in doesn't include the new version of each modified
+    // entry, which is added as the entries are written.
+    uint256 hashPrevBlock = GetBestBlock();
+    CCoinsSetStats setStats;
+    bool fHaveStats = db.Read(DB_COINS_STATS, setStats) && setStats.hashBlock == hashPrevBlock;
+    if (!fHaveStats && hashPrevBlock.IsNull()) {
+        setStats = CCoinsSetStats();
+        fHaveStats = true;
+    }
+
     CDBBatch batch(db);
     size_t count = 0;
     size_t changed = 0;
@@ -366,19 +431,21 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
                 batch.Erase(make_pair(DB_COINS, it->first));
             else
                 batch.Write(make_pair(DB_COINS, it->first), it->second.coins);
+            if (fHaveStats)
+                setStats.AddCoins(it->first, it->second.coins);
             changed++;
         }
         count++;
-        it = mapCoins.erase(it);
+        it = fErase ? mapCoins.erase(it) : std::next(it);
     }
 
-    ::BatchWriteAnchors<CAnchorsSproutMap, CAnchorsSproutMap::iterator, CAnchorsSproutCacheEntry, SproutMerkleTree>(batch, mapSproutAnchors, DB_SPROUT_ANCHOR);
-    ::BatchWriteAnchors<CAnchorsSaplingMap, CAnchorsSaplingMap::iterator, CAnchorsSaplingCacheEntry, SaplingMerkleTree>(batch, mapSaplingAnchors, DB_SAPLING_ANCHOR);
-    ::BatchWriteAnchors<CAnchorsOrchardMap, CAnchorsOrchardMap::iterator, CAnchorsOrchardCacheEntry, OrchardMerkleFrontier>(batch, mapOrchardAnchors, DB_ORCHARD_ANCHOR);
+    ::BatchWriteAnchors<CAnchorsSproutMap, CAnchorsSproutMap::iterator, CAnchorsSproutCacheEntry, SproutMerkleTree>(batch, mapSproutAnchors, DB_SPROUT_ANCHOR, fErase);
+    ::BatchWriteAnchors<CAnchorsSaplingMap, CAnchorsSaplingMap::iterator, CAnchorsSaplingCacheEntry, SaplingMerkleTree>(batch, mapSaplingAnchors, DB_SAPLING_ANCHOR, fErase);
+    ::BatchWriteAnchors<CAnchorsOrchardMap, CAnchorsOrchardMap::iterator, CAnchorsOrchardCacheEntry, OrchardMerkleFrontier>(batch, mapOrchardAnchors, DB_ORCHARD_ANCHOR, fErase);
 
-    ::BatchWriteNullifiers(batch, mapSproutNullifiers, DB_NULLIFIER);
-    ::BatchWriteNullifiers(batch, mapSaplingNullifiers, DB_SAPLING_NULLIFIER);
-    ::BatchWriteNullifiers(batch, mapOrchardNullifiers, DB_ORCHARD_NULLIFIER);
+    ::BatchWriteNullifiers(batch, mapSproutNullifiers, DB_NULLIFIER, fErase);
+    ::BatchWriteNullifiers(batch, mapSaplingNullifiers, DB_SAPLING_NULLIFIER, fErase);
+    ::BatchWriteNullifiers(batch, mapOrchardNullifiers, DB_ORCHARD_NULLIFIER, fErase);
 
     ::BatchWriteHistory(batch, historyCacheMap);
 
@@ -388,6 +455,13 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
     WriteSubtrees(batch, SAPLING, latestSaplingSubtree, cacheSaplingSubtrees.parentLatestSubtree, cacheSaplingSubtrees.newSubtrees);
     WriteSubtrees(batch, ORCHARD, latestOrchardSubtree, cacheOrchardSubtrees.parentLatestSubtree, cacheOrchardSubtrees.newSubtrees);
 
+    if (fHaveStats) {
+        setStats += statsDelta;
+        if (!hashBlock.IsNull())
+            setStats.hashBlock = hashBlock;
+        batch.Write(DB_COINS_STATS, setStats);
+    }
+
     if (!hashBlock.IsNull())
         batch.Write(DB_BEST_BLOCK, hashBlock);
     if (!hashSproutAnchor.IsNull())
@@ -424,52 +498,332 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) const {
     return Read(DB_LAST_BLOCK, nFile);
 }
 
-bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
+bool CCoinsViewDB::ComputeStats(CCoinsSetStats &setStats) const {
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
     boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
-    pcursor->Seek(DB_COINS);
 
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock();
-    ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
+    setStats = CCoinsSetStats();
+    setStats.hashBlock = GetBestBlock();
+    pcursor->Seek(DB_COINS);
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         std::pair<char, uint256> key;
         CCoins coins;
         if (pcursor->GetKey(key) && key.first == DB_COINS) {
             if (pcursor->GetValue(coins)) {
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + pcursor->GetValueSize();
-                ss << VARINT(0);
+                setStats.AddCoins(key.second, coins);
             } else {
-                return error("CCoinsViewDB::GetStats() : unable to read value");
+                return error("CCoinsViewDB::ComputeStats() : unable to read value");
             }
         } else {
             break;
         }
         pcursor->Next();
     }
+
+    for (const auto& [dbChar, type] : {
+            std::make_pair(DB_NULLIFIER, SPROUT),
+            std::make_pair(DB_SAPLING_NULLIFIER, SAPLING),
+            std::make_pair(DB_ORCHARD_NULLIFIER, ORCHARD)}) {
+        pcursor->Seek(dbChar);
+        while (pcursor->Valid()) {
+            boost::this_thread::interruption_point();
+            std::pair<char, uint256> key;
+            if (pcursor->GetKey(key) && key.first == dbChar) {
+                setStats.AddNullifier(key.second, type);
+            } else {
+                break;
+            }
+            pcursor->Next();
+        }
+    }
+    return true;
+}
+
+bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
+    // BatchWrite holds cs_nullifierWrites while it reads, updates and writes
+    // the statistics. Hold it here too, so that a batch written by the
+    // background writer can't land between reading or computing them and
+    // storing them. cs_main isn't enough for that on its own: it only
+    // excludes batches that have not been queued yet.
+    LOCK(cs_nullifierWrites);
+    CCoinsSetStats setStats;
+    if (!db.Read(DB_COINS_STATS, setStats) || setStats.hashBlock != GetBestBlock()) {
+        // The statistics are maintained from the first time they are
+        // computed, which for a database written by an earlier version
+        // requires a walk over the whole database.
+        LogPrintf("Computing chain state statistics, this may take a while...\n");
+        if (!ComputeStats(setStats)) {
+            return false;
+        }
+        // As above, use a const-cast to store them.
+        if (!const_cast<CDBWrapper*>(&db)->Write(DB_COINS_STATS, setStats)) {
+            return error("CCoinsViewDB::GetStats() : unable to write chain state statistics");
+        }
+    }
+
+    setStats.ToCoinsStats(stats);
     {
         LOCK(cs_main);
-        stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
+        BlockMap::iterator it = mapBlockIndex.find(stats.hashBlock);
+        if (it != mapBlockIndex.end())
+            stats.nHeight = it->second->nHeight;
     }
-    stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
+CDBIterator *CCoinsViewDB::RawCursor() const {
+    // LevelDB iterators read from an implicit snapshot of the database, so
+    // the cursor is not affected by later writes.
+    CDBIterator *pcursor = const_cast<CDBWrapper*>(&db)->NewIterator();
+    pcursor->SeekToFirst();
+    return pcursor;
+}
+
+bool CCoinsViewDB::EraseAll() {
+    static const size_t nBatchRecords = 100000;
+
+    ResetNullifierFilters();
+
+    boost::scoped_ptr<CDBIterator> pcursor(RawCursor());
+    std::vector<unsigned char> key;
+    while (pcursor->Valid()) {
+        CDBBatch batch(db);
+        for (size_t n = 0; n < nBatchRecords && pcursor->Valid(); n++) {
+            boost::this_thread::interruption_point();
+            pcursor->GetRawKey(key);
+            batch.EraseRaw(key);
+            pcursor->Next();
+        }
+        if (!db.WriteBatch(batch)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool CCoinsViewDB::WriteRawRecords(const std::vector<std::pair<std::vector<unsigned char>, std::vector<unsigned char>>>& records) {
+    ResetNullifierFilters();
+
+    CDBBatch batch(db);
+    for (const auto& record : records) {
+        batch.WriteRaw(record.first, record.second);
+    }
+    return db.WriteBatch(batch);
+}
+
+static size_t NullifierFilterCapacity(size_t nNullifiers) {
+    return std::max(nNullifiers, NULLIFIER_FILTER_MIN_CAPACITY);
+}
+
+static size_t NullifierFilterSize(size_t nCapacity) {
+    return nCapacity * NULLIFIER_FILTER_BITS_PER_ELEMENT / 8;
+}
+
+void CCoinsViewDB::QueueNullifierFilter(ShieldedType type, size_t nCapacity) {
+    NullifierFilter& filter = nullifierFilters[NullifierFilterIndex(type)];
+    filter.building.reset(new CBlockedBloomFilter(
+        NullifierFilterCapacity(nCapacity), NULLIFIER_FILTER_BITS_PER_ELEMENT));
+    filter.nGeneration++;
+    condNullifierFilters.notify_all();
+}
+
+void CCoinsViewDB::AddToNullifierFilter(ShieldedType type, const CNullifiersMap& mapNullifiers) {
+    NullifierFilter& filter = nullifierFilters[NullifierFilterIndex(type)];
+    if (!filter.active && !filter.building) {
+        return;
+    }
+    for (const auto& entry : mapNullifiers) {
+        if ((entry.second.flags & CNullifiersCacheEntry::DIRTY) && entry.second.entered) {
+            if (filter.active) {
+                filter.active->insert(entry.first);
+            }
+            if (filter.building) {
+                filter.building->insert(entry.first);
+            }
+        }
+    }
+    // Once the active filter holds more nullifiers than it was sized for, its
+    // false positive rate grows quickly, so build a larger one.
+    // If the larger filter doesn't fit alongside the others (the one it
+    // replaces included, while it is built), stop using a filter for this
+    // type rather than let it take more of -dbcache.
+    if (filter.active && !filter.building && filter.active->size() > filter.active->capacity()) {
+        size_t nCapacity = NullifierFilterCapacity(filter.active->size() * 2);
+        size_t nUsage = NullifierFilterUsage();
+        if (nUsage + NullifierFilterSize(nCapacity) <= nMaxNullifierFilterUsage) {
+            QueueNullifierFilter(type, nCapacity);
+        } else {
+            LogPrintf("Dropping the filter of nullifiers of type %d: growing it to %u nullifiers would take the filters over %.1fMiB\n",
+                (int)type, (unsigned int)nCapacity, nMaxNullifierFilterUsage * (1.0 / 1024 / 1024));
+            filter.active.reset();
+            filter.nGeneration++;
+        }
+    }
+}
+
+void CCoinsViewDB::ResetNullifierFilters() {
+    LOCK2(cs_nullifierWrites, cs_nullifierFilters);
+    for (NullifierFilter& filter : nullifierFilters) {
+        filter.active.reset();
+        filter.building.reset();
+        filter.nGeneration++;
+    }
+}
+
+size_t CCoinsViewDB::EstimateNullifierCount(ShieldedType type) const {
+    // Each nullifier record (a 33-byte key and a 1-byte value) takes about
+    // 40 bytes in the table files. The keys are random, so they don't
+    // compress.
+    static const size_t nRecordDiskSize = 40;
+    char dbChar = NullifierDBChar(type);
+    return db.EstimateSize(dbChar, (char)(dbChar + 1)) / nRecordDiskSize;
+}
+
+void CCoinsViewDB::LoadNullifierFilters(size_t nMaxUsage) {
+    // The filters are sized from the nullifier counts of the chain state
+    // statistics, with room to grow. If the statistics have not been
+    // computed yet, the counts are estimated from the size of the nullifier
+    // records on disk instead, so that the filters don't have to be rebuilt
+    // as they fill up.
+    size_t nNullifiers[3];
+    CCoinsSetStats setStats;
+    if (db.Read(DB_COINS_STATS, setStats)) {
+        nNullifiers[0] = setStats.nSproutNullifiers;
+        nNullifiers[1] = setStats.nSaplingNullifiers;
+        nNullifiers[2] = setStats.nOrchardNullifiers;
+    } else {
+        nNullifiers[0] = EstimateNullifierCount(SPROUT);
+        nNullifiers[1] = EstimateNullifierCount(SAPLING);
+        nNullifiers[2] = EstimateNullifierCount(ORCHARD);
+    }
+    {
+        LOCK2(cs_nullifierWrites, cs_nullifierFilters);
+        nMaxNullifierFilterUsage = nMaxUsage;
+        // Filters that don't fit in the memory allowed are not built, starting
+        // with the oldest pool, whose nullifiers are looked up least often.
+        size_t nUsage = 0;
+        for (ShieldedType type : {ORCHARD, SAPLING, SPROUT}) {
+            size_t nCapacity = NullifierFilterCapacity(nNullifiers[NullifierFilterIndex(type)] * 3 / 2);
+            size_t nSize = NullifierFilterSize(nCapacity);
+            if (nUsage + nSize <= nMaxUsage) {
+                QueueNullifierFilter(type, nCapacity);
+                nUsage += nSize;
+            } else {
+                NullifierFilter& filter = nullifierFilters[NullifierFilterIndex(type)];
+                filter.active.reset();
+                filter.building.reset();
+                filter.nGeneration++;
+                LogPrintf("Not using a filter of nullifiers of type %d: it would take the filters over %.1fMiB\n",
+                    (int)type, nMaxUsage * (1.0 / 1024 / 1024));
+            }
+        }
+        LogPrintf("Using %.1fMiB for nullifier filters\n", nUsage * (1.0 / 1024 / 1024));
+    }
+    if (!threadNullifierFilters.joinable()) {
+        threadNullifierFilters = std::thread(&CCoinsViewDB::ThreadBuildNullifierFilters, this);
+    }
+}
+
+size_t CCoinsViewDB::DynamicMemoryUsage() const {
+    LOCK(cs_nullifierFilters);
+    return NullifierFilterUsage();
+}
+
+size_t CCoinsViewDB::NullifierFilterUsage() const {
+    size_t nUsage = 0;
+    for (const NullifierFilter& filter : nullifierFilters) {
+        if (filter.active) {
+            nUsage += memusage::DynamicUsage(filter.active) + filter.active->DynamicMemoryUsage();
+        }
+        if (filter.building) {
+            nUsage += memusage::DynamicUsage(filter.building) + filter.building->DynamicMemoryUsage();
+        }
+    }
+    return nUsage;
+}
+
+void CCoinsViewDB::ThreadBuildNullifierFilters() {
+    static const size_t nChunkSize = 10000;
+
+    RenameThread("zc-nullifierfilter");
+    while (true) {
+        ShieldedType type = SPROUT;
+        uint64_t nGeneration;
+        {
+            WAIT_LOCK(cs_nullifierFilters, lock);
+            auto nextQueued = [&]() {
+                for (ShieldedType queued : {SPROUT, SAPLING, ORCHARD}) {
+                    if (nullifierFilters[NullifierFilterIndex(queued)].building) {
+                        type = queued;
+                        return true;
+                    }
+                }
+                return false;
+            };
+            while (!fStopNullifierFilters && !nextQueued()) {
+                condNullifierFilters.wait(lock);
+            }
+            if (fStopNullifierFilters) {
+                return;
+            }
+            nGeneration = nullifierFilters[NullifierFilterIndex(type)].nGeneration;
+        }
+
+        // The filter was registered before this point while holding
+        // cs_nullifierWrites, and LevelDB iterators read from a snapshot taken
+        // when they are created. So every nullifier is either in the snapshot
+        // or was inserted into the filter by BatchWrite.
+        char dbChar = NullifierDBChar(type);
+        int64_t nStart = GetTimeMillis();
+        try {
+            boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+            pcursor->Seek(dbChar);
+            std::vector<uint256> vNullifiers;
+            vNullifiers.reserve(nChunkSize);
+            bool fDone = false;
+            while (!fDone) {
+                vNullifiers.clear();
+                while (vNullifiers.size() < nChunkSize) {
+                    std::pair<char, uint256> key;
+                    if (!pcursor->Valid() || !pcursor->GetKey(key) || key.first != dbChar) {
+                        fDone = true;
+                        break;
+                    }
+                    vNullifiers.push_back(key.second);
+                    pcursor->Next();
+                }
+
+                LOCK(cs_nullifierFilters);
+                NullifierFilter& filter = nullifierFilters[NullifierFilterIndex(type)];
+                if (fStopNullifierFilters || filter.nGeneration != nGeneration) {
+                    // Stopped, or replaced by another build.
+                    break;
+                }
+                for (const uint256& nf : vNullifiers) {
+                    filter.building->insert(nf);
+                }
+                if (fDone) {
+                    // If the filter was sized too small, BatchWrite queues a
+                    // larger one.
+                    filter.active = std::move(filter.building);
+                    LogPrint("coindb", "Built the filter of %u nullifiers of type %d in %dms\n",
+                        (unsigned int)filter.active->size(), (int)type, GetTimeMillis() - nStart);
+                }
+            }
+        } catch (const std::exception& e) {
+            LogPrintf("%s: Error building the nullifier filter: %s\n", __func__, e.what());
+            LOCK(cs_nullifierFilters);
+            NullifierFilter& filter = nullifierFilters[NullifierFilterIndex(type)];
+            if (filter.nGeneration == nGeneration) {
+                filter.building.reset();
+            }
+        }
+    }
+}
+
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<CBlockIndex*>& blockinfo) {
     MetricsIncrementCounter("zcashd.debug.blocktree.write_batch");
     CDBBatch batch(*this);
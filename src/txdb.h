@@ -7,12 +7,18 @@
 #ifndef BITCOIN_TXDB_H
 #define BITCOIN_TXDB_H
 
+#include "bloom.h"
 #include "coins.h"
 #include "dbwrapper.h"
 #include "chain.h"
+#include "sync.h"
 
+#include <atomic>
+#include <condition_variable>
 #include <map>
+#include <memory>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -73,15 +79,68 @@ struct CDiskTxPos : public CDiskBlockPos
     }
 };
 
+//! Bits per nullifier of the nullifier filters, for a false positive rate of
+//! about 0.1%.
+static const unsigned int NULLIFIER_FILTER_BITS_PER_ELEMENT = 16;
+//! The nullifier filters have room for at least this many nullifiers.
+static const size_t NULLIFIER_FILTER_MIN_CAPACITY = 65536;
+//! The nullifier filters may use at most this share of the in-memory chain
+//! state cache (-dbcache).
+static const unsigned int NULLIFIER_FILTER_MAX_CACHE_PERCENT = 25;
+
 /** CCoinsView backed by the coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
 {
+private:
+    /**
+     * A Bloom filter of the nullifiers of one shielded type in the database,
+     * so that most lookups of unspent nullifiers do not read the database.
+     * Lookups only use the active filter, which contains every nullifier in
+     * the database once it has been built. A new filter is built in the
+     * background when the node starts, and again when the active one has had
+     * more nullifiers inserted than it was sized for.
+     */
+    struct NullifierFilter {
+        std::unique_ptr<CBlockedBloomFilter> active;
+        //! The filter being built, which BatchWrite also inserts into.
+        std::unique_ptr<CBlockedBloomFilter> building;
+        //! Incremented whenever the filter being built is replaced, so that
+        //! the builder notices.
+        uint64_t nGeneration = 0;
+    };
+
+    mutable Mutex cs_nullifierFilters;
+    NullifierFilter nullifierFilters[3] GUARDED_BY(cs_nullifierFilters);
+    std::condition_variable condNullifierFilters;
+    bool fStopNullifierFilters GUARDED_BY(cs_nullifierFilters) = false;
+    //! The memory the filters may use, including any being built.
+    size_t nMaxNullifierFilterUsage GUARDED_BY(cs_nullifierFilters) = 0;
+    std::thread threadNullifierFilters;
+    //! Held while nullifiers are inserted into the filters and then written,
+    //! and while a filter to be built is registered, so that the database
+    //! snapshot the builder reads from (taken after registration) includes
+    //! every nullifier that was not inserted into that filter. BatchWrite
+    //! holds it throughout, so GetStats also takes it to keep the chain state
+    //! statistics consistent with the batches written.
+    mutable Mutex cs_nullifierWrites;
+
+    //! Start building a new filter for the nullifiers of the given type.
+    //! Requires cs_nullifierWrites.
+    void QueueNullifierFilter(ShieldedType type, size_t nCapacity) EXCLUSIVE_LOCKS_REQUIRED(cs_nullifierFilters);
+    void AddToNullifierFilter(ShieldedType type, const CNullifiersMap& mapNullifiers) EXCLUSIVE_LOCKS_REQUIRED(cs_nullifierFilters);
+    void ResetNullifierFilters();
+    void ThreadBuildNullifierFilters();
+    size_t NullifierFilterUsage() const EXCLUSIVE_LOCKS_REQUIRED(cs_nullifierFilters);
+    //! Estimate the number of nullifiers of the given type in the database
+    //! from the size of their records on disk.
+    size_t EstimateNullifierCount(ShieldedType type) const;
+
 protected:
     CDBWrapper db;
     CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
-    ~CCoinsViewDB() {}
+    ~CCoinsViewDB();
 
     bool GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const;
     bool GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree) const;
@@ -111,8 +170,31 @@ public:
                     CNullifiersMap &mapOrchardNullifiers,
                     CHistoryCacheMap &historyCacheMap,
                     SubtreeCache &cacheSaplingSubtrees,
-                    SubtreeCache &cacheOrchardSubtrees);
+                    SubtreeCache &cacheOrchardSubtrees,
+                    const CCoinsSetStats &statsDelta,
+                    bool fErase);
     bool GetStats(CCoinsStats &stats) const;
+    //! Compute the chain state statistics by walking the whole database.
+    bool ComputeStats(CCoinsSetStats &setStats) const;
+
+    //! Return a cursor over every record in the database, as of this call.
+    //! Used to write chain state snapshots.
+    CDBIterator *RawCursor() const;
+    //! Erase every record in the database. The nullifier filters are not
+    //! used until LoadNullifierFilters() is called again.
+    bool EraseAll();
+    //! Write records whose keys and values are already serialized, as read
+    //! from a RawCursor(). As for EraseAll(), this stops using the nullifier
+    //! filters.
+    bool WriteRawRecords(const std::vector<std::pair<std::vector<unsigned char>, std::vector<unsigned char>>>& records);
+
+    //! Start building the nullifier filters from the database, in the
+    //! background. Until a filter is built, lookups read the database. The
+    //! filters use at most nMaxUsage bytes: a filter that doesn't fit is not
+    //! built, and one that outgrows it is dropped.
+    void LoadNullifierFilters(size_t nMaxUsage);
+    //! Memory used by the nullifier filters, including any being built.
+    size_t DynamicMemoryUsage() const;
 };
 
 /** Access to the block database (blocks/index/) */
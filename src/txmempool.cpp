@@ -146,10 +146,13 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
         if (it == mapTx.end()) {
             continue;
         }
-        std::map<COutPoint, CInPoint>::iterator iter = mapNextTx.lower_bound(COutPoint(hash, 0));
         // First calculate the children, and update setMemPoolChildren to
         // include them, and update their setMemPoolParents to include this tx.
-        for (; iter != mapNextTx.end() && iter->first.hash == hash; ++iter) {
+        for (uint32_t i = 0; i < it->GetTx().vout.size(); i++) {
+            CSpentOutpointsMap::iterator iter = mapNextTx.find(COutPoint(hash, i));
+            if (iter == mapNextTx.end()) {
+                continue;
+            }
             const uint256 &childHash = iter->second.ptx->GetHash();
             txiter childIter = mapTx.find(childHash);
             assert(childIter != mapTx.end());
@@ -352,16 +355,17 @@ CTxMemPool::~CTxMemPool()
     delete limitSet;
 }
 
+SaltedOutpointHasher::SaltedOutpointHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
+
 void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
 {
     LOCK(cs);
 
-    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hashTx, 0));
-
-    // iterate over all COutPoints in mapNextTx whose hash equals the provided hashTx
-    while (it != mapNextTx.end() && it->first.hash == hashTx) {
-        coins.Spend(it->first.n); // and remove those outputs from coins
-        it++;
+    // look up every output of hashTx that coins still has in mapNextTx
+    for (uint32_t i = 0; i < coins.vout.size(); i++) {
+        if (mapNextTx.count(COutPoint(hashTx, i))) {
+            coins.Spend(i); // and remove those outputs from coins
+        }
     }
 }
 
@@ -399,12 +403,17 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
         }
     }
 
+    AddCandidate(newit);
+
     // Update cachedInnerUsage to include contained transaction's usage.
     // (When we update the entry for in-mempool parents, memory usage will be
     // further updated.)
     cachedInnerUsage += entry.DynamicMemoryUsage();
 
     const CTransaction& tx = newit->GetTx();
+    vTxHashes.push_back({tx.GetHash(), tx.GetAuthDigest(), newit});
+    newit->vTxHashesIdx = vTxHashes.size() - 1;
+
     mapRecentlyAddedTx[tx.GetHash()] = &tx;
     nRecentlyAddedSequence += 1;
     std::set<uint256> setParentTransactions;
@@ -571,6 +580,18 @@ void CTxMemPool::removeUnchecked(txiter it)
         mapOrchardNullifiers.erase(orchardNullifier);
     }
 
+    RemoveCandidate(it);
+    // Move the last transaction into the place of the removed one.
+    if (vTxHashes.size() > 1) {
+        vTxHashes[it->vTxHashesIdx] = vTxHashes.back();
+        vTxHashes[it->vTxHashesIdx].entry->vTxHashesIdx = it->vTxHashesIdx;
+        vTxHashes.pop_back();
+        if (vTxHashes.size() * 2 < vTxHashes.capacity())
+            vTxHashes.shrink_to_fit();
+    } else {
+        vTxHashes.clear();
+    }
+
     totalTxSize -= it->GetTxSize();
     cachedInnerUsage -= it->DynamicMemoryUsage();
     cachedInnerUsage -= memusage::DynamicUsage(mapLinks[it].parents) + memusage::DynamicUsage(mapLinks[it].children);
@@ -629,7 +650,7 @@ void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& rem
             // happen during chain re-orgs if origTx isn't re-accepted into
             // the mempool for any reason.
             for (unsigned int i = 0; i < origTx.vout.size(); i++) {
-                std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
+                CSpentOutpointsMap::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
                 if (it == mapNextTx.end())
                     continue;
                 txiter nextit = mapTx.find(it->second.ptx->GetHash());
@@ -739,7 +760,7 @@ void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>
     list<CTransaction> result;
     LOCK(cs);
     for (const CTxIn &txin : tx.vin) {
-        std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(txin.prevout);
+        CSpentOutpointsMap::iterator it = mapNextTx.find(txin.prevout);
         if (it != mapNextTx.end()) {
             const CTransaction &txConflict = *it->second.ptx;
             if (txConflict != tx)
@@ -751,7 +772,7 @@ void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>
 
     for (const JSDescription &joinsplit : tx.vJoinSplit) {
         for (const uint256 &nf : joinsplit.nullifiers) {
-            std::map<uint256, const CTransaction*>::iterator it = mapSproutNullifiers.find(nf);
+            CMempoolNullifiersMap::iterator it = mapSproutNullifiers.find(nf);
             if (it != mapSproutNullifiers.end()) {
                 const CTransaction &txConflict = *it->second;
                 if (txConflict != tx) {
@@ -770,7 +791,7 @@ void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>
         }
     }
     for (const uint256 &orchardNullifier : tx.GetOrchardBundle().GetNullifiers()) {
-        std::map<uint256, const CTransaction*>::iterator it = mapOrchardNullifiers.find(orchardNullifier);
+        CMempoolNullifiersMap::iterator it = mapOrchardNullifiers.find(orchardNullifier);
         if (it != mapOrchardNullifiers.end()) {
             const CTransaction &txConflict = *it->second;
             if (txConflict != tx) {
@@ -854,6 +875,9 @@ void CTxMemPool::_clear()
     mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
+    vTxHashes.clear();
+    candidatesPayingConventionalFee = weightedCandidates();
+    candidatesNotPayingConventionalFee = weightedCandidates();
     totalTxSize = 0;
     cachedInnerUsage = 0;
     ++nTransactionsUpdated;
@@ -907,7 +931,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
                 assert(coins && coins->IsAvailable(txin.prevout.n));
             }
             // Check whether its inputs are marked in mapNextTx.
-            std::map<COutPoint, CInPoint>::const_iterator it3 = mapNextTx.find(txin.prevout);
+            CSpentOutpointsMap::const_iterator it3 = mapNextTx.find(txin.prevout);
             assert(it3 != mapNextTx.end());
             assert(it3->second.ptx == &tx);
             assert(it3->second.n == i);
@@ -916,10 +940,13 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
         assert(setParentCheck == GetMemPoolParents(it));
         // Check children against mapNextTx
         CTxMemPool::setEntries setChildrenCheck;
-        std::map<COutPoint, CInPoint>::const_iterator iter = mapNextTx.lower_bound(COutPoint(it->GetTx().GetHash(), 0));
         int64_t childSizes = 0;
         CAmount childModFee = 0;
-        for (; iter != mapNextTx.end() && iter->first.hash == it->GetTx().GetHash(); ++iter) {
+        for (uint32_t n = 0; n < tx.vout.size(); n++) {
+            CSpentOutpointsMap::const_iterator iter = mapNextTx.find(COutPoint(tx.GetHash(), n));
+            if (iter == mapNextTx.end()) {
+                continue;
+            }
             txiter childit = mapTx.find(iter->second.ptx->GetHash());
             assert(childit != mapTx.end()); // mapNextTx points to in-mempool transactions
             if (setChildrenCheck.insert(childit).second) {
@@ -966,7 +993,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             stepsSinceLastRemove = 0;
         }
     }
-    for (std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
+    for (CSpentOutpointsMap::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
         uint256 hash = it->second.ptx->GetHash();
         indexed_transaction_set::const_iterator it2 = mapTx.find(hash);
         const CTransaction& tx = it2->GetTx();
@@ -982,10 +1009,13 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
 
     assert(totalTxSize == checkTotal);
     assert(innerUsage == cachedInnerUsage);
+    assert(vTakenCandidates.empty());
+    assert(candidatesPayingConventionalFee.size() + candidatesNotPayingConventionalFee.size() == mapTx.size());
+    assert(vTxHashes.size() == mapTx.size());
 }
 
-template<typename T>
-void CTxMemPool::checkNullifiers(const std::map<T, const CTransaction*>& mapToUse) const
+template<typename Map>
+void CTxMemPool::checkNullifiers(const Map& mapToUse) const
 {
     for (const auto& entry : mapToUse) {
         uint256 hash = entry.second->GetHash();
@@ -1094,6 +1124,9 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const std::string str
         txiter it = mapTx.find(hash);
         if (it != mapTx.end()) {
             mapTx.modify(it, update_fee_delta(delta));
+            // The weight ratio follows the modified fee.
+            RemoveCandidate(it);
+            AddCandidate(it);
             // Now update all ancestors' modified fees with descendants
             setEntries setAncestors;
             uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
@@ -1123,6 +1156,46 @@ void CTxMemPool::ClearPrioritisation(const uint256 hash)
     mapDeltas.erase(hash);
 }
 
+void CTxMemPool::AddCandidate(txiter entry)
+{
+    int128_t weightRatio = entry->GetWeightRatio();
+    if (weightRatio >= WEIGHT_RATIO_SCALE) {
+        candidatesPayingConventionalFee.add(entry->GetTx().GetHash(), entry, weightRatio);
+    } else {
+        candidatesNotPayingConventionalFee.add(entry->GetTx().GetHash(), entry, weightRatio);
+    }
+}
+
+void CTxMemPool::RemoveCandidate(txiter entry)
+{
+    const uint256& hash = entry->GetTx().GetHash();
+    if (!candidatesPayingConventionalFee.remove(hash)) {
+        candidatesNotPayingConventionalFee.remove(hash);
+    }
+}
+
+std::optional<CTxMemPool::txiter> CTxMemPool::TakeRandomCandidate(bool fPayingConventionalFee)
+{
+    AssertLockHeld(cs);
+    weightedCandidates& candidates = fPayingConventionalFee ?
+        candidatesPayingConventionalFee : candidatesNotPayingConventionalFee;
+    auto taken = candidates.takeRandom();
+    if (!taken.has_value()) {
+        return std::nullopt;
+    }
+    vTakenCandidates.push_back(std::get<1>(taken.value()));
+    return std::get<1>(taken.value());
+}
+
+void CTxMemPool::RestoreCandidates()
+{
+    AssertLockHeld(cs);
+    for (txiter entry : vTakenCandidates) {
+        AddCandidate(entry);
+    }
+    vTakenCandidates.clear();
+}
+
 bool CTxMemPool::HasNoInputsOf(const CTransaction &tx) const
 {
     for (unsigned int i = 0; i < tx.vin.size(); i++)
@@ -1207,6 +1280,7 @@ size_t CTxMemPool::DynamicMemoryUsage() const {
 
     // Three metadata maps inherited from Bitcoin Core
     total += memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks);
+    total += memusage::DynamicUsage(vTxHashes);
 
     // Saves iterating over the full map
     total += cachedInnerUsage;
@@ -1320,6 +1394,16 @@ bool CTxMemPool::IsRecentlyEvicted(const uint256& txId) {
     return recentlyEvicted->contains(txId);
 }
 
+std::vector<std::pair<uint256, int64_t>> CTxMemPool::GetRecentlyEvicted() {
+    LOCK(cs);
+    return recentlyEvicted->entries();
+}
+
+void CTxMemPool::AddRecentlyEvicted(const uint256& txId, int64_t nTime) {
+    LOCK(cs);
+    recentlyEvicted->add(txId, nTime);
+}
+
 void CTxMemPool::EnsureSizeLimit() {
     AssertLockHeld(cs);
     std::optional<uint256> maybeDropTxId;
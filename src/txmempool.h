@@ -14,6 +14,7 @@
 #include "int128.h"
 #include "amount.h"
 #include "coins.h"
+#include "hash.h"
 #include "mempool_limit.h"
 #include "primitives/transaction.h"
 #include "sync.h"
@@ -28,6 +29,7 @@
 #include "boost/multi_index_container.hpp"
 #include "boost/multi_index/ordered_index.hpp"
 #include "boost/multi_index/hashed_index.hpp"
+#include "boost/unordered_map.hpp"
 
 class CAutoFile;
 
@@ -123,6 +125,8 @@ public:
 
     bool GetSpendsCoinbase() const { return spendsCoinbase; }
     uint32_t GetValidatedBranchId() const { return nBranchId; }
+
+    mutable size_t vTxHashesIdx; //!< Index in the mempool's vTxHashes
 };
 
 // Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
@@ -249,6 +253,37 @@ public:
     size_t DynamicMemoryUsage() const { return 0; }
 };
 
+class SaltedOutpointHasher
+{
+private:
+    /** Salt */
+    const uint64_t k0, k1;
+
+public:
+    SaltedOutpointHasher();
+
+    size_t operator()(const COutPoint& outpoint) const {
+        return SipHashUint256Extra(k0, k1, outpoint.hash, outpoint.n);
+    }
+};
+
+class SaltedNullifierHasher
+{
+private:
+    SaltedTxidHasher hasher;
+
+public:
+    size_t operator()(const libzcash::nullifier_t& nf) const {
+        return hasher(uint256::FromRawBytes(nf));
+    }
+};
+
+// The mempool's indexes of spent outputs and nullifiers are only ever looked
+// up by key, so they are salted hash maps rather than ordered maps.
+typedef boost::unordered_map<COutPoint, CInPoint, SaltedOutpointHasher> CSpentOutpointsMap;
+typedef boost::unordered_map<uint256, const CTransaction*, SaltedTxidHasher> CMempoolNullifiersMap;
+typedef boost::unordered_map<libzcash::nullifier_t, const CTransaction*, SaltedNullifierHasher> CMempoolSaplingNullifiersMap;
+
 /**
  * Information about a mempool transaction.
  */
@@ -353,14 +388,14 @@ private:
     uint64_t nRecentlyAddedSequence = 0;
     uint64_t nNotifiedSequence = 0;
 
-    std::map<uint256, const CTransaction*> mapSproutNullifiers;
-    std::map<libzcash::nullifier_t, const CTransaction*> mapSaplingNullifiers;
-    std::map<uint256, const CTransaction*> mapOrchardNullifiers;
+    CMempoolNullifiersMap mapSproutNullifiers;
+    CMempoolSaplingNullifiersMap mapSaplingNullifiers;
+    CMempoolNullifiersMap mapOrchardNullifiers;
     RecentlyEvictedList* recentlyEvicted = new RecentlyEvictedList(GetNodeClock(), DEFAULT_MEMPOOL_EVICTION_MEMORY_MINUTES * 60);
     MempoolLimitTxSet* limitSet = new MempoolLimitTxSet(DEFAULT_MEMPOOL_TOTAL_COST_LIMIT);
 
-    template<typename T>
-    void checkNullifiers(const std::map<T, const CTransaction*>& mapToUse) const;
+    template<typename Map>
+    void checkNullifiers(const Map& mapToUse) const;
 
     CFeeRate minReasonableRelayFee;
 
@@ -447,6 +482,18 @@ private:
     typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
     txlinksMap mapLinks;
 
+    // Block template candidates, split by whether they pay the ZIP 317
+    // conventional fee. These are kept up to date as transactions enter and
+    // leave the pool, so that block templates don't need to rebuild them.
+    weightedCandidates candidatesPayingConventionalFee;
+    weightedCandidates candidatesNotPayingConventionalFee;
+    // Candidates taken by TakeRandomCandidate(), to be put back by
+    // RestoreCandidates().
+    std::vector<txiter> vTakenCandidates;
+
+    void AddCandidate(txiter entry);
+    void RemoveCandidate(txiter entry);
+
     void UpdateParent(txiter entry, txiter parent, bool add);
     void UpdateChild(txiter entry, txiter child, bool add);
 
@@ -459,9 +506,19 @@ private:
     std::vector<indexed_transaction_set::const_iterator> GetSortedDepthAndScore() const;
 
 public:
-    std::map<COutPoint, CInPoint> mapNextTx;
+    CSpentOutpointsMap mapNextTx;
     std::map<uint256, CAmount> mapDeltas;
 
+    /** The txid and auth digest of a transaction in mapTx. */
+    struct TxHashes {
+        uint256 txid;
+        uint256 authDigest;
+        txiter entry;
+    };
+    /** Every transaction in mapTx, in no particular order, so that the short
+     *  IDs of a compact block can be matched without walking mapTx. */
+    std::vector<TxHashes> vTxHashes;
+
     /** Create a new CTxMemPool.
      *  minReasonableRelayFee should be a feerate which is, roughly, somewhere
      *  around what it "costs" to relay a transaction around the network and
@@ -523,6 +580,19 @@ public:
     void ApplyDelta(const uint256 hash, CAmount &nFeeDelta) const;
     void ClearPrioritisation(const uint256 hash);
 
+    /**
+     * Take a random block template candidate, with probability in proportion
+     * to its weight ratio, from those that pay the ZIP 317 conventional fee or
+     * from those that don't, as constructZIP317BlockTemplate() samples them.
+     * Returns std::nullopt once there are none left. The candidates are taken
+     * from the sets the pool maintains rather than from copies of them, so
+     * RestoreCandidates() must be called to put them back before cs is
+     * released. Requires cs.
+     */
+    std::optional<txiter> TakeRandomCandidate(bool fPayingConventionalFee);
+    /** Put back the candidates taken by TakeRandomCandidate(). Requires cs. */
+    void RestoreCandidates();
+
 public:
     /** Remove a set of transactions from the mempool.
      *  If a transaction is in this set, then all in-mempool descendants must
@@ -592,6 +662,10 @@ public:
     void SetMempoolCostLimit(int64_t totalCostLimit, int64_t evictionMemorySeconds);
     // Returns true if a transaction has been recently evicted
     bool IsRecentlyEvicted(const uint256& txId);
+    // Returns the recently evicted transactions, with the times they were evicted
+    std::vector<std::pair<uint256, int64_t>> GetRecentlyEvicted();
+    // Remembers a transaction evicted at the given time, such as before a restart
+    void AddRecentlyEvicted(const uint256& txId, int64_t nTime);
     // If the mempool size limit is exceeded, this evicts transactions from the mempool until it is below capacity
     void EnsureSizeLimit();
 
@@ -0,0 +1,277 @@
+// Copyright (c) 2026 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "txreconciliation.h"
+
+#include "crypto/common.h"
+#include "hash.h"
+
+#include <algorithm>
+#include <assert.h>
+
+namespace {
+
+// Elements of GF(2^32) are polynomials over GF(2) modulo the irreducible
+// polynomial x^32 + x^7 + x^3 + x^2 + 1, so x^32 reduces to x^7 + x^3 + x^2 + 1.
+inline uint64_t MulByReduction(uint64_t a)
+{
+    return a ^ (a << 2) ^ (a << 3) ^ (a << 7);
+}
+
+uint32_t FieldMul(uint32_t a, uint32_t b)
+{
+    uint64_t r = 0;
+    for (int i = 0; i < 32; i++) {
+        r ^= ((uint64_t)a << i) & (0 - (uint64_t)((b >> i) & 1));
+    }
+    // Fold the high half down twice: it is at most 31 bits wide, then 6.
+    r = (r & 0xffffffff) ^ MulByReduction(r >> 32);
+    r = (r & 0xffffffff) ^ MulByReduction(r >> 32);
+    return r;
+}
+
+uint32_t FieldInv(uint32_t a)
+{
+    assert(a != 0);
+    // a^(2^32 - 2) is the inverse of a.
+    uint32_t r = 1;
+    for (uint32_t e = 0xfffffffe; e != 0; e >>= 1) {
+        if (e & 1) r = FieldMul(r, a);
+        a = FieldMul(a, a);
+    }
+    return r;
+}
+
+// Polynomials over GF(2^32), lowest coefficient first, without leading zeros.
+typedef std::vector<uint32_t> Poly;
+
+void Trim(Poly& a)
+{
+    while (!a.empty() && a.back() == 0) a.pop_back();
+}
+
+// Reduce a modulo m, storing the quotient in q if it is not NULL.
+void PolyDivMod(Poly& a, const Poly& m, Poly* q = NULL)
+{
+    assert(!m.empty());
+    if (q) q->assign(a.size() >= m.size() ? a.size() - m.size() + 1 : 0, 0);
+    uint32_t inv = FieldInv(m.back());
+    while (a.size() >= m.size()) {
+        uint32_t f = FieldMul(a.back(), inv);
+        size_t shift = a.size() - m.size();
+        if (q) (*q)[shift] = f;
+        for (size_t i = 0; i < m.size(); i++) {
+            a[shift + i] ^= FieldMul(f, m[i]);
+        }
+        Trim(a);
+    }
+}
+
+// In characteristic 2, the square of a polynomial is the sum of the squares
+// of its terms.
+Poly PolySquareMod(const Poly& a, const Poly& m)
+{
+    if (a.empty()) return Poly();
+    Poly r(2 * a.size() - 1);
+    for (size_t i = 0; i < a.size(); i++) {
+        r[2 * i] = FieldMul(a[i], a[i]);
+    }
+    PolyDivMod(r, m);
+    return r;
+}
+
+// The monic greatest common divisor of a and b.
+Poly PolyGcd(Poly a, Poly b)
+{
+    while (!b.empty()) {
+        PolyDivMod(a, b);
+        std::swap(a, b);
+    }
+    if (!a.empty()) {
+        uint32_t inv = FieldInv(a.back());
+        for (uint32_t& c : a) c = FieldMul(c, inv);
+    }
+    return a;
+}
+
+// Find the roots of the monic polynomial f, which must have deg(f) distinct
+// roots in the field, by splitting it into factors with the trace map
+// (Berlekamp's trace algorithm).
+bool FindRoots(const Poly& f, std::vector<uint32_t>& roots, uint32_t& nRandom)
+{
+    if (f.size() == 2) {
+        roots.push_back(f[0]);
+        return true;
+    }
+    for (int nTry = 0; nTry < 64; nTry++) {
+        // xorshift32; for any factorization, about half the values of beta
+        // split it.
+        nRandom ^= nRandom << 13;
+        nRandom ^= nRandom >> 17;
+        nRandom ^= nRandom << 5;
+        // Tr(beta * z) = sum of (beta * z)^(2^i), for i from 0 to 31, is 0 or
+        // 1 at each root, so its gcd with f has about half of the roots.
+        Poly u = {0, nRandom};
+        Poly trace = u;
+        for (int i = 1; i < 32; i++) {
+            u = PolySquareMod(u, f);
+            trace.resize(std::max(trace.size(), u.size()));
+            for (size_t j = 0; j < u.size(); j++) trace[j] ^= u[j];
+        }
+        Trim(trace);
+        Poly g = PolyGcd(f, trace);
+        if (g.size() > 1 && g.size() < f.size()) {
+            Poly rest = f, quotient;
+            PolyDivMod(rest, g, &quotient);
+            return FindRoots(g, roots, nRandom) && FindRoots(quotient, roots, nRandom);
+        }
+    }
+    return false;
+}
+
+} // anon namespace
+
+void PinSketch::Add(uint32_t element)
+{
+    assert(element != 0);
+    uint32_t square = FieldMul(element, element);
+    uint32_t power = element;
+    for (uint32_t& syndrome : syndromes) {
+        syndrome ^= power;
+        power = FieldMul(power, square);
+    }
+}
+
+void PinSketch::Merge(const PinSketch& other)
+{
+    assert(other.syndromes.size() == syndromes.size());
+    for (size_t i = 0; i < syndromes.size(); i++) {
+        syndromes[i] ^= other.syndromes[i];
+    }
+}
+
+bool PinSketch::Decode(std::vector<uint32_t>& elements) const
+{
+    elements.clear();
+    size_t capacity = syndromes.size();
+
+    // All power sums s_1 ... s_2c; in characteristic 2, s_2k = s_k^2.
+    std::vector<uint32_t> sums(2 * capacity);
+    for (size_t i = 0; i < capacity; i++) {
+        sums[2 * i] = syndromes[i];
+        sums[2 * i + 1] = FieldMul(sums[i], sums[i]);
+    }
+
+    // Berlekamp-Massey finds the shortest recurrence C (with C[0] = 1) the
+    // power sums satisfy. Its reverse has the elements as roots.
+    Poly c = {1}, b = {1};
+    size_t nLength = 0, nShift = 1;
+    uint32_t nLastDiscrepancy = 1;
+    for (size_t n = 0; n < sums.size(); n++) {
+        uint32_t d = sums[n];
+        for (size_t i = 1; i <= nLength && i < c.size(); i++) {
+            d ^= FieldMul(c[i], sums[n - i]);
+        }
+        if (d == 0) {
+            nShift++;
+            continue;
+        }
+        Poly t = c;
+        uint32_t f = FieldMul(d, FieldInv(nLastDiscrepancy));
+        c.resize(std::max(c.size(), b.size() + nShift));
+        for (size_t i = 0; i < b.size(); i++) {
+            c[i + nShift] ^= FieldMul(f, b[i]);
+        }
+        if (2 * nLength <= n) {
+            nLength = n + 1 - nLength;
+            b = t;
+            nLastDiscrepancy = d;
+            nShift = 1;
+        } else {
+            nShift++;
+        }
+    }
+    Trim(c);
+    if (nLength == 0) return true;
+    if (nLength > capacity || c.size() != nLength + 1) return false;
+
+    Poly locator(c.rbegin(), c.rend());
+
+    // The elements must be distinct roots in GF(2^32), i.e. the locator
+    // must divide z^(2^32) - z.
+    Poly z = {0, 1};
+    Poly power = z;
+    PolyDivMod(power, locator);
+    for (int i = 0; i < 32; i++) {
+        power = PolySquareMod(power, locator);
+    }
+    PolyDivMod(z, locator);
+    if (power != z) return false;
+
+    uint32_t nRandom = 0x9e3779b9;
+    if (!FindRoots(locator, elements, nRandom)) {
+        elements.clear();
+        return false;
+    }
+
+    // Beyond the capacity, the power sums of a different set can still fit
+    // a recurrence by chance, so check that the elements match the sketch.
+    PinSketch check(capacity);
+    for (uint32_t element : elements) {
+        check.Add(element);
+    }
+    if (check.syndromes != syndromes) {
+        elements.clear();
+        return false;
+    }
+    return true;
+}
+
+std::vector<unsigned char> PinSketch::Serialize() const
+{
+    std::vector<unsigned char> data(syndromes.size() * 4);
+    for (size_t i = 0; i < syndromes.size(); i++) {
+        WriteLE32(&data[i * 4], syndromes[i]);
+    }
+    return data;
+}
+
+bool PinSketch::Deserialize(const std::vector<unsigned char>& data)
+{
+    if (data.size() % 4 != 0 || data.size() / 4 > MAX_SKETCH_CAPACITY)
+        return false;
+    syndromes.resize(data.size() / 4);
+    for (size_t i = 0; i < syndromes.size(); i++) {
+        syndromes[i] = ReadLE32(&data[i * 4]);
+    }
+    return true;
+}
+
+size_t EstimateSketchCapacity(size_t nLocalSetSize, size_t nRemoteSetSize, uint16_t nQ)
+{
+    size_t nDifference = std::max(nLocalSetSize, nRemoteSetSize) - std::min(nLocalSetSize, nRemoteSetSize);
+    size_t nCapacity = nDifference + std::min(nLocalSetSize, nRemoteSetSize) * nQ / RECON_Q_SCALE + 1;
+    return std::min(nCapacity, MAX_SKETCH_CAPACITY);
+}
+
+TxReconciliationState::TxReconciliationState(bool fInitiatorIn, uint64_t nLocalSalt, uint64_t nRemoteSalt) :
+        fInitiator(fInitiatorIn), nNextRequest(0), fRequestPending(false)
+{
+    // Both peers derive the same keys, whichever of them sent which salt.
+    uint256 hash = (CHashWriter(SER_GETHASH, 0) << std::min(nLocalSalt, nRemoteSalt) << std::max(nLocalSalt, nRemoteSalt)).GetHash();
+    k0 = hash.GetUint64(0);
+    k1 = hash.GetUint64(1);
+}
+
+uint32_t TxReconciliationState::GetShortID(const uint256& txid) const
+{
+    uint32_t nShortID = SipHashUint256(k0, k1, txid);
+    // Sketches can't hold 0.
+    return nShortID == 0 ? 1 : nShortID;
+}
+
+bool TxReconciliationState::ShouldFlood(const uint256& txid) const
+{
+    return fInitiator && (SipHashUint256(k1, k0, txid) % RECON_FLOOD_RATIO) == 0;
+}
@@ -0,0 +1,112 @@
+// Copyright (c) 2026 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#ifndef ZCASH_TXRECONCILIATION_H
+#define ZCASH_TXRECONCILIATION_H
+
+#include "uint256.h"
+
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Transaction relay by set reconciliation, after Erlay (BIP 330).
+ *
+ * Instead of announcing every transaction to every peer with "inv", two peers
+ * that negotiated reconciliation with "sendrecon" each keep the set of
+ * transactions they would have announced to the other. Periodically the peer
+ * that made the connection asks for a sketch of the other's set
+ * ("reqrecon"), which is sent in a "sketch" message. Combined with a sketch
+ * of its own set, it yields the short IDs of the transactions only one side
+ * has. The requester announces the ones the other side is missing, and asks
+ * for the ones it is missing itself in a "reconcildiff" message. If there
+ * were more differences than the sketch could recover, both sides announce
+ * their whole set instead.
+ *
+ * A small fraction of transactions is still flooded to outbound peers, so
+ * that transactions keep propagating quickly across the network.
+ */
+
+/** Version of the reconciliation protocol we negotiate with "sendrecon". */
+static const uint32_t TXRECONCILIATION_VERSION = 1;
+/** Maximum number of differences that can be recovered from one sketch. */
+static const size_t MAX_SKETCH_CAPACITY = 64;
+/** Average interval in seconds between reconciliations we request from a peer. */
+static const int RECON_REQUEST_INTERVAL = 8;
+/** One in this many transactions is also flooded to each outbound peer we reconcile with. */
+static const uint32_t RECON_FLOOD_RATIO = 8;
+/** Scale of the q parameter of reqrecon: q = 1 is sent as RECON_Q_SCALE. */
+static const uint32_t RECON_Q_SCALE = 1 << 14;
+/** The q we send: the fraction of the smaller set we expect only one side to have. */
+static const uint16_t DEFAULT_RECON_Q = RECON_Q_SCALE / 2;
+/** Transactions beyond this many waiting to be reconciled with a peer are announced to it instead. */
+static const size_t MAX_RECONCILIATION_SET_SIZE = 3000;
+
+/**
+ * A PinSketch of a set of nonzero 32-bit elements: the odd power sums of the
+ * elements in GF(2^32). Sketches of two sets can be merged into a sketch of
+ * their symmetric difference, which can be decoded as long as it has no more
+ * elements than the capacity of the sketch.
+ */
+class PinSketch {
+private:
+    std::vector<uint32_t> syndromes;
+
+public:
+    explicit PinSketch(size_t capacity) : syndromes(capacity) {}
+
+    size_t GetCapacity() const { return syndromes.size(); }
+
+    //! Add an element to the set, or remove it if it was already there.
+    void Add(uint32_t element);
+    //! Turn this into a sketch of the symmetric difference with another set.
+    void Merge(const PinSketch& other);
+    //! Recover the elements of the set. Returns false if there are more of
+    //! them than the capacity of the sketch.
+    bool Decode(std::vector<uint32_t>& elements) const;
+
+    std::vector<unsigned char> Serialize() const;
+    //! Returns false if the data is not a sketch of at most MAX_SKETCH_CAPACITY.
+    bool Deserialize(const std::vector<unsigned char>& data);
+};
+
+/**
+ * Sketch capacity needed to reconcile sets of the given sizes: their
+ * difference in size, plus the fraction q of the smaller one we expect only
+ * one side to have, plus one. The extra element of capacity is a check: a
+ * sketch of a larger difference than its capacity can still decode by chance,
+ * but almost never to fewer elements than its capacity.
+ */
+size_t EstimateSketchCapacity(size_t nLocalSetSize, size_t nRemoteSetSize, uint16_t nQ);
+
+/** Reconciliation state of a peer. Protected by CNode::cs_inventory. */
+class TxReconciliationState {
+private:
+    uint64_t k0, k1;
+
+public:
+    //! Whether we request reconciliations from this peer (we made the
+    //! connection), rather than answer its requests.
+    bool fInitiator;
+    //! Transactions we would announce to this peer, by txid.
+    std::set<uint256> setToReconcile;
+    //! The transactions we sent a sketch of, by short ID, until the peer
+    //! tells us which of them it is missing.
+    std::map<uint32_t, uint256> mapSketched;
+    //! When we next ask the peer for a sketch (in microseconds).
+    int64_t nNextRequest;
+    //! Whether we are waiting for a sketch we asked for.
+    bool fRequestPending;
+
+    TxReconciliationState(bool fInitiatorIn, uint64_t nLocalSalt, uint64_t nRemoteSalt);
+
+    //! The nonzero 32-bit ID of a transaction in this peer's sketches.
+    uint32_t GetShortID(const uint256& txid) const;
+    //! Whether a transaction should be flooded to this peer anyway.
+    bool ShouldFlood(const uint256& txid) const;
+};
+
+#endif // ZCASH_TXRECONCILIATION_H